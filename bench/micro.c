@@ -0,0 +1,517 @@
+// microbenchmarks of the runtime's hot primitives, driven directly from c
+// instead of through a script: the hash tables, string hashing and
+// interning, reallocate() and the collector
+//
+//     make microbench && ./microbench [name filter]
+//
+// every line is the time per operation and, where perf_event_open() is
+// allowed, last level cache and l1d read misses per operation
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// key counts that fit in l1/l2, in l3 and in neither
+static const int KEY_COUNTS[] = {1 << 10, 1 << 15, 1 << 19};
+#define KEY_COUNT_COUNT (int)(sizeof(KEY_COUNTS) / sizeof(KEY_COUNTS[0]))
+// operations every measurement does at least, so small tables get timed
+// over more than a few microseconds
+#define MIN_OPS (1 << 22)
+
+static const char* filter = NULL;
+
+// counters
+
+typedef struct {
+    int cacheMisses;
+    int l1dMisses;
+} Counters;
+
+static Counters counters = {-1, -1};
+
+static int openCounter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    // allowed for our own process without privileges
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void openCounters() {
+    counters.cacheMisses = openCounter(PERF_TYPE_HARDWARE,
+                                       PERF_COUNT_HW_CACHE_MISSES);
+    counters.l1dMisses = openCounter(PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    if (counters.cacheMisses == -1 && counters.l1dMisses == -1) {
+        fprintf(stderr, "perf_event_open() is not allowed here, "
+                        "timing only.\n");
+    }
+}
+
+static void startCounter(int fd) {
+    if (fd == -1) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// -1 if the counter is not there
+static double stopCounter(int fd, long ops) {
+    if (fd == -1) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+    return (double)count / ops;
+}
+
+// measuring
+
+typedef struct {
+    struct timespec start;
+} Measurement;
+
+static bool selected(const char* name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void start(Measurement* measurement) {
+    startCounter(counters.cacheMisses);
+    startCounter(counters.l1dMisses);
+    clock_gettime(CLOCK_MONOTONIC, &measurement->start);
+}
+
+static void printPerOp(double value) {
+    if (value < 0) {
+        printf(" %12s", "-");
+    } else {
+        printf(" %12.3f", value);
+    }
+}
+
+static void stop(Measurement* measurement, const char* name, long ops) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double misses = stopCounter(counters.cacheMisses, ops);
+    double l1dMisses = stopCounter(counters.l1dMisses, ops);
+    double ns = (end.tv_sec - measurement->start.tv_sec) * 1e9 +
+                (end.tv_nsec - measurement->start.tv_nsec);
+    printf("%-40s %10.2f", name, ns / ops);
+    printPerOp(misses);
+    printPerOp(l1dMisses);
+    printf("\n");
+}
+
+// keys
+
+static uint64_t randomState = 88172645463325252ull;
+
+// xorshift, the same sequence every run
+static uint64_t nextRandom() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+    return randomState;
+}
+
+static void shuffle(ObjString** keys, int count) {
+    for (int i = count - 1; i > 0; i--) {
+        int j = (int)(nextRandom() % (uint64_t)(i + 1));
+        ObjString* swap = keys[i];
+        keys[i] = keys[j];
+        keys[j] = swap;
+    }
+}
+
+// count interned strings named prefix0, prefix1 and so on, kept alive as
+// host values until releaseKeys() or the end of the benchmark
+static ObjString** makeKeys(VM* vm, const char* prefix, int count) {
+    ObjString** keys = malloc(sizeof(ObjString*) * count);
+    char chars[32];
+    for (int i = 0; i < count; i++) {
+        int length = snprintf(chars, sizeof(chars), "%s%d", prefix, i);
+        keys[i] = copyString(vm, chars, length);
+        writeValueArray(vm, &vm->hostValues, OBJ_VAL(keys[i]));
+    }
+    return keys;
+}
+
+// lets the collector have every key and everything else made since
+static void releaseKeys(VM* vm) {
+    vm->hostValues.count = 0;
+    collectGarbage(vm);
+    // collections would only add noise to everything but the gc benchmarks
+    vm->nextGC = SIZE_MAX;
+}
+
+static long repeatsFor(int count) {
+    return count >= MIN_OPS ? 1 : (MIN_OPS + count - 1) / count;
+}
+
+// string hashing
+
+static void benchHash(VM* vm, int count, int percent) {
+    static const int LENGTHS[] = {8, 32, 256};
+    char chars[256];
+    for (int i = 0; i < (int)sizeof(chars); i++) chars[i] = 'a' + i % 26;
+
+    for (int i = 0; i < 3; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "hashString %d chars", LENGTHS[i]);
+        if (!selected(name)) continue;
+        // a result that is used, so the calls are not optimised away
+        volatile uint32_t sink = 0;
+        Measurement measurement;
+        start(&measurement);
+        for (long op = 0; op < MIN_OPS; op++) {
+            chars[0] = (char)op;
+            sink ^= hashString(chars, LENGTHS[i]);
+        }
+        stop(&measurement, name, MIN_OPS);
+        (void)sink;
+    }
+}
+
+// tables
+
+static void benchInsert(VM* vm, int count, int percent) {
+    char name[64];
+    snprintf(name, sizeof(name), "tableSet new %d keys", count);
+    if (!selected(name)) return;
+    ObjString** keys = makeKeys(vm, "k", count);
+    shuffle(keys, count);
+    long repeats = repeatsFor(count);
+
+    Measurement measurement;
+    start(&measurement);
+    for (long repeat = 0; repeat < repeats; repeat++) {
+        // growing from empty, as every table does
+        Table table;
+        initTable(&table);
+        for (int i = 0; i < count; i++) {
+            tableSet(vm, &table, keys[i], NUMBER_VAL(i));
+        }
+        freeTable(vm, &table);
+    }
+    stop(&measurement, name, repeats * count);
+    free(keys);
+}
+
+static void benchOverwrite(VM* vm, int count, int percent) {
+    char name[64];
+    snprintf(name, sizeof(name), "tableSet existing %d keys", count);
+    if (!selected(name)) return;
+    ObjString** keys = makeKeys(vm, "k", count);
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < count; i++) tableSet(vm, &table, keys[i], NIL_VAL);
+    shuffle(keys, count);
+    long repeats = repeatsFor(count);
+
+    Measurement measurement;
+    start(&measurement);
+    for (long repeat = 0; repeat < repeats; repeat++) {
+        for (int i = 0; i < count; i++) {
+            tableSet(vm, &table, keys[i], NUMBER_VAL(i));
+        }
+    }
+    stop(&measurement, name, repeats * count);
+    freeTable(vm, &table);
+    free(keys);
+}
+
+// looks count keys up in a table of count keys, hitPercent of them there
+static void benchGet(VM* vm, int count, int hitPercent) {
+    char name[64];
+    snprintf(name, sizeof(name), "tableGet %d keys %d%% hits", count,
+             hitPercent);
+    if (!selected(name)) return;
+    ObjString** keys = makeKeys(vm, "k", count);
+    ObjString** misses = makeKeys(vm, "m", count);
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < count; i++) tableSet(vm, &table, keys[i], NIL_VAL);
+
+    ObjString** lookups = malloc(sizeof(ObjString*) * count);
+    for (int i = 0; i < count; i++) {
+        lookups[i] = (int)(nextRandom() % 100) < hitPercent ? keys[i]
+                                                             : misses[i];
+    }
+    shuffle(lookups, count);
+    long repeats = repeatsFor(count);
+
+    Value value;
+    long found = 0;
+    Measurement measurement;
+    start(&measurement);
+    for (long repeat = 0; repeat < repeats; repeat++) {
+        for (int i = 0; i < count; i++) {
+            found += tableGet(&table, lookups[i], &value);
+        }
+    }
+    stop(&measurement, name, repeats * count);
+    if (found < 0) printf("%ld\n", found);
+
+    free(lookups);
+    freeTable(vm, &table);
+    free(keys);
+    free(misses);
+}
+
+// looks every key a table once had up after deletePercent of them were
+// deleted, the deleted ones have to probe past the tombstones
+static void benchTombstones(VM* vm, int count, int deletePercent) {
+    char name[64];
+    snprintf(name, sizeof(name), "tableGet %d keys %d%% tombstones", count,
+             deletePercent);
+    if (!selected(name)) return;
+    ObjString** keys = makeKeys(vm, "k", count);
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < count; i++) tableSet(vm, &table, keys[i], NIL_VAL);
+    for (int i = 0; i < count; i++) {
+        if ((int)(nextRandom() % 100) < deletePercent) {
+            tableDelete(&table, keys[i]);
+        }
+    }
+    shuffle(keys, count);
+    long repeats = repeatsFor(count);
+
+    Value value;
+    long found = 0;
+    Measurement measurement;
+    start(&measurement);
+    for (long repeat = 0; repeat < repeats; repeat++) {
+        for (int i = 0; i < count; i++) {
+            found += tableGet(&table, keys[i], &value);
+        }
+    }
+    stop(&measurement, name, repeats * count);
+    if (found < 0) printf("%ld\n", found);
+
+    freeTable(vm, &table);
+    free(keys);
+}
+
+// string interning
+
+// copyString() of strings that are already interned, which only hashes
+// and looks them up
+static void benchCopyInterned(VM* vm, int count, int percent) {
+    char name[64];
+    snprintf(name, sizeof(name), "copyString interned, %d strings", count);
+    if (!selected(name)) return;
+    ObjString** keys = makeKeys(vm, "interned", count);
+    shuffle(keys, count);
+    long repeats = repeatsFor(count);
+
+    Measurement measurement;
+    start(&measurement);
+    for (long repeat = 0; repeat < repeats; repeat++) {
+        for (int i = 0; i < count; i++) {
+            copyString(vm, keys[i]->chars, keys[i]->length);
+        }
+    }
+    stop(&measurement, name, repeats * count);
+    free(keys);
+}
+
+// copyString() of count new strings, which allocates them and adds them
+// to the intern table, growing it
+static void benchCopyNew(VM* vm, int count, int percent) {
+    char name[64];
+    snprintf(name, sizeof(name), "copyString new, %d strings", count);
+    if (!selected(name)) return;
+    char (*chars)[16] = malloc(sizeof(*chars) * count);
+    int* lengths = malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        lengths[i] = snprintf(chars[i], sizeof(chars[i]), "new%d", i);
+    }
+
+    Measurement measurement;
+    start(&measurement);
+    for (int i = 0; i < count; i++) copyString(vm, chars[i], lengths[i]);
+    stop(&measurement, name, count);
+    free(chars);
+    free(lengths);
+}
+
+// takeString() of buffers holding strings that are already interned, which
+// frees them
+static void benchTakeInterned(VM* vm, int count, int percent) {
+    char name[64];
+    snprintf(name, sizeof(name), "takeString interned, %d strings", count);
+    if (!selected(name)) return;
+    ObjString** keys = makeKeys(vm, "taken", count);
+    char** buffers = malloc(sizeof(char*) * count);
+    for (int i = 0; i < count; i++) {
+        buffers[i] = ALLOCATE(vm, char, keys[i]->length + 1);
+        memcpy(buffers[i], keys[i]->chars, keys[i]->length + 1);
+    }
+
+    Measurement measurement;
+    start(&measurement);
+    for (int i = 0; i < count; i++) {
+        takeString(vm, buffers[i], keys[i]->length);
+    }
+    stop(&measurement, name, count);
+    free(buffers);
+    free(keys);
+}
+
+// reallocate
+
+static void benchReallocate(VM* vm, int count, int percent) {
+    static const size_t SIZES[] = {16, 64, 256, 4096};
+    void* blocks[256];
+    for (int i = 0; i < 4; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "reallocate %zu bytes and free",
+                 SIZES[i]);
+        if (!selected(name)) continue;
+        // a few blocks live at once, like objects being made and dropped
+        Measurement measurement;
+        start(&measurement);
+        for (long op = 0; op < MIN_OPS; op += 256) {
+            for (int j = 0; j < 256; j++) {
+                blocks[j] = reallocate(vm, NULL, 0, SIZES[i]);
+            }
+            for (int j = 0; j < 256; j++) {
+                reallocate(vm, blocks[j], SIZES[i], 0);
+            }
+        }
+        stop(&measurement, name, MIN_OPS);
+    }
+
+    const char* name = "reallocate growing by doubling";
+    if (!selected(name)) return;
+    Measurement measurement;
+    long ops = 0;
+    start(&measurement);
+    for (long repeat = 0; repeat < MIN_OPS / 16; repeat++) {
+        void* block = NULL;
+        size_t size = 0;
+        // what GROW_ARRAY does for a chunk or value array
+        for (size_t next = 8; next <= 1 << 15; next *= 2) {
+            block = reallocate(vm, block, size, next);
+            size = next;
+            ops++;
+        }
+        reallocate(vm, block, size, 0);
+    }
+    stop(&measurement, name, ops);
+}
+
+// the collector
+
+// one collection of a heap of count strings, livePercent of them still
+// reachable, per object in the heap
+static void benchCollect(VM* vm, int count, int livePercent) {
+    char name[64];
+    snprintf(name, sizeof(name), "collectGarbage %d objects %d%% live",
+             count, livePercent);
+    if (!selected(name)) return;
+    int runs = count >= 1 << 15 ? 4 : 64;
+    long objects = 0;
+    Measurement measurement;
+    // set up outside the measurement, which is then paused and resumed
+    // around every collection
+    double ns = 0;
+    double misses = 0;
+    double l1dMisses = 0;
+    for (int run = 0; run < runs; run++) {
+        ObjString** keys = makeKeys(vm, "gc", count);
+        // drop the ones that are garbage, spread out over the heap
+        int live = 0;
+        for (int i = 0; i < count; i++) {
+            if ((int)(nextRandom() % 100) < livePercent) {
+                vm->hostValues.values[live++] = OBJ_VAL(keys[i]);
+            }
+        }
+        vm->hostValues.count = live;
+        free(keys);
+
+        struct timespec end;
+        start(&measurement);
+        collectGarbage(vm);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double runMisses = stopCounter(counters.cacheMisses, 1);
+        double runL1dMisses = stopCounter(counters.l1dMisses, 1);
+        ns += (end.tv_sec - measurement.start.tv_sec) * 1e9 +
+              (end.tv_nsec - measurement.start.tv_nsec);
+        misses = runMisses < 0 ? -1 : misses + runMisses;
+        l1dMisses = runL1dMisses < 0 ? -1 : l1dMisses + runL1dMisses;
+        objects += count;
+        releaseKeys(vm);
+    }
+    printf("%-40s %10.2f", name, ns / objects);
+    printPerOp(misses < 0 ? -1 : misses / objects);
+    printPerOp(l1dMisses < 0 ? -1 : l1dMisses / objects);
+    printf("\n");
+}
+
+// every benchmark gets a vm of its own, so that none of them sees the
+// intern table or the heap an earlier one grew
+typedef void (*Benchmark)(VM* vm, int count, int percent);
+
+static void run(Benchmark benchmark, int count, int percent) {
+    VM vm;
+    initVM(&vm);
+    // collections would only add noise to everything but the gc benchmarks
+    vm.nextGC = SIZE_MAX;
+    benchmark(&vm, count, percent);
+    freeVM(&vm);
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: microbench [name filter]\n");
+        exit(64);
+    }
+    if (argc == 2) filter = argv[1];
+
+    openCounters();
+    printf("%-40s %10s %12s %12s\n", "", "ns/op", "llc misses", "l1d misses");
+
+    run(benchHash, 0, 0);
+    for (int i = 0; i < KEY_COUNT_COUNT; i++) {
+        run(benchInsert, KEY_COUNTS[i], 0);
+        run(benchOverwrite, KEY_COUNTS[i], 0);
+    }
+    for (int i = 0; i < KEY_COUNT_COUNT; i++) {
+        run(benchGet, KEY_COUNTS[i], 100);
+        run(benchGet, KEY_COUNTS[i], 50);
+        run(benchGet, KEY_COUNTS[i], 0);
+    }
+    for (int i = 0; i < KEY_COUNT_COUNT; i++) {
+        run(benchTombstones, KEY_COUNTS[i], 25);
+        run(benchTombstones, KEY_COUNTS[i], 50);
+    }
+    for (int i = 0; i < KEY_COUNT_COUNT; i++) {
+        run(benchCopyInterned, KEY_COUNTS[i], 0);
+        run(benchCopyNew, KEY_COUNTS[i], 0);
+        run(benchTakeInterned, KEY_COUNTS[i], 0);
+    }
+    run(benchReallocate, 0, 0);
+    for (int i = 0; i < KEY_COUNT_COUNT; i++) {
+        run(benchCollect, KEY_COUNTS[i], 100);
+        run(benchCollect, KEY_COUNTS[i], 10);
+    }
+    return 0;
+}
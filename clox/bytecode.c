@@ -0,0 +1,965 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "memory.h"
+#include "register.h"
+#include "table.h"
+
+/*
+Bytecode files
+
+lox -c script.lox compiles the script to script.loxc, which lox then runs
+without scanning or compiling anything. The file holds every function the
+compile made, each with its constants, line numbers and code, and one
+table of the strings they use, which are interned once as the file is
+loaded. It is mapped private and writable, and the code and lines of every
+chunk are used where they lie in the mapping, flagged with Chunk.mapped so
+freeChunk() leaves them be. Quickening writes over the code as it always
+does, which only copies the pages it touches.
+
+Global slots are only good for the vm that compiled the code, so each
+function lists its global operands with the names they were for, and the
+loader gives every name its slot with globalSlot(). While the natives are
+defined in the same order that is the slot the file already has and the
+code is left as it is.
+
+A file is refused unless its version, its modes and the last opcode match
+this build and everything after the header hashes to the checksum in it,
+which catches a torn or damaged file. Nothing in it is used before it is
+checked to lie inside the file and to refer to strings and functions that
+are there, and every operand of every instruction is checked to name a
+constant, inline cache, global, local or upvalue the function has and to
+jump to the start of an instruction. How deep the code takes the stack and
+what types of value it leaves there are still trusted, as they are for
+code fresh from the compiler.
+
+lox script.lox goes through a cache directory ($LOX_CACHE_DIR, else
+$XDG_CACHE_HOME/lox, else ~/.cache/lox). The file for a script is named by
+a hash of its source, the modes and the lox binary that compiled it, so an
+edited script or a rebuilt lox simply misses, compiles and stores the new
+file next to the old one. --no-cache turns this off.
+*/
+
+#define BYTECODE_MAGIC "LOXC"
+// bump whenever the layout below or what an opcode means changes
+#define BYTECODE_VERSION 2
+
+#define BYTECODE_REGISTER 1
+#define BYTECODE_NAN_BOXING 2
+
+// name of a function without one, the script
+#define NO_STRING UINT32_MAX
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    // last opcode of the build that wrote it, one with other opcodes
+    // refuses the file
+    uint32_t lastOpcode;
+    // what the cache stored it under, 0 for a file from lox -c
+    uint64_t key;
+    uint32_t stringCount;
+    uint32_t functionCount;
+    // ObjFunction.ids the compile used up, each function's id is one of them
+    uint32_t idCount;
+    uint32_t padding;
+    // hashBytes() of everything after the header
+    uint64_t checksum;
+} BytecodeHeader;
+
+// followed by its constants, globals, lines and code, the script is the
+// first function
+typedef struct {
+    uint32_t arity;
+    uint32_t upvalueCount;
+    uint32_t maxSlots;
+    uint32_t name;
+    uint32_t id;
+    uint32_t codeCount;
+    uint32_t cacheCount;
+    uint32_t constantCount;
+    uint32_t globalCount;
+} FunctionRecord;
+
+#define CONSTANT_VALUE 0
+#define CONSTANT_STRING 1
+#define CONSTANT_FUNCTION 2
+
+typedef struct {
+    uint32_t tag;
+    // string or function index
+    uint32_t index;
+    // the value itself for CONSTANT_VALUE
+    Value value;
+} ConstantRecord;
+
+typedef struct {
+    // of the two byte slot operand
+    uint32_t offset;
+    uint32_t slot;
+    uint32_t name;
+} GlobalRecord;
+
+typedef struct BytecodeFile {
+    struct BytecodeFile* next;
+    void* bytes;
+    size_t size;
+} BytecodeFile;
+
+static uint32_t bytecodeFlags(VM* vm) {
+    uint32_t flags = vm->registerMode ? BYTECODE_REGISTER : 0;
+#ifdef NAN_BOXING
+    flags |= BYTECODE_NAN_BOXING;
+#endif
+    return flags;
+}
+
+#define HASH_SEED 14695981039346656037u
+
+// FNV-1a, 64 bits of it
+static uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length) {
+    const uint8_t* byte = (const uint8_t*)bytes;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= byte[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+// writing
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+static void writeBytes(Buffer* buffer, const void* bytes, size_t length) {
+    if (buffer->count + length > buffer->capacity) {
+        size_t capacity = GROW_CAPACITY(buffer->capacity);
+        while (capacity < buffer->count + length) capacity *= 2;
+        buffer->bytes = (uint8_t*)realloc(buffer->bytes, capacity);
+        if (buffer->bytes == NULL) exit(1);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, length);
+    buffer->count += length;
+}
+
+static void writeUint(Buffer* buffer, uint32_t value) {
+    writeBytes(buffer, &value, sizeof(value));
+}
+
+// pads to four bytes, which keeps every line array in the file aligned
+static void align(Buffer* buffer) {
+    static const uint8_t zeros[4] = {0};
+    writeBytes(buffer, zeros, (4 - buffer->count % 4) % 4);
+}
+
+typedef struct {
+    VM* vm;
+    // every function the script reaches, by id
+    ObjFunction** functions;
+    int functionCount;
+    int functionCapacity;
+    // string -> its index, and the strings by index
+    Table stringIndexes;
+    Buffer strings;
+    uint32_t stringCount;
+    Buffer records;
+} Writer;
+
+static void findFunctions(Writer* writer, ObjFunction* function) {
+    for (int i = 0; i < writer->functionCount; i++) {
+        if (writer->functions[i] == function) return;
+    }
+    if (writer->functionCount + 1 > writer->functionCapacity) {
+        writer->functionCapacity = GROW_CAPACITY(writer->functionCapacity);
+        writer->functions = (ObjFunction**)realloc(writer->functions,
+            sizeof(ObjFunction*) * writer->functionCapacity);
+        if (writer->functions == NULL) exit(1);
+    }
+    writer->functions[writer->functionCount++] = function;
+
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            findFunctions(writer, AS_FUNCTION(constants->values[i]));
+        }
+    }
+}
+
+static int compareIds(const void* a, const void* b) {
+    uint32_t first = (*(ObjFunction* const*)a)->id;
+    uint32_t second = (*(ObjFunction* const*)b)->id;
+    return first < second ? -1 : first > second;
+}
+
+static uint32_t functionIndex(Writer* writer, ObjFunction* function) {
+    ObjFunction** found = bsearch(&function, writer->functions,
+                                  writer->functionCount,
+                                  sizeof(ObjFunction*), compareIds);
+    return (uint32_t)(found - writer->functions);
+}
+
+static uint32_t stringIndex(Writer* writer, ObjString* string) {
+    Value index;
+    if (tableGet(&writer->stringIndexes, string, &index)) {
+        return (uint32_t)AS_NUMBER(index);
+    }
+    tableSet(writer->vm, &writer->stringIndexes, string,
+             NUMBER_VAL(writer->stringCount));
+    writeUint(&writer->strings, (uint32_t)string->length);
+    writeBytes(&writer->strings, string->chars, string->length);
+    return writer->stringCount++;
+}
+
+static bool isGlobalInstruction(uint8_t instruction) {
+    return instruction == OP_GET_GLOBAL || instruction == OP_SET_GLOBAL ||
+           instruction == OP_DEFINE_GLOBAL;
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function,
+                          uint32_t firstId) {
+    Chunk* chunk = &function->chunk;
+    int globalCount = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (isGlobalInstruction(chunk->code[offset])) globalCount++;
+    }
+
+    FunctionRecord record;
+    record.arity = (uint32_t)function->arity;
+    record.upvalueCount = (uint32_t)function->upvalueCount;
+    record.maxSlots = (uint32_t)function->maxSlots;
+    record.name = function->name == NULL
+                      ? NO_STRING : stringIndex(writer, function->name);
+    record.id = function->id - firstId;
+    record.codeCount = (uint32_t)chunk->count;
+    record.cacheCount = (uint32_t)chunk->cacheCount;
+    record.constantCount = (uint32_t)chunk->constants.count;
+    record.globalCount = (uint32_t)globalCount;
+    writeBytes(&writer->records, &record, sizeof(record));
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        ConstantRecord constant;
+        // zeroes the padding too, so the same script makes the same file
+        memset(&constant, 0, sizeof(constant));
+        if (IS_STRING(value)) {
+            constant.tag = CONSTANT_STRING;
+            constant.index = stringIndex(writer, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            constant.tag = CONSTANT_FUNCTION;
+            constant.index = functionIndex(writer, AS_FUNCTION(value));
+        } else {
+            // the compiler makes no other objects
+            constant.tag = CONSTANT_VALUE;
+            constant.value = value;
+        }
+        writeBytes(&writer->records, &constant, sizeof(constant));
+    }
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (!isGlobalInstruction(chunk->code[offset])) continue;
+        int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        GlobalRecord global;
+        global.offset = (uint32_t)offset + 1;
+        global.slot = (uint32_t)slot;
+        global.name = stringIndex(writer,
+            AS_STRING(writer->vm->globalNames.values[slot]));
+        writeBytes(&writer->records, &global, sizeof(global));
+    }
+
+    writeBytes(&writer->records, chunk->lines, sizeof(int) * chunk->count);
+    writeBytes(&writer->records, chunk->code, chunk->count);
+    align(&writer->records);
+}
+
+// writes script, fresh from compile(), and every function it reaches;
+// firstId is vm->nextFunctionId from before the compile
+static bool writeFile(VM* vm, ObjFunction* script, uint32_t firstId,
+                      uint64_t key, const char* path) {
+    Writer writer;
+    writer.vm = vm;
+    writer.functions = NULL;
+    writer.functionCount = 0;
+    writer.functionCapacity = 0;
+    initTable(&writer.stringIndexes);
+    writer.strings = (Buffer){NULL, 0, 0};
+    writer.stringCount = 0;
+    writer.records = (Buffer){NULL, 0, 0};
+
+    // in the order the compiler made them, which puts the script first
+    findFunctions(&writer, script);
+    qsort(writer.functions, writer.functionCount, sizeof(ObjFunction*),
+          compareIds);
+    for (int i = 0; i < writer.functionCount; i++) {
+        writeFunction(&writer, writer.functions[i], firstId);
+    }
+    align(&writer.strings);
+
+    BytecodeHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BYTECODE_MAGIC, 4);
+    header.version = BYTECODE_VERSION;
+    header.flags = bytecodeFlags(vm);
+    header.lastOpcode = OP_GET_THIS_FIELD;
+    header.key = key;
+    header.stringCount = writer.stringCount;
+    header.functionCount = (uint32_t)writer.functionCount;
+    header.idCount = vm->nextFunctionId - firstId;
+    header.checksum = hashBytes(HASH_SEED, writer.strings.bytes,
+                                writer.strings.count);
+    header.checksum = hashBytes(header.checksum, writer.records.bytes,
+                                writer.records.count);
+
+    FILE* file = fopen(path, "wb");
+    bool written = file != NULL &&
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(writer.strings.bytes, 1, writer.strings.count, file) ==
+            writer.strings.count &&
+        fwrite(writer.records.bytes, 1, writer.records.count, file) ==
+            writer.records.count;
+    if (file != NULL && fclose(file) != 0) written = false;
+
+    free(writer.functions);
+    freeTable(vm, &writer.stringIndexes);
+    free(writer.strings.bytes);
+    free(writer.records.bytes);
+    return written;
+}
+
+bool writeBytecodeFile(VM* vm, const char* source, const char* path) {
+    uint32_t firstId = vm->nextFunctionId;
+    ObjFunction* script = compile(vm, source);
+    if (script == NULL) return false;
+    push(vm, OBJ_VAL(script));
+    bool written = writeFile(vm, script, firstId, 0, path);
+    pop(vm);
+    if (!written) fprintf(stderr, "Could not write file \"%s\".\n", path);
+    return written;
+}
+
+// loading
+
+typedef struct BytecodeReader {
+    uint8_t* bytes;
+    size_t size;
+    size_t position;
+    // the strings and then the functions by index, roots until the script
+    // is handed out
+    ValueArray objects;
+    // why the file was refused
+    const char* error;
+} BytecodeReader;
+
+void markBytecodeRoots(VM* vm) {
+    if (vm->bytecodeReader == NULL) return;
+    ValueArray* objects = &vm->bytecodeReader->objects;
+    for (int i = 0; i < objects->count; i++) markValue(vm, objects->values[i]);
+}
+
+// the next length bytes where they lie, NULL if the file ends first
+static uint8_t* readBytes(BytecodeReader* reader, size_t length) {
+    if (length > reader->size - reader->position) {
+        reader->error = "it is cut short";
+        return NULL;
+    }
+    uint8_t* bytes = reader->bytes + reader->position;
+    reader->position += length;
+    return bytes;
+}
+
+static bool readRecord(BytecodeReader* reader, void* record, size_t length) {
+    uint8_t* bytes = readBytes(reader, length);
+    if (bytes == NULL) return false;
+    memcpy(record, bytes, length);
+    return true;
+}
+
+static bool skipPadding(BytecodeReader* reader) {
+    return readBytes(reader, (4 - reader->position % 4) % 4) != NULL;
+}
+
+static bool refuse(BytecodeReader* reader, const char* error) {
+    reader->error = error;
+    return false;
+}
+
+static bool readHeader(VM* vm, BytecodeReader* reader, uint64_t key,
+                       BytecodeHeader* header) {
+    if (!readRecord(reader, header, sizeof(*header)) ||
+        memcmp(header->magic, BYTECODE_MAGIC, 4) != 0) {
+        return refuse(reader, "it is no bytecode file");
+    }
+    if (header->version != BYTECODE_VERSION ||
+        header->lastOpcode != OP_GET_THIS_FIELD) {
+        return refuse(reader, "it is for another version of lox");
+    }
+    if (header->flags != bytecodeFlags(vm)) {
+        return refuse(reader, vm->registerMode
+                                  ? "it was compiled without --register"
+                                  : "it was compiled with --register");
+    }
+    if (key != 0 && header->key != key) {
+        return refuse(reader, "it is for another script");
+    }
+    if (header->checksum != hashBytes(HASH_SEED, reader->bytes +
+                                      reader->position,
+                                      reader->size - reader->position)) {
+        return refuse(reader, "it is damaged");
+    }
+    if (header->functionCount == 0 || header->functionCount > reader->size ||
+        header->stringCount > reader->size ||
+        header->idCount < header->functionCount) {
+        return refuse(reader, "its header is damaged");
+    }
+    return true;
+}
+
+static bool readStrings(VM* vm, BytecodeReader* reader, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t length;
+        if (!readRecord(reader, &length, sizeof(length))) return false;
+        uint8_t* chars = readBytes(reader, length);
+        if (chars == NULL || length > INT_MAX) return false;
+        // the slot first, so the string is a root as soon as it exists
+        writeValueArray(vm, &reader->objects, NIL_VAL);
+        reader->objects.values[reader->objects.count - 1] =
+            OBJ_VAL(copyString(vm, (const char*)chars, (int)length));
+    }
+    return skipPadding(reader);
+}
+
+static ObjString* stringAt(BytecodeReader* reader, uint32_t index,
+                           uint32_t stringCount) {
+    if (index >= stringCount) {
+        reader->error = "it refers to a string it does not have";
+        return NULL;
+    }
+    return AS_STRING(reader->objects.values[index]);
+}
+
+static bool readFunction(VM* vm, BytecodeReader* reader,
+                         ObjFunction* function, BytecodeHeader* header) {
+    FunctionRecord record;
+    if (!readRecord(reader, &record, sizeof(record))) return false;
+    if (record.id >= header->idCount || record.arity > UINT16_COUNT ||
+        record.upvalueCount > UINT16_COUNT || record.codeCount == 0 ||
+        record.codeCount > INT_MAX || record.maxSlots > INT_MAX ||
+        record.maxSlots < record.arity + 1) {
+        return refuse(reader, "a function in it is damaged");
+    }
+    function->arity = (int)record.arity;
+    function->upvalueCount = (int)record.upvalueCount;
+    function->maxSlots = (int)record.maxSlots;
+    function->id += record.id;
+    if (record.name != NO_STRING) {
+        function->name = stringAt(reader, record.name, header->stringCount);
+        if (function->name == NULL) return false;
+    }
+
+    Chunk* chunk = &function->chunk;
+    for (uint32_t i = 0; i < record.constantCount; i++) {
+        ConstantRecord constant;
+        if (!readRecord(reader, &constant, sizeof(constant))) return false;
+        Value value = constant.value;
+        if (constant.tag == CONSTANT_STRING) {
+            ObjString* string = stringAt(reader, constant.index,
+                                         header->stringCount);
+            if (string == NULL) return false;
+            value = OBJ_VAL(string);
+        } else if (constant.tag == CONSTANT_FUNCTION) {
+            if (constant.index >= header->functionCount) {
+                return refuse(reader, "it refers to a function it does not have");
+            }
+            value = reader->objects.values[header->stringCount +
+                                           constant.index];
+        } else if (constant.tag != CONSTANT_VALUE || IS_OBJ(value)) {
+            return refuse(reader, "a constant in it is damaged");
+        }
+        writeValueArray(vm, &chunk->constants, value);
+    }
+
+    uint8_t* globals = readBytes(reader,
+                                 sizeof(GlobalRecord) * record.globalCount);
+    uint8_t* lines = readBytes(reader, sizeof(int) * record.codeCount);
+    uint8_t* code = readBytes(reader, record.codeCount);
+    if (globals == NULL || lines == NULL || code == NULL ||
+        !skipPadding(reader)) {
+        return false;
+    }
+    // in place, see freeChunk()
+    chunk->mapped = true;
+    chunk->code = code;
+    chunk->lines = (int*)lines;
+    chunk->count = (int)record.codeCount;
+    chunk->capacity = (int)record.codeCount;
+    if (record.cacheCount > 0) {
+        if (record.cacheCount > UINT16_COUNT) {
+            return refuse(reader, "a function in it is damaged");
+        }
+        chunk->caches = ALLOCATE(vm, InlineCache, record.cacheCount);
+        chunk->cacheCount = chunk->cacheCapacity = (int)record.cacheCount;
+        for (uint32_t i = 0; i < record.cacheCount; i++) {
+            chunk->caches[i].count = 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < record.globalCount; i++) {
+        GlobalRecord global;
+        memcpy(&global, globals + sizeof(GlobalRecord) * i, sizeof(global));
+        ObjString* name = stringAt(reader, global.name, header->stringCount);
+        if (name == NULL) return false;
+        if (global.offset == 0 || global.offset + 2 > record.codeCount ||
+            !isGlobalInstruction(code[global.offset - 1])) {
+            return refuse(reader, "a global in it is damaged");
+        }
+        int slot = globalSlot(vm, name);
+        if (slot > UINT16_MAX) return refuse(reader, "it has too many globals");
+        // only written to, and so only copied, if this vm differs
+        if ((uint32_t)slot != global.slot) {
+            code[global.offset] = (uint8_t)(slot >> 8);
+            code[global.offset + 1] = (uint8_t)slot;
+        }
+    }
+    return true;
+}
+
+static int shortAt(uint8_t* bytes) {
+    return (bytes[0] << 8) | bytes[1];
+}
+
+static uint32_t intAt(uint8_t* bytes) {
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) |
+           ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+// whether chunk has the constant, and it is a string if name is set
+static bool hasConstant(Chunk* chunk, int constant, bool name) {
+    return constant < chunk->constants.count &&
+           (!name || IS_STRING(chunk->constants.values[constant]));
+}
+
+// the closure's constant and its captures, which instructionLength()
+// would take on trust; 0 if any of it is damaged
+static int checkClosure(ObjFunction* function, int offset, int window) {
+    Chunk* chunk = &function->chunk;
+    uint8_t* code = &chunk->code[offset];
+    int left = chunk->count - offset;
+    int length = code[0] == OP_CLOSURE ? 2 : 3;
+    if (length > left) return 0;
+    int constant = code[0] == OP_CLOSURE ? window + code[1] : shortAt(code + 1);
+    if (!hasConstant(chunk, constant, false) ||
+        !IS_FUNCTION(chunk->constants.values[constant])) {
+        return 0;
+    }
+
+    ObjFunction* closed = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int i = 0; i < closed->upvalueCount; i++) {
+        if (length + 2 > left) return 0;
+        uint8_t flags = code[length];
+        int index = code[length + 1];
+        if (flags & UPVALUE_WIDE) {
+            if (length + 3 > left) return 0;
+            index = shortAt(code + length + 1);
+        }
+        length += flags & UPVALUE_WIDE ? 3 : 2;
+        // a local of this frame, or one of the upvalues it closed over
+        if (index >= (flags & UPVALUE_LOCAL ? function->maxSlots
+                                            : function->upvalueCount)) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+// the length of the instruction at offset once every operand it has is
+// found in range, 0 if one is not or the instruction is cut short; *target
+// is set to where it jumps, or -1. window is the one OP_WIDE opened for it
+static int checkInstruction(VM* vm, ObjFunction* function, int offset,
+                            int window, long* target) {
+    Chunk* chunk = &function->chunk;
+    uint8_t* code = &chunk->code[offset];
+    *target = -1;
+    // quickened instructions are only ever written by run(), and expect a
+    // filled inline cache
+    if (code[0] > OP_GET_THIS_FIELD || genericOpcode(code[0]) != code[0]) {
+        return 0;
+    }
+    if (code[0] == OP_CLOSURE || code[0] == OP_CLOSURE_LONG) {
+        return checkClosure(function, offset, window);
+    }
+    int length = instructionLength(chunk, offset);
+    if (length > chunk->count - offset) return 0;
+
+    int slots = function->maxSlots;
+    int name = window + (length > 1 ? code[1] : 0);
+    bool valid = true;
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_RETURN_CONSTANT:
+            valid = hasConstant(chunk, name, false);
+            break;
+        case OP_CONSTANT_LONG:
+            valid = hasConstant(chunk, (code[1] << 16) | shortAt(code + 2),
+                                false);
+            break;
+        case OP_GET_SUPER:
+        case OP_CLASS:
+        case OP_METHOD:
+            valid = hasConstant(chunk, name, true);
+            break;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_THIS_PROPERTY:
+            valid = hasConstant(chunk, name, true) &&
+                    shortAt(code + 2) < chunk->cacheCount;
+            break;
+        // a call can not take more arguments than the frame holds
+        case OP_INVOKE:
+            valid = hasConstant(chunk, name, true) && code[2] < slots &&
+                    shortAt(code + 3) < chunk->cacheCount;
+            break;
+        case OP_INVOKE_LONG:
+            valid = hasConstant(chunk, name, true) &&
+                    shortAt(code + 2) < slots &&
+                    shortAt(code + 4) < chunk->cacheCount;
+            break;
+        case OP_SUPER_INVOKE:
+            valid = hasConstant(chunk, name, true) && code[2] < slots;
+            break;
+        case OP_SUPER_INVOKE_LONG:
+            valid = hasConstant(chunk, name, true) &&
+                    shortAt(code + 2) < slots;
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            valid = code[1] < slots;
+            break;
+        case OP_CALL_LONG:
+            valid = shortAt(code + 1) < slots;
+            break;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+            // after the loader gave the names their slots in this vm
+            valid = shortAt(code + 1) < vm->globalValues.count;
+            break;
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            valid = code[1] < slots;
+            break;
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+            valid = shortAt(code + 1) < slots;
+            break;
+        case OP_ADD_LOCALS:
+        case OP_R_MOVE:
+            valid = code[1] < slots && code[2] < slots;
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            valid = code[1] < function->upvalueCount;
+            break;
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+            valid = shortAt(code + 1) < function->upvalueCount;
+            break;
+        case OP_R_LOADK:
+            valid = code[1] < slots &&
+                    hasConstant(chunk, window + code[2], false);
+            break;
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_EQUAL:
+        case OP_R_GREATER:
+        case OP_R_LESS:
+            valid = (code[1] == REG_PUSH || code[1] < slots) &&
+                    code[2] < slots && code[3] < slots;
+            break;
+        case OP_R_ADDK:
+        case OP_R_SUBTRACTK:
+        case OP_R_MULTIPLYK:
+        case OP_R_DIVIDEK:
+        case OP_R_EQUALK:
+        case OP_R_GREATERK:
+        case OP_R_LESSK:
+            valid = (code[1] == REG_PUSH || code[1] < slots) &&
+                    code[2] < slots &&
+                    hasConstant(chunk, window + code[3], false);
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            *target = offset + 3L + shortAt(code + 1);
+            break;
+        case OP_LOOP:
+            *target = offset + 3L - shortAt(code + 1);
+            break;
+        case OP_LESS_CONSTANT_JUMP:
+            valid = hasConstant(chunk, name, false);
+            *target = offset + 4L + shortAt(code + 2);
+            break;
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+            *target = offset + 5L + intAt(code + 1);
+            break;
+        case OP_LOOP_LONG:
+            *target = offset + 5L - intAt(code + 1);
+            break;
+        default:
+            break;
+    }
+    return valid ? length : 0;
+}
+
+// marks of the instructions checkCode() found
+#define INSTRUCTION_START 1
+// right after OP_WIDE, only ever run with its window open
+#define INSTRUCTION_WIDENED 2
+
+// every instruction whole, inside the chunk and with operands in range, so
+// run() and the jits can step through the code without checking anything;
+// the functions of OP_CLOSURE have to be read already
+static bool checkCode(VM* vm, BytecodeReader* reader, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    uint8_t* marks = ALLOCATE(vm, uint8_t, chunk->count);
+    memset(marks, 0, chunk->count);
+    const char* error = NULL;
+
+    int offset = 0;
+    int last = 0;
+    int window = 0;
+    while (offset < chunk->count && error == NULL) {
+        long target;
+        int length = checkInstruction(vm, function, offset, window, &target);
+        if (length == 0) {
+            error = "it has an instruction that is damaged";
+            break;
+        }
+        marks[offset] = window != 0 ? INSTRUCTION_WIDENED : INSTRUCTION_START;
+        if (target != -1 && (target < 0 || target >= chunk->count)) {
+            error = "it jumps out of a function";
+        }
+        // OP_WIDE opens the window for just the instruction after it, which
+        // has to be one that reads a constant and then OP_NARROW
+        if (window != 0 && (target != -1 || chunk->code[offset] == OP_WIDE ||
+                            offset + length >= chunk->count ||
+                            chunk->code[offset + length] != OP_NARROW)) {
+            error = "it has an instruction that is damaged";
+        }
+        window = chunk->code[offset] == OP_WIDE
+                     ? chunk->code[offset + 1] * UINT8_COUNT : 0;
+        last = offset;
+        offset += length;
+    }
+
+    // run() has to leave the code before it runs off the end
+    if (error == NULL) {
+        uint8_t instruction = chunk->code[last];
+        if (instruction != OP_RETURN && instruction != OP_RETURN_CONSTANT &&
+            instruction != OP_JUMP && instruction != OP_JUMP_LONG &&
+            instruction != OP_LOOP && instruction != OP_LOOP_LONG) {
+            error = "it has a function that does not return";
+        }
+    }
+    // and jumps may only land on an instruction, with no window open
+    for (offset = 0; offset < chunk->count && error == NULL;
+         offset += instructionLength(chunk, offset)) {
+        long target;
+        checkInstruction(vm, function, offset, 0, &target);
+        if (target != -1 && marks[target] != INSTRUCTION_START) {
+            error = "it jumps into the middle of an instruction";
+        }
+    }
+
+    FREE_ARRAY(vm, uint8_t, marks, chunk->count);
+    if (error == NULL) return true;
+    return refuse(reader, error);
+}
+
+static ObjFunction* readFile(VM* vm, BytecodeReader* reader, uint64_t key) {
+    BytecodeHeader header;
+    if (!readHeader(vm, reader, key, &header)) return NULL;
+    if (!readStrings(vm, reader, header.stringCount)) return NULL;
+
+    // all of them first, so constants can refer to functions further on;
+    // their ids run on from vm->nextFunctionId like the compile's did
+    uint32_t firstId = vm->nextFunctionId;
+    for (uint32_t i = 0; i < header.functionCount; i++) {
+        writeValueArray(vm, &reader->objects, NIL_VAL);
+        ObjFunction* function = newFunction(vm);
+        function->id = firstId;
+        reader->objects.values[reader->objects.count - 1] =
+            OBJ_VAL(function);
+    }
+    vm->nextFunctionId = firstId + header.idCount;
+
+    Value* functions = reader->objects.values + header.stringCount;
+    for (uint32_t i = 0; i < header.functionCount; i++) {
+        if (!readFunction(vm, reader, AS_FUNCTION(functions[i]), &header)) {
+            return NULL;
+        }
+    }
+    if (reader->position != reader->size) {
+        refuse(reader, "it goes on past its last function");
+        return NULL;
+    }
+    for (uint32_t i = 0; i < header.functionCount; i++) {
+        if (!checkCode(vm, reader, AS_FUNCTION(functions[i]))) {
+            return NULL;
+        }
+    }
+    return AS_FUNCTION(functions[0]);
+}
+
+// key is the one the file has to have been stored under, 0 for any; a file
+// that is refused is only reported if report is set
+static ObjFunction* mapFile(VM* vm, const char* path, uint64_t key,
+                            bool report) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (report) fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return NULL;
+    }
+    struct stat info;
+    void* bytes = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        // private, so quickening and global slots write to copies
+        bytes = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE, fd, 0);
+    }
+    // the mapping keeps the file
+    close(fd);
+    if (bytes == MAP_FAILED) {
+        if (report) fprintf(stderr, "Could not read file \"%s\".\n", path);
+        return NULL;
+    }
+
+    BytecodeReader reader;
+    reader.bytes = bytes;
+    reader.size = (size_t)info.st_size;
+    reader.position = 0;
+    initValueArray(&reader.objects);
+    reader.error = NULL;
+    vm->bytecodeReader = &reader;
+    ObjFunction* script = readFile(vm, &reader, key);
+    vm->bytecodeReader = NULL;
+    freeValueArray(vm, &reader.objects);
+
+    if (script == NULL) {
+        if (report) {
+            fprintf(stderr, "Could not load \"%s\": %s.\n", path,
+                    reader.error);
+        }
+        // whatever was read never runs, and the gc leaves mapped code be
+        munmap(bytes, reader.size);
+        return NULL;
+    }
+
+    BytecodeFile* file = (BytecodeFile*)malloc(sizeof(BytecodeFile));
+    if (file == NULL) exit(1);
+    file->bytes = bytes;
+    file->size = reader.size;
+    file->next = vm->bytecodeFiles;
+    vm->bytecodeFiles = file;
+    return script;
+}
+
+ObjFunction* loadBytecodeFile(VM* vm, const char* path) {
+    return mapFile(vm, path, 0, true);
+}
+
+void freeBytecodeFiles(VM* vm) {
+    BytecodeFile* file = vm->bytecodeFiles;
+    while (file != NULL) {
+        BytecodeFile* next = file->next;
+        munmap(file->bytes, file->size);
+        free(file);
+        file = next;
+    }
+    vm->bytecodeFiles = NULL;
+}
+
+// the cache
+
+static uint64_t cacheKey(VM* vm, const char* source) {
+    uint64_t hash = HASH_SEED;
+    // the binary, so that a rebuilt lox never runs what an old one compiled
+    struct stat binary;
+    if (stat("/proc/self/exe", &binary) == 0) {
+        hash = hashBytes(hash, &binary.st_mtime, sizeof(binary.st_mtime));
+        hash = hashBytes(hash, &binary.st_size, sizeof(binary.st_size));
+        hash = hashBytes(hash, &binary.st_ino, sizeof(binary.st_ino));
+    }
+    uint32_t flags = bytecodeFlags(vm);
+    hash = hashBytes(hash, &flags, sizeof(flags));
+    hash = hashBytes(hash, source, strlen(source));
+    // 0 stands for no key in the header
+    return hash == 0 ? 1 : hash;
+}
+
+static bool makeDirectory(const char* path) {
+    return mkdir(path, 0755) == 0 || access(path, W_OK) == 0;
+}
+
+// false if there is none to be had
+static bool cacheDirectory(char* path, size_t size) {
+    const char* directory = getenv("LOX_CACHE_DIR");
+    if (directory != NULL) {
+        snprintf(path, size, "%s", directory);
+        return directory[0] != '\0' && makeDirectory(path);
+    }
+    const char* cache = getenv("XDG_CACHE_HOME");
+    if (cache != NULL && cache[0] != '\0') {
+        snprintf(path, size, "%s/lox", cache);
+        return makeDirectory(path);
+    }
+    const char* home = getenv("HOME");
+    if (home == NULL || home[0] == '\0') return false;
+    snprintf(path, size, "%s/.cache", home);
+    if (!makeDirectory(path)) return false;
+    snprintf(path, size, "%s/.cache/lox", home);
+    return makeDirectory(path);
+}
+
+ObjFunction* compileCached(VM* vm, const char* source) {
+    char directory[PATH_MAX];
+    if (!cacheDirectory(directory, sizeof(directory))) {
+        return compile(vm, source);
+    }
+    uint64_t key = cacheKey(vm, source);
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%016llx.loxc", directory,
+             (unsigned long long)key);
+    ObjFunction* script = mapFile(vm, path, key, false);
+    if (script != NULL) return script;
+
+    uint32_t firstId = vm->nextFunctionId;
+    script = compile(vm, source);
+    if (script == NULL) return NULL;
+    push(vm, OBJ_VAL(script));
+    // written aside and renamed over, so a lox starting at the same time
+    // never maps half a file
+    char temporary[PATH_MAX + 48];
+    snprintf(temporary, sizeof(temporary), "%s.%ld", path, (long)getpid());
+    if (!writeFile(vm, script, firstId, key, temporary) ||
+        rename(temporary, path) != 0) {
+        unlink(temporary);
+    }
+    pop(vm);
+    return script;
+}
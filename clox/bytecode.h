@@ -0,0 +1,27 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// compiles source to path as a .loxc file that runs without compiling;
+// false with an error printed if either failed
+bool writeBytecodeFile(VM* vm, const char* source, const char* path);
+
+// maps the .loxc file at path and returns its script, NULL with an error
+// printed if it is not one this build can run
+ObjFunction* loadBytecodeFile(VM* vm, const char* path);
+
+// compile() through the cache directory: source compiled before by this
+// same binary is loaded from there, anything else is compiled and stored
+ObjFunction* compileCached(VM* vm, const char* source);
+
+// the objects of a .loxc file being loaded into vm, before anything else
+// refers to them
+void markBytecodeRoots(VM* vm);
+
+// unmaps the files whose code vm's functions ran in place
+void freeBytecodeFiles(VM* vm);
+
+#endif
@@ -9,25 +9,32 @@ void initChunk(Chunk* chunk) {
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
+    chunk->mapped = false;
     initValueArray(&chunk->constants);
 }
 
-void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(uint8_t, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+void freeChunk(VM* vm, Chunk* chunk) {
+    if (!chunk->mapped) {
+        FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(vm, uint8_t, chunk->lines, chunk->capacity);
+    }
+    freeValueArray(vm, &chunk->constants);
+    FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCapacity);
     initChunk(chunk);
 }
 
 // adds opcode into chunk
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
     // if opcode spills over chunk capacity size then increase it
     if (chunk->capacity < chunk->count +1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, 
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, 
             oldCapacity, chunk->capacity); 
-        chunk->lines = GROW_ARRAY(int, chunk->lines, 
+        chunk->lines = GROW_ARRAY(vm, int, chunk->lines, 
             oldCapacity, chunk->capacity); 
     }
 
@@ -37,10 +44,200 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 
 }
 
-int addConstant(Chunk* chunk, Value value) {
+int addConstant(VM* vm, Chunk* chunk, Value value) {
     // ensures value is still reachable during allocation so gc doesnt remove
-    push(value);
-    writeValueArray(&chunk->constants, value); 
-    pop();
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value); 
+    pop(vm);
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+// adds an empty inline cache and returns its index
+int addInlineCache(VM* vm, Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches,
+            oldCapacity, chunk->cacheCapacity);
+    }
+
+    chunk->caches[chunk->cacheCount].count = 0;
+    return chunk->cacheCount++;
+}
+
+// number of bytes taken by the instruction at offset including its operands
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_NOT_EQUAL:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_NARROW:
+            return 1;
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_RETURN_CONSTANT:
+        case OP_WIDE:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_SUPER_INVOKE:
+        case OP_R_MOVE:
+        case OP_R_LOADK:
+        case OP_ADD_LOCALS:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_SET_UPVALUE_LONG:
+        case OP_CALL_LONG:
+            return 3;
+        case OP_R_ADD:
+        case OP_R_ADDK:
+        case OP_R_SUBTRACT:
+        case OP_R_SUBTRACTK:
+        case OP_R_MULTIPLY:
+        case OP_R_MULTIPLYK:
+        case OP_R_DIVIDE:
+        case OP_R_DIVIDEK:
+        case OP_R_EQUAL:
+        case OP_R_EQUALK:
+        case OP_R_GREATER:
+        case OP_R_GREATERK:
+        case OP_R_LESS:
+        case OP_R_LESSK:
+        case OP_LESS_CONSTANT_JUMP:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_THIS_PROPERTY:
+        case OP_GET_PROPERTY_FIELD:
+        case OP_GET_THIS_FIELD:
+        case OP_CONSTANT_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            return 4;
+        case OP_INVOKE:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+            return 5;
+        case OP_INVOKE_LONG:
+            return 6;
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            uint8_t* code = &chunk->code[offset];
+            int constant = code[0] == OP_CLOSURE
+                ? code[1] : (code[1] << 8) | code[2];
+            int length = code[0] == OP_CLOSURE ? 2 : 3;
+            // each captured upvalue adds a flags byte and its index
+            ObjFunction* function = AS_FUNCTION(
+                chunk->constants.values[constant]);
+            for (int i = 0; i < function->upvalueCount; i++) {
+                length += code[length] & UPVALUE_WIDE ? 3 : 2;
+            }
+            return length;
+        }
+    }
+    return 1;
+}
+
+// how many values the instruction at offset leaves on the stack minus how
+// many it takes; only defined for the stack code the compiler emits
+int stackEffect(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_UPVALUE_LONG:
+        case OP_CLOSURE_LONG:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_METHOD:
+            return -1;
+        // the arguments and the callee become the result
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -chunk->code[offset + 1];
+        case OP_INVOKE:
+            return -chunk->code[offset + 2];
+        case OP_CALL_LONG:
+            return -((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+        case OP_INVOKE_LONG:
+            return -((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+        // the superclass on top goes as well
+        case OP_SUPER_INVOKE:
+            return -chunk->code[offset + 2] - 1;
+        case OP_SUPER_INVOKE_LONG:
+            return -((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]) - 1;
+        default:
+            return 0;
+    }
+}
+
+uint8_t genericOpcode(uint8_t instruction) {
+    switch (instruction) {
+        case OP_ADD_NUM:
+        case OP_ADD_STR:             return OP_ADD;
+        case OP_SUBTRACT_NUM:        return OP_SUBTRACT;
+        case OP_MULTIPLY_NUM:        return OP_MULTIPLY;
+        case OP_DIVIDE_NUM:          return OP_DIVIDE;
+        case OP_GREATER_NUM:         return OP_GREATER;
+        case OP_LESS_NUM:            return OP_LESS;
+        case OP_GET_PROPERTY_FIELD:  return OP_GET_PROPERTY;
+        case OP_GET_THIS_FIELD:      return OP_GET_THIS_PROPERTY;
+        default:                     return instruction;
+    }
+}
@@ -34,6 +34,7 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,    // CALL in return position, reuses the caller's frame
   OP_INVOKE,
   OP_SUPER_INVOKE,
   OP_CLOSURE,
@@ -41,9 +42,86 @@ typedef enum {
   OP_RETURN,
   OP_CLASS,
   OP_INHERIT,
-  OP_METHOD
+  OP_METHOD,
+  // wide forms, only emitted once an operand no longer fits the compact one
+  OP_CONSTANT_LONG,       // 24-bit constant index
+  OP_GET_LOCAL_LONG,      // 16-bit slot
+  OP_SET_LOCAL_LONG,
+  OP_GET_UPVALUE_LONG,    // 16-bit upvalue index
+  OP_SET_UPVALUE_LONG,
+  OP_JUMP_LONG,           // 32-bit offset
+  OP_JUMP_IF_FALSE_LONG,
+  OP_LOOP_LONG,
+  OP_CALL_LONG,           // 16-bit argument count
+  OP_INVOKE_LONG,
+  OP_SUPER_INVOKE_LONG,
+  OP_CLOSURE_LONG,        // 16-bit function constant
+  // one-byte name operands see the constants through a window of 256:
+  // OP_WIDE n moves it to n * 256 for the instruction that follows and
+  // OP_NARROW moves it back to 0 after that
+  OP_WIDE,
+  OP_NARROW,
+  // three address register forms, only emitted by lowerToRegisters()
+  OP_R_MOVE,
+  OP_R_LOADK,
+  OP_R_ADD,
+  OP_R_ADDK,
+  OP_R_SUBTRACT,
+  OP_R_SUBTRACTK,
+  OP_R_MULTIPLY,
+  OP_R_MULTIPLYK,
+  OP_R_DIVIDE,
+  OP_R_DIVIDEK,
+  OP_R_EQUAL,
+  OP_R_EQUALK,
+  OP_R_GREATER,
+  OP_R_GREATERK,
+  OP_R_LESS,
+  OP_R_LESSK,
+  // superinstructions, only emitted by fuseSuperinstructions()
+  OP_ADD_LOCALS,          // GET_LOCAL a; GET_LOCAL b; ADD
+  OP_GET_THIS_PROPERTY,   // GET_LOCAL 0; GET_PROPERTY name
+  OP_LESS_CONSTANT_JUMP,  // CONSTANT k; LESS; JUMP_IF_FALSE offset
+  OP_NOT_EQUAL,           // EQUAL; NOT
+  OP_RETURN_CONSTANT,     // CONSTANT k; RETURN
+  // quickened instructions, written over the generic one by run() once it
+  // has seen its operand types; each checks them and reverts if they change
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  OP_GET_PROPERTY_FIELD,  // the cache's one shape has the property as a field
+  OP_GET_THIS_FIELD,
 } OpCode;
 
+// flags byte in front of each upvalue index of OP_CLOSURE, a wide index
+// takes two bytes instead of one
+#define UPVALUE_LOCAL 1
+#define UPVALUE_WIDE 2
+
+// most shapes a property or invoke site remembers before it gives up
+#define IC_POLYMORPHIC_MAX 4
+// count of a cache that saw too many shapes and is no longer used
+#define IC_MEGAMORPHIC UINT8_MAX
+
+// how a property name resolved for one instance shape at one call site
+typedef struct {
+    uint32_t classVersion;     // ObjClass.version the entry was filled for
+    struct ObjShape* shape;    // shape of the instances it was filled for
+    int fieldIndex;            // slot in the instance's fields, -1 for a method
+    Value method;              // the method closure when fieldIndex is -1
+    struct ObjShape* transition; // shape after a set adds the field, else NULL
+} InlineCacheEntry;
+
+// one per OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE instruction
+typedef struct {
+    uint8_t count;
+    InlineCacheEntry entries[IC_POLYMORPHIC_MAX];
+} InlineCache;
+
 // chunk of data represents all the data that is sent to the CPU as instructions
 // needs to be dynamic since we dont know how big the instruction has to be
 // When we add an element, if the count is less than the capacity, 
@@ -56,11 +134,23 @@ typedef struct {
     int* lines;
     ValueArray constants;
     uint8_t* code; 
+    // inline caches, indexed by the 16-bit operand of the instructions using them
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
+    // code and lines lie in a mapped .loxc file and are not ours to free,
+    // see bytecode.c
+    bool mapped;
 } Chunk;
 
 void initChunk(Chunk* chunk);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-int addConstant(Chunk* chunk, Value value);
+void freeChunk(VM* vm, Chunk* chunk);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+int addConstant(VM* vm, Chunk* chunk, Value value);
+int addInlineCache(VM* vm, Chunk* chunk);
+int instructionLength(Chunk* chunk, int offset);
+int stackEffect(Chunk* chunk, int offset);
+// the instruction a quickened one specializes, anything else unchanged
+uint8_t genericOpcode(uint8_t instruction);
 
 #endif
\ No newline at end of file
@@ -7,12 +7,34 @@
 
 #define NAN_BOXING
 
+// threaded dispatch in run() using labels as values, only GCC and Clang
+    // support it so everything else falls back to the switch loop
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
 // #define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// print the stack before every instruction; --trace is the cheap way to
+// see what ran
+// #define DEBUG_TRACE_EXECUTION
+
+// count the most frequent opcode sequences and print them on exit
+// #define DEBUG_PROFILE_NGRAMS
 
-#define DEBUG_STRESS_GC
+// count executions and cycles per opcode, calls per function and probes
+// per table lookup, and report them on exit (--stats out.json for json)
+// #define DEBUG_STATS
+
+// collect on every allocation, which finds missing roots and makes
+// everything else crawl
+// #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+
+// one interpreter with its own heap, globals and stack; everything that
+// can allocate or run code takes the one it works for
+typedef struct VM VM;
 
 #endif
\ No newline at end of file
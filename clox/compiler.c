@@ -8,16 +8,14 @@
 #include "scanner.h"
 #include "object.h"
 #include "chunk.h"
+#include "peephole.h"
+#include "register.h"
+#include "table.h"
 
 #ifdef DEBUG_PRINT_CODE 
 #include "debug.h"
 #endif
-typedef struct {
-    Token current; 
-    Token previous;
-    bool hadError;
-    bool panicMode;
-} Parser;
+typedef struct Parser Parser;
 
 // lox precedence from highest to lowest
 typedef enum {
@@ -35,7 +33,7 @@ typedef enum {
 } Precedence;
 
 // function pointer 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {
     ParseFn prefix; 
@@ -51,7 +49,7 @@ typedef struct {
 
 typedef struct {
     // stores which local slot the upvalue is capturing
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
@@ -67,10 +65,20 @@ typedef struct Compiler {
     ObjFunction* function; 
     FunctionType type;
 
-    Upvalue upvalues[UINT8_COUNT];
-    Local locals[UINT8_COUNT];
+    // both grow as needed, up to UINT16_COUNT entries
+    Upvalue* upvalues;
+    int upvalueCapacity;
+    Local* locals;
+    int localCapacity;
     int localCount; 
     int scopeDepth;
+    // offset of the last OP_CALL emitted, -1 before the first
+    int lastCall;
+    // index of every name in the constants, so each is only added once
+    Table names;
+    // where the function starts in the source, what marks it for long jumps
+    const char* start;
+    bool longJumps;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -78,18 +86,34 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
+// everything one compile() works with, handed to every function here
+struct Parser {
+    VM* vm;
+    Scanner scanner;
+    Token current; 
+    Token previous;
+    bool hadError;
+    bool panicMode;
+    // a 16-bit jump overflowed, the source is compiled again with its
+    // function on 32-bit jumps
+    bool needsRecompile;
+
+    // innermost function and class being compiled
+    Compiler* compiler;
+    ClassCompiler* currentClass;
+    // starts of the functions that need 32-bit jumps
+    const char** longJumpFunctions;
+    int longJumpCount;
+    int longJumpCapacity;
+};
 
-static Chunk* currentChunk() {
-    return &current->function->chunk;
+static Chunk* currentChunk(Parser* parser) {
+    return &parser->compiler->function->chunk;
 }
 
-static void errorAt(Token* token, const char* message) {
-    if (parser.panicMode) return;
-    parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if (parser->panicMode) return;
+    parser->panicMode = true;
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -101,121 +125,195 @@ static void errorAt(Token* token, const char* message) {
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    parser->hadError = true;
 }
 
-static void error(const char* message) {
-    errorAt(&parser.current, message);
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
 }
 
-static void errorAtCurrent(const char* message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
 }
 
-static void advance() {
+static void advance(Parser* parser) {
     // sends current scanner token to previous 
-    parser.previous = parser.current;
+    parser->previous = parser->current;
 
     // loops through all source code and scans next token
     // keeps track of current token for error purposes
     for (;;) {
         // breaks out of loop here since it returns Token
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) break;
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
 // similar to advance but it also validates that the token has as expected type
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
 // check if type matches current parser type
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+    return parser->current.type == type;
 }
 
 // if matches advance once and return true
-static bool match(TokenType type) {
-    if (!check(type)) return false;
-    advance();
+static bool match(Parser* parser, TokenType type) {
+    if (!check(parser, type)) return false;
+    advance(parser);
     return true;
 }
 
 // append single byte to chunk
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static void emitLoop(int LoopStart) {
-    emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int LoopStart) {
+    // a body too large for 16 bits loops back with a 32-bit offset
+    if (currentChunk(parser)->count - LoopStart + 3 > UINT16_MAX) {
+        emitByte(parser, OP_LOOP_LONG);
+        int offset = currentChunk(parser)->count - LoopStart + 4;
+        emitBytes(parser, (offset >> 24) & 0xff, (offset >> 16) & 0xff);
+        emitBytes(parser, (offset >> 8) & 0xff, offset & 0xff);
+        return;
+    }
 
-    // loop offset to start of loop - 2 bytes (to accont for the size of OP_LOOP instructions own operands we need to jump over)
-    int offset = currentChunk()->count - LoopStart + 2; 
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    emitByte(parser, OP_LOOP);
 
+    // loop offset to start of loop - 2 bytes (to accont for the size of OP_LOOP instructions own operands we need to jump over)
+    int offset = currentChunk(parser)->count - LoopStart + 2; 
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
 // adds a placeholder buffer after an instruction that can be jumped to
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction); 
+static int emitJump(Parser* parser, uint8_t instruction) {
+    if (parser->compiler->longJumps) {
+        emitByte(parser, instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+        emitBytes(parser, 0xff, 0xff);
+        emitBytes(parser, 0xff, 0xff);
+        return currentChunk(parser)->count - 4;
+    }
+
+    emitByte(parser, instruction); 
     // jump 16 bit offset (jump over 65535 bytes of code)
     // these are just placeholders in the chunk opcode
-    emitByte(0xff);
-    emitByte(0xff);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
     // move the current chunk count back to before these placeholders
-    return currentChunk()->count - 2;
+    return currentChunk(parser)->count - 2;
 }
 
-static void emitReturn() {
-    if (current->type == TYPE_INITIALIZER) {
-        emitBytes(OP_GET_LOCAL, 0);
+static void emitReturn(Parser* parser) {
+    // initializers always hand back the instance in slot 0
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+        emitBytes(parser, OP_GET_LOCAL, 0);
     } else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
 
-    emitByte(OP_NIL);
-    emitByte(OP_RETURN);
+    emitByte(parser, OP_RETURN);
 }
 
 // add constant adds given value to end of chunk's constant table and returns the index
 // this function also makes sure we dont have too many constants 
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk");
+static int makeConstant(Parser* parser, Value value) {
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
+    // OP_CONSTANT_LONG has 24 bits for the index
+    if (constant >= 1 << 24) {
+        error(parser, "Too many constants in one chunk");
         return 0;
     }
 
-    // cast to 8 bit int
-    return (uint8_t)constant;
+    return constant;
 }
 
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+// instructions naming a constant past the first 256 open a window onto it
+// and return the byte to use as their operand
+static uint8_t beginName(Parser* parser, int constant) {
+    if (constant > UINT8_MAX) emitBytes(parser, OP_WIDE, (constant >> 8) & 0xff);
+    return constant & 0xff;
 }
 
-static void patchJump(int offset) {
+// closes the window again after the instruction using it
+static void endName(Parser* parser, int constant) {
+    if (constant > UINT8_MAX) emitByte(parser, OP_NARROW);
+}
+
+// operand pointing a property or invoke instruction at its own inline cache
+static void emitInlineCache(Parser* parser) {
+    int cache = addInlineCache(parser->vm, currentChunk(parser));
+    if (cache > UINT16_MAX) {
+        error(parser, "Too many property accesses in one chunk.");
+    }
+
+    emitBytes(parser, (cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void emitConstant(Parser* parser, Value value) {
+    int constant = makeConstant(parser, value);
+    if (constant <= UINT8_MAX) {
+        emitBytes(parser, OP_CONSTANT, constant);
+    } else {
+        emitBytes(parser, OP_CONSTANT_LONG, (constant >> 16) & 0xff);
+        emitBytes(parser, (constant >> 8) & 0xff, constant & 0xff);
+    }
+}
+
+static bool hasLongJumps(Parser* parser, const char* start) {
+    for (int i = 0; i < parser->longJumpCount; i++) {
+        if (parser->longJumpFunctions[i] == start) return true;
+    }
+    return false;
+}
+
+// the next compile of the source gives the current function 32-bit jumps
+static void needLongJumps(Parser* parser) {
+    parser->needsRecompile = true;
+    if (hasLongJumps(parser, parser->compiler->start)) return;
+    if (parser->longJumpCapacity < parser->longJumpCount + 1) {
+        int oldCapacity = parser->longJumpCapacity;
+        parser->longJumpCapacity = GROW_CAPACITY(oldCapacity);
+        parser->longJumpFunctions = GROW_ARRAY(parser->vm, const char*, parser->longJumpFunctions,
+                                       oldCapacity, parser->longJumpCapacity);
+    }
+    parser->longJumpFunctions[parser->longJumpCount++] = parser->compiler->start;
+}
+
+static void patchJump(Parser* parser, int offset) {
+    if (parser->compiler->longJumps) {
+        int jump = currentChunk(parser)->count - offset - 4;
+        for (int i = 3; i >= 0; i--) {
+            currentChunk(parser)->code[offset + i] = jump & 0xff;
+            jump >>= 8;
+        }
+        return;
+    }
+
     // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
+    // how far the jumps of a function go is only known at their targets, so
+    // the function is compiled again from the start instead
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        needLongJumps(parser);
+        return;
     }
 
     /*
@@ -241,26 +339,37 @@ static void patchJump(int offset) {
 
     This basically a convention that ensures that it is of size 1 byte 
     */
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
     // remaining byte in jump
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
-    compiler->enclosing = current;
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type) {
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
-    compiler->scopeDepth = 0; 
-    compiler->function = newFunction();
-    current = compiler;
+    compiler->scopeDepth = 0;
+    compiler->lastCall = -1; 
+    compiler->upvalues = NULL;
+    compiler->upvalueCapacity = 0;
+    compiler->locals = NULL;
+    compiler->localCapacity = 0;
+    initTable(&compiler->names);
+    compiler->start = parser->current.start;
+    compiler->longJumps = hasLongJumps(parser, compiler->start);
+    compiler->function = newFunction(parser->vm);
+    parser->compiler = compiler;
 
     if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+        parser->compiler->function->name = copyString(parser->vm,
+                parser->previous.start, parser->previous.length);
     }
 
     // claim local slot 0 for internal use
-    Local* local = &current->locals[current->localCount++];
+    parser->compiler->localCapacity = 8;
+    parser->compiler->locals = ALLOCATE(parser->vm, Local, parser->compiler->localCapacity);
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
 
@@ -274,150 +383,239 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 
 }
 
-static ObjFunction* endCompiler() {
-    emitReturn();
-    ObjFunction* function = current->function;
+// deepest the stack gets above the frame's slots; the code is structured,
+// so straight-line code and the forward jumps into it cover every path and
+// a loop's back-edge always leaves the stack as deep as its header
+static int maxStackDepth(Parser* parser, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    int* targetDepths = ALLOCATE(parser->vm, int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) targetDepths[i] = 0;
+
+    // the callee slot and the parameters are there when the call starts
+    int depth = function->arity + 1;
+    int maxDepth = depth;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        if (targetDepths[offset] > depth) depth = targetDepths[offset];
+        depth += stackEffect(chunk, offset);
+        if (depth > maxDepth) maxDepth = depth;
+
+        uint8_t* code = &chunk->code[offset];
+        int target = -1;
+        if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE) {
+            target = offset + 3 + ((code[1] << 8) | code[2]);
+        } else if (code[0] == OP_JUMP_LONG ||
+                   code[0] == OP_JUMP_IF_FALSE_LONG) {
+            target = offset + 5 + (int)(((uint32_t)code[1] << 24) |
+                (code[2] << 16) | (code[3] << 8) | code[4]);
+        }
+        if (target != -1 && depth > targetDepths[target]) {
+            targetDepths[target] = depth;
+        }
+    }
+
+    FREE_ARRAY(parser->vm, int, targetDepths, chunk->count + 1);
+    return maxDepth;
+}
+
+static ObjFunction* endCompiler(Parser* parser) {
+    emitReturn(parser);
+    ObjFunction* function = parser->compiler->function;
+    // a pass that is compiled again may have jumps that were never patched
+    if (!parser->needsRecompile) {
+        // on the stack code, the passes below only ever make it shallower
+        function->maxSlots = maxStackDepth(parser, function);
+        if (parser->vm->registerMode) lowerToRegisters(parser->vm, &function->chunk);
+        fuseSuperinstructions(parser->vm, &function->chunk);
+    }
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
+    if (!parser->hadError && !parser->needsRecompile) {
         // top level defined funcion does not have a name so display <script> if that is the current function
         char* displayName = function->name != NULL ? function->name->chars : "<script>";
-        disassembleChunk(currentChunk(), displayName);
+        disassembleChunk(parser->vm, currentChunk(parser), displayName);
     }
 #endif
 
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function; 
 }
 
+// the function keeps none of this, it goes once its closure is emitted
+static void freeCompiler(Parser* parser, Compiler* compiler) {
+    FREE_ARRAY(parser->vm, Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+    FREE_ARRAY(parser->vm, Local, compiler->locals, compiler->localCapacity);
+    freeTable(parser->vm, &compiler->names);
+}
+
 // increase depth of scope when beginning new scope
-static void beginScope() {
-    current->scopeDepth++;
+static void beginScope(Parser* parser) {
+    parser->compiler->scopeDepth++;
 }
 
-static void endScope() {
-    current->scopeDepth--;
+static void endScope(Parser* parser) {
+    Compiler* compiler = parser->compiler;
+    compiler->scopeDepth--;
 
     // clear local variables on scope
-    while (current->localCount > 0 && 
-    current->locals[current->localCount -1].depth > current->scopeDepth) {
+    while (compiler->localCount > 0 &&
+    compiler->locals[compiler->localCount -1].depth > compiler->scopeDepth) {
 
-        if (current->locals[current->localCount - 1].isCaptured) {
-            emitByte(OP_CLOSE_UPVALUE);
+        if (compiler->locals[compiler->localCount - 1].isCaptured) {
+            emitByte(parser, OP_CLOSE_UPVALUE);
         } else {
-            emitByte(OP_POP);
+            emitByte(parser, OP_POP);
         }
         // remove variable from local
-        current->localCount--;
+        compiler->localCount--;
     }
 }
 
-static void expression(); 
-static void statement();
-static void declaration();
+static void expression(Parser* parser); 
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence Precedence);
+static void parsePrecedence(Parser* parser, Precedence Precedence);
 
-static void binary(bool canAssign) {
+static void binary(Parser* parser, bool canAssign) {
     // left operand has already been consumed
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
     ParseRule* rule = getRule(operatorType);
     // cast 
-    parsePrecedence((Precedence)(rule->precedence+1));
+    parsePrecedence(parser, (Precedence)(rule->precedence+1));
 
     switch (operatorType) {    
-        case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:          emitByte(OP_ADD); break;
-        case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:    emitBytes(parser, OP_EQUAL, OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQUAL); break;
+        case TOKEN_GREATER:       emitByte(parser, OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+        case TOKEN_LESS:          emitByte(parser, OP_LESS); break;
+        case TOKEN_LESS_EQUAL:    emitBytes(parser, OP_GREATER, OP_NOT); break;
+        case TOKEN_PLUS:          emitByte(parser, OP_ADD); break;
+        case TOKEN_MINUS:         emitByte(parser, OP_SUBTRACT); break;
+        case TOKEN_STAR:          emitByte(parser, OP_MULTIPLY); break;
+        case TOKEN_SLASH:         emitByte(parser, OP_DIVIDE); break;
         default: return; // Unreachable.
     }
 }
 
-static uint8_t argumentList() {
-    uint8_t argCount = 0; 
-    if (!check(TOKEN_RIGHT_PAREN)) {
+static int argumentList(Parser* parser) {
+    int argCount = 0; 
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            expression(); 
-            if (argCount == 255) {
-                error("Can't have more than 255 arguments.");
+            expression(parser); 
+            if (argCount == UINT16_MAX) {
+                error(parser, "Can't have more than 65535 arguments.");
             }
             argCount++;
-        } while (match(TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments");
     return argCount;
 }
 
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Parser* parser, Token* name) {
     // adds lexeme to chunk's constant table as string
     // then returns index of that constant in teh constant table
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
-}
+    ObjString* string = copyString(parser->vm, name->start, name->length);
+    Value index;
+    if (tableGet(&parser->compiler->names, string, &index)) {
+        return (int)AS_NUMBER(index);
+    }
 
-static void call(bool canAssign) {
-    uint8_t argCount = argumentList(); 
-    emitBytes(OP_CALL, argCount);
+    int constant = makeConstant(parser, OBJ_VAL(string));
+    // names are a byte within the window OP_WIDE opens, so 16 bits at most
+    if (constant > UINT16_MAX) {
+        error(parser, "Too many names in one chunk.");
+        return 0;
+    }
+    tableSet(parser->vm, &parser->compiler->names, string, NUMBER_VAL(constant));
+    return constant;
 }
 
-static void dot(bool canAssign) {
-    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+// resolves a global variable to its slot in vm->globalValues, the slot is
+// made here if needed so the name can be defined after it is used
+static uint16_t globalVariable(Parser* parser, Token* name) {
+    int slot = globalSlot(parser->vm, copyString(parser->vm, name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
+}
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(OP_SET_PROPERTY, name);
-    } else if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
-        emitByte(argCount);
+static void call(Parser* parser, bool canAssign) {
+    int argCount = argumentList(parser); 
+    if (argCount > UINT8_MAX) {
+        emitByte(parser, OP_CALL_LONG);
+        emitBytes(parser, (argCount >> 8) & 0xff, argCount & 0xff);
+        return;
+    }
+    parser->compiler->lastCall = currentChunk(parser)->count;
+    emitBytes(parser, OP_CALL, argCount);
+}
+
+static void dot(Parser* parser, bool canAssign) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    int name = identifierConstant(parser, &parser->previous);
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitBytes(parser, OP_SET_PROPERTY, beginName(parser, name));
+        emitInlineCache(parser);
+    } else if (match(parser, TOKEN_LEFT_PAREN)) {
+        int argCount = argumentList(parser);
+        if (argCount > UINT8_MAX) {
+            emitBytes(parser, OP_INVOKE_LONG, beginName(parser, name));
+            emitBytes(parser, (argCount >> 8) & 0xff, argCount & 0xff);
+        } else {
+            emitBytes(parser, OP_INVOKE, beginName(parser, name));
+            emitByte(parser, argCount);
+        }
+        emitInlineCache(parser);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitBytes(parser, OP_GET_PROPERTY, beginName(parser, name));
+        emitInlineCache(parser);
     }
+    endName(parser, name);
 }
 
-static void literal(bool canAssign) {
-    switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+static void literal(Parser* parser, bool canAssign) {
+    switch (parser->previous.type) {
+        case TOKEN_FALSE: emitByte(parser, OP_FALSE); break;
+        case TOKEN_NIL: emitByte(parser, OP_NIL); break;
+        case TOKEN_TRUE: emitByte(parser, OP_TRUE); break;
         default: return; // unreachable
     }
 }
 
 // dealing with parenthesis
-static void grouping(bool canAssign) {
+static void grouping(Parser* parser, bool canAssign) {
     // there is no opcode for parenthesis so all we are doing here is just 
     // generating the bypecode with a higher precedence
-    expression(); 
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    expression(parser); 
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void or_(bool canAssign) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool canAssign) {
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
 
-    patchJump(elseJump);
-    emitByte(OP_POP);
+    patchJump(parser, elseJump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
-static void string(bool canAssign) {
+static void string(Parser* parser, bool canAssign) {
     // the + 1 and -2 trim the tailing and leading quotation marks ""
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, 
-                                    parser.previous.length - 2)));
+    emitConstant(parser, OBJ_VAL(copyString(parser->vm, parser->previous.start + 1, 
+                                    parser->previous.length - 2)));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -425,7 +623,7 @@ static bool identifiersEqual(Token* a, Token* b) {
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
     // walk locals that are in scope
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         Local* local = &compiler->locals[i];
@@ -434,7 +632,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
             // be reference to variable in its own 
             // intializer and we throw error
             if (local->depth == -1) {
-                error("Can't read local variable in its own initializer");
+                error(parser, "Can't read local variable in its own initializer");
             }
             return i;
         }
@@ -445,7 +643,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 }
 
 // adds a new upvalue to array so can access upvalues at runtime
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser* parser, Compiler* compiler, int index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     // check to see if function already has an upvalue that closes over that variable
@@ -456,10 +654,16 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
         }
     }
 
-    if (upvalueCount == UINT8_COUNT) {
-        error("Too many closure variables in function.");
+    if (upvalueCount == UINT16_COUNT) {
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
+    if (compiler->upvalueCapacity < upvalueCount + 1) {
+        int oldCapacity = compiler->upvalueCapacity;
+        compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->upvalues = GROW_ARRAY(parser->vm, Upvalue, compiler->upvalues,
+                                        oldCapacity, compiler->upvalueCapacity);
+    }
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
@@ -467,94 +671,115 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 }
 
 // call this function if we know the variable isnt in the current compiler
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
     // if enclosing compiler is null we know weve reached the outermost function
     // and the variable must be global
     // or "hopefully global" since we wont know till runtime
     if (compiler->enclosing == NULL) return -1;
 
-    int local = resolveLocal(compiler->enclosing, name);
+    int local = resolveLocal(parser, compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(parser, compiler, local, true);
     }
 
     // recursively calls 
     // each time works one step outside a function
     // calls until the upvalue is found
-    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(parser, compiler, upvalue, false);
     }
 
     return -1;
 }
 
-static void addLocal(Token name) {
-    if (current->localCount == UINT8_MAX) {
-        error("Too many local variables in function. ");
+static void addLocal(Parser* parser, Token name) {
+    if (parser->compiler->localCount == UINT16_COUNT) {
+        error(parser, "Too many local variables in function. ");
         return;
     }
+    if (parser->compiler->localCapacity < parser->compiler->localCount + 1) {
+        int oldCapacity = parser->compiler->localCapacity;
+        parser->compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+        parser->compiler->locals = GROW_ARRAY(parser->vm, Local, parser->compiler->locals,
+                                     oldCapacity, parser->compiler->localCapacity);
+    }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     // mark depth as sentine - 1 depth since it has not been initialized yet
     local->depth = -1;
     local->isCaptured = false;
 }
 
-static void declareVariable() {
+static void declareVariable(Parser* parser) {
     // only for locals
-    if (current->scopeDepth == 0) return;
+    if (parser->compiler->scopeDepth == 0) return;
 
-    Token* name = &parser.previous;
+    Token* name = &parser->previous;
 
-    for (int i = current->localCount - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
             break;
         }
 
         if (identifiersEqual(name, &local->name)) {
-            error("Already a variable with this name in this scope");
+            error(parser, "Already a variable with this name in this scope");
         }
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
-static void namedVariable(Token name, bool canAssign) {
+// globals and the long forms take a 16 bit slot, locals and upvalues a
+// single byte
+static void emitVariableOp(Parser* parser, uint8_t op, int arg) {
+    emitByte(parser, op);
+    if (op != OP_GET_LOCAL && op != OP_SET_LOCAL &&
+        op != OP_GET_UPVALUE && op != OP_SET_UPVALUE) {
+        emitByte(parser, (arg >> 8) & 0xff);
+    }
+    emitByte(parser, arg & 0xff);
+}
+
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
 
     // try get local from give name
+    // slot 255 already takes the long form, it is REG_PUSH to the register
+    // instructions
     if (arg != -1) {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
-    } else if ((arg = resolveUpvalue(current, &name)) != -1) {
-        getOp = OP_GET_UPVALUE;
-        setOp = OP_SET_UPVALUE;
+        bool isLong = arg >= REG_PUSH;
+        getOp = isLong ? OP_GET_LOCAL_LONG : OP_GET_LOCAL;
+        setOp = isLong ? OP_SET_LOCAL_LONG : OP_SET_LOCAL;
+    } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
+        bool isLong = arg > UINT8_MAX;
+        getOp = isLong ? OP_GET_UPVALUE_LONG : OP_GET_UPVALUE;
+        setOp = isLong ? OP_SET_UPVALUE_LONG : OP_SET_UPVALUE;
     }
     
     else {
         // if not found in local use global
-        arg = identifierConstant(&name);
+        arg = globalVariable(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     
     // look for equals sign after identifier
     // if we find one, we compile assigned value and emit an assignment instruction
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression(); 
-        emitBytes(setOp, (uint8_t)arg);
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser); 
+        emitVariableOp(parser, setOp, arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitVariableOp(parser, getOp, arg);
     }
 }
 
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
 }
 
 static Token syntheticToken(const char* text) {
@@ -564,49 +789,55 @@ static Token syntheticToken(const char* text) {
     return token;
 }
 
-static void super_(bool canAssign) {
-    if (currentClass == NULL) {
-        error("Can't use 'super' outside of a class.");
-    } else if (!currentClass->hasSuperclass) {
-        error("Can't use 'super' in a class with no superclass.");
+static void super_(Parser* parser, bool canAssign) {
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'super' outside of a class.");
+    } else if (!parser->currentClass->hasSuperclass) {
+        error(parser, "Can't use 'super' in a class with no superclass.");
     }
 
-    consume(TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
-
-    namedVariable(syntheticToken("this"), false);
-    if (match(TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList();
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
-        emitByte(argCount);
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    int name = identifierConstant(parser, &parser->previous);
+
+    namedVariable(parser, syntheticToken("this"), false);
+    if (match(parser, TOKEN_LEFT_PAREN)) {
+        int argCount = argumentList(parser);
+        namedVariable(parser, syntheticToken("super"), false);
+        if (argCount > UINT8_MAX) {
+            emitBytes(parser, OP_SUPER_INVOKE_LONG, beginName(parser, name));
+            emitBytes(parser, (argCount >> 8) & 0xff, argCount & 0xff);
+        } else {
+            emitBytes(parser, OP_SUPER_INVOKE, beginName(parser, name));
+            emitByte(parser, argCount);
+        }
     } else {
-        namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_GET_SUPER, beginName(parser, name));
     }
+    endName(parser, name);
 }
 
-static void this_(bool canAssign) {
+static void this_(Parser* parser, bool canAssign) {
     // cans use 'this' keyword outside of a class
-    if (currentClass == NULL) {
-        error("Can't use 'this' outside of a class.");
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
 
-    variable(false);
+    variable(parser, false);
 } 
 
-static void unary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
 
     // compile operand
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     // emit the operator instruction
     switch (operatorType) {
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
-        case TOKEN_BANG: emitByte(OP_NOT); break;
+        case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
+        case TOKEN_BANG: emitByte(parser, OP_NOT); break;
         default: return;
     }
 }
@@ -614,66 +845,68 @@ static void unary(bool canAssign) {
 
 
 // starts at current token and parses any expression at the given precedence level or higher
-static void parsePrecedence(Precedence precedence) {
-    advance();
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+    advance(parser);
     // read the current token and look up the corresponding ParseRule
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     // if no prefix parser then token must be syntax error
     if (prefixRule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
     // while precedence of operation of following token is higher, advance and repeat
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance(); 
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser); 
         // if following token not infix then ends 
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
         // e.g. if following token is '-' then infixRule() = binary()
-        infixRule(canAssign);
+        infixRule(parser, canAssign);
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static uint16_t parseVariable(Parser* parser, const char* errorMessage) {
     // requires next token to be an identifier
-    consume(TOKEN_IDENTIFIER, errorMessage); 
+    consume(parser, TOKEN_IDENTIFIER, errorMessage); 
 
-    declareVariable();
+    declareVariable(parser);
     // exit function if in a local scope 
-    if (current->scopeDepth > 0) return 0;
+    if (parser->compiler->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(parser, &parser->previous);
 }
 
-static void markInitialized() {
-    if (current->scopeDepth == 0) return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInitialized(Parser* parser) {
+    if (parser->compiler->scopeDepth == 0) return;
+    parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-    if (current->scopeDepth > 0) {
+static void defineVariable(Parser* parser, uint16_t global) {
+    if (parser->compiler->scopeDepth > 0) {
         // once variable initializer been compiled we mark it initialized
-        markInitialized();
+        markInitialized(parser);
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitByte(parser, OP_DEFINE_GLOBAL);
+    emitByte(parser, (global >> 8) & 0xff);
+    emitByte(parser, global & 0xff);
 }
 
-static void and_(bool canAssign) {
-    int endJump = emitJump(OP_JUMP_IF_FALSE); 
+static void and_(Parser* parser, bool canAssign) {
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE); 
 
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
-    patchJump(endJump);
+    patchJump(parser, endJump);
 }
 
 ParseRule rules[] = {
@@ -729,285 +962,308 @@ static ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
-static void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration(); 
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser); 
     } 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
+static void function(Parser* parser, FunctionType type) {
     Compiler compiler; 
-    initCompiler(&compiler, type);
-    beginScope(); 
+    initCompiler(parser, &compiler, type);
+    beginScope(parser); 
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         // do loop ensures it at least runs once
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                errorAtCurrent("Cant have more than 255 parameters.");
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > UINT16_MAX) {
+                errorAtCurrent(parser, "Cant have more than 65535 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
-            defineVariable(constant);
-        } while (match(TOKEN_COMMA));
+            uint16_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after function name.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' after function name.");
+    block(parser);
+
+    ObjFunction* function = endCompiler(parser); 
+    int constant = makeConstant(parser, OBJ_VAL(function));
+    if (constant <= UINT8_MAX) {
+        emitBytes(parser, OP_CLOSURE, constant);
+    } else {
+        if (constant > UINT16_MAX) error(parser, "Too many functions in one chunk.");
+        emitByte(parser, OP_CLOSURE_LONG);
+        emitBytes(parser, (constant >> 8) & 0xff, constant & 0xff);
     }
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after function name.");
-    consume(TOKEN_LEFT_BRACE, "Expect '{' after function name.");
-    block();
-
-    ObjFunction* function = endCompiler(); 
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+        uint8_t flags = compiler.upvalues[i].isLocal ? UPVALUE_LOCAL : 0;
+        int index = compiler.upvalues[i].index;
+        if (index > UINT8_MAX) {
+            emitBytes(parser, flags | UPVALUE_WIDE, (index >> 8) & 0xff);
+        } else {
+            emitByte(parser, flags);
+        }
+        emitByte(parser, index & 0xff);
     }
-
+    freeCompiler(parser, &compiler);
 }
 
-static void method() {
-    consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+static void method(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+    int constant = identifierConstant(parser, &parser->previous);
 
     FunctionType type = TYPE_METHOD;
 
-    if (parser.previous.length == 4 &&
-        memcmp(parser.previous.start, "init", 4) == 0) {
+    if (parser->previous.length == 4 &&
+        memcmp(parser->previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
-    function(type);
-    emitBytes(OP_METHOD, constant);
+    function(parser, type);
+    emitBytes(parser, OP_METHOD, beginName(parser, constant));
+    endName(parser, constant);
 }
 
-static void classDeclaration() {
-    consume(TOKEN_IDENTIFIER, "Expect class name.");
-    Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
-    declareVariable();
+static void classDeclaration(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser->previous;
+    int nameConstant = identifierConstant(parser, &parser->previous);
+    declareVariable(parser);
+    uint16_t global = parser->compiler->scopeDepth > 0 ? 0 : globalVariable(parser, &className);
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitBytes(parser, OP_CLASS, beginName(parser, nameConstant));
+    endName(parser, nameConstant);
+    defineVariable(parser, global);
 
     // when compiler begins compiling a class, it pushes a new
         // classCompiler onto the implicit linked stack
     ClassCompiler classCompiler; 
     classCompiler.hasSuperclass = false;
-    classCompiler.enclosing = currentClass;
-    currentClass = &classCompiler;
+    classCompiler.enclosing = parser->currentClass;
+    parser->currentClass = &classCompiler;
 
-    emitBytes(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    emitBytes(parser, OP_CLASS, beginName(parser, nameConstant));
+    endName(parser, nameConstant);
+    defineVariable(parser, global);
 
-    if (match(TOKEN_LESS)) {
-        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-        variable(false);
+    if (match(parser, TOKEN_LESS)) {
+        consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(parser, false);
 
-        if (identifiersEqual(&className, &parser.previous)) {
-            error("A class can't inherit from itself.");
+        if (identifiersEqual(&className, &parser->previous)) {
+            error(parser, "A class can't inherit from itself.");
         }
         // adding synthetic token to super class 
-        beginScope(); 
-        addLocal(syntheticToken("super"));
-        defineVariable(0);
+        beginScope(parser); 
+        addLocal(parser, syntheticToken("super"));
+        defineVariable(parser, 0);
 
-        namedVariable(className, false);
-        emitByte(OP_INHERIT);
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
         classCompiler.hasSuperclass = true;
     }
 
-    namedVariable(className, false);
-    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        method();
+    namedVariable(parser, className, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        method(parser);
     }
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emitByte(OP_POP);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(parser, OP_POP);
 
     if (classCompiler.hasSuperclass) {
-        endScope();
+        endScope(parser);
     }
 
-    currentClass = currentClass->enclosing;
+    parser->currentClass = parser->currentClass->enclosing;
 }
 
-static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
-    markInitialized(); 
-    function(TYPE_FUNCTION);
-    defineVariable(global);
+static void funDeclaration(Parser* parser) {
+    uint16_t global = parseVariable(parser, "Expect function name.");
+    markInitialized(parser); 
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
 }
 
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+static void varDeclaration(Parser* parser) {
+    uint16_t global = parseVariable(parser, "Expect variable name.");
 
-    if (match(TOKEN_EQUAL)) {
-        expression();
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     } else {
         // if just var variable; with no = then = nil
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-    defineVariable(global);
+    defineVariable(parser, global);
 }
 
 // expression statement is an expression followed by a semicolon
-static void expressionStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
 }
 
-static void forStatement() {
-    beginScope();
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(TOKEN_SEMICOLON)) {
+static void forStatement(Parser* parser) {
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMICOLON)) {
         // No initializer.
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     int exitJump = -1;
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_POP);
     }
 
-    if(!match(TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    if(!match(parser, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-        emitLoop(loopStart);
+        emitLoop(parser, loopStart);
         loopStart = incrementStart;
-        patchJump(bodyJump);
+        patchJump(parser, bodyJump);
     }
 
-    statement();
-    emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
     if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP_POP);
+        patchJump(parser, exitJump);
+        emitByte(parser, OP_POP);
     }
-    endScope();
+    endScope(parser);
 }
 
-static void ifStatement() {
+static void ifStatement(Parser* parser) {
     // compile statement inside brackets
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
 
     // then run OP_JUMP_IF_FALSE op code to top chunk bytecode
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
 
-    int elseJump = emitJump(OP_JUMP);
+    int elseJump = emitJump(parser, OP_JUMP);
 
-    patchJump(thenJump);
-    emitByte(OP_POP);
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(elseJump);
+    patchJump(parser, thenJump);
+    emitByte(parser, OP_POP);
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patchJump(parser, elseJump);
 }
 
-static void caseStatement() {
-    consume(TOKEN_COLON, "Expect ':' after literal");
+static void caseStatement(Parser* parser) {
+    consume(parser, TOKEN_COLON, "Expect ':' after literal");
 }
 
-static void defaultStatement() {
-    consume(TOKEN_COLON, "Expect ':' after 'default'");
+static void defaultStatement(Parser* parser) {
+    consume(parser, TOKEN_COLON, "Expect ':' after 'default'");
 }
 
-static void switchStatement() {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+static void switchStatement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
     // capture switch statement
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition");
 
 
     for (;;) {
 
-        if (parser.current.type == TOKEN_CASE) {
-            advance();
+        if (parser->current.type == TOKEN_CASE) {
+            advance(parser);
             // compare to switch statement 
             // if true then caseStatement();
         } else break;
         
     }
 
-    if (parser.current.type == TOKEN_DEFAULT) {
-        advance(); 
-        defaultStatement();
+    if (parser->current.type == TOKEN_DEFAULT) {
+        advance(parser); 
+        defaultStatement(parser);
     }
    
 }
 
-static void printStatement() {
-    expression(); 
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+    expression(parser); 
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement() {
-    if (current->type == TYPE_SCRIPT) {
-        error("Can't return from top-level code.");
+static void returnStatement(Parser* parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
     }
 
-    if (match(TOKEN_SEMICOLON)) {
-        emitReturn();
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
     } else {
         // class initialisers cant return anything 
         // they literally just do init(variables_to_init) { this.vars = vars };
-        if (current->type == TYPE_INITIALIZER) {
-            error("Can't return a value from an initializer.");
+        if (parser->compiler->type == TYPE_INITIALIZER) {
+            error(parser, "Can't return a value from an initializer.");
         }
 
-        expression(); 
-        consume(TOKEN_SEMICOLON, "Expect ';' after return value,");
-        emitByte(OP_RETURN);
+        expression(parser); 
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value,");
+        // a call that is the last thing before the return becomes a tail
+        // call; the OP_RETURN stays for jumps that land after the call, like
+        // the one of 'and', and for callees that do not reuse the frame
+        if (parser->compiler->lastCall == currentChunk(parser)->count - 2) {
+            currentChunk(parser)->code[parser->compiler->lastCall] = OP_TAIL_CALL;
+        }
+        emitByte(parser, OP_RETURN);
     }
 }
 
 // mostly same as if loop
-static void whileStatement() {
-    int loopStart = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(Parser* parser) {
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loopStart);
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart);
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
 }
 
-static void synchronize() {
-    parser.panicMode = false;
+static void synchronize(Parser* parser) {
+    parser->panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
+    while (parser->current.type != TOKEN_EOF) {
         // skip tokens until we reach a statement boundary
         // e.g. semicolon
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-            switch (parser.current.type) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+            switch (parser->current.type) {
                 case TOKEN_CLASS:
                 case TOKEN_FUN:
                 case TOKEN_VAR:
@@ -1021,72 +1277,98 @@ static void synchronize() {
                 default: 
                     ; // do nothing
             }
-        advance();
+        advance(parser);
     }
 }
 
-static void declaration() {
-    if (match(TOKEN_CLASS)) {
-        classDeclaration();
-    } else if (match(TOKEN_FUN)) {
-        funDeclaration();
-    } else if (match(TOKEN_VAR)) {
-        varDeclaration();
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_CLASS)) {
+        classDeclaration(parser);
+    } else if (match(parser, TOKEN_FUN)) {
+        funDeclaration(parser);
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        statement();
-    }
-
-    if (parser.panicMode) synchronize();
-}
-
-static void statement() {
-    if (match(TOKEN_PRINT)) {
-        printStatement();
-    } else if (match(TOKEN_FOR)) {
-        forStatement();   
-    } else if (match(TOKEN_IF)) {
-        ifStatement();   
-    } else if (match(TOKEN_RETURN)) {
-        returnStatement();
-    } else if (match(TOKEN_WHILE)) {
-        whileStatement();   
-    } else if (match(TOKEN_LEFT_BRACE)) {
-        beginScope(); 
-        block(); 
-        endScope(); 
+        statement(parser);
+    }
+
+    if (parser->panicMode) synchronize(parser);
+}
+
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);   
+    } else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);   
+    } else if (match(parser, TOKEN_RETURN)) {
+        returnStatement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);   
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser); 
+        block(parser); 
+        endScope(parser); 
     } else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
 
 // will need to change type of function at some point
 // at the end of this function the scanner will have passed the required opcodes as well as 
     // constant values onto the chunk using emitValues 
-ObjFunction* compile(const char* source) {
-    initScanner(source);
-    Compiler compiler; 
-    initCompiler(&compiler, TYPE_SCRIPT);
-
-    parser.hadError = false;
-    parser.panicMode = false;
+static ObjFunction* compilePass(Parser* parser, const char* source) {
+    initScanner(&parser->scanner, source);
+    parser->hadError = false;
+    parser->panicMode = false;
+    parser->needsRecompile = false;
 
-    advance();
+    advance(parser);
+    Compiler compiler; 
+    initCompiler(parser, &compiler, TYPE_SCRIPT);
 
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    while (!match(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
 
     // return function from compiler
-    ObjFunction* function = endCompiler();
+    ObjFunction* function = endCompiler(parser);
+    freeCompiler(parser, &compiler);
+    return function;
+}
+
+ObjFunction* compile(VM* vm, const char* source) {
+    Parser parser;
+    parser.vm = vm;
+    parser.compiler = NULL;
+    parser.currentClass = NULL;
+    parser.longJumpFunctions = NULL;
+    parser.longJumpCount = 0;
+    parser.longJumpCapacity = 0;
+    vm->parser = &parser;
+
+    // a pass that finds a jump too far for 16 bits marks its function and
+    // the next pass gives that one long jumps, leaving every other function
+    // as it was
+    ObjFunction* function;
+    do {
+        function = compilePass(&parser, source);
+    } while (parser.needsRecompile && !parser.hadError);
+
+    FREE_ARRAY(vm, const char*, parser.longJumpFunctions,
+               parser.longJumpCapacity);
+    vm->parser = NULL;
     // if no compiler errors we return function return the function, 
     // else return NULL
     return parser.hadError ? NULL : function;
 }
 
-void markCompilerRoots() {
-    Compiler* compiler = current;
+void markCompilerRoots(VM* vm) {
+    if (vm->parser == NULL) return;
+    Compiler* compiler = vm->parser->compiler;
     while (compiler != NULL) {
-        markObject((Obj*)compiler->function);
+        markObject(vm, (Obj*)compiler->function);
         compiler = compiler->enclosing;
     }
-}
\ No newline at end of file
+}
@@ -1,18 +1,118 @@
 #include <stdio.h>
 
 #include "debug.h"
+#include "register.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 // disassemble the instructions until you get to the end of the chunk
-void disassembleChunk(Chunk* chunk, const char* name) {
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
 }
 
+static const char* opcodeNames[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+    [OP_GET_UPVALUE_LONG] = "OP_GET_UPVALUE_LONG",
+    [OP_SET_UPVALUE_LONG] = "OP_SET_UPVALUE_LONG",
+    [OP_JUMP_LONG] = "OP_JUMP_LONG",
+    [OP_JUMP_IF_FALSE_LONG] = "OP_JUMP_IF_FALSE_LONG",
+    [OP_LOOP_LONG] = "OP_LOOP_LONG",
+    [OP_CALL_LONG] = "OP_CALL_LONG",
+    [OP_INVOKE_LONG] = "OP_INVOKE_LONG",
+    [OP_SUPER_INVOKE_LONG] = "OP_SUPER_INVOKE_LONG",
+    [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+    [OP_WIDE] = "OP_WIDE",
+    [OP_NARROW] = "OP_NARROW",
+    [OP_R_MOVE] = "OP_R_MOVE",
+    [OP_R_LOADK] = "OP_R_LOADK",
+    [OP_R_ADD] = "OP_R_ADD",
+    [OP_R_ADDK] = "OP_R_ADDK",
+    [OP_R_SUBTRACT] = "OP_R_SUBTRACT",
+    [OP_R_SUBTRACTK] = "OP_R_SUBTRACTK",
+    [OP_R_MULTIPLY] = "OP_R_MULTIPLY",
+    [OP_R_MULTIPLYK] = "OP_R_MULTIPLYK",
+    [OP_R_DIVIDE] = "OP_R_DIVIDE",
+    [OP_R_DIVIDEK] = "OP_R_DIVIDEK",
+    [OP_R_EQUAL] = "OP_R_EQUAL",
+    [OP_R_EQUALK] = "OP_R_EQUALK",
+    [OP_R_GREATER] = "OP_R_GREATER",
+    [OP_R_GREATERK] = "OP_R_GREATERK",
+    [OP_R_LESS] = "OP_R_LESS",
+    [OP_R_LESSK] = "OP_R_LESSK",
+    [OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+    [OP_GET_THIS_PROPERTY] = "OP_GET_THIS_PROPERTY",
+    [OP_LESS_CONSTANT_JUMP] = "OP_LESS_CONSTANT_JUMP",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_RETURN_CONSTANT] = "OP_RETURN_CONSTANT",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_GET_PROPERTY_FIELD] = "OP_GET_PROPERTY_FIELD",
+    [OP_GET_THIS_FIELD] = "OP_GET_THIS_FIELD",
+};
+
+const char* opcodeName(uint8_t instruction) {
+    if (instruction >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) ||
+        opcodeNames[instruction] == NULL) {
+        return "OP_UNKNOWN";
+    }
+    return opcodeNames[instruction];
+}
+
+// where OP_WIDE put the window of name constants for the instruction being
+// printed, and for the one after it
+static int window = 0;
+static int nextWindow = 0;
+
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -24,6 +124,14 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2; 
 }
 
+// the 16-bit operands of the long local, upvalue and call forms
+static int shortInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) |
+                               chunk->code[offset + 2]);
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
@@ -31,6 +139,14 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int longJumpInstruction(const char* name, int sign, Chunk* chunk,
+                               int offset) {
+    uint32_t jump = 0;
+    for (int i = 1; i <= 4; i++) jump = (jump << 8) | chunk->code[offset + i];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 5 + sign * (int)jump);
+    return offset + 5;
+}
+
 /*
 As with OP_RETURN, we print out the name of the opcode
 Then we pull out the constant index from the subsequent byte in the chunk
@@ -38,7 +154,7 @@ We print that index and look up the value and display the value itself too
 */
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     // constant value is offset of one from the opcode
-    uint8_t constant = chunk->code[offset + 1];
+    int constant = window + chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
@@ -47,8 +163,27 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+static int longConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    int constant = (chunk->code[offset + 1] << 16) |
+                   (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+// globals are named by a 16 bit slot in vm->globalValues
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) |
+                               chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm->globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
+    int constant = window + chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
@@ -56,8 +191,113 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 3;
 }
 
+// name constant followed by the index of the instruction's inline cache
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    int constant = window + chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+    cache |= chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 4;
+}
+
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset) {
+    int constant = window + chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 5;
+}
+
+// the long invokes have a 16-bit argument count, and the cache if any after it
+static int longInvokeInstruction(const char* name, bool hasCache,
+                                 Chunk* chunk, int offset) {
+    int constant = window + chunk->code[offset + 1];
+    uint16_t argCount = (uint16_t)((chunk->code[offset + 2] << 8) |
+                                   chunk->code[offset + 3]);
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    if (!hasCache) {
+        printf("'\n");
+        return offset + 4;
+    }
+    uint16_t cache = (uint16_t)((chunk->code[offset + 4] << 8) |
+                                chunk->code[offset + 5]);
+    printf("' ic %d\n", cache);
+    return offset + 6;
+}
+
+static int closureInstruction(Chunk* chunk, int offset) {
+    uint8_t instruction = chunk->code[offset++];
+    int constant = chunk->code[offset++];
+    if (instruction == OP_CLOSURE_LONG) {
+        constant = (constant << 8) | chunk->code[offset++];
+    }
+    printf("%-16s %4d ", opcodeName(instruction), constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        int start = offset;
+        int flags = chunk->code[offset++];
+        int index = chunk->code[offset++];
+        if (flags & UPVALUE_WIDE) index = (index << 8) | chunk->code[offset++];
+        printf("%04d      |                     %s %d\n",
+            start, flags & UPVALUE_LOCAL ? "local" : "upvalue", index);
+    }
+    return offset;
+}
+
+static void printRegister(uint8_t slot) {
+    if (slot == REG_PUSH) {
+        printf(" push");
+    } else {
+        printf(" r%-3d", slot);
+    }
+}
+
+// register form with a destination slot and a source slot or constant
+static int moveInstruction(const char* name, bool isConstant,
+                           Chunk* chunk, int offset) {
+    uint8_t source = chunk->code[offset + 2];
+    printf("%-16s", name);
+    printRegister(chunk->code[offset + 1]);
+    if (isConstant) {
+        printf(" k%d '", source);
+        printValue(chunk->constants.values[source]);
+        printf("'\n");
+    } else {
+        printRegister(source);
+        printf("\n");
+    }
+    return offset + 3;
+}
+
+// three address form, dest = left op right
+static int registerInstruction(const char* name, bool isConstant,
+                               Chunk* chunk, int offset) {
+    uint8_t right = chunk->code[offset + 3];
+    printf("%-16s", name);
+    printRegister(chunk->code[offset + 1]);
+    printRegister(chunk->code[offset + 2]);
+    if (isConstant) {
+        printf(" k%d '", right);
+        printValue(chunk->constants.values[right]);
+        printf("'\n");
+    } else {
+        printRegister(right);
+        printf("\n");
+    }
+    return offset + 4;
+}
+
 // prints out opcode as well as the offset
-int disassembleInstruction(Chunk* chunk, int offset) {
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
     printf("%04d ", offset);
 
     // if same line as before instruction just print |
@@ -68,6 +308,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             printf("%4d ", chunk->lines[offset]);
         }
 
+    // the window of an OP_WIDE only covers the instruction right after it
+    window = nextWindow;
+    nextWindow = 0;
+
     uint8_t instruction = chunk->code[offset];
     switch (instruction)
     {
@@ -86,19 +330,19 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SET_LOCAL:
         return byteInstruction("OP_DEFINE_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:
         return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
         return byteInstruction("OP_SET_UPVALUE", chunk, offset);
     case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_SUPER:
       return constantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_EQUAL:
@@ -129,27 +373,15 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_INVOKE: 
-        return invokeInstruction("OP_INVOKE", chunk, offset);
+        return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
         return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-    case OP_CLOSURE: {
-        offset++; // could cause segfault since not checking within bounds still
-        uint8_t constant = chunk->code[offset++];
-        printf("%-16s %4d ", "OP_CLOSURE", constant);
-        printValue(chunk->constants.values[constant]);
-        printf("\n");
-
-        ObjFunction* function = AS_FUNCTION(
-        chunk->constants.values[constant]);
-        for (int j = 0; j < function->upvalueCount; j++) {
-            int isLocal = chunk->code[offset++];
-            int index = chunk->code[offset++];
-            printf("%04d      |                     %s %d\n",
-                offset - 2, isLocal ? "local" : "upvalue", index);
-        }
-        return offset;
-    }
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+        return closureInstruction(chunk, offset);
     case OP_CLOSE_UPVALUE:
       return simpleInstruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:
@@ -160,6 +392,94 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:
         return constantInstruction("OP_METHOD", chunk, offset);
+    case OP_CONSTANT_LONG:
+        return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+    case OP_CALL_LONG:
+        return shortInstruction(opcodeName(instruction), chunk, offset);
+    case OP_JUMP_LONG:
+        return longJumpInstruction("OP_JUMP_LONG", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+        return longJumpInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+    case OP_LOOP_LONG:
+        return longJumpInstruction("OP_LOOP_LONG", -1, chunk, offset);
+    case OP_INVOKE_LONG:
+        return longInvokeInstruction("OP_INVOKE_LONG", true, chunk, offset);
+    case OP_SUPER_INVOKE_LONG:
+        return longInvokeInstruction("OP_SUPER_INVOKE_LONG", false,
+                                     chunk, offset);
+    case OP_WIDE:
+        nextWindow = chunk->code[offset + 1] * UINT8_COUNT;
+        return byteInstruction("OP_WIDE", chunk, offset);
+    case OP_NARROW:
+        return simpleInstruction("OP_NARROW", offset);
+    case OP_ADD_LOCALS: {
+        uint8_t a = chunk->code[offset + 1];
+        uint8_t b = chunk->code[offset + 2];
+        printf("%-16s %4d %4d\n", "OP_ADD_LOCALS", a, b);
+        return offset + 3;
+    }
+    case OP_GET_THIS_PROPERTY:
+        return propertyInstruction("OP_GET_THIS_PROPERTY", chunk, offset);
+    case OP_LESS_CONSTANT_JUMP: {
+        uint8_t constant = chunk->code[offset + 1];
+        uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+        jump |= chunk->code[offset + 3];
+        printf("%-16s %4d '", "OP_LESS_CONSTANT_JUMP", constant);
+        printValue(chunk->constants.values[constant]);
+        printf("' %d -> %d\n", offset, offset + 4 + jump);
+        return offset + 4;
+    }
+    case OP_NOT_EQUAL:
+        return simpleInstruction("OP_NOT_EQUAL", offset);
+    case OP_RETURN_CONSTANT:
+        return constantInstruction("OP_RETURN_CONSTANT", chunk, offset);
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+        return simpleInstruction(opcodeName(instruction), offset);
+    case OP_GET_PROPERTY_FIELD:
+    case OP_GET_THIS_FIELD:
+        return propertyInstruction(opcodeName(instruction), chunk, offset);
+    case OP_R_MOVE:
+        return moveInstruction("OP_R_MOVE", false, chunk, offset);
+    case OP_R_LOADK:
+        return moveInstruction("OP_R_LOADK", true, chunk, offset);
+    case OP_R_ADD:
+        return registerInstruction("OP_R_ADD", false, chunk, offset);
+    case OP_R_ADDK:
+        return registerInstruction("OP_R_ADDK", true, chunk, offset);
+    case OP_R_SUBTRACT:
+        return registerInstruction("OP_R_SUBTRACT", false, chunk, offset);
+    case OP_R_SUBTRACTK:
+        return registerInstruction("OP_R_SUBTRACTK", true, chunk, offset);
+    case OP_R_MULTIPLY:
+        return registerInstruction("OP_R_MULTIPLY", false, chunk, offset);
+    case OP_R_MULTIPLYK:
+        return registerInstruction("OP_R_MULTIPLYK", true, chunk, offset);
+    case OP_R_DIVIDE:
+        return registerInstruction("OP_R_DIVIDE", false, chunk, offset);
+    case OP_R_DIVIDEK:
+        return registerInstruction("OP_R_DIVIDEK", true, chunk, offset);
+    case OP_R_EQUAL:
+        return registerInstruction("OP_R_EQUAL", false, chunk, offset);
+    case OP_R_EQUALK:
+        return registerInstruction("OP_R_EQUALK", true, chunk, offset);
+    case OP_R_GREATER:
+        return registerInstruction("OP_R_GREATER", false, chunk, offset);
+    case OP_R_GREATERK:
+        return registerInstruction("OP_R_GREATERK", true, chunk, offset);
+    case OP_R_LESS:
+        return registerInstruction("OP_R_LESS", false, chunk, offset);
+    case OP_R_LESSK:
+        return registerInstruction("OP_R_LESSK", true, chunk, offset);
 
     default:
         printf("Unknown opcode %d\n", instruction);
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lox.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+Embedding
+
+lox.h is what a C program that runs lox code sees of the vm. A LoxVM is
+the VM itself and a LoxValue a Value with room to spare, copied in and out
+as is: numbers, bools and nil cost nothing to pass, and a string goes over
+as the pointer to its object, so loxAsString() hands out the vm's own
+characters and loxTakeString() makes a string of the host's buffer.
+
+The gc only knows the values on the vm's stack and in its globals, not
+the ones the host has in its locals. Every value the vm hands to the host
+or makes for it goes into vm->hostValues, a root, which the next loxCall()
+or loxLoad() empties once it has what it needs on the stack; a host
+function's own values only last until it returns. Pinning a value never
+allocates: the room for it is made before the value is.
+
+Host functions are natives whose function is callHost(), which finds the
+host's function and its userData in the ObjNative being called.
+*/
+
+_Static_assert(sizeof(Value) <= sizeof(LoxValue), "LoxValue holds a Value");
+
+static inline LoxValue wrap(Value value) {
+    LoxValue wrapped = {{0, 0}};
+    memcpy(&wrapped, &value, sizeof(Value));
+    return wrapped;
+}
+
+static inline Value unwrap(LoxValue value) {
+    Value unwrapped;
+    memcpy(&unwrapped, &value, sizeof(Value));
+    return unwrapped;
+}
+
+// room to pin one more value, made before the value is allocated
+static void reservePin(VM* vm) {
+    writeValueArray(vm, &vm->hostValues, NIL_VAL);
+    vm->hostValues.count--;
+}
+
+static LoxValue pin(VM* vm, Value value) {
+    vm->hostValues.values[vm->hostValues.count++] = value;
+    return wrap(value);
+}
+
+LoxVM* loxNewVM(void) {
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL) return NULL;
+    initVM(vm);
+    return vm;
+}
+
+void loxFreeVM(LoxVM* vm) {
+    freeVM(vm);
+    free(vm);
+}
+
+static LoxResult toLoxResult(InterpretResult result) {
+    switch (result) {
+        case INTERPRET_OK: return LOX_OK;
+        case INTERPRET_COMPILE_ERROR: return LOX_COMPILE_ERROR;
+        default: return LOX_RUNTIME_ERROR;
+    }
+}
+
+LoxResult loxLoad(LoxVM* vm, const char* source) {
+    vm->hostValues.count = 0;
+    return toLoxResult(interpret(vm, source));
+}
+
+int loxGlobal(LoxVM* vm, const char* name) {
+    ObjString* key = copyString(vm, name, (int)strlen(name));
+    Value slot;
+    if (!tableGet(&vm->globalSlots, key, &slot)) return -1;
+    int global = (int)AS_NUMBER(slot);
+    if (IS_UNDEFINED(vm->globalValues.values[global])) return -1;
+    return global;
+}
+
+LoxValue loxGetGlobal(LoxVM* vm, int global) {
+    if (global < 0 || global >= vm->globalValues.count ||
+        IS_UNDEFINED(vm->globalValues.values[global])) {
+        return loxNil();
+    }
+    reservePin(vm);
+    return pin(vm, vm->globalValues.values[global]);
+}
+
+void loxSetGlobal(LoxVM* vm, const char* name, LoxValue value) {
+    int global = globalSlot(vm, copyString(vm, name, (int)strlen(name)));
+    vm->globalValues.values[global] = unwrap(value);
+}
+
+LoxResult loxCall(LoxVM* vm, int global, int argCount, const LoxValue* args,
+                  LoxValue* result) {
+    Value callee = UNDEFINED_VAL;
+    if (global >= 0 && global < vm->globalValues.count) {
+        callee = vm->globalValues.values[global];
+    }
+    if (!IS_CLOSURE(callee)) {
+        runtimeError(vm, "Can only call functions.");
+        return LOX_RUNTIME_ERROR;
+    }
+    if (!reserveStack(vm, vm->stackTop, argCount + 1)) {
+        runtimeError(vm, "Stack overflow.");
+        return LOX_RUNTIME_ERROR;
+    }
+
+    push(vm, callee);
+    for (int i = 0; i < argCount; i++) push(vm, unwrap(args[i]));
+    // the stack has the arguments now, and the host is done with the rest
+    vm->hostValues.count = 0;
+    reservePin(vm);
+
+    Value value;
+    InterpretResult status = callFunction(vm, argCount, &value);
+    if (status != INTERPRET_OK) return toLoxResult(status);
+    LoxValue pinned = pin(vm, value);
+    if (result != NULL) *result = pinned;
+    return LOX_OK;
+}
+
+// values
+
+LoxValue loxNil(void) {
+    return wrap(NIL_VAL);
+}
+
+LoxValue loxBool(bool boolean) {
+    return wrap(BOOL_VAL(boolean));
+}
+
+LoxValue loxNumber(double number) {
+    return wrap(NUMBER_VAL(number));
+}
+
+LoxValue loxString(LoxVM* vm, const char* chars, size_t length) {
+    reservePin(vm);
+    return pin(vm, OBJ_VAL(copyString(vm, chars, (int)length)));
+}
+
+LoxValue loxTakeString(LoxVM* vm, char* chars, size_t length) {
+    reservePin(vm);
+    chars[length] = '\0';
+    return pin(vm, OBJ_VAL(takeString(vm, chars, (int)length)));
+}
+
+bool loxIsNil(LoxValue value) {
+    return IS_NIL(unwrap(value));
+}
+
+bool loxIsBool(LoxValue value) {
+    return IS_BOOL(unwrap(value));
+}
+
+bool loxIsNumber(LoxValue value) {
+    return IS_NUMBER(unwrap(value));
+}
+
+bool loxIsString(LoxValue value) {
+    return IS_STRING(unwrap(value));
+}
+
+bool loxAsBool(LoxValue value) {
+    return AS_BOOL(unwrap(value));
+}
+
+double loxAsNumber(LoxValue value) {
+    return AS_NUMBER(unwrap(value));
+}
+
+const char* loxAsString(LoxValue value, size_t* length) {
+    Value unwrapped = unwrap(value);
+    if (!IS_STRING(unwrapped)) return NULL;
+    ObjString* string = AS_STRING(unwrapped);
+    if (length != NULL) *length = (size_t)string->length;
+    return string->chars;
+}
+
+// host functions
+
+// arguments a host function gets without a malloc()
+#define HOST_ARGS_INLINE 8
+
+static bool callHost(VM* vm, int argCount, Value* args) {
+    ObjNative* native = AS_NATIVE(args[-1]);
+    LoxValue local[HOST_ARGS_INLINE] = {0};
+    LoxValue* hostArgs = local;
+    if (argCount > HOST_ARGS_INLINE) {
+        hostArgs = malloc(sizeof(LoxValue) * (size_t)argCount);
+        if (hostArgs == NULL) {
+            vm->nativeError = "Out of memory.";
+            return false;
+        }
+    }
+    for (int i = 0; i < argCount; i++) hostArgs[i] = wrap(args[i]);
+
+    int pinned = vm->hostValues.count;
+    LoxValue result = loxNil();
+    vm->nativeError = "Host function failed.";
+    bool ok = ((LoxHostFn)native->host)(vm, argCount, hostArgs, &result,
+                                        native->userData);
+    if (hostArgs != local) free(hostArgs);
+
+    if (ok) args[-1] = unwrap(result);
+    // the result is on the stack, what else the host made can go
+    vm->hostValues.count = pinned;
+    return ok;
+}
+
+void loxDefine(LoxVM* vm, const char* name, LoxHostFn function, int arity,
+               void* userData) {
+    defineNative(vm, name, callHost, arity, 0);
+    ObjNative* native = AS_NATIVE(
+        vm->globalValues.values[loxGlobal(vm, name)]);
+    native->host = (void (*)(void))function;
+    native->userData = userData;
+}
+
+void loxError(LoxVM* vm, const char* message) {
+    vm->nativeError = message;
+}
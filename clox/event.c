@@ -0,0 +1,649 @@
+// accept4 and pipe2
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+Event loop
+
+The i/o natives only start things: read(fd, fn), write(fd, data, fn),
+accept(fd, fn), connect(path, fn) and setTimeout(fn, ms) note the
+callback and return nil straight away. Once the script is done,
+interpret() takes the callbacks of whatever finished from nextEvent() one
+at a time and calls them, and they can start more. It returns once
+nothing is pending any more.
+
+Descriptors are numbers and always non-blocking. Each has a Watch with
+the callbacks waiting on it, and epoll says when they can go on. Regular
+files do not work with epoll, but they never block either, so they are
+simply always ready. Every read or accept hands one result to its
+callback and is done; the callback calls read() again for more.
+
+Timers are a binary heap by due time, and the earliest one is the timeout
+of epoll_wait().
+
+Only the main script runs callbacks: isolates start no event loop, and
+the natives that would need one are a runtime error there.
+*/
+
+// most bytes one read() hands to its callback
+#define READ_CHUNK 65536
+// epoll events taken per epoll_wait()
+#define MAX_EVENTS 64
+
+typedef struct {
+    // closures waiting for the descriptor, NIL_VAL for none
+    Value reader;
+    Value writer;
+    // what a write still has to write, from written on
+    ObjString* output;
+    int written;
+    // a listening socket accepts when readable, a connecting one has
+    // connected once writable
+    bool accepting;
+    bool connecting;
+    // EPOLLIN and EPOLLOUT for what is waiting, and what epoll has of them
+    uint32_t wanted;
+    uint32_t registered;
+    bool alwaysReady;
+    // in loop->readyFds
+    bool queued;
+} Watch;
+
+typedef struct {
+    double due;
+    int id;
+    Value callback;
+} Timer;
+
+typedef struct {
+    Value callback;
+    Value argument;
+    int argCount;
+} Event;
+
+struct EventLoop {
+    int epoll;
+
+    // by descriptor
+    Watch* watches;
+    int watchCapacity;
+    // descriptors with something wanted, the loop runs while there are any
+    int watching;
+
+    // always ready descriptors with something wanted
+    int* readyFds;
+    int readyCount;
+    int readyCapacity;
+
+    Timer* timers;
+    int timerCount;
+    int timerCapacity;
+    int nextTimerId;
+
+    // finished, waiting for nextEvent() to call them
+    Event* events;
+    int eventHead;
+    int eventCount;
+    int eventCapacity;
+
+    ObjClass* pipeClass;
+    ObjString* readerName;
+    ObjString* writerName;
+};
+
+static void* growArray(void* array, int* capacity, size_t size) {
+    *capacity = GROW_CAPACITY(*capacity);
+    array = realloc(array, size * *capacity);
+    if (array == NULL) exit(1);
+    return array;
+}
+
+static EventLoop* loopOf(VM* vm) {
+    if (vm->loop != NULL) return vm->loop;
+    EventLoop* loop = (EventLoop*)calloc(1, sizeof(EventLoop));
+    if (loop == NULL) exit(1);
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll == -1) exit(1);
+    loop->nextTimerId = 1;
+    // writes to a closed pipe or socket fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    vm->loop = loop;
+    return loop;
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+// the loop to start i/o or a timer on, NULL in an isolate
+static EventLoop* startLoop(VM* vm) {
+    if (vm->noEvents) {
+        vm->nativeError = "Isolates cannot wait for events.";
+        return NULL;
+    }
+    return loopOf(vm);
+}
+
+static Watch* watchOf(EventLoop* loop, int fd) {
+    while (fd >= loop->watchCapacity) {
+        int oldCapacity = loop->watchCapacity;
+        loop->watches = (Watch*)growArray(loop->watches,
+                                          &loop->watchCapacity, sizeof(Watch));
+        for (int i = oldCapacity; i < loop->watchCapacity; i++) {
+            loop->watches[i] = (Watch){.reader = NIL_VAL, .writer = NIL_VAL};
+        }
+    }
+    return &loop->watches[fd];
+}
+
+static void addEvent(EventLoop* loop, Value callback, Value argument,
+                     int argCount) {
+    if (loop->eventCount + 1 > loop->eventCapacity) {
+        loop->events = (Event*)growArray(loop->events, &loop->eventCapacity,
+                                         sizeof(Event));
+    }
+    loop->events[loop->eventCount++] = (Event){callback, argument, argCount};
+}
+
+static void queueReady(EventLoop* loop, int fd, Watch* watch) {
+    if (watch->queued) return;
+    if (loop->readyCount + 1 > loop->readyCapacity) {
+        loop->readyFds = (int*)growArray(loop->readyFds, &loop->readyCapacity,
+                                         sizeof(int));
+    }
+    loop->readyFds[loop->readyCount++] = fd;
+    watch->queued = true;
+}
+
+// brings epoll, or the ready list, in line with what fd waits for
+static void updateWatch(EventLoop* loop, int fd) {
+    Watch* watch = &loop->watches[fd];
+    uint32_t wanted = 0;
+    if (!IS_NIL(watch->reader)) wanted |= EPOLLIN;
+    if (watch->output != NULL || watch->connecting) wanted |= EPOLLOUT;
+    loop->watching += (wanted != 0) - (watch->wanted != 0);
+    watch->wanted = wanted;
+
+    if (!watch->alwaysReady && wanted != watch->registered) {
+        struct epoll_event event = {.events = wanted, .data.fd = fd};
+        int op = watch->registered == 0 ? EPOLL_CTL_ADD
+               : wanted == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+        if (epoll_ctl(loop->epoll, op, fd, &event) == 0) {
+            watch->registered = wanted;
+        } else if (errno == EPERM) {
+            watch->alwaysReady = true;
+        }
+    }
+    if (watch->alwaysReady && wanted != 0) queueReady(loop, fd, watch);
+}
+
+static void finishRead(EventLoop* loop, Watch* watch, Value result) {
+    addEvent(loop, watch->reader, result, 1);
+    watch->reader = NIL_VAL;
+}
+
+static void finishWrite(EventLoop* loop, Watch* watch, Value result) {
+    if (!IS_NIL(watch->writer)) addEvent(loop, watch->writer, result, 1);
+    watch->writer = NIL_VAL;
+    watch->output = NULL;
+    watch->connecting = false;
+}
+
+static void serviceRead(VM* vm, EventLoop* loop, int fd) {
+    Watch* watch = &loop->watches[fd];
+    if (watch->accepting) {
+        int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client == -1 && (errno == EAGAIN || errno == EINTR)) return;
+        watch->accepting = false;
+        finishRead(loop, watch, client == -1 ? NIL_VAL
+                                              : NUMBER_VAL((double)client));
+        return;
+    }
+
+    char buffer[READ_CHUNK];
+    ssize_t count = read(fd, buffer, sizeof(buffer));
+    if (count == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    // the reader keeps the callback alive while the string is made
+    Value result = count > 0
+        ? OBJ_VAL(copyString(vm, buffer, (int)count)) : NIL_VAL;
+    finishRead(loop, &loop->watches[fd], result);
+}
+
+static void serviceWrite(EventLoop* loop, int fd) {
+    Watch* watch = &loop->watches[fd];
+    if (watch->connecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error == EINPROGRESS) return;
+        finishWrite(loop, watch, error == 0 ? NUMBER_VAL((double)fd)
+                                            : NIL_VAL);
+        return;
+    }
+
+    ObjString* output = watch->output;
+    ssize_t count = write(fd, output->chars + watch->written,
+                          output->length - watch->written);
+    if (count == -1) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        finishWrite(loop, watch, BOOL_VAL(false));
+        return;
+    }
+    watch->written += (int)count;
+    if (watch->written == output->length) finishWrite(loop, watch, BOOL_VAL(true));
+}
+
+static void serviceFd(VM* vm, EventLoop* loop, int fd, uint32_t events) {
+    Watch* watch = &loop->watches[fd];
+    uint32_t failed = EPOLLHUP | EPOLLERR;
+    if (!IS_NIL(watch->reader) && (events & (EPOLLIN | failed))) {
+        serviceRead(vm, loop, fd);
+    }
+    if ((watch->wanted & EPOLLOUT) && (events & (EPOLLOUT | failed))) {
+        serviceWrite(loop, fd);
+    }
+    updateWatch(loop, fd);
+}
+
+// timers
+
+static bool timerBefore(Timer* a, Timer* b) {
+    return a->due < b->due || (a->due == b->due && a->id < b->id);
+}
+
+static void swapTimers(EventLoop* loop, int a, int b) {
+    Timer timer = loop->timers[a];
+    loop->timers[a] = loop->timers[b];
+    loop->timers[b] = timer;
+}
+
+static void siftUp(EventLoop* loop, int index) {
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (!timerBefore(&loop->timers[index], &loop->timers[parent])) break;
+        swapTimers(loop, index, parent);
+        index = parent;
+    }
+}
+
+static void siftDown(EventLoop* loop, int index) {
+    for (;;) {
+        int first = index;
+        int left = 2 * index + 1;
+        int right = left + 1;
+        if (left < loop->timerCount &&
+            timerBefore(&loop->timers[left], &loop->timers[first])) {
+            first = left;
+        }
+        if (right < loop->timerCount &&
+            timerBefore(&loop->timers[right], &loop->timers[first])) {
+            first = right;
+        }
+        if (first == index) return;
+        swapTimers(loop, index, first);
+        index = first;
+    }
+}
+
+static void removeTimer(EventLoop* loop, int index) {
+    loop->timers[index] = loop->timers[--loop->timerCount];
+    if (index < loop->timerCount) {
+        siftDown(loop, index);
+        siftUp(loop, index);
+    }
+}
+
+static void expireTimers(EventLoop* loop) {
+    double time = now();
+    while (loop->timerCount > 0 && loop->timers[0].due <= time) {
+        addEvent(loop, loop->timers[0].callback, NIL_VAL, 0);
+        removeTimer(loop, 0);
+    }
+}
+
+// waits for something to finish, false if nothing is pending
+static bool pollEvents(VM* vm, EventLoop* loop) {
+    if (loop->watching == 0 && loop->timerCount == 0) return false;
+
+    int timeout = -1;
+    if (loop->readyCount > 0) {
+        timeout = 0;
+    } else if (loop->timerCount > 0) {
+        double wait = loop->timers[0].due - now();
+        timeout = wait <= 0 ? 0 : (int)wait + 1;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(loop->epoll, events, MAX_EVENTS, timeout);
+    for (int i = 0; i < count; i++) {
+        serviceFd(vm, loop, events[i].data.fd, events[i].events);
+    }
+
+    // the ones still wanting more queue themselves up again
+    int readyCount = loop->readyCount;
+    loop->readyCount = 0;
+    for (int i = 0; i < readyCount; i++) {
+        int fd = loop->readyFds[i];
+        loop->watches[fd].queued = false;
+        serviceFd(vm, loop, fd, EPOLLIN | EPOLLOUT);
+    }
+
+    expireTimers(loop);
+    return true;
+}
+
+int nextEvent(VM* vm) {
+    EventLoop* loop = vm->loop;
+    if (loop == NULL) return -1;
+    while (loop->eventHead == loop->eventCount) {
+        loop->eventHead = 0;
+        loop->eventCount = 0;
+        if (!pollEvents(vm, loop)) return -1;
+    }
+    Event* event = &loop->events[loop->eventHead++];
+    push(vm, event->callback);
+    if (event->argCount == 1) push(vm, event->argument);
+    return event->argCount;
+}
+
+void markEventRoots(VM* vm) {
+    EventLoop* loop = vm->loop;
+    if (loop == NULL) return;
+    for (int i = 0; i < loop->watchCapacity; i++) {
+        markValue(vm, loop->watches[i].reader);
+        markValue(vm, loop->watches[i].writer);
+        markObject(vm, (Obj*)loop->watches[i].output);
+    }
+    for (int i = 0; i < loop->timerCount; i++) {
+        markValue(vm, loop->timers[i].callback);
+    }
+    for (int i = loop->eventHead; i < loop->eventCount; i++) {
+        markValue(vm, loop->events[i].callback);
+        markValue(vm, loop->events[i].argument);
+    }
+    markObject(vm, (Obj*)loop->pipeClass);
+    markObject(vm, (Obj*)loop->readerName);
+    markObject(vm, (Obj*)loop->writerName);
+}
+
+void freeEventLoop(VM* vm) {
+    EventLoop* loop = vm->loop;
+    if (loop == NULL) return;
+    close(loop->epoll);
+    free(loop->watches);
+    free(loop->readyFds);
+    free(loop->timers);
+    free(loop->events);
+    free(loop);
+    vm->loop = NULL;
+}
+
+// natives
+
+// an open one, the watches are by descriptor
+static bool isDescriptor(Value value) {
+    if (!IS_NUMBER(value)) return false;
+    double number = AS_NUMBER(value);
+    return number >= 0 && number <= INT32_MAX && number == (int)number &&
+           fcntl((int)number, F_GETFD) != -1;
+}
+
+static bool openNative(VM* vm, int argCount, Value* args) {
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+        vm->nativeError = "Arguments to open must be a path and a mode.";
+        return false;
+    }
+    const char* mode = AS_CSTRING(args[1]);
+    int flags;
+    if (strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (strcmp(mode, "a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        vm->nativeError = "Mode must be \"r\", \"w\" or \"a\".";
+        return false;
+    }
+    int fd = open(AS_CSTRING(args[0]), flags | O_NONBLOCK | O_CLOEXEC, 0644);
+    args[-1] = fd == -1 ? NIL_VAL : NUMBER_VAL((double)fd);
+    return true;
+}
+
+static bool pipeNative(VM* vm, int argCount, Value* args) {
+    EventLoop* loop = loopOf(vm);
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        args[-1] = NIL_VAL;
+        return true;
+    }
+
+    // the callee slot keeps each new object alive while the next is made
+    if (loop->pipeClass == NULL) {
+        loop->readerName = copyString(vm, "reader", 6);
+        loop->writerName = copyString(vm, "writer", 6);
+        args[-1] = OBJ_VAL(copyString(vm, "Pipe", 4));
+        loop->pipeClass = newClass(vm, AS_STRING(args[-1]));
+    }
+    ObjInstance* pipe = newInstance(vm, loop->pipeClass);
+    args[-1] = OBJ_VAL(pipe);
+    instanceSetField(vm, pipe, loop->readerName, NUMBER_VAL((double)fds[0]));
+    instanceSetField(vm, pipe, loop->writerName, NUMBER_VAL((double)fds[1]));
+    return true;
+}
+
+static bool readNative(VM* vm, int argCount, Value* args) {
+    if (!isDescriptor(args[0]) || !IS_CLOSURE(args[1])) {
+        vm->nativeError = "Arguments to read must be a descriptor and a function.";
+        return false;
+    }
+    EventLoop* loop = startLoop(vm);
+    if (loop == NULL) return false;
+    int fd = (int)AS_NUMBER(args[0]);
+    Watch* watch = watchOf(loop, fd);
+    if (!IS_NIL(watch->reader)) {
+        vm->nativeError = "Already reading from this descriptor.";
+        return false;
+    }
+    watch->reader = args[1];
+    updateWatch(loop, fd);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool writeNative(VM* vm, int argCount, Value* args) {
+    if (!isDescriptor(args[0]) || !IS_STRING(args[1]) ||
+        (!IS_CLOSURE(args[2]) && !IS_NIL(args[2]))) {
+        vm->nativeError =
+            "Arguments to write must be a descriptor, a string and a function or nil.";
+        return false;
+    }
+    EventLoop* loop = startLoop(vm);
+    if (loop == NULL) return false;
+    int fd = (int)AS_NUMBER(args[0]);
+    Watch* watch = watchOf(loop, fd);
+    if (watch->output != NULL || watch->connecting) {
+        vm->nativeError = "Already writing to this descriptor.";
+        return false;
+    }
+    watch->output = AS_STRING(args[1]);
+    watch->written = 0;
+    watch->writer = args[2];
+    if (watch->output->length == 0) {
+        finishWrite(loop, watch, BOOL_VAL(true));
+    } else {
+        updateWatch(loop, fd);
+    }
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool closeNative(VM* vm, int argCount, Value* args) {
+    if (!isDescriptor(args[0])) {
+        vm->nativeError = "Can only close a descriptor.";
+        return false;
+    }
+    int fd = (int)AS_NUMBER(args[0]);
+    if (vm->loop != NULL && fd < vm->loop->watchCapacity) {
+        // whatever was waiting on it never gets called
+        Watch* watch = &vm->loop->watches[fd];
+        watch->reader = NIL_VAL;
+        watch->writer = NIL_VAL;
+        watch->output = NULL;
+        watch->accepting = false;
+        watch->connecting = false;
+        updateWatch(vm->loop, fd);
+        watch->alwaysReady = false;
+        watch->queued = false;
+    }
+    close(fd);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool unixAddress(Value path, struct sockaddr_un* address) {
+    if (!IS_STRING(path)) return false;
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (AS_STRING(path)->length >= (int)sizeof(address->sun_path)) {
+        return false;
+    }
+    memcpy(address->sun_path, AS_CSTRING(path), AS_STRING(path)->length);
+    return true;
+}
+
+static bool listenNative(VM* vm, int argCount, Value* args) {
+    struct sockaddr_un address;
+    if (!unixAddress(args[0], &address)) {
+        vm->nativeError = "Can only listen on a socket path.";
+        return false;
+    }
+    // a socket left behind by an earlier run would be in the way
+    struct stat status;
+    if (stat(address.sun_path, &status) == 0 && S_ISSOCK(status.st_mode)) {
+        unlink(address.sun_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd != -1 &&
+        (bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+         listen(fd, SOMAXCONN) == -1)) {
+        close(fd);
+        fd = -1;
+    }
+    args[-1] = fd == -1 ? NIL_VAL : NUMBER_VAL((double)fd);
+    return true;
+}
+
+static bool acceptNative(VM* vm, int argCount, Value* args) {
+    if (!isDescriptor(args[0]) || !IS_CLOSURE(args[1])) {
+        vm->nativeError = "Arguments to accept must be a descriptor and a function.";
+        return false;
+    }
+    EventLoop* loop = startLoop(vm);
+    if (loop == NULL) return false;
+    int fd = (int)AS_NUMBER(args[0]);
+    Watch* watch = watchOf(loop, fd);
+    if (!IS_NIL(watch->reader)) {
+        vm->nativeError = "Already reading from this descriptor.";
+        return false;
+    }
+    watch->reader = args[1];
+    watch->accepting = true;
+    updateWatch(loop, fd);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool connectNative(VM* vm, int argCount, Value* args) {
+    struct sockaddr_un address;
+    if (!unixAddress(args[0], &address) || !IS_CLOSURE(args[1])) {
+        vm->nativeError = "Arguments to connect must be a socket path and a function.";
+        return false;
+    }
+    EventLoop* loop = startLoop(vm);
+    if (loop == NULL) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        addEvent(loop, args[1], NIL_VAL, 1);
+    } else if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1 &&
+               errno != EINPROGRESS && errno != EAGAIN) {
+        close(fd);
+        addEvent(loop, args[1], NIL_VAL, 1);
+    } else {
+        // done once it is writable, like any non-blocking connect
+        Watch* watch = watchOf(loop, fd);
+        watch->writer = args[1];
+        watch->connecting = true;
+        updateWatch(loop, fd);
+    }
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool setTimeoutNative(VM* vm, int argCount, Value* args) {
+    if (!IS_CLOSURE(args[0]) || !IS_NUMBER(args[1])) {
+        vm->nativeError = "Arguments to setTimeout must be a function and milliseconds.";
+        return false;
+    }
+    EventLoop* loop = startLoop(vm);
+    if (loop == NULL) return false;
+    if (loop->timerCount + 1 > loop->timerCapacity) {
+        loop->timers = (Timer*)growArray(loop->timers, &loop->timerCapacity,
+                                         sizeof(Timer));
+    }
+    int id = loop->nextTimerId++;
+    loop->timers[loop->timerCount++] =
+        (Timer){now() + AS_NUMBER(args[1]), id, args[0]};
+    siftUp(loop, loop->timerCount - 1);
+    args[-1] = NUMBER_VAL((double)id);
+    return true;
+}
+
+static bool clearTimeoutNative(VM* vm, int argCount, Value* args) {
+    if (!IS_NUMBER(args[0])) {
+        vm->nativeError = "Can only clear what setTimeout returned.";
+        return false;
+    }
+    EventLoop* loop = vm->loop;
+    int id = (int)AS_NUMBER(args[0]);
+    for (int i = 0; loop != NULL && i < loop->timerCount; i++) {
+        if (loop->timers[i].id == id) {
+            removeTimer(loop, i);
+            break;
+        }
+    }
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+void defineEventNatives(VM* vm) {
+    defineNative(vm, "open", openNative, 2, 0);
+    defineNative(vm, "pipe", pipeNative, 0, 0);
+    defineNative(vm, "read", readNative, 2, 0);
+    defineNative(vm, "write", writeNative, 3, 0);
+    defineNative(vm, "close", closeNative, 1, 0);
+    defineNative(vm, "listen", listenNative, 1, 0);
+    defineNative(vm, "accept", acceptNative, 2, 0);
+    defineNative(vm, "connect", connectNative, 2, 0);
+    defineNative(vm, "setTimeout", setTimeoutNative, 2, 0);
+    defineNative(vm, "clearTimeout", clearTimeoutNative, 1, 0);
+}
@@ -0,0 +1,20 @@
+#ifndef clox_event_h
+#define clox_event_h
+
+#include "common.h"
+#include "value.h"
+
+typedef struct EventLoop EventLoop;
+
+// open, pipe, read, write, close, listen, accept, connect, setTimeout and
+// clearTimeout
+void defineEventNatives(VM* vm);
+
+// pushes the callback of the next finished timer or i/o and its argument,
+// waiting for one if need be; -1 once nothing is pending any more
+int nextEvent(VM* vm);
+
+void markEventRoots(VM* vm);
+void freeEventLoop(VM* vm);
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "fiber.h"
+#include "memory.h"
+#include "vm.h"
+
+/*
+Fibers
+
+fiber(fn) makes a fiber that runs fn on a stack of values and call frames
+of its own once something resumes it. resume(fiber, value) runs the fiber
+until it yields or returns, and evaluates to what it yielded or returned;
+yield(value) in turn makes that resume() return, and evaluates to the
+value of the next resume(). The first resume() passes its value to fn if
+fn takes an argument. The script itself runs on a fiber of its own that
+can not yield.
+
+A switch only swaps the vm's stack fields with the ones saved in the
+fibers, so it costs about as much as a native call. resume and yield are
+natives that set vm->switched and return false, which has run() load the
+frame of whichever fiber runs now, just like after a call or return.
+
+Upvalues still open on a suspended fiber's stack can outlive the fiber:
+started fibers are kept in vm->fibers, and the gc has the open upvalues of
+the ones it is about to free take their values along, the way a return
+closes them.
+*/
+
+// values a fiber's stack starts out with, it grows like the script's does
+#define FIBER_STACK_INITIAL 32
+
+// the vm's stack goes back into the fiber it belongs to, and the one of
+// fiber takes its place
+static void switchFiber(VM* vm, ObjFiber* fiber) {
+    ObjFiber* current = vm->fiber;
+    current->stack = vm->stack;
+    current->stackEnd = vm->stackEnd;
+    current->stackLow = vm->stackLow;
+    current->stackTop = vm->stackTop;
+    current->frames = vm->frames;
+    current->frameCount = vm->frameCount;
+    current->openUpvalues = vm->openUpvalues;
+
+    // the profiler's signal handler must not see one fiber's frames
+    // counted by the other's frameCount
+    vm->frameCount = 0;
+    atomic_signal_fence(memory_order_release);
+    vm->stack = fiber->stack;
+    vm->stackEnd = fiber->stackEnd;
+    vm->stackLow = fiber->stackLow;
+    vm->stackTop = fiber->stackTop;
+    vm->frames = fiber->frames;
+    atomic_signal_fence(memory_order_release);
+    vm->frameCount = fiber->frameCount;
+    vm->openUpvalues = fiber->openUpvalues;
+    vm->fiber = fiber;
+}
+
+static void freeStack(VM* vm, ObjFiber* fiber) {
+    Value* stack = fiber->stack;
+    CallFrame* frames = fiber->frames;
+    int capacity = (int)(fiber->stackEnd - fiber->stack);
+    // gone before the gc could see it half freed
+    fiber->stack = NULL;
+    fiber->stackEnd = NULL;
+    fiber->stackLow = NULL;
+    fiber->stackTop = NULL;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    FREE_ARRAY(vm, Value, stack, capacity);
+    FREE_ARRAY(vm, CallFrame, frames, capacity);
+}
+
+static void startFiber(VM* vm, ObjFiber* fiber, Value value) {
+    ObjFunction* function = fiber->closure->function;
+    // room for the call right away, so it can not fail
+    int capacity = FIBER_STACK_INITIAL;
+    while (capacity < function->maxSlots + STACK_HEADROOM) capacity *= 2;
+
+    fiber->caller = vm->fiber;
+    fiber->state = FIBER_RUNNING;
+    switchFiber(vm, fiber);
+    initStack(vm, capacity);
+    fiber->nextFiber = vm->fibers;
+    vm->fibers = fiber;
+
+    push(vm, OBJ_VAL(fiber->closure));
+    if (function->arity == 1) push(vm, value);
+    callClosure(vm, fiber->closure, function->arity);
+}
+
+// the running fiber will not run again, so it lets go of its stack
+void finishFiber(VM* vm, Value result) {
+    ObjFiber* fiber = vm->fiber;
+    ObjFiber* caller = fiber->caller;
+    closeUpvalues(vm, vm->stack);
+    fiber->state = FIBER_DONE;
+    fiber->caller = NULL;
+    switchFiber(vm, caller);
+    vm->stackTop[-1] = result;
+    freeStack(vm, fiber);
+}
+
+bool unwindFiber(VM* vm) {
+    if (vm->fiber->caller == NULL) return false;
+    finishFiber(vm, NIL_VAL);
+    return true;
+}
+
+void markFiber(VM* vm, ObjFiber* fiber) {
+    markObject(vm, (Obj*)fiber->closure);
+    markObject(vm, (Obj*)fiber->caller);
+    // the running fiber's stack is the vm's, which is a root
+    if (fiber == vm->fiber) return;
+
+    for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+        markValue(vm, *slot);
+    }
+    for (int i = 0; i < fiber->frameCount; i++) {
+        markObject(vm, (Obj*)fiber->frames[i].closure);
+    }
+    for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        markObject(vm, (Obj*)upvalue);
+    }
+}
+
+void freeFiber(VM* vm, ObjFiber* fiber) {
+    // the stack of the running one is the vm's to free
+    if (fiber != vm->fiber && fiber->stack != NULL) freeStack(vm, fiber);
+}
+
+void closeDeadFibers(VM* vm) {
+    ObjFiber** link = &vm->fibers;
+    while (*link != NULL) {
+        ObjFiber* fiber = *link;
+        if (fiber->obj.isMarked && fiber->state != FIBER_DONE) {
+            link = &fiber->nextFiber;
+            continue;
+        }
+        for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL;
+             upvalue = upvalue->next) {
+            upvalue->closed = *upvalue->location;
+            upvalue->location = &upvalue->closed;
+        }
+        fiber->openUpvalues = NULL;
+        *link = fiber->nextFiber;
+    }
+}
+
+// natives
+
+static bool fiberNative(VM* vm, int argCount, Value* args) {
+    if (!IS_CLOSURE(args[0]) || AS_CLOSURE(args[0])->function->arity > 1) {
+        vm->nativeError = "A fiber runs a function of at most one argument.";
+        return false;
+    }
+    args[-1] = OBJ_VAL(newFiber(vm, AS_CLOSURE(args[0])));
+    return true;
+}
+
+static bool resumeNative(VM* vm, int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0])) {
+        vm->nativeError = "Can only resume a fiber, with at most one value.";
+        return false;
+    }
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    Value value = argCount == 2 ? args[1] : NIL_VAL;
+    if (fiber->state == FIBER_RUNNING) {
+        vm->nativeError = "Fiber is already running.";
+        return false;
+    }
+    if (fiber->state == FIBER_DONE) {
+        vm->nativeError = "Can't resume a finished fiber.";
+        return false;
+    }
+
+    // what the fiber yields or returns lands in the callee slot
+    if (fiber->state == FIBER_NEW) {
+        // value stays on this stack while the new one is allocated
+        startFiber(vm, fiber, value);
+        fiber->caller->stackTop = args;
+    } else {
+        vm->stackTop = args;
+        fiber->caller = vm->fiber;
+        fiber->state = FIBER_RUNNING;
+        switchFiber(vm, fiber);
+        vm->stackTop[-1] = value;
+    }
+    vm->switched = true;
+    return false;
+}
+
+static bool yieldNative(VM* vm, int argCount, Value* args) {
+    if (argCount > 1) {
+        vm->nativeError = "Can only yield one value.";
+        return false;
+    }
+    ObjFiber* fiber = vm->fiber;
+    if (fiber->caller == NULL) {
+        vm->nativeError = "Can only yield from inside a fiber.";
+        return false;
+    }
+    Value value = argCount == 1 ? args[0] : NIL_VAL;
+
+    // the value of the next resume lands in the callee slot
+    vm->stackTop = args;
+    ObjFiber* caller = fiber->caller;
+    fiber->state = FIBER_SUSPENDED;
+    fiber->caller = NULL;
+    switchFiber(vm, caller);
+    vm->stackTop[-1] = value;
+    vm->switched = true;
+    return false;
+}
+
+static bool isDoneNative(VM* vm, int argCount, Value* args) {
+    if (!IS_FIBER(args[0])) {
+        vm->nativeError = "Can only check whether a fiber is done.";
+        return false;
+    }
+    args[-1] = BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+    return true;
+}
+
+void defineFiberNatives(VM* vm) {
+    defineNative(vm, "fiber", fiberNative, 1, 0);
+    defineNative(vm, "resume", resumeNative, -1, 0);
+    defineNative(vm, "yield", yieldNative, -1, 0);
+    defineNative(vm, "isDone", isDoneNative, 1, NATIVE_NO_GC);
+}
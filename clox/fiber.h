@@ -0,0 +1,25 @@
+#ifndef clox_fiber_h
+#define clox_fiber_h
+
+#include "common.h"
+#include "object.h"
+
+// fiber, resume, yield and isDone
+void defineFiberNatives(VM* vm);
+
+// the running fiber returned from its function: it is done and its
+// resumer goes on with result
+void finishFiber(VM* vm, Value result);
+
+// a runtime error ends the running fiber and goes on to the fiber that
+// resumed it, to report its frames too; false once that is the script's
+bool unwindFiber(VM* vm);
+
+void markFiber(VM* vm, ObjFiber* fiber);
+void freeFiber(VM* vm, ObjFiber* fiber);
+
+// for the gc, before it sweeps: the upvalues still open on the stack of a
+// fiber about to be freed take their values along
+void closeDeadFibers(VM* vm);
+
+#endif
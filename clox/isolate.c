@@ -0,0 +1,980 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "isolate.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+Isolates
+
+spawn(fn, args...) runs fn in an isolate: a VM of its own, with its own
+heap, globals and stack, on one of a fixed pool of worker threads. It
+returns a channel that gets the function's result once it returns, which
+await() waits for. The result stays on the channel, so every await() of
+the handle, in any isolate, decodes a copy of the same value.
+
+Isolates share nothing but channels. Every value that crosses over, the
+function and arguments of a spawn as much as anything sent on a channel,
+is encoded into a message of plain bytes by the sender and decoded into a
+deep copy on the receiving heap, so each heap keeps its own gc. Functions
+go over with their bytecode; the globals it uses are looked up by name on
+the receiving side and, if not defined there yet, defined from a copy of
+the sender's value.
+
+receive() and await() never block a worker. They suspend run(), and an
+isolate with nothing to receive is parked on the channel until a send puts
+it back on the run queue, so a few workers can run any number of isolates
+waiting on each other. The main script has no scheduler to hand its
+thread to and just blocks in waitForMessage().
+
+Isolates still running when the main script ends go down with the process.
+*/
+
+typedef struct Message {
+    struct Message* next;
+    uint8_t* bytes;
+    int count;
+    int capacity;
+    // references held on the channels inside, the receiver takes them over
+    Channel** channels;
+    int channelCount;
+    int channelCapacity;
+} Message;
+
+typedef struct Isolate {
+    VM* vm;            // made by the worker that first runs it
+    Message* entry;    // the function and its arguments
+    int argCount;
+    Channel* result;
+    struct Isolate* next;  // in the run queue or parked on a channel
+    // modes of the spawning vm
+    bool registerMode;
+    bool jitMode;
+    bool traceMode;
+    bool quicken;
+    int stackLimit;
+} Isolate;
+
+struct Channel {
+    pthread_mutex_t lock;
+    // the main script waits on this, isolates park in waiters instead
+    pthread_cond_t sent;
+    Message* head;
+    Message* tail;
+    Isolate* waiters;
+    // the result of the spawned function, never taken off the channel
+    Message* result;
+    // the spawned function it was to get the result of failed
+    bool failed;
+    int refCount;
+};
+
+// one value that is not an object, as its raw bits
+#define TAG_VALUE 0
+// an object already in the message, by the order objects were written in
+#define TAG_REF 1
+#define TAG_STRING 2
+#define TAG_FUNCTION 3
+#define TAG_CLOSURE 4
+#define TAG_UPVALUE 5
+#define TAG_CLASS 6
+#define TAG_INSTANCE 7
+#define TAG_BOUND_METHOD 8
+#define TAG_NATIVE 9
+#define TAG_CHANNEL 10
+
+static struct {
+    pthread_once_t started;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Isolate* head;
+    Isolate* tail;
+    int workerCount;
+} pool = {PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER,
+          PTHREAD_COND_INITIALIZER, NULL, NULL, 0};
+
+void setWorkerCount(int count) {
+    pool.workerCount = count;
+}
+
+static void schedule(Isolate* isolate) {
+    pthread_mutex_lock(&pool.lock);
+    isolate->next = NULL;
+    if (pool.tail == NULL) {
+        pool.head = isolate;
+    } else {
+        pool.tail->next = isolate;
+    }
+    pool.tail = isolate;
+    pthread_cond_signal(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// messages
+
+static Message* newMessage(void) {
+    Message* message = (Message*)calloc(1, sizeof(Message));
+    if (message == NULL) exit(1);
+    return message;
+}
+
+static void freeMessage(Message* message) {
+    for (int i = 0; i < message->channelCount; i++) {
+        releaseChannel(message->channels[i]);
+    }
+    free(message->channels);
+    free(message->bytes);
+    free(message);
+}
+
+static void writeBytes(Message* message, const void* bytes, int length) {
+    if (message->count + length > message->capacity) {
+        int capacity = GROW_CAPACITY(message->capacity);
+        while (capacity < message->count + length) capacity *= 2;
+        message->bytes = (uint8_t*)realloc(message->bytes, capacity);
+        if (message->bytes == NULL) exit(1);
+        message->capacity = capacity;
+    }
+    memcpy(message->bytes + message->count, bytes, length);
+    message->count += length;
+}
+
+static void writeByte(Message* message, uint8_t byte) {
+    writeBytes(message, &byte, 1);
+}
+
+static void writeInt(Message* message, int value) {
+    writeBytes(message, &value, (int)sizeof(int));
+}
+
+// channels
+
+static Channel* newChannelState(void) {
+    Channel* channel = (Channel*)calloc(1, sizeof(Channel));
+    if (channel == NULL) exit(1);
+    pthread_mutex_init(&channel->lock, NULL);
+    pthread_cond_init(&channel->sent, NULL);
+    channel->refCount = 1;
+    return channel;
+}
+
+static void retainChannel(Channel* channel) {
+    pthread_mutex_lock(&channel->lock);
+    channel->refCount++;
+    pthread_mutex_unlock(&channel->lock);
+}
+
+void releaseChannel(Channel* channel) {
+    pthread_mutex_lock(&channel->lock);
+    bool last = --channel->refCount == 0;
+    pthread_mutex_unlock(&channel->lock);
+    if (!last) return;
+
+    Message* message = channel->head;
+    while (message != NULL) {
+        Message* next = message->next;
+        freeMessage(message);
+        message = next;
+    }
+    if (channel->result != NULL) freeMessage(channel->result);
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->sent);
+    free(channel);
+}
+
+// wakes everything waiting on the channel, the isolates that lose the race
+// for a message just park again; called with the channel locked
+static Isolate* wakeWaiters(Channel* channel) {
+    Isolate* woken = channel->waiters;
+    channel->waiters = NULL;
+    pthread_cond_broadcast(&channel->sent);
+    return woken;
+}
+
+static void scheduleAll(Isolate* isolate) {
+    while (isolate != NULL) {
+        Isolate* next = isolate->next;
+        schedule(isolate);
+        isolate = next;
+    }
+}
+
+static void sendMessage(Channel* channel, Message* message) {
+    pthread_mutex_lock(&channel->lock);
+    message->next = NULL;
+    if (channel->tail == NULL) {
+        channel->head = message;
+    } else {
+        channel->tail->next = message;
+    }
+    channel->tail = message;
+    Isolate* woken = wakeWaiters(channel);
+    pthread_mutex_unlock(&channel->lock);
+    scheduleAll(woken);
+}
+
+// the spawned function returned, the result is there for good
+static void settleChannel(Channel* channel, Message* result) {
+    pthread_mutex_lock(&channel->lock);
+    channel->result = result;
+    Isolate* woken = wakeWaiters(channel);
+    pthread_mutex_unlock(&channel->lock);
+    scheduleAll(woken);
+}
+
+static void failChannel(Channel* channel) {
+    pthread_mutex_lock(&channel->lock);
+    channel->failed = true;
+    Isolate* woken = wakeWaiters(channel);
+    pthread_mutex_unlock(&channel->lock);
+    scheduleAll(woken);
+}
+
+// called with the channel locked
+static Message* takeMessage(Channel* channel) {
+    Message* message = channel->head;
+    if (message != NULL) {
+        channel->head = message->next;
+        if (channel->head == NULL) channel->tail = NULL;
+    }
+    return message;
+}
+
+// what a receive gets, called with the channel locked: the next message,
+// else the result to copy with copyResult(), else nothing for a failed
+// spawn; false if there is none of these yet
+static bool takeReceived(Channel* channel, Message** message,
+                         Message** result) {
+    *message = takeMessage(channel);
+    *result = *message == NULL ? channel->result : NULL;
+    return *message != NULL || *result != NULL || channel->failed;
+}
+
+// a message of its own for one receiver of a spawn's result; the result is
+// only freed with the channel, which the receiver holds, so this runs with
+// the channel unlocked
+static Message* copyResult(Message* result) {
+    Message* message = newMessage();
+    writeBytes(message, result->bytes, result->count);
+    if (result->channelCount > 0) {
+        message->channels = (Channel**)malloc(sizeof(Channel*) *
+                                              result->channelCount);
+        if (message->channels == NULL) exit(1);
+        for (int i = 0; i < result->channelCount; i++) {
+            retainChannel(result->channels[i]);
+            message->channels[i] = result->channels[i];
+        }
+        message->channelCount = message->channelCapacity =
+            result->channelCount;
+    }
+    return message;
+}
+
+// encoding, on the sender's thread; reads the sender's heap and only
+// allocates in the message
+
+typedef struct {
+    VM* vm;
+    Message* message;
+    // every object written so far and its index, open addressed by address
+    Obj** seen;
+    int* indexes;
+    int seenCount;
+    int seenCapacity;
+    // slots of the globals the written functions use, in the order found
+    bool* globalQueued;
+    int* globals;
+    int globalCount;
+} Encoder;
+
+static uint32_t hashObject(Obj* object) {
+    uintptr_t address = (uintptr_t)object;
+    return (uint32_t)((address >> 3) ^ (address >> 17));
+}
+
+// the object's index if it has been written before, otherwise gives it the
+// next one and returns -1
+static int seeObject(Encoder* encoder, Obj* object) {
+    if (encoder->seenCount + 1 > encoder->seenCapacity * 3 / 4) {
+        int oldCapacity = encoder->seenCapacity;
+        Obj** oldSeen = encoder->seen;
+        int* oldIndexes = encoder->indexes;
+        encoder->seenCapacity = GROW_CAPACITY(oldCapacity) * 2;
+        encoder->seen = (Obj**)calloc(encoder->seenCapacity, sizeof(Obj*));
+        encoder->indexes = (int*)malloc(sizeof(int) * encoder->seenCapacity);
+        if (encoder->seen == NULL || encoder->indexes == NULL) exit(1);
+        for (int i = 0; i < oldCapacity; i++) {
+            if (oldSeen[i] == NULL) continue;
+            uint32_t slot = hashObject(oldSeen[i]) % encoder->seenCapacity;
+            while (encoder->seen[slot] != NULL) {
+                slot = (slot + 1) % encoder->seenCapacity;
+            }
+            encoder->seen[slot] = oldSeen[i];
+            encoder->indexes[slot] = oldIndexes[i];
+        }
+        free(oldSeen);
+        free(oldIndexes);
+    }
+
+    uint32_t slot = hashObject(object) % encoder->seenCapacity;
+    while (encoder->seen[slot] != NULL) {
+        if (encoder->seen[slot] == object) return encoder->indexes[slot];
+        slot = (slot + 1) % encoder->seenCapacity;
+    }
+    encoder->seen[slot] = object;
+    encoder->indexes[slot] = encoder->seenCount++;
+    return -1;
+}
+
+static void queueGlobal(Encoder* encoder, int slot) {
+    if (encoder->globalQueued[slot]) return;
+    encoder->globalQueued[slot] = true;
+    encoder->globals[encoder->globalCount++] = slot;
+}
+
+static void encodeValue(Encoder* encoder, Value value);
+
+static void encodeTable(Encoder* encoder, Table* table) {
+    writeInt(encoder->message, table->count);
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        encodeValue(encoder, OBJ_VAL(entry->key));
+        encodeValue(encoder, entry->value);
+    }
+}
+
+static void encodeFunction(Encoder* encoder, ObjFunction* function) {
+    Message* message = encoder->message;
+    Chunk* chunk = &function->chunk;
+    writeInt(message, function->arity);
+    writeInt(message, function->upvalueCount);
+    writeInt(message, function->maxSlots);
+    encodeValue(encoder, function->name == NULL
+                             ? NIL_VAL : OBJ_VAL(function->name));
+
+    // quickened instructions go back to their generic form, the receiver
+    // starts out with empty caches anyway
+    writeInt(message, chunk->count);
+    int globalCount = 0;
+    for (int offset = 0; offset < chunk->count;) {
+        int length = instructionLength(chunk, offset);
+        uint8_t instruction = chunk->code[offset];
+        writeByte(message, genericOpcode(instruction));
+        writeBytes(message, chunk->code + offset + 1, length - 1);
+        if (instruction == OP_GET_GLOBAL || instruction == OP_SET_GLOBAL ||
+            instruction == OP_DEFINE_GLOBAL) {
+            globalCount++;
+        }
+        offset += length;
+    }
+    writeBytes(message, chunk->lines, (int)sizeof(int) * chunk->count);
+
+    // global slots are only good for the sender, so every global operand
+    // goes along with the name of its global
+    writeInt(message, globalCount);
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction != OP_GET_GLOBAL && instruction != OP_SET_GLOBAL &&
+            instruction != OP_DEFINE_GLOBAL) {
+            continue;
+        }
+        int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        writeInt(message, offset + 1);
+        encodeValue(encoder, encoder->vm->globalNames.values[slot]);
+        queueGlobal(encoder, slot);
+    }
+
+    writeInt(message, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        encodeValue(encoder, chunk->constants.values[i]);
+    }
+    writeInt(message, chunk->cacheCount);
+}
+
+static void encodeUpvalue(Encoder* encoder, ObjUpvalue* upvalue) {
+    int index = seeObject(encoder, (Obj*)upvalue);
+    if (index != -1) {
+        writeByte(encoder->message, TAG_REF);
+        writeInt(encoder->message, index);
+        return;
+    }
+    writeByte(encoder->message, TAG_UPVALUE);
+    // an open upvalue still points into the sender's stack
+    encodeValue(encoder, *upvalue->location);
+}
+
+static void encodeInstance(Encoder* encoder, ObjInstance* instance) {
+    encodeValue(encoder, OBJ_VAL(instance->klass));
+    if (instance->shape == NULL) {
+        encodeTable(encoder, &instance->dictionary);
+        return;
+    }
+
+    // the shapes name the fields from the last one back
+    ObjString* names[SHAPE_MAX_FIELDS];
+    int count = instance->shape->fieldCount;
+    for (ObjShape* shape = instance->shape; shape->parent != NULL;
+         shape = shape->parent) {
+        names[shape->fieldCount - 1] = shape->name;
+    }
+    writeInt(encoder->message, count);
+    for (int i = 0; i < count; i++) {
+        encodeValue(encoder, OBJ_VAL(names[i]));
+        encodeValue(encoder, instance->fields[i]);
+    }
+}
+
+static void encodeValue(Encoder* encoder, Value value) {
+    Message* message = encoder->message;
+    if (!IS_OBJ(value)) {
+        writeByte(message, TAG_VALUE);
+        writeBytes(message, &value, (int)sizeof(Value));
+        return;
+    }
+
+    Obj* object = AS_OBJ(value);
+    int index = seeObject(encoder, object);
+    if (index != -1) {
+        writeByte(message, TAG_REF);
+        writeInt(message, index);
+        return;
+    }
+
+    switch (object->type) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            writeByte(message, TAG_STRING);
+            writeInt(message, string->length);
+            writeBytes(message, string->chars, string->length);
+            break;
+        }
+        case OBJ_FUNCTION:
+            writeByte(message, TAG_FUNCTION);
+            encodeFunction(encoder, (ObjFunction*)object);
+            break;
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            writeByte(message, TAG_CLOSURE);
+            encodeValue(encoder, OBJ_VAL(closure->function));
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                encodeUpvalue(encoder, closure->upvalues[i]);
+            }
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            writeByte(message, TAG_CLASS);
+            encodeValue(encoder, OBJ_VAL(klass->name));
+            // inherited methods were copied in, the superclass is not needed
+            encodeTable(encoder, &klass->methods);
+            break;
+        }
+        case OBJ_INSTANCE:
+            writeByte(message, TAG_INSTANCE);
+            encodeInstance(encoder, (ObjInstance*)object);
+            break;
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            writeByte(message, TAG_BOUND_METHOD);
+            encodeValue(encoder, bound->receiver);
+            encodeValue(encoder, OBJ_VAL(bound->method));
+            break;
+        }
+        case OBJ_NATIVE: {
+            // natives live in the one process, their pointers stay good
+            ObjNative* native = (ObjNative*)object;
+            writeByte(message, TAG_NATIVE);
+            writeBytes(message, &native->function, (int)sizeof(NativeFn));
+            writeInt(message, native->arity);
+            writeByte(message, native->flags);
+            writeBytes(message, &native->host, (int)sizeof(native->host));
+            writeBytes(message, &native->userData, (int)sizeof(void*));
+            break;
+        }
+        case OBJ_CHANNEL: {
+            Channel* channel = ((ObjChannel*)object)->channel;
+            retainChannel(channel);
+            if (message->channelCount + 1 > message->channelCapacity) {
+                message->channelCapacity =
+                    GROW_CAPACITY(message->channelCapacity);
+                message->channels = (Channel**)realloc(message->channels,
+                    sizeof(Channel*) * message->channelCapacity);
+                if (message->channels == NULL) exit(1);
+            }
+            message->channels[message->channelCount++] = channel;
+            writeByte(message, TAG_CHANNEL);
+            writeBytes(message, &channel, (int)sizeof(Channel*));
+            break;
+        }
+        case OBJ_FIBER:
+            // its stack belongs to this heap, so it can not go along
+            encodeValue(encoder, NIL_VAL);
+            break;
+        case OBJ_SHAPE:
+        case OBJ_UPVALUE:
+            // never values of their own
+            break;
+    }
+}
+
+// the values and then every global the functions among them need, which
+// can bring in yet more functions and globals
+static Message* encodeMessage(VM* vm, Value* values, int count) {
+    Encoder encoder;
+    encoder.vm = vm;
+    encoder.message = newMessage();
+    encoder.seen = NULL;
+    encoder.indexes = NULL;
+    encoder.seenCount = 0;
+    encoder.seenCapacity = 0;
+    int globals = vm->globalValues.count;
+    encoder.globalQueued = (bool*)calloc(globals + 1, sizeof(bool));
+    encoder.globals = (int*)malloc(sizeof(int) * (globals + 1));
+    encoder.globalCount = 0;
+    if (encoder.globalQueued == NULL || encoder.globals == NULL) exit(1);
+
+    writeInt(encoder.message, count);
+    for (int i = 0; i < count; i++) encodeValue(&encoder, values[i]);
+    for (int i = 0; i < encoder.globalCount; i++) {
+        int slot = encoder.globals[i];
+        Value value = vm->globalValues.values[slot];
+        if (IS_UNDEFINED(value)) continue;
+        writeByte(encoder.message, 1);
+        encodeValue(&encoder, vm->globalNames.values[slot]);
+        encodeValue(&encoder, value);
+    }
+    writeByte(encoder.message, 0);
+
+    free(encoder.seen);
+    free(encoder.indexes);
+    free(encoder.globalQueued);
+    free(encoder.globals);
+    return encoder.message;
+}
+
+// decoding, on the receiver's thread into its heap
+
+typedef struct Decoder {
+    Message* message;
+    int position;
+    // every object decoded so far by index, a gc root until the end
+    ValueArray objects;
+} Decoder;
+
+void markDecoderRoots(VM* vm) {
+    if (vm->decoder == NULL) return;
+    ValueArray* objects = &vm->decoder->objects;
+    for (int i = 0; i < objects->count; i++) markValue(vm, objects->values[i]);
+}
+
+static void readBytes(Decoder* decoder, void* bytes, int length) {
+    memcpy(bytes, decoder->message->bytes + decoder->position, length);
+    decoder->position += length;
+}
+
+static uint8_t readByte(Decoder* decoder) {
+    return decoder->message->bytes[decoder->position++];
+}
+
+static int readInt(Decoder* decoder) {
+    int value;
+    readBytes(decoder, &value, (int)sizeof(int));
+    return value;
+}
+
+// takes the next object index before the object exists, so the objects it
+// refers to can come first and refer back to it
+static int reserveObject(VM* vm, Decoder* decoder) {
+    writeValueArray(vm, &decoder->objects, NIL_VAL);
+    return decoder->objects.count - 1;
+}
+
+static Value decodeValue(VM* vm, Decoder* decoder);
+
+static ObjString* decodeString(VM* vm, Decoder* decoder) {
+    return AS_STRING(decodeValue(vm, decoder));
+}
+
+static void decodeFunction(VM* vm, Decoder* decoder, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    function->arity = readInt(decoder);
+    function->upvalueCount = readInt(decoder);
+    function->maxSlots = readInt(decoder);
+    Value name = decodeValue(vm, decoder);
+    function->name = IS_NIL(name) ? NULL : AS_STRING(name);
+
+    int count = readInt(decoder);
+    uint8_t* code = decoder->message->bytes + decoder->position;
+    decoder->position += count;
+    for (int i = 0; i < count; i++) {
+        writeChunk(vm, chunk, code[i], readInt(decoder));
+    }
+
+    int globalCount = readInt(decoder);
+    for (int i = 0; i < globalCount; i++) {
+        int operand = readInt(decoder);
+        int slot = globalSlot(vm, decodeString(vm, decoder));
+        chunk->code[operand] = (uint8_t)(slot >> 8);
+        chunk->code[operand + 1] = (uint8_t)slot;
+    }
+
+    int constants = readInt(decoder);
+    for (int i = 0; i < constants; i++) {
+        // an object constant is already held by the decoder
+        writeValueArray(vm, &chunk->constants, decodeValue(vm, decoder));
+    }
+    int caches = readInt(decoder);
+    for (int i = 0; i < caches; i++) addInlineCache(vm, chunk);
+}
+
+static ObjUpvalue* decodeUpvalue(VM* vm, Decoder* decoder) {
+    if (readByte(decoder) == TAG_REF) {
+        return (ObjUpvalue*)AS_OBJ(decoder->objects.values[readInt(decoder)]);
+    }
+    int index = reserveObject(vm, decoder);
+    ObjUpvalue* upvalue = newUpvalue(vm, NULL);
+    decoder->objects.values[index] = OBJ_VAL(upvalue);
+    upvalue->location = &upvalue->closed;
+    upvalue->closed = decodeValue(vm, decoder);
+    return upvalue;
+}
+
+static Value decodeValue(VM* vm, Decoder* decoder) {
+    uint8_t tag = readByte(decoder);
+    if (tag == TAG_VALUE) {
+        Value value;
+        readBytes(decoder, &value, (int)sizeof(Value));
+        return value;
+    }
+    if (tag == TAG_REF) return decoder->objects.values[readInt(decoder)];
+
+    int index = reserveObject(vm, decoder);
+    switch (tag) {
+        case TAG_STRING: {
+            int length = readInt(decoder);
+            char* chars = (char*)decoder->message->bytes + decoder->position;
+            decoder->position += length;
+            decoder->objects.values[index] =
+                OBJ_VAL(copyString(vm, chars, length));
+            break;
+        }
+        case TAG_FUNCTION: {
+            ObjFunction* function = newFunction(vm);
+            decoder->objects.values[index] = OBJ_VAL(function);
+            decodeFunction(vm, decoder, function);
+            break;
+        }
+        case TAG_CLOSURE: {
+            ObjClosure* closure =
+                newClosure(vm, AS_FUNCTION(decodeValue(vm, decoder)));
+            decoder->objects.values[index] = OBJ_VAL(closure);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                closure->upvalues[i] = decodeUpvalue(vm, decoder);
+            }
+            break;
+        }
+        case TAG_CLASS: {
+            ObjClass* klass = newClass(vm, decodeString(vm, decoder));
+            decoder->objects.values[index] = OBJ_VAL(klass);
+            int count = readInt(decoder);
+            for (int i = 0; i < count; i++) {
+                ObjString* name = decodeString(vm, decoder);
+                tableSet(vm, &klass->methods, name, decodeValue(vm, decoder));
+            }
+            break;
+        }
+        case TAG_INSTANCE: {
+            ObjInstance* instance =
+                newInstance(vm, AS_CLASS(decodeValue(vm, decoder)));
+            decoder->objects.values[index] = OBJ_VAL(instance);
+            int count = readInt(decoder);
+            for (int i = 0; i < count; i++) {
+                ObjString* name = decodeString(vm, decoder);
+                instanceSetField(vm, instance, name,
+                                 decodeValue(vm, decoder));
+            }
+            break;
+        }
+        case TAG_BOUND_METHOD: {
+            ObjBoundMethod* bound = newBoundMethod(vm, NIL_VAL, NULL);
+            decoder->objects.values[index] = OBJ_VAL(bound);
+            bound->receiver = decodeValue(vm, decoder);
+            bound->method = AS_CLOSURE(decodeValue(vm, decoder));
+            break;
+        }
+        case TAG_NATIVE: {
+            NativeFn function;
+            readBytes(decoder, &function, (int)sizeof(NativeFn));
+            int arity = readInt(decoder);
+            uint8_t flags = readByte(decoder);
+            ObjNative* native = newNative(vm, function, arity, flags);
+            readBytes(decoder, &native->host, (int)sizeof(native->host));
+            readBytes(decoder, &native->userData, (int)sizeof(void*));
+            decoder->objects.values[index] = OBJ_VAL(native);
+            break;
+        }
+        case TAG_CHANNEL: {
+            // takes over the reference the message holds
+            Channel* channel;
+            readBytes(decoder, &channel, (int)sizeof(Channel*));
+            decoder->objects.values[index] = OBJ_VAL(newChannel(vm, channel));
+            break;
+        }
+    }
+    return decoder->objects.values[index];
+}
+
+// pushes the message's values onto vm's stack and frees it, false if the
+// stack can not take them
+static bool decodeMessage(VM* vm, Message* message) {
+    Decoder decoder;
+    decoder.message = message;
+    decoder.position = 0;
+    initValueArray(&decoder.objects);
+
+    int count = readInt(&decoder);
+    // newClass() and globalSlot() push a value of their own for a moment
+    if (!reserveStack(vm, vm->stackTop, count + 1)) {
+        freeMessage(message);
+        return false;
+    }
+
+    vm->decoder = &decoder;
+    for (int i = 0; i < count; i++) push(vm, decodeValue(vm, &decoder));
+    while (readByte(&decoder)) {
+        ObjString* name = decodeString(vm, &decoder);
+        Value value = decodeValue(vm, &decoder);
+        int slot = globalSlot(vm, name);
+        if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+            vm->globalValues.values[slot] = value;
+        }
+    }
+    vm->decoder = NULL;
+    freeValueArray(vm, &decoder.objects);
+
+    // the channel references went to the decoded channel objects
+    message->channelCount = 0;
+    freeMessage(message);
+    return true;
+}
+
+// receiving
+
+static bool takeResult(VM* vm, Message* message, Value* result) {
+    if (message == NULL) {
+        runtimeError(vm, "Spawned function failed.");
+        return false;
+    }
+    if (!decodeMessage(vm, message)) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    *result = pop(vm);
+    return true;
+}
+
+// the receive is over, whatever it got
+static void stopReceiving(VM* vm) {
+    releaseChannel(vm->receiving);
+    vm->receiving = NULL;
+}
+
+bool waitForMessage(VM* vm, Value* message) {
+    Channel* channel = vm->receiving;
+    pthread_mutex_lock(&channel->lock);
+    Message* next;
+    Message* result;
+    while (!takeReceived(channel, &next, &result)) {
+        pthread_cond_wait(&channel->sent, &channel->lock);
+    }
+    pthread_mutex_unlock(&channel->lock);
+    if (result != NULL) next = copyResult(result);
+    stopReceiving(vm);
+    return takeResult(vm, next, message);
+}
+
+// workers
+
+static InterpretResult startIsolate(Isolate* isolate) {
+    VM* vm = (VM*)malloc(sizeof(VM));
+    if (vm == NULL) exit(1);
+    initVM(vm);
+    vm->registerMode = isolate->registerMode;
+    vm->jitMode = isolate->jitMode;
+    vm->traceMode = isolate->traceMode;
+    vm->quicken = isolate->quicken;
+    vm->stackLimit = isolate->stackLimit;
+    vm->noEvents = true;
+    isolate->vm = vm;
+
+    bool decoded = decodeMessage(vm, isolate->entry);
+    isolate->entry = NULL;
+    if (!decoded) {
+        runtimeError(vm, "Stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    return interpretCall(vm, isolate->argCount);
+}
+
+static void finishIsolate(Isolate* isolate, InterpretResult result) {
+    VM* vm = isolate->vm;
+    if (result == INTERPRET_OK) {
+        settleChannel(isolate->result,
+                      encodeMessage(vm, vm->stackTop - 1, 1));
+    } else {
+        failChannel(isolate->result);
+    }
+    releaseChannel(isolate->result);
+    freeVM(vm);
+    free(vm);
+    free(isolate);
+}
+
+// runs the isolate until it ends or parks on a channel
+static void runIsolate(Isolate* isolate) {
+    InterpretResult result = isolate->vm == NULL
+        ? startIsolate(isolate) : INTERPRET_SUSPENDED;
+    VM* vm = isolate->vm;
+
+    while (result == INTERPRET_SUSPENDED) {
+        Channel* channel = vm->receiving;
+        pthread_mutex_lock(&channel->lock);
+        Message* message;
+        Message* settled;
+        if (!takeReceived(channel, &message, &settled)) {
+            isolate->next = channel->waiters;
+            channel->waiters = isolate;
+            pthread_mutex_unlock(&channel->lock);
+            return;
+        }
+        pthread_mutex_unlock(&channel->lock);
+
+        if (settled != NULL) message = copyResult(settled);
+        stopReceiving(vm);
+        Value received;
+        if (!takeResult(vm, message, &received)) {
+            result = INTERPRET_RUNTIME_ERROR;
+            break;
+        }
+        result = resumeInterpret(vm, received);
+    }
+    finishIsolate(isolate, result);
+}
+
+static void* workerMain(void* unused) {
+    (void)unused;
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.head == NULL) pthread_cond_wait(&pool.ready, &pool.lock);
+        Isolate* isolate = pool.head;
+        pool.head = isolate->next;
+        if (pool.head == NULL) pool.tail = NULL;
+        pthread_mutex_unlock(&pool.lock);
+
+        runIsolate(isolate);
+    }
+    return NULL;
+}
+
+static void startPool(void) {
+    if (pool.workerCount <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        pool.workerCount = cores > 0 ? (int)cores : 1;
+    }
+    for (int i = 0; i < pool.workerCount; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, workerMain, NULL) != 0) {
+            fprintf(stderr, "Could not start a worker thread.\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+// natives
+
+static bool spawnNative(VM* vm, int argCount, Value* args) {
+    if (argCount == 0 || !IS_CLOSURE(args[0])) {
+        vm->nativeError = "Can only spawn a function.";
+        return false;
+    }
+    if (AS_CLOSURE(args[0])->function->arity != argCount - 1) {
+        vm->nativeError = "Wrong number of arguments for the spawned function.";
+        return false;
+    }
+    pthread_once(&pool.started, startPool);
+
+    Isolate* isolate = (Isolate*)malloc(sizeof(Isolate));
+    if (isolate == NULL) exit(1);
+    isolate->vm = NULL;
+    isolate->entry = encodeMessage(vm, args, argCount);
+    isolate->argCount = argCount - 1;
+    isolate->result = newChannelState();
+    isolate->registerMode = vm->registerMode;
+    isolate->jitMode = vm->jitMode;
+    isolate->traceMode = vm->traceMode;
+    isolate->quicken = vm->quicken;
+    isolate->stackLimit = vm->stackLimit;
+
+    // one reference for the isolate and one for the handle
+    retainChannel(isolate->result);
+    args[-1] = OBJ_VAL(newChannel(vm, isolate->result));
+    schedule(isolate);
+    return true;
+}
+
+static bool channelNative(VM* vm, int argCount, Value* args) {
+    args[-1] = OBJ_VAL(newChannel(vm, newChannelState()));
+    return true;
+}
+
+static bool sendNative(VM* vm, int argCount, Value* args) {
+    if (!IS_CHANNEL(args[0])) {
+        vm->nativeError = "Can only send to a channel.";
+        return false;
+    }
+    sendMessage(AS_CHANNEL(args[0])->channel,
+                encodeMessage(vm, &args[1], 1));
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// the value comes in once run() has returned, see waitForMessage() and
+// runIsolate()
+static bool suspendReceive(VM* vm, Value channel) {
+    vm->receiving = AS_CHANNEL(channel)->channel;
+    retainChannel(vm->receiving);
+    vm->suspended = true;
+    return false;
+}
+
+static bool receiveNative(VM* vm, int argCount, Value* args) {
+    if (!IS_CHANNEL(args[0])) {
+        vm->nativeError = "Can only receive from a channel.";
+        return false;
+    }
+    return suspendReceive(vm, args[0]);
+}
+
+static bool awaitNative(VM* vm, int argCount, Value* args) {
+    if (!IS_CHANNEL(args[0])) {
+        vm->nativeError = "Can only await what spawn returned.";
+        return false;
+    }
+    return suspendReceive(vm, args[0]);
+}
+
+void defineIsolateNatives(VM* vm) {
+    defineNative(vm, "spawn", spawnNative, -1, 0);
+    defineNative(vm, "channel", channelNative, 0, 0);
+    defineNative(vm, "send", sendNative, 2, 0);
+    defineNative(vm, "receive", receiveNative, 1, 0);
+    defineNative(vm, "await", awaitNative, 1, 0);
+}
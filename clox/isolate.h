@@ -0,0 +1,28 @@
+#ifndef clox_isolate_h
+#define clox_isolate_h
+
+#include "common.h"
+#include "value.h"
+
+typedef struct Channel Channel;
+
+// workers the isolates are spread over, by default one per online core;
+// only has an effect before the first spawn starts the pool
+void setWorkerCount(int count);
+
+// spawn, channel, send, receive and await
+void defineIsolateNatives(VM* vm);
+
+// blocks until the channel a receive suspended vm on has a message and
+// decodes it into vm, false once the channel can never get one again
+bool waitForMessage(VM* vm, Value* message);
+
+// the objects of a message being decoded into vm, before anything else
+// refers to them
+void markDecoderRoots(VM* vm);
+
+// drops one reference, the channel and its undelivered messages go with
+// the last one
+void releaseChannel(Channel* channel);
+
+#endif
@@ -0,0 +1,555 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "x64.h"
+
+#ifdef JIT_SUPPORTED
+
+/*
+Baseline template jit
+
+A function that has been called JIT_HOT_CALLS times is translated one
+instruction at a time into x86-64, each opcode always becoming the same
+template of machine code. Numbers get inline fast paths that work on the
+NaN boxed bits directly; everything else (strings, properties, errors)
+calls back into the helpers in vm.c.
+
+The compiled code works on the same value stack and CallFrame as the
+interpreter and only ever runs one frame. Calls and returns are left to
+the interpreter: the code stores vm->stackTop and frame->ip and returns,
+run() performs the call or return, and if the frame it ends up in has been
+compiled it jumps back in at that frame's ip. Every instruction start has
+an entry point for that. Functions using an instruction without a
+template are never compiled and just keep being interpreted.
+
+Inside the code a few registers stay pinned:
+    rbx  frame->slots
+    r12  vm->stackTop, written back before every helper call and exit
+    r13  the VM
+    r14  the CallFrame
+    r15  QNAN, to tell numbers apart from everything else
+*/
+
+struct JitCode {
+    uint8_t* code;  // executable, starts with the entry trampoline
+    size_t size;
+    int* entries;   // offset of each instruction's machine code, by bytecode offset
+};
+
+typedef bool (*JitEntry)(VM* vm, CallFrame* frame, Value* stackTop,
+                         uint8_t* target);
+
+#define SLOTS    RBX
+#define TOP      R12
+#define VM_BASE  R13
+#define FRAME    R14
+
+// moves the stack top by a few bytes
+static void adjustTop(Assembler* as, int bytes) {
+    if (bytes >= 0) {
+        EMIT(as, 0x49, 0x83, 0xc4, (uint8_t)bytes);  // add r12, bytes
+    } else {
+        EMIT(as, 0x49, 0x83, 0xec, (uint8_t)-bytes); // sub r12, -bytes
+    }
+}
+
+static void pushRegister(Assembler* as, Register reg) {
+    asmStore(as, TOP, 0, reg);
+    adjustTop(as, 8);
+}
+
+// points frame->ip just past the opcode, where runtimeError expects it
+static void syncIp(Assembler* as, Chunk* chunk, int offset) {
+    asmImmediate(as, RAX, (uint64_t)(uintptr_t)(chunk->code + offset + 1));
+    asmStore(as, FRAME, offsetof(CallFrame, ip), RAX);
+}
+
+// calls into c with vm->stackTop up to date and picks the top up again after
+// helpers that can fail report the error themselves and return false; the vm
+// is always the first argument, the template loads the rest into rsi and rdx
+static void callHelper(Assembler* as, uint64_t helper, bool canFail) {
+    asmStore(as, VM_BASE, offsetof(VM, stackTop), TOP);
+    asmRegisters(as, 0x89, RDI, VM_BASE);
+    asmImmediate(as, RAX, helper);
+    EMIT(as, 0xff, 0xd0);  // call rax
+    if (canFail) {
+        EMIT(as, 0x84, 0xc0);  // test al, al
+        asmPatch(as, asmJump(as, JE), as->errorExit);
+    }
+    asmLoad(as, TOP, VM_BASE, offsetof(VM, stackTop));
+}
+
+// hands the instruction at offset over to the interpreter
+static void emitExit(Assembler* as, Chunk* chunk, int offset) {
+    asmStore(as, VM_BASE, offsetof(VM, stackTop), TOP);
+    asmImmediate(as, RAX, (uint64_t)(uintptr_t)(chunk->code + offset));
+    asmStore(as, FRAME, offsetof(CallFrame, ip), RAX);
+    EMIT(as, 0xb8, 0x01, 0x00, 0x00, 0x00);  // mov eax, 1
+    asmPatch(as, asmJump(as, JMP), as->exit);
+}
+
+// entered through jitExecute(vm, frame, stackTop, target)
+static void emitTrampoline(Assembler* as) {
+    EMIT(as, 0x55);                    // push rbp
+    EMIT(as, 0x48, 0x89, 0xe5);        // mov rbp, rsp
+    EMIT(as, 0x53);                    // push rbx
+    EMIT(as, 0x41, 0x54, 0x41, 0x55);  // push r12; push r13
+    EMIT(as, 0x41, 0x56, 0x41, 0x57);  // push r14; push r15
+    EMIT(as, 0x48, 0x83, 0xec, 0x08);  // sub rsp, 8 to keep calls aligned
+    asmRegisters(as, 0x89, VM_BASE, RDI);
+    asmRegisters(as, 0x89, FRAME, RSI);
+    asmRegisters(as, 0x89, TOP, RDX);
+    asmLoad(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    asmImmediate(as, QNAN_REG, QNAN);
+    EMIT(as, 0xff, 0xe1);              // jmp rcx
+
+    as->errorExit = as->count;
+    EMIT(as, 0x31, 0xc0);              // xor eax, eax
+    as->exit = as->count;
+    EMIT(as, 0x48, 0x83, 0xc4, 0x08);  // add rsp, 8
+    EMIT(as, 0x41, 0x5f, 0x41, 0x5e);  // pop r15; pop r14
+    EMIT(as, 0x41, 0x5d, 0x41, 0x5c);  // pop r13; pop r12
+    EMIT(as, 0x5b, 0x5d, 0xc3);        // pop rbx; pop rbp; ret
+}
+
+// slow paths, only reached once the inline number path gave up
+
+// the operands are not both numbers
+static bool jitBinaryOp(VM* vm, int op) {
+    if (op == OP_ADD) {
+        if (IS_STRING(vm->stackTop[-1]) && IS_STRING(vm->stackTop[-2])) {
+            concatenate(vm);
+            return true;
+        }
+        runtimeError(vm, "Operands must be two numbers or two strings.");
+        return false;
+    }
+    runtimeError(vm, "Operands must be numbers.");
+    return false;
+}
+
+static bool jitNegateError(VM* vm) {
+    runtimeError(vm, "Operand must be a number");
+    return false;
+}
+
+static bool jitUndefinedGlobal(VM* vm, int slot) {
+    runtimeError(vm, "Undefined variable '%s'.",
+                 AS_CSTRING(vm->globalNames.values[slot]));
+    return false;
+}
+
+static void jitPrint(VM* vm) {
+    flockfile(stdout);
+    printValue(pop(vm));
+    printf("\n");
+    funlockfile(stdout);
+}
+
+static void jitCloseUpvalue(VM* vm) {
+    closeUpvalues(vm, vm->stackTop - 1);
+    pop(vm);
+}
+
+static void emitSlowBinary(Assembler* as, Chunk* chunk, int offset,
+                           uint8_t op) {
+    syncIp(as, chunk, offset);
+    asmImmediate(as, RSI, op);
+    callHelper(as, HELPER(jitBinaryOp), true);
+}
+
+// a op b on the top two values, sse is the opcode of addsd and friends
+static void emitArithmetic(Assembler* as, Chunk* chunk, int offset,
+                           uint8_t op,
+                           uint8_t sse) {
+    asmLoad(as, RCX, TOP, -8);
+    asmLoad(as, RAX, TOP, -16);
+    int notA = asmJumpIfNotNumber(as, RAX);
+    int notB = asmJumpIfNotNumber(as, RCX);
+    asmToDoubles(as);
+    EMIT(as, 0xf2, 0x0f, sse, 0xc1);         // op xmm0, xmm1
+    EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc0);  // movq rax, xmm0
+    asmStore(as, TOP, -16, RAX);
+    adjustTop(as, -8);
+    int done = asmJump(as, JMP);
+
+    asmPatchHere(as, notA);
+    asmPatchHere(as, notB);
+    emitSlowBinary(as, chunk, offset, op);
+    asmPatchHere(as, done);
+}
+
+static void emitComparison(Assembler* as, Chunk* chunk, int offset,
+                           uint8_t op) {
+    asmLoad(as, RCX, TOP, -8);
+    asmLoad(as, RAX, TOP, -16);
+    int notA = asmJumpIfNotNumber(as, RAX);
+    int notB = asmJumpIfNotNumber(as, RCX);
+    asmToDoubles(as);
+    if (op == OP_GREATER) {
+        EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);  // ucomisd xmm0, xmm1
+    } else {
+        EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);  // ucomisd xmm1, xmm0
+    }
+    EMIT(as, 0x0f, 0x97, 0xc0);            // seta al, false for NaN
+    asmBoolFromAl(as);
+    asmStore(as, TOP, -16, RAX);
+    adjustTop(as, -8);
+    int done = asmJump(as, JMP);
+
+    asmPatchHere(as, notA);
+    asmPatchHere(as, notB);
+    emitSlowBinary(as, chunk, offset, op);
+    asmPatchHere(as, done);
+}
+
+// same as valuesEqual: numbers compare as doubles, anything else by its bits
+static void emitEquality(Assembler* as, bool negate) {
+    asmLoad(as, RCX, TOP, -8);
+    asmLoad(as, RAX, TOP, -16);
+    int notA = asmJumpIfNotNumber(as, RAX);
+    int notB = asmJumpIfNotNumber(as, RCX);
+    asmToDoubles(as);
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);  // ucomisd xmm0, xmm1
+    EMIT(as, 0x0f, 0x94, 0xc0);        // sete al
+    EMIT(as, 0x0f, 0x9b, 0xc2);        // setnp dl, NaN is unordered
+    EMIT(as, 0x20, 0xd0);              // and al, dl
+    int done = asmJump(as, JMP);
+
+    asmPatchHere(as, notA);
+    asmPatchHere(as, notB);
+    asmRegisters(as, 0x39, RAX, RCX);
+    EMIT(as, 0x0f, 0x94, 0xc0);        // sete al
+    asmPatchHere(as, done);
+
+    if (negate) EMIT(as, 0x34, 0x01);  // xor al, 1
+    asmBoolFromAl(as);
+    asmStore(as, TOP, -16, RAX);
+    adjustTop(as, -8);
+}
+
+static void emitGetGlobal(Assembler* as, Chunk* chunk, int offset,
+                          uint16_t slot) {
+    asmLoad(as, RAX, VM_BASE,
+         offsetof(VM, globalValues) + offsetof(ValueArray, values));
+    asmLoad(as, RAX, RAX, slot * (int)sizeof(Value));
+    asmImmediate(as, RCX, UNDEFINED_VAL);
+    asmRegisters(as, 0x39, RAX, RCX);
+    int defined = asmJump(as, JNE);
+    syncIp(as, chunk, offset);
+    asmImmediate(as, RSI, slot);
+    callHelper(as, HELPER(jitUndefinedGlobal), true);
+    asmPatchHere(as, defined);
+    pushRegister(as, RAX);
+}
+
+static void emitSetGlobal(Assembler* as, Chunk* chunk, int offset,
+                          uint16_t slot) {
+    asmLoad(as, RCX, VM_BASE,
+         offsetof(VM, globalValues) + offsetof(ValueArray, values));
+    asmLoad(as, RAX, RCX, slot * (int)sizeof(Value));
+    asmImmediate(as, RDX, UNDEFINED_VAL);
+    asmRegisters(as, 0x39, RAX, RDX);
+    int defined = asmJump(as, JNE);
+    syncIp(as, chunk, offset);
+    asmImmediate(as, RSI, slot);
+    callHelper(as, HELPER(jitUndefinedGlobal), true);
+    asmPatchHere(as, defined);
+    asmLoad(as, RAX, TOP, -8);
+    asmStore(as, RCX, slot * (int)sizeof(Value), RAX);
+}
+
+// rax = the location of upvalue slot of the frame's closure
+static void loadUpvalueLocation(Assembler* as, uint8_t slot) {
+    asmLoad(as, RAX, FRAME, offsetof(CallFrame, closure));
+    asmLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+    asmLoad(as, RAX, RAX, slot * (int)sizeof(ObjUpvalue*));
+    asmLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+static void emitProperty(Assembler* as, Chunk* chunk, int offset,
+                         uint64_t helper) {
+    ObjString* name = AS_STRING(chunk->constants.values[chunk->code[offset + 1]]);
+    uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) |
+                                chunk->code[offset + 3]);
+    syncIp(as, chunk, offset);
+    asmImmediate(as, RSI, (uint64_t)(uintptr_t)&chunk->caches[cache]);
+    asmImmediate(as, RDX, (uint64_t)(uintptr_t)name);
+    callHelper(as, helper, true);
+}
+
+static void emitJumpIfFalsey(Assembler* as, int target) {
+    asmImmediate(as, RCX, NIL_VAL);
+    asmRegisters(as, 0x39, RAX, RCX);
+    asmFixup(as, JE, target);
+    asmImmediate(as, RCX, FALSE_VAL);
+    asmRegisters(as, 0x39, RAX, RCX);
+    asmFixup(as, JE, target);
+}
+
+// instructions that leave the compiled code for the interpreter
+static bool isExit(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_RETURN:
+        case OP_RETURN_CONSTANT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// the two byte operand of the instruction at code, only read by the
+// cases of instructions that have one: a one byte instruction can be the
+// last in the chunk
+#define OPERAND16 ((uint16_t)((code[1] << 8) | code[2]))
+
+// emits the template of the instruction at offset, false if there is none
+static bool emitInstruction(Assembler* as, Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    // quickened instructions get the same template, it checks types anyway
+    uint8_t instruction = genericOpcode(code[0]);
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            asmImmediate(as, RAX, chunk->constants.values[code[1]]);
+            pushRegister(as, RAX);
+            return true;
+        case OP_NIL:   asmImmediate(as, RAX, NIL_VAL); pushRegister(as, RAX); return true;
+        case OP_TRUE:  asmImmediate(as, RAX, TRUE_VAL); pushRegister(as, RAX); return true;
+        case OP_FALSE: asmImmediate(as, RAX, FALSE_VAL); pushRegister(as, RAX); return true;
+        case OP_POP:
+            adjustTop(as, -8);
+            return true;
+        case OP_GET_LOCAL:
+            asmLoad(as, RAX, SLOTS, code[1] * (int)sizeof(Value));
+            pushRegister(as, RAX);
+            return true;
+        case OP_SET_LOCAL:
+            asmLoad(as, RAX, TOP, -8);
+            asmStore(as, SLOTS, code[1] * (int)sizeof(Value), RAX);
+            return true;
+        case OP_GET_GLOBAL:
+            emitGetGlobal(as, chunk, offset, OPERAND16);
+            return true;
+        case OP_DEFINE_GLOBAL:
+            asmLoad(as, RCX, VM_BASE,
+                 offsetof(VM, globalValues) + offsetof(ValueArray, values));
+            asmLoad(as, RAX, TOP, -8);
+            asmStore(as, RCX, OPERAND16 * (int)sizeof(Value), RAX);
+            adjustTop(as, -8);
+            return true;
+        case OP_SET_GLOBAL:
+            emitSetGlobal(as, chunk, offset, OPERAND16);
+            return true;
+        case OP_GET_UPVALUE:
+            loadUpvalueLocation(as, code[1]);
+            asmLoad(as, RAX, RAX, 0);
+            pushRegister(as, RAX);
+            return true;
+        case OP_SET_UPVALUE:
+            loadUpvalueLocation(as, code[1]);
+            asmLoad(as, RCX, TOP, -8);
+            asmStore(as, RAX, 0, RCX);
+            return true;
+        case OP_GET_THIS_PROPERTY:
+            asmLoad(as, RAX, SLOTS, 0);
+            pushRegister(as, RAX);
+            emitProperty(as, chunk, offset, HELPER(getProperty));
+            return true;
+        case OP_GET_PROPERTY:
+            emitProperty(as, chunk, offset, HELPER(getProperty));
+            return true;
+        case OP_SET_PROPERTY:
+            emitProperty(as, chunk, offset, HELPER(setProperty));
+            return true;
+        case OP_EQUAL:     emitEquality(as, false); return true;
+        case OP_NOT_EQUAL: emitEquality(as, true); return true;
+        case OP_GREATER:
+        case OP_LESS:
+            emitComparison(as, chunk, offset, instruction);
+            return true;
+        case OP_ADD:      emitArithmetic(as, chunk, offset, OP_ADD, 0x58); return true;
+        case OP_SUBTRACT: emitArithmetic(as, chunk, offset, OP_SUBTRACT, 0x5c); return true;
+        case OP_MULTIPLY: emitArithmetic(as, chunk, offset, OP_MULTIPLY, 0x59); return true;
+        case OP_DIVIDE:   emitArithmetic(as, chunk, offset, OP_DIVIDE, 0x5e); return true;
+        case OP_ADD_LOCALS: {
+            asmLoad(as, RAX, SLOTS, code[1] * (int)sizeof(Value));
+            asmLoad(as, RCX, SLOTS, code[2] * (int)sizeof(Value));
+            int notA = asmJumpIfNotNumber(as, RAX);
+            int notB = asmJumpIfNotNumber(as, RCX);
+            asmToDoubles(as);
+            EMIT(as, 0xf2, 0x0f, 0x58, 0xc1);        // addsd xmm0, xmm1
+            EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc0);  // movq rax, xmm0
+            pushRegister(as, RAX);
+            int done = asmJump(as, JMP);
+
+            // push both like OP_ADD would see them
+            asmPatchHere(as, notA);
+            asmPatchHere(as, notB);
+            asmStore(as, TOP, 0, RAX);
+            asmStore(as, TOP, 8, RCX);
+            adjustTop(as, 16);
+            emitSlowBinary(as, chunk, offset, OP_ADD);
+            asmPatchHere(as, done);
+            return true;
+        }
+        case OP_NOT:
+            asmLoad(as, RAX, TOP, -8);
+            asmImmediate(as, RCX, NIL_VAL);
+            asmRegisters(as, 0x39, RAX, RCX);
+            EMIT(as, 0x0f, 0x94, 0xc2);  // sete dl
+            asmImmediate(as, RCX, FALSE_VAL);
+            asmRegisters(as, 0x39, RAX, RCX);
+            EMIT(as, 0x0f, 0x94, 0xc0);  // sete al
+            EMIT(as, 0x08, 0xd0);        // or al, dl
+            asmBoolFromAl(as);
+            asmStore(as, TOP, -8, RAX);
+            return true;
+        case OP_NEGATE: {
+            asmLoad(as, RAX, TOP, -8);
+            int notNumber = asmJumpIfNotNumber(as, RAX);
+            EMIT(as, 0x48, 0x0f, 0xba, 0xf8, 0x3f);  // btc rax, 63
+            asmStore(as, TOP, -8, RAX);
+            int done = asmJump(as, JMP);
+            asmPatchHere(as, notNumber);
+            syncIp(as, chunk, offset);
+            callHelper(as, HELPER(jitNegateError), true);
+            asmPatchHere(as, done);
+            return true;
+        }
+        case OP_PRINT:
+            callHelper(as, HELPER(jitPrint), false);
+            return true;
+        case OP_JUMP:
+            asmFixup(as, JMP, offset + 3 + OPERAND16);
+            return true;
+        case OP_JUMP_IF_FALSE:
+            asmLoad(as, RAX, TOP, -8);
+            emitJumpIfFalsey(as, offset + 3 + OPERAND16);
+            return true;
+        case OP_LESS_CONSTANT_JUMP: {
+            Value constant = chunk->constants.values[code[1]];
+            if (!IS_NUMBER(constant)) return false;
+            uint16_t jump = (uint16_t)((code[2] << 8) | code[3]);
+
+            asmLoad(as, RAX, TOP, -8);
+            int notNumber = asmJumpIfNotNumber(as, RAX);
+            asmImmediate(as, RCX, constant);
+            asmToDoubles(as);
+            EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);  // ucomisd xmm1, xmm0
+            EMIT(as, 0x0f, 0x97, 0xc0);        // seta al
+            asmBoolFromAl(as);
+            asmStore(as, TOP, -8, RAX);
+            asmImmediate(as, RCX, TRUE_VAL);
+            asmRegisters(as, 0x39, RAX, RCX);
+            asmFixup(as, JNE, offset + 4 + jump);
+            int done = asmJump(as, JMP);
+            asmPatchHere(as, notNumber);
+            emitSlowBinary(as, chunk, offset, OP_LESS);
+            asmPatchHere(as, done);
+            return true;
+        }
+        case OP_LOOP:
+            asmFixup(as, JMP, offset + 3 - OPERAND16);
+            return true;
+        case OP_CLOSE_UPVALUE:
+            callHelper(as, HELPER(jitCloseUpvalue), false);
+            return true;
+        // frames change, so the interpreter takes over
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_RETURN:
+        case OP_RETURN_CONSTANT:
+            emitExit(as, chunk, offset);
+            return true;
+        default:
+            // closures, classes and the register instructions
+            return false;
+    }
+}
+
+#undef OPERAND16
+
+bool jitCompile(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    // something like a method that only returns a constant would go
+        // straight back out, which costs more than interpreting it
+    if (isExit(chunk->code[0])) return false;
+
+    Assembler as = {0};
+    // the machine code offset of each instruction, by bytecode offset
+    int* entries = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    if (entries == NULL) exit(1);
+    for (int i = 0; i <= chunk->count; i++) entries[i] = -1;
+
+    emitTrampoline(&as);
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        entries[offset] = as.count;
+        if (!emitInstruction(&as, chunk, offset)) {
+            asmFree(&as);
+            free(entries);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < as.fixupCount; i++) {
+        asmPatch(&as, as.fixups[i].at, entries[as.fixups[i].target]);
+    }
+
+    uint8_t* code = asmFinish(&as);
+    size_t size = as.count;
+    asmFree(&as);
+    if (code == NULL) {
+        free(entries);
+        return false;
+    }
+
+    JitCode* jit = (JitCode*)malloc(sizeof(JitCode));
+    if (jit == NULL) exit(1);
+    jit->code = code;
+    jit->size = size;
+    jit->entries = entries;
+    function->jit = jit;
+    return true;
+}
+
+bool jitExecute(VM* vm, CallFrame* frame) {
+    JitCode* jit = frame->closure->function->jit;
+    int offset = (int)(frame->ip - frame->closure->function->chunk.code);
+    JitEntry entry = (JitEntry)(void*)jit->code;
+    return entry(vm, frame, vm->stackTop, jit->code + jit->entries[offset]);
+}
+
+void freeJitCode(JitCode* jit) {
+    if (jit == NULL) return;
+    freeExecutable(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+}
+
+#else
+
+bool jitCompile(ObjFunction* function) {
+    return false;
+}
+
+// nothing is ever compiled, so run() never gets here
+bool jitExecute(VM* vm, CallFrame* frame) {
+    return true;
+}
+
+void freeJitCode(JitCode* jit) {
+}
+
+#endif
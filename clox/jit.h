@@ -0,0 +1,25 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+#include "vm.h"
+
+// the jit emits x86-64 for the System V ABI and relies on NaN boxed values
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+#define JIT_SUPPORTED
+#endif
+
+// calls before a function is handed to the jit
+#define JIT_HOT_CALLS 100
+
+typedef struct JitCode JitCode;
+
+// false if the function uses an instruction the jit has no template for
+bool jitCompile(ObjFunction* function);
+// runs the frame's compiled function from frame->ip until it reaches a call
+// or return, which it leaves for the interpreter with frame->ip on it
+// false on a runtime error, which has already been reported
+bool jitExecute(VM* vm, CallFrame* frame);
+void freeJitCode(JitCode* code);
+
+#endif
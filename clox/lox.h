@@ -0,0 +1,91 @@
+#ifndef clox_lox_h
+#define clox_lox_h
+
+// the embedding api: everything a host program needs, and nothing of the
+// interpreter's own headers. link against liblox.a (make liblox.a)
+//
+//     LoxVM* vm = loxNewVM();
+//     loxLoad(vm, "fun add(a, b) { return a + b; }");
+//     int add = loxGlobal(vm, "add");
+//     LoxValue args[] = {loxNumber(1), loxNumber(2)}, sum;
+//     if (loxCall(vm, add, 2, args, &sum) == LOX_OK) {
+//         printf("%g\n", loxAsNumber(sum));
+//     }
+//     loxFreeVM(vm);
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct VM LoxVM;
+
+// room for a value of the vm whichever way it represents them; only look
+// at it through the functions below
+typedef struct {
+    uint64_t opaque[2];
+} LoxValue;
+
+typedef enum {
+    LOX_OK,
+    LOX_COMPILE_ERROR,
+    LOX_RUNTIME_ERROR,
+} LoxResult;
+
+LoxVM* loxNewVM(void);
+void loxFreeVM(LoxVM* vm);
+
+// compiles and runs a script once; the functions, classes and globals it
+// defines stay around for loxCall(), so a host compiles each script only
+// once. errors go to stderr
+LoxResult loxLoad(LoxVM* vm, const char* source);
+
+// slot of the global called name, good for the life of the vm, or -1 if
+// no such global is defined
+int loxGlobal(LoxVM* vm, const char* name);
+LoxValue loxGetGlobal(LoxVM* vm, int global);
+void loxSetGlobal(LoxVM* vm, const char* name, LoxValue value);
+
+// calls the function in a global with argCount arguments and, when it
+// returns, stores what it returned in *result unless that is NULL
+LoxResult loxCall(LoxVM* vm, int global, int argCount, const LoxValue* args,
+                  LoxValue* result);
+
+// values. strings and the results of loxCall() stay valid until the next
+// loxCall() or loxLoad() has started, since the vm's gc does not know
+// where else the host keeps them; put one in a global to keep it longer
+LoxValue loxNil(void);
+LoxValue loxBool(bool boolean);
+LoxValue loxNumber(double number);
+// copies length bytes from chars
+LoxValue loxString(LoxVM* vm, const char* chars, size_t length);
+// takes over chars without copying: it has to come from malloc(), with
+// room for length + 1 bytes, and the vm frees it
+LoxValue loxTakeString(LoxVM* vm, char* chars, size_t length);
+
+bool loxIsNil(LoxValue value);
+bool loxIsBool(LoxValue value);
+bool loxIsNumber(LoxValue value);
+bool loxIsString(LoxValue value);
+bool loxAsBool(LoxValue value);
+double loxAsNumber(LoxValue value);
+// the string's own '\0' terminated characters, not a copy, or NULL if the
+// value is no string; *length gets its length unless length is NULL
+const char* loxAsString(LoxValue value, size_t* length);
+
+// a host function lox code can call. it gets its arguments as the vm has
+// them, valid until it returns, and either stores its result in *result
+// (nil otherwise) and returns true, or calls loxError() and returns false.
+// it may make values but must not call loxCall(), loxLoad(), loxDefine()
+// or loxSetGlobal()
+typedef bool (*LoxHostFn)(LoxVM* vm, int argCount, const LoxValue* args,
+                          LoxValue* result, void* userData);
+
+// defines a global called name that calls function with userData; arity
+// is the number of arguments every call has to pass, -1 for any number
+void loxDefine(LoxVM* vm, const char* name, LoxHostFn function, int arity,
+               void* userData);
+// the runtime error a host function that returns false reports; message
+// has to stay valid, like a string literal does
+void loxError(LoxVM* vm, const char* message);
+
+#endif
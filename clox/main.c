@@ -3,11 +3,17 @@
 #include <string.h>
 
 #include "common.h"
+#include "bytecode.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "isolate.h"
+#include "profile.h"
+#include "stats.h"
+#include "tracelog.h"
 #include "vm.h"
 
-static void repl() {
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -17,7 +23,7 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
@@ -62,27 +68,155 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+static bool hasSuffix(const char* path, const char* suffix) {
+    size_t length = strlen(path);
+    size_t suffixLength = strlen(suffix);
+    return length >= suffixLength &&
+           strcmp(path + length - suffixLength, suffix) == 0;
+}
+
+// a .loxc file runs as it is, a script is compiled, or found compiled in
+// the cache unless that is off
+static InterpretResult runFile(VM* vm, const char* path, bool cache) {
+    ObjFunction* function;
+    if (hasSuffix(path, ".loxc")) {
+        function = loadBytecodeFile(vm, path);
+    } else {
+        char* source = readFile(path);
+        function = cache ? compileCached(vm, source) : compile(vm, source);
+        free(source);
+    }
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(vm, function);
+}
+
+// lox -c script.lox writes script.loxc
+static int compileFile(VM* vm, const char* path) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    size_t length = strlen(path);
+    char* output = (char*)malloc(length + 2);
+    if (output == NULL) exit(74);
+    memcpy(output, path, length);
+    if (hasSuffix(path, ".lox")) {
+        output[length++] = 'c';
+    } else {
+        memcpy(output + length, ".loxc", 6);
+        length += 5;
+    }
+    output[length] = '\0';
+
+    bool written = writeBytecodeFile(vm, source, output);
+    free(output);
     free(source);
+    freeVM(vm);
+    return written ? 0 : 65;
+}
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+static void usage() {
+    fprintf(stderr, "Usage: clox [--register] [--jit] [--trace-jit] [--dump-traces]\n"
+                    "            [--no-quicken] [--stack-limit values] [--workers n]\n"
+                    "            [--profile out] [--trace out] [--gc-stats]\n"
+                    "            [--no-cache] [path]\n"
+                    "       clox --decode-trace trace path\n"
+                    "       clox -c path\n");
+    exit(64);
 }
 
 int main(int argc, const char* argv[]) {
-    initVM();
+    VM vm;
+    initVM(&vm);
+
+    const char* path = NULL;
+    const char* profilePath = NULL;
+    const char* tracePath = NULL;
+    const char* decodePath = NULL;
+    bool gcStats = false;
+    bool cache = true;
+    bool compileOnly = false;
+#ifdef DEBUG_STATS
+    const char* statsPath = NULL;
+#endif
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--register") == 0) {
+            vm.registerMode = true;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            vm.jitMode = true;
+        } else if (strcmp(argv[i], "--no-quicken") == 0) {
+            vm.quicken = false;
+        } else if (strcmp(argv[i], "--trace-jit") == 0) {
+            vm.traceMode = true;
+        } else if (strcmp(argv[i], "--dump-traces") == 0) {
+            vm.traceMode = true;
+            vm.dumpTraces = true;
+        } else if (strcmp(argv[i], "--stack-limit") == 0 && i + 1 < argc) {
+            vm.stackLimit = atoi(argv[++i]);
+            if (vm.stackLimit < STACK_INITIAL) usage();
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            int count = atoi(argv[++i]);
+            if (count < 1) usage();
+            setWorkerCount(count);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (strcmp(argv[i], "--decode-trace") == 0 && i + 1 < argc) {
+            decodePath = argv[++i];
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            gcStats = true;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            cache = false;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            compileOnly = true;
+#ifdef DEBUG_STATS
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            statsPath = argv[++i];
+#endif
+        } else if (argv[i][0] == '-' || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    if (compileOnly) {
+        if (path == NULL) usage();
+        return compileFile(&vm, path);
+    }
+    if (decodePath != NULL) {
+        // the script the trace was written by, to compile again
+        if (path == NULL) usage();
+        char* source = readFile(path);
+        bool decoded = decodeTraceLog(&vm, decodePath, source);
+        free(source);
+        freeVM(&vm);
+        return decoded ? 0 : 65;
+    }
+    if (tracePath != NULL && !openTraceLog(&vm, tracePath)) {
+        fprintf(stderr, "Could not open file \"%s\".\n", tracePath);
+        exit(74);
+    }
+    if (profilePath != NULL && !startProfiler(&vm)) {
+        fprintf(stderr, "Could not start the profiler.\n");
+        exit(70);
+    }
+
+    InterpretResult result = INTERPRET_OK;
+    if (path == NULL) {
+        repl(&vm);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        result = runFile(&vm, path, cache);
     }
 
-    freeVM();
+    // a run that failed still has its profile written
+    if (profilePath != NULL) stopProfiler(&vm, profilePath);
+    // for utils/bench.py, on stderr so the script's output stays the same
+    if (gcStats) fprintf(stderr, "gc: %zu collections\n", vm.gcCount);
+#ifdef DEBUG_STATS
+    writeStats(&vm, statsPath);
+#endif
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+
+    freeVM(&vm);
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,13 @@
 #include <stdlib.h>
 
+#include "bytecode.h"
 #include "compiler.h"
+#include "event.h"
+#include "fiber.h"
+#include "isolate.h"
+#include "jit.h"
+#include "profile.h"
+#include "trace.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -11,7 +18,7 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void markObject(Obj* object) {
+void markObject(VM* vm, Obj* object) {
     if (object == NULL) return;
     if (object->isMarked) return;
 #ifdef DEBUG_LOG_GC
@@ -22,29 +29,29 @@ void markObject(Obj* object) {
 
     object->isMarked = true;
 
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
 
-        if (vm.grayStack == NULL) exit(1);
+        if (vm->grayStack == NULL) exit(1);
     }
 
-    vm.grayStack[vm.grayCount++] = object;
+    vm->grayStack[vm->grayCount++] = object;
 }
 
-void markValue(Value value) {
-  if (IS_OBJ(value)) markObject(AS_OBJ(value));
+void markValue(VM* vm, Value value) {
+  if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
 }
 
-static void markArray(ValueArray* array) {
+static void markArray(VM* vm, ValueArray* array) {
     for (int i = 0; i < array->count; i++) {
-        markValue(array->values[i]);
+        markValue(vm, array->values[i]);
     }
 }
 
 // if the memory is referenced by something else mark it black 
 // and omit it from gc clean up 
-static void blackenObject(Obj* object) {
+static void blackenObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
@@ -53,123 +60,167 @@ static void blackenObject(Obj* object) {
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
-            markValue(bound->receiver);
-            markObject((Obj*)bound->method);
+            markValue(vm, bound->receiver);
+            markObject(vm, (Obj*)bound->method);
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            markObject((Obj*)klass->name);
-            markTable(&klass->methods);
+            markObject(vm, (Obj*)klass->name);
+            markTable(vm, &klass->methods);
+            markObject(vm, (Obj*)klass->rootShape);
             break;
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
-            markObject((Obj*)closure->function);
+            markObject(vm, (Obj*)closure->function);
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj*)closure->upvalues[i]);
+                markObject(vm, (Obj*)closure->upvalues[i]);
             }
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
-            markObject((Obj*)function->name);
-            markArray(&function->chunk.constants);
+            markObject(vm, (Obj*)function->name);
+            markArray(vm, &function->chunk.constants);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject(vm, (Obj*)instance->klass);
+            if (instance->shape != NULL) {
+                markObject(vm, (Obj*)instance->shape);
+                for (int i = 0; i < instance->shape->fieldCount; i++) {
+                    markValue(vm, instance->fields[i]);
+                }
+            } else {
+                markTable(vm, &instance->dictionary);
+            }
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markObject(vm, (Obj*)shape->parent);
+            markObject(vm, (Obj*)shape->name);
+            markTable(vm, &shape->transitions);
             break;
         }
+        case OBJ_FIBER:
+            markFiber(vm, (ObjFiber*)object);
+            break;
         case OBJ_UPVALUE: 
-            markValue(((ObjUpvalue*)object)->closed);
+            markValue(vm, ((ObjUpvalue*)object)->closed);
             break;
+        case OBJ_CHANNEL:
         case OBJ_NATIVE:
         case OBJ_STRING:
             break;
     }
 }
 
-static void freeObject(Obj* object) {
+static void freeObject(VM* vm, Obj* object) {
     switch (object->type) {
         case OBJ_BOUND_METHOD:
-            FREE(ObjBoundMethod, object);
+            FREE(vm, ObjBoundMethod, object);
+            break;
+        case OBJ_CHANNEL:
+            releaseChannel(((ObjChannel*)object)->channel);
+            FREE(vm, ObjChannel, object);
             break;
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeTable(vm, &klass->methods);
+            FREE(vm, ObjClass, object);
             break;
         } 
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
+            FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+            FREE(vm, ObjClosure, object);
             break;
         }
+        case OBJ_FIBER:
+            freeFiber(vm, (ObjFiber*)object);
+            FREE(vm, ObjFiber, object);
+            break;
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
             // have to free chunk since functions own their own chunk
-            freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            freeChunk(vm, &function->chunk);
+            freeJitCode(function->jit);
+            FREE(vm, ObjFunction, object);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+            freeTable(vm, &instance->dictionary);
+            FREE(vm, ObjInstance, object);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(vm, &shape->transitions);
+            FREE(vm, ObjShape, object);
             break;
         }
         case OBJ_NATIVE:
-            FREE(ObjNative, object);
+            FREE(vm, ObjNative, object);
             break;
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            FREE_ARRAY(vm, char, string->chars, string->length + 1);
+            FREE(vm, ObjString, object);
             break;
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
+            FREE(vm, ObjUpvalue, object);
             break;
         }
     }
 }
 
 // marks all of the reachable variables and constants for gc to ignore
-static void markRoots() {
+static void markRoots(VM* vm) {
     // mark all values in stack
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-        markValue(*slot);
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(vm, *slot);
     }
 
     // mark all values in callFrames
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj*)vm.frames[i].closure);
+    for (int i = 0; i < vm->frameCount; i++) {
+        markObject(vm, (Obj*)vm->frames[i].closure);
     }
 
     // mark all upvalues in upvalue list that the VM can reach
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-        markObject((Obj*)upvalue);
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        markObject(vm, (Obj*)upvalue);
     }
 
-    markTable(&vm.globals);
-    markCompilerRoots();
-    markObject((Obj*)vm.initString);
+    markTable(vm, &vm->globalSlots);
+    markArray(vm, &vm->globalValues);
+    markArray(vm, &vm->globalNames);
+    markArray(vm, &vm->hostValues);
+    markCompilerRoots(vm);
+    markDecoderRoots(vm);
+    markBytecodeRoots(vm);
+    markEventRoots(vm);
+    markProfileRoots(vm);
+    markObject(vm, (Obj*)vm->fiber);
+    markTraces(vm);
+    markObject(vm, (Obj*)vm->initString);
 
 }
 
-static void traceReferences() {
-    while (vm.grayCount > 0) {
-        Obj* object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+static void traceReferences(VM* vm) {
+    while (vm->grayCount > 0) {
+        Obj* object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
     }
 }
 
-static void sweep() {
+static void sweep(VM* vm) {
     Obj* previous = NULL;
-    Obj* object = vm.objects;
+    Obj* object = vm->objects;
     while (object != NULL) {
         if (object->isMarked) {
             // set black object back to white
@@ -182,55 +233,59 @@ static void sweep() {
         if (previous != NULL) {
             previous->next = object;
         } else {
-            vm.objects = object;
+            vm->objects = object;
         }
 
-        freeObject(unreached);
+        freeObject(vm, unreached);
         }
     }
 }
 
-void collectGarbage() {
+void collectGarbage(VM* vm) {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
+    size_t before = vm->bytesAllocated;
 #endif
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    markRoots(vm);
+    traceReferences(vm);
+    tableRemoveWhite(&vm->strings);
+    closeDeadFibers(vm);
+    sweep(vm);
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm->gcCount++;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
     printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-        before - vm.bytesAllocated, before, vm.bytesAllocated,
-        vm.nextGC);
+        before - vm->bytesAllocated, before, vm->bytesAllocated,
+        vm->nextGC);
 #endif
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+void freeObjects(VM* vm) {
+    Obj* object = vm->objects;
     while (object != NULL) {
         Obj* next = object->next;
-        freeObject(object);
+        freeObject(vm, object);
         object = next;
     }
 
-    free(vm.grayStack);
+    free(vm->grayStack);
 }
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+    vm->bytesAllocated += newSize - oldSize;
+    // only growing collects, sweep frees through here as well
     if (newSize > oldSize) {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+    collectGarbage(vm);
 #endif
-    }
 
-    if (vm.bytesAllocated > vm.nextGC) {
-        collectGarbage();
+        if (vm->bytesAllocated > vm->nextGC) {
+            collectGarbage(vm);
+        }
     }
 
     if (newSize == 0) {
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "ngram.h"
+
+/*
+Opcode sequence profiler
+
+Counts how often every sequence of 2 to NGRAM_MAX consecutively executed
+opcodes shows up over a whole run. The most frequent ones are the
+candidates for superinstructions in peephole.c. Only compiled in when
+DEBUG_PROFILE_NGRAMS is defined.
+*/
+
+#define NGRAM_TABLE_SIZE 4096
+#define NGRAM_REPORT_COUNT 15
+
+typedef struct {
+    // length in the top byte and then one opcode per byte, never 0
+    uint32_t key;
+    uint64_t count;
+} Ngram;
+
+static Ngram ngrams[NGRAM_TABLE_SIZE];
+static uint8_t history[NGRAM_MAX];
+static int historyCount = 0;
+
+static void countNgram(uint32_t key) {
+    // Knuth's multiplicative hash then linear probing like table.c
+    uint32_t index = (key * 2654435761u) & (NGRAM_TABLE_SIZE - 1);
+    for (int probes = 0; probes < NGRAM_TABLE_SIZE; probes++) {
+        Ngram* ngram = &ngrams[index];
+        if (ngram->key == key) {
+            ngram->count++;
+            return;
+        }
+        if (ngram->key == 0) {
+            ngram->key = key;
+            ngram->count = 1;
+            return;
+        }
+        index = (index + 1) & (NGRAM_TABLE_SIZE - 1);
+    }
+    // table full, the sequence just goes uncounted
+}
+
+void profileInstruction(uint8_t instruction) {
+    // shift the newest opcode into the end of the history window
+    if (historyCount == NGRAM_MAX) {
+        for (int i = 1; i < NGRAM_MAX; i++) history[i - 1] = history[i];
+        historyCount--;
+    }
+    history[historyCount++] = instruction;
+
+    // count every sequence ending at this instruction
+    for (int length = 2; length <= historyCount; length++) {
+        uint32_t key = (uint32_t)length << 24;
+        for (int i = historyCount - length; i < historyCount; i++) {
+            key = (key & 0xff000000) | ((key << 8) & 0x00ffffff) | history[i];
+        }
+        countNgram(key);
+    }
+}
+
+static int compareNgrams(const void* a, const void* b) {
+    uint64_t countA = ((const Ngram*)a)->count;
+    uint64_t countB = ((const Ngram*)b)->count;
+    if (countA == countB) return 0;
+    return countA < countB ? 1 : -1;
+}
+
+static void printNgram(Ngram* ngram, uint64_t total) {
+    int length = ngram->key >> 24;
+    fprintf(stderr, "%12llu %5.1f%%  ", (unsigned long long)ngram->count,
+            100.0 * ngram->count / total);
+    for (int i = length - 1; i >= 0; i--) {
+        fprintf(stderr, "%s%s", opcodeName((ngram->key >> (i * 8)) & 0xff),
+                i > 0 ? "; " : "\n");
+    }
+}
+
+void printNgramProfile() {
+    Ngram sorted[NGRAM_TABLE_SIZE];
+    for (int length = 2; length <= NGRAM_MAX; length++) {
+        int count = 0;
+        uint64_t total = 0;
+        for (int i = 0; i < NGRAM_TABLE_SIZE; i++) {
+            if (ngrams[i].key >> 24 != (uint32_t)length) continue;
+            sorted[count++] = ngrams[i];
+            total += ngrams[i].count;
+        }
+        if (count == 0) continue;
+
+        qsort(sorted, count, sizeof(Ngram), compareNgrams);
+        fprintf(stderr, "== most frequent %d-grams ==\n", length);
+        for (int i = 0; i < count && i < NGRAM_REPORT_COUNT; i++) {
+            printNgram(&sorted[i], total);
+        }
+    }
+}
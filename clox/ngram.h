@@ -0,0 +1,12 @@
+#ifndef clox_ngram_h
+#define clox_ngram_h
+
+#include "common.h"
+
+// longest opcode sequence the profiler counts
+#define NGRAM_MAX 3
+
+void profileInstruction(uint8_t instruction);
+void printNgramProfile();
+
+#endif
@@ -7,17 +7,17 @@
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
 // allocates an object of given size onto the heap 
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+    Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
     object->type = type;
     object->isMarked = false;
 
-    object->next = vm.objects; 
-    vm.objects = object;
+    object->next = vm->objects; 
+    vm->objects = object;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -26,71 +26,206 @@ static Obj* allocateObject(size_t size, ObjType type) {
     return object;
 }
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
-    ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method) {
+    ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
     bound->method = method;
     return bound;
 }
 
-ObjClass* newClass(ObjString* name) {
-    ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+static ObjShape* newShape(VM* vm, ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+    initTable(&shape->transitions);
+    return shape;
+}
+
+ObjChannel* newChannel(VM* vm, struct Channel* channel) {
+    ObjChannel* object = ALLOCATE_OBJ(vm, ObjChannel, OBJ_CHANNEL);
+    object->channel = channel;
+    return object;
+}
+
+ObjClass* newClass(VM* vm, ObjString* name) {
+    ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
     klass->name = name; 
+    klass->rootShape = NULL;
     initTable(&klass->methods);
+    klass->version = vm->nextClassVersion++;
+
+    // keep the class reachable while its root shape is allocated
+    push(vm, OBJ_VAL(klass));
+    klass->rootShape = newShape(vm, NULL, NULL);
+    pop(vm);
     return klass;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
+ObjFiber* newFiber(VM* vm, ObjClosure* closure) {
+    ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->state = closure == NULL ? FIBER_RUNNING : FIBER_NEW;
+    fiber->closure = closure;
+    fiber->caller = NULL;
+    fiber->nextFiber = NULL;
+    // the stack is only made once the fiber starts
+    fiber->stack = NULL;
+    fiber->stackEnd = NULL;
+    fiber->stackLow = NULL;
+    fiber->stackTop = NULL;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->openUpvalues = NULL;
+    return fiber;
+}
+
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
     // allocate array of upvalues and initialise all to null
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+    ObjUpvalue** upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalueCount);
     for (int i = 0; i < function->upvalueCount; i++) {
         upvalues[i] = NULL;
     }
 
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;    
     return closure;
 }
 
-ObjFunction* newFunction() {
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* newFunction(VM* vm) {
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 1;
     function->name = NULL;
+    function->callCount = 0;
+    function->id = vm->nextFunctionId++;
+#ifdef DEBUG_STATS
+    function->calls = 0;
+#endif
+    function->jit = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjInstance* newInstance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+    ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = klass->rootShape;
+    instance->fields = NULL;
+    instance->fieldCapacity = 0;
+    initTable(&instance->dictionary);
     return instance;
 }
 
-ObjNative* newNative(NativeFn function) {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+// slot of the field name in instances with this shape, -1 if it has none
+// shapes stay small so walking up the chain beats hashing the name
+int shapeSlot(ObjShape* shape, ObjString* name) {
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->name == name) return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+// the shape after adding field name, or NULL if the instance should
+// switch to dictionary mode instead
+ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+    if (shape->fieldCount == SHAPE_MAX_FIELDS ||
+        shape->transitions.count == SHAPE_MAX_TRANSITIONS) {
+        return NULL;
+    }
+
+    ObjShape* child = newShape(vm, shape, name);
+    // ensures the new shape is safe from the gc while the table grows
+    push(vm, OBJ_VAL(child));
+    tableSet(vm, &shape->transitions, name, OBJ_VAL(child));
+    pop(vm);
+    return child;
+}
+
+// moves every field into the dictionary table and drops the shape
+static void makeDictionary(VM* vm, ObjInstance* instance) {
+    for (ObjShape* shape = instance->shape; shape->parent != NULL;
+         shape = shape->parent) {
+        tableSet(vm, &instance->dictionary, shape->name,
+                 instance->fields[shape->fieldCount - 1]);
+    }
+
+    FREE_ARRAY(vm, Value, instance->fields, instance->fieldCapacity);
+    instance->fields = NULL;
+    instance->fieldCapacity = 0;
+    instance->shape = NULL;
+}
+
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+    if (instance->shape == NULL) {
+        return tableGet(&instance->dictionary, name, value);
+    }
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot == -1) return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
+// the instance and value have to be reachable by the gc, adding a field
+// can allocate a new shape or grow the field array
+void instanceSetField(VM* vm, ObjInstance* instance, ObjString* name, Value value) {
+    if (instance->shape != NULL) {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot != -1) {
+            instance->fields[slot] = value;
+            return;
+        }
+
+        ObjShape* next = shapeTransition(vm, instance->shape, name);
+        if (next != NULL) {
+            if (instance->fieldCapacity < next->fieldCount) {
+                int oldCapacity = instance->fieldCapacity;
+                instance->fieldCapacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+                instance->fields = GROW_ARRAY(vm, Value, instance->fields,
+                    oldCapacity, instance->fieldCapacity);
+            }
+            instance->fields[next->fieldCount - 1] = value;
+            instance->shape = next;
+            return;
+        }
+
+        makeDictionary(vm, instance);
+    }
+
+    tableSet(vm, &instance->dictionary, name, value);
+}
+
+ObjNative* newNative(VM* vm, NativeFn function, int arity, uint8_t flags) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
+    native->flags = flags;
+    native->host = NULL;
+    native->userData = NULL;
     return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString* allocateString(VM* vm, char* chars, int length, uint32_t hash) {
+    ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->length = length; 
     string->chars = chars;
     string->hash = hash;
 
     // ensures that string is safe from being removed by gc for this short period
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
+    push(vm, OBJ_VAL(string));
+    tableSet(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
     return string;
 }
 
 // FVV-1a hashing algorithm
-static uint32_t hashString(const char* key, int length) {
+uint32_t hashString(const char* key, int length) {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
         hash ^= (uint32_t)key[i];
@@ -99,24 +234,24 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
     // when copying string into new LoxString, we look up 
         // in string table first
     // if we find it, instead of copying, we just return reference to that string
-    ObjString* interned = tableFindString(&vm.strings, chars, length, 
+    ObjString* interned = tableFindString(&vm->strings, chars, length, 
     hash);
     if (interned != NULL) return interned;
-    char* heapChars = ALLOCATE(char, length + 1);
+    char* heapChars = ALLOCATE(vm, char, length + 1);
     // copy chars to heapChars of 'length' bytes
     memcpy(heapChars, chars, length);
     // allocate terminal bit to end of string memory
     heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return allocateString(vm, heapChars, length, hash);
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-    ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
@@ -135,9 +270,15 @@ void printObject(Value value) {
         case OBJ_BOUND_METHOD:
             printFunction(AS_BOUND_METHOD(value)->method->function);
             break;
+        case OBJ_CHANNEL:
+            printf("<channel>");
+            break;
         case OBJ_CLASS:
             printf("%s", AS_CLASS(value)->name->chars);
             break;
+        case OBJ_FIBER:
+            printf("<fiber>");
+            break;
         case OBJ_CLOSURE: 
             printFunction(AS_CLOSURE(value)->function);
             break;
@@ -150,6 +291,9 @@ void printObject(Value value) {
         case OBJ_NATIVE: 
             printf("<native fn>");
             break;
+        case OBJ_SHAPE:
+            printf("shape");
+            break;
         case OBJ_STRING: 
             printf("%s", AS_CSTRING(value));
             break;
@@ -159,13 +303,13 @@ void printObject(Value value) {
     }
 }
 
-ObjString* takeString(char* chars, int length) {
+ObjString* takeString(VM* vm, char* chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
+    ObjString* interned = tableFindString(&vm->strings, chars, length,
     hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(vm, char, chars, length + 1);
         return interned;
     }
-    return allocateString(chars, length, hash);
+    return allocateString(vm, chars, length, hash);
 }
\ No newline at end of file
@@ -7,11 +7,14 @@
 #include "table.h"
 
 #define IS_BOUND_METHOD(value)  isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CHANNEL(value)       isObjType(value, OBJ_CHANNEL)
 #define IS_CLASS(value)         isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)       isObjType(value, OBJ_CLOSURE)
+#define IS_FIBER(value)         isObjType(value, OBJ_FIBER)
 #define IS_FUNCTION(value)      isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)      isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)        isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value)         isObjType(value, OBJ_SHAPE)
 #define OBJ_TYPE(value)         (AS_OBJ(value)->type)
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
 
@@ -19,24 +22,28 @@
 // These following two macros take a Value that is expected to contain a pointer to a 
 //valid ObjString on the heap. The first one returns the ObjString* pointer. 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_CHANNEL(value)      ((ObjChannel*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
 //The second one steps through that to return the character array itself
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
-// extracts the c functin pointer from a value representing a native function
-#define AS_NATIVE(value) \
-    (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
 typedef enum {
     OBJ_BOUND_METHOD,
+    OBJ_CHANNEL,
     OBJ_CLASS, 
     OBJ_CLOSURE,
+    OBJ_FIBER,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
@@ -52,15 +59,43 @@ typedef struct {
     Obj obj; 
     int arity; // number of parameters the function expects
     int upvalueCount;
+    // most stack slots a call uses from its callee slot up, reserved up front
+    int maxSlots;
     Chunk chunk;
     ObjString* name;
+    // calls so far, the jit compiles the function once it gets hot
+    int callCount;
+    // order the vm made it in, which names it in --trace files
+    uint32_t id;
+#ifdef DEBUG_STATS
+    // every call, whatever mode, see stats.c
+    uint64_t calls;
+#endif
+    // machine code from the jit, NULL while the function is interpreted
+    struct JitCode* jit;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// a native leaves its result in args[-1], the callee's slot, and returns
+// true; on an error it sets vm->nativeError and returns false instead
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
+
+// the result depends on nothing but the arguments and the call changes
+// nothing, so a failed call can simply be made again
+#define NATIVE_PURE  1
+// never allocates, so it can run while values only live in registers or
+// machine code spill slots the gc does not know about
+#define NATIVE_NO_GC 2
 
 typedef struct {
     Obj obj; 
     NativeFn function;
+    // arguments every call has to pass, -1 for any number
+    int arity;
+    uint8_t flags;
+    // host callbacks from lox.h all run through one function, which finds
+    // the host's function and its data here
+    void (*host)(void);
+    void* userData;
 } ObjNative;
 
 struct ObjString {
@@ -87,16 +122,44 @@ typedef struct {
     int upvalueCount;
 } ObjClosure;
 
+// instances with more fields than this fall back to dictionary mode
+#define SHAPE_MAX_FIELDS 32
+// a shape with this many different fields added after it is being used
+// like a dictionary, instances adding yet another one fall back too
+#define SHAPE_MAX_TRANSITIONS 16
+
+// hidden class describing which field lives in which slot of an instance
+// every class has an empty root shape and adding a field moves the
+// instance along to the child shape for that name, so instances that
+// get the same fields in the same order all end up sharing one shape
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;  // NULL for the root shape of a class
+    ObjString* name;          // field this shape added, in slot fieldCount - 1
+    int fieldCount;
+    Table transitions;        // field name -> child shape
+} ObjShape;
+
 typedef struct {
     Obj obj; 
     ObjString* name; 
     Table methods;
+    ObjShape* rootShape;
+    // unique per class and replaced whenever the methods change
+    // so inline caches filled for the old methods stop matching
+    uint32_t version;
 } ObjClass;
 
 typedef struct {
     Obj obj;
     ObjClass* klass; 
-    Table fields; 
+    // NULL once the instance fell back to dictionary mode
+    ObjShape* shape;
+    // one slot per field of the shape
+    Value* fields;
+    int fieldCapacity;
+    // only used in dictionary mode
+    Table dictionary;
 } ObjInstance;
 
 typedef struct {
@@ -105,20 +168,68 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
-
-ObjClass* newClass(ObjString* name);
-
-ObjClosure* newClosure(ObjFunction* function);
-
-ObjFunction* newFunction();
-ObjInstance* newInstance(ObjClass* klass);
-
-ObjNative* newNative(NativeFn function);
+// this heap's handle on a channel shared between isolates, see isolate.c
+typedef struct {
+    Obj obj;
+    struct Channel* channel;
+} ObjChannel;
 
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
-ObjUpvalue* newUpvalue(Value* slot);
+typedef enum {
+    FIBER_NEW,
+    FIBER_SUSPENDED,
+    // the one the vm runs, or one waiting in resume() for it to yield
+    FIBER_RUNNING,
+    FIBER_DONE,
+} FiberState;
+
+// a stack of values and call frames of its own, see fiber.c. the running
+// fiber's stack lives in the vm's fields, the ones here are only up to
+// date while it is not running
+typedef struct ObjFiber {
+    Obj obj;
+    FiberState state;
+    // what the first resume() calls
+    ObjClosure* closure;
+    // the fiber that resumed this one, while it runs
+    struct ObjFiber* caller;
+    // next started fiber, in vm->fibers
+    struct ObjFiber* nextFiber;
+
+    Value* stack;
+    Value* stackEnd;
+    Value* stackLow;
+    Value* stackTop;
+    struct CallFrame* frames;
+    int frameCount;
+    ObjUpvalue* openUpvalues;
+} ObjFiber;
+
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method);
+
+// takes over a reference on the channel, released when it is collected
+ObjChannel* newChannel(VM* vm, struct Channel* channel);
+
+ObjClass* newClass(VM* vm, ObjString* name);
+
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+
+// closure is NULL for the script's own fiber, which starts out running
+ObjFiber* newFiber(VM* vm, ObjClosure* closure);
+
+ObjFunction* newFunction(VM* vm);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+int shapeSlot(ObjShape* shape, ObjString* name);
+ObjShape* shapeTransition(VM* vm, ObjShape* shape, ObjString* name);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+void instanceSetField(VM* vm, ObjInstance* instance, ObjString* name, Value value);
+
+ObjNative* newNative(VM* vm, NativeFn function, int arity, uint8_t flags);
+
+// FNV-1a, what the intern table and every Table of strings key on
+uint32_t hashString(const char* key, int length);
+ObjString* takeString(VM* vm, char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
 
 // we put this outside of the macro for the following reason 
     // macros evaluate the expression for each insance it is called 
@@ -0,0 +1,307 @@
+#include <stdlib.h>
+
+#include "trace.h"
+
+/*
+One forward pass folds constants, drops guards whose outcome is already
+known and forwards loads from earlier loads and stores, followed by a
+backward pass that turns instructions nobody uses into NOPs. Removed
+instructions keep their slot in trace->ir, so refs stay valid and only
+have to be substituted.
+*/
+
+// which of a, b and c hold refs
+#define USES_A 1
+#define USES_B 2
+#define USES_C 4
+
+static const uint8_t operands[] = {
+    [IR_NOP] = 0,
+    [IR_CONST] = 0,
+    [IR_SLOAD] = 0,
+    [IR_GLOAD] = 0,
+    [IR_GSTORE] = USES_B,
+    [IR_FLOAD] = USES_A,
+    [IR_FSTORE] = USES_A | USES_C,
+    [IR_GUARD_NUM] = USES_A,
+    [IR_GUARD_TRUTHY] = USES_A,
+    [IR_GUARD_FALSEY] = USES_A,
+    [IR_GUARD_VALUE] = USES_A,
+    [IR_GUARD_SHAPE] = USES_A,
+    [IR_GUARD_CLASS] = USES_A,
+    [IR_ADD] = USES_A | USES_B,
+    [IR_SUB] = USES_A | USES_B,
+    [IR_MUL] = USES_A | USES_B,
+    [IR_DIV] = USES_A | USES_B,
+    [IR_NEG] = USES_A,
+    [IR_LT] = USES_A | USES_B,
+    [IR_GT] = USES_A | USES_B,
+    [IR_EQ] = USES_A | USES_B,
+    [IR_NE] = USES_A | USES_B,
+    [IR_NOT] = USES_A,
+    [IR_CALLN] = USES_A | USES_B,
+    [IR_LOOP] = 0,
+};
+
+static uint8_t usesOf(IRIns* in) {
+    // a native call only reads a and b when it has that many arguments
+    if (in->op == IR_CALLN) return operands[IR_CALLN] & ((1 << in->c) - 1);
+    return operands[in->op];
+}
+
+// instructions without side effects that can go when their result is unused
+static bool isPure(uint8_t op) {
+    switch (op) {
+        case IR_CONST: case IR_SLOAD: case IR_GLOAD: case IR_FLOAD:
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV: case IR_NEG:
+        case IR_LT: case IR_GT: case IR_EQ: case IR_NE: case IR_NOT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// a value the optimizer knows to be in a global or a field
+typedef struct {
+    uint8_t op;   // IR_GLOAD or IR_FLOAD
+    IRRef object; // instance of a field
+    IRRef index;  // global slot or field index
+    IRRef value;
+} Known;
+
+typedef struct {
+    VM* vm;
+    Trace* trace;
+    IRRef subst[TRACE_MAX_IR];
+    uint8_t types[TRACE_MAX_IR];   // what each ref is known to hold
+    Known known[TRACE_MAX_IR];
+    int knownCount;
+} Optimizer;
+
+static IRIns* ins(Optimizer* opt, IRRef ref) {
+    return &opt->trace->ir[ref];
+}
+
+static bool isConst(Optimizer* opt, IRRef ref) {
+    return ins(opt, ref)->op == IR_CONST;
+}
+
+static bool isConstNumber(Optimizer* opt, IRRef ref) {
+    return isConst(opt, ref) && IS_NUMBER(ins(opt, ref)->value);
+}
+
+static void makeConst(IRIns* target, Value value) {
+    target->op = IR_CONST;
+    target->type = IS_NUMBER(value) ? IRT_NUM
+                 : IS_BOOL(value) ? IRT_BOOL : IRT_ANY;
+    target->value = value;
+}
+
+static void removeIns(Optimizer* opt, IRRef ref, IRRef replacement) {
+    ins(opt, ref)->op = IR_NOP;
+    opt->subst[ref] = replacement;
+}
+
+static Known* findKnown(Optimizer* opt, uint8_t op, IRRef object, IRRef index) {
+    for (int i = 0; i < opt->knownCount; i++) {
+        Known* known = &opt->known[i];
+        if (known->op == op && known->object == object &&
+            known->index == index) {
+            return known;
+        }
+    }
+    return NULL;
+}
+
+static void setKnown(Optimizer* opt, uint8_t op, IRRef object, IRRef index,
+                     IRRef value) {
+    Known* known = findKnown(opt, op, object, index);
+    if (known == NULL) known = &opt->known[opt->knownCount++];
+    known->op = op;
+    known->object = object;
+    known->index = index;
+    known->value = value;
+}
+
+// a store to a field of one instance may be a store to the same field of
+// any other instance ref, those are no longer known
+static void forgetFields(Optimizer* opt, IRRef index) {
+    for (int i = 0; i < opt->knownCount; i++) {
+        if (opt->known[i].op == IR_FLOAD && opt->known[i].index == index) {
+            opt->known[i] = opt->known[--opt->knownCount];
+            i--;
+        }
+    }
+}
+
+// an earlier guard of the same kind on the same ref with the same value
+static bool hasGuard(Optimizer* opt, IRRef guard) {
+    IRIns* in = ins(opt, guard);
+    for (IRRef i = 0; i < guard; i++) {
+        IRIns* other = ins(opt, i);
+        if (other->op == in->op && other->a == in->a &&
+            valuesEqual(other->value, in->value)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void foldArithmetic(Optimizer* opt, IRRef ref) {
+    IRIns* in = ins(opt, ref);
+    if (!isConstNumber(opt, in->a) || !isConstNumber(opt, in->b)) return;
+    double a = AS_NUMBER(ins(opt, in->a)->value);
+    double b = AS_NUMBER(ins(opt, in->b)->value);
+    switch (in->op) {
+        case IR_ADD: makeConst(in, NUMBER_VAL(a + b)); break;
+        case IR_SUB: makeConst(in, NUMBER_VAL(a - b)); break;
+        case IR_MUL: makeConst(in, NUMBER_VAL(a * b)); break;
+        case IR_DIV: makeConst(in, NUMBER_VAL(a / b)); break;
+        case IR_LT:  makeConst(in, BOOL_VAL(a < b)); break;
+        case IR_GT:  makeConst(in, BOOL_VAL(a > b)); break;
+    }
+}
+
+// a pure native on constants gives the same result every iteration; a
+// call that fails stays in the trace to take its exit
+static void foldNative(Optimizer* opt, IRRef ref) {
+    IRIns* in = ins(opt, ref);
+    Value args[TRACE_MAX_NATIVE_ARGS + 1];
+    for (int i = 0; i < in->c; i++) {
+        IRRef arg = i == 0 ? in->a : in->b;
+        if (!isConst(opt, arg)) return;
+        args[i + 1] = ins(opt, arg)->value;
+    }
+    if (AS_NATIVE(in->value)->function(opt->vm, in->c, args + 1)) {
+        makeConst(in, args[0]);
+    }
+}
+
+static void optimizeIns(Optimizer* opt, IRRef ref) {
+    IRIns* in = ins(opt, ref);
+    uint8_t uses = usesOf(in);
+    if (uses & USES_A) in->a = opt->subst[in->a];
+    if (uses & USES_B) in->b = opt->subst[in->b];
+    if (uses & USES_C) in->c = opt->subst[in->c];
+
+    switch (in->op) {
+        case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV:
+        case IR_LT: case IR_GT:
+            foldArithmetic(opt, ref);
+            break;
+        case IR_NEG:
+            if (isConstNumber(opt, in->a)) {
+                makeConst(in, NUMBER_VAL(-AS_NUMBER(ins(opt, in->a)->value)));
+            }
+            break;
+        case IR_NOT:
+            if (isConst(opt, in->a)) {
+                makeConst(in, BOOL_VAL(isFalsey(ins(opt, in->a)->value)));
+            }
+            break;
+        case IR_EQ:
+        case IR_NE:
+            if (isConst(opt, in->a) && isConst(opt, in->b)) {
+                bool equal = valuesEqual(ins(opt, in->a)->value,
+                                         ins(opt, in->b)->value);
+                makeConst(in, BOOL_VAL(in->op == IR_EQ ? equal : !equal));
+            }
+            break;
+        case IR_CALLN:
+            foldNative(opt, ref);
+            break;
+
+        case IR_GUARD_NUM:
+            if (opt->types[in->a] == IRT_NUM) {
+                removeIns(opt, ref, ref);
+            } else {
+                opt->types[in->a] = IRT_NUM;
+            }
+            break;
+        case IR_GUARD_TRUTHY:
+        case IR_GUARD_FALSEY:
+            // a constant condition always holds: it came from the recording
+            if (isConst(opt, in->a)) removeIns(opt, ref, ref);
+            break;
+        case IR_GUARD_VALUE:
+            if (isConst(opt, in->a) || hasGuard(opt, ref)) {
+                removeIns(opt, ref, ref);
+            }
+            break;
+        case IR_GUARD_SHAPE:
+        case IR_GUARD_CLASS:
+            if (hasGuard(opt, ref)) removeIns(opt, ref, ref);
+            break;
+
+        case IR_GLOAD:
+        case IR_FLOAD: {
+            // globals have no object, their slot is in a
+            IRRef object = in->op == IR_FLOAD ? in->a : 0;
+            IRRef index = in->op == IR_FLOAD ? in->b : in->a;
+            Known* known = findKnown(opt, in->op, object, index);
+            if (known != NULL) {
+                removeIns(opt, ref, known->value);
+            } else {
+                setKnown(opt, in->op, object, index, ref);
+            }
+            break;
+        }
+        case IR_GSTORE:
+            setKnown(opt, IR_GLOAD, 0, in->a, in->b);
+            break;
+        case IR_FSTORE:
+            forgetFields(opt, in->b);
+            setKnown(opt, IR_FLOAD, in->a, in->b, in->c);
+            break;
+    }
+
+    if (in->op != IR_NOP && opt->types[ref] == IRT_ANY) {
+        opt->types[ref] = in->type;
+    }
+}
+
+static void markUsed(bool* used, IRRef ref) {
+    used[ref] = true;
+}
+
+static void eliminateDeadCode(Trace* trace) {
+    bool used[TRACE_MAX_IR] = {false};
+    for (int i = 0; i < trace->entryCount; i++) {
+        markUsed(used, trace->entries[i].ref);
+    }
+    for (int i = trace->irCount - 1; i >= 0; i--) {
+        IRIns* in = &trace->ir[i];
+        if (isPure(in->op) && !used[i]) {
+            in->op = IR_NOP;
+            continue;
+        }
+        uint8_t uses = usesOf(in);
+        if (uses & USES_A) markUsed(used, in->a);
+        if (uses & USES_B) markUsed(used, in->b);
+        if (uses & USES_C) markUsed(used, in->c);
+    }
+}
+
+void optimizeTrace(VM* vm, Trace* trace) {
+    Optimizer optimizer;
+    optimizer.vm = vm;
+    optimizer.trace = trace;
+    optimizer.knownCount = 0;
+    for (int i = 0; i < trace->irCount; i++) {
+        optimizer.subst[i] = (IRRef)i;
+        optimizer.types[i] = IRT_ANY;
+    }
+
+    for (int i = 0; i < trace->irCount; i++) {
+        optimizeIns(&optimizer, (IRRef)i);
+    }
+    for (int i = 0; i < trace->entryCount; i++) {
+        trace->entries[i].ref = optimizer.subst[trace->entries[i].ref];
+    }
+    eliminateDeadCode(trace);
+
+    // the backend only has to know which refs hold numbers
+    for (int i = 0; i < trace->irCount; i++) {
+        if (trace->ir[i].op != IR_NOP) trace->ir[i].type = optimizer.types[i];
+    }
+}
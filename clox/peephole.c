@@ -0,0 +1,75 @@
+#include "peephole.h"
+#include "rewrite.h"
+
+/*
+Superinstructions
+
+Replaces the opcode sequences that come out on top of the DEBUG_PROFILE_NGRAMS
+profile (fib, method dispatch and loop benchmarks) with single instructions
+so each one only pays for one dispatch:
+
+    GET_LOCAL a; GET_LOCAL b; ADD          -> ADD_LOCALS a b
+    GET_LOCAL 0; GET_PROPERTY name         -> GET_THIS_PROPERTY name
+    CONSTANT k; LESS; JUMP_IF_FALSE offset -> LESS_CONSTANT_JUMP k offset
+    EQUAL; NOT                             -> NOT_EQUAL
+    CONSTANT k; RETURN                     -> RETURN_CONSTANT k
+*/
+
+static int fuseAt(Rewriter* rewriter, int index, Chunk* out) {
+    VM* vm = rewriter->vm;
+    uint8_t first = rewriterOp(rewriter, index);
+    uint8_t second = rewriterOp(rewriter, index + 1);
+    uint8_t third = rewriterOp(rewriter, index + 2);
+
+    switch (first) {
+        case OP_GET_LOCAL:
+            if (second == OP_GET_LOCAL && third == OP_ADD &&
+                isStraightLine(rewriter, index, 3)) {
+                int line = rewriterLine(rewriter, index + 2);
+                writeChunk(vm, out, OP_ADD_LOCALS, line);
+                writeChunk(vm, out, rewriterOperand(rewriter, index), line);
+                writeChunk(vm, out, rewriterOperand(rewriter, index + 1), line);
+                return 3;
+            }
+            if (rewriterOperand(rewriter, index) == 0 &&
+                second == OP_GET_PROPERTY &&
+                isStraightLine(rewriter, index, 2)) {
+                int line = rewriterLine(rewriter, index + 1);
+                writeChunk(vm, out, OP_GET_THIS_PROPERTY, line);
+                // name and inline cache operands carry over unchanged
+                uint8_t* operands = &rewriter->chunk->code[
+                    rewriter->starts[index + 1] + 1];
+                for (int i = 0; i < 3; i++) writeChunk(vm, out, operands[i], line);
+                return 2;
+            }
+            return 0;
+        case OP_CONSTANT:
+            if (second == OP_LESS && third == OP_JUMP_IF_FALSE &&
+                isStraightLine(rewriter, index, 3)) {
+                int line = rewriterLine(rewriter, index + 1);
+                writeChunk(vm, out, OP_LESS_CONSTANT_JUMP, line);
+                writeChunk(vm, out, rewriterOperand(rewriter, index), line);
+                rewriterJumpOperand(rewriter, index + 2, out);
+                return 3;
+            }
+            if (second == OP_RETURN && isStraightLine(rewriter, index, 2)) {
+                int line = rewriterLine(rewriter, index + 1);
+                writeChunk(vm, out, OP_RETURN_CONSTANT, line);
+                writeChunk(vm, out, rewriterOperand(rewriter, index), line);
+                return 2;
+            }
+            return 0;
+        case OP_EQUAL:
+            if (second == OP_NOT && isStraightLine(rewriter, index, 2)) {
+                writeChunk(vm, out, OP_NOT_EQUAL, rewriterLine(rewriter, index));
+                return 2;
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+void fuseSuperinstructions(VM* vm, Chunk* chunk) {
+    rewriteChunk(vm, chunk, fuseAt);
+}
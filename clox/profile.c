@@ -0,0 +1,342 @@
+// SIGEV_THREAD_ID
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "profile.h"
+#include "vm.h"
+
+// glibc before 2.41 only has the union member, not its name
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/*
+Profiler
+
+--profile samples where the script spends its time. A timer sends the
+thread running the script SIGPROF PROFILE_HZ times a second, and the
+handler copies vm->frames, each as its function and the
+line its ip is at, into a ring buffer. The handler can interrupt the vm
+anywhere, so it only reads, and the vm keeps frames and frameCount such
+that the first frameCount frames are whole at every instruction: call()
+fills a frame in before it counts it, a moved stack is freed only once the
+vm has the new one and a fiber switch takes the frames along before their
+count. Callers' ips are at the call they are in, which gives their lines.
+run() otherwise keeps the innermost frame's ip to itself until a call or
+an exit, so while vm->profiling is set it stores it in the frame before
+every instruction; code the jits compiled still only stores it at exits.
+
+The handler is the ring's only writer and a collector thread, every
+PROFILE_DRAIN_MS, its only reader, so neither takes a lock: the handler
+publishes a sample by moving head past it, the collector frees the room by
+moving tail. A sample that does not fit is dropped and counted. The
+collector counts the samples by stack in a hash table of its own.
+
+Samples only point at functions, which the gc would free once the program
+is done with them, so the gc marks the functions in the ring and the table
+as roots, with the collector locked out. At exit stopProfiler() writes one
+line per stack with its count.
+
+The timer runs on the wall clock: the cpu clocks only tick as often as the
+kernel does, 250 times a second or so. Time lox code spends blocked, say
+in await(), shows up in the samples; time between event callbacks, with no
+frames at all, does not.
+*/
+
+// frames kept per sample, the innermost ones of deeper stacks
+#define PROFILE_MAX_DEPTH 128
+// frames the ring holds, a power of two
+#define PROFILE_RING_SIZE (1 << 16)
+#define PROFILE_RING_MASK (PROFILE_RING_SIZE - 1)
+// how often the collector empties the ring
+#define PROFILE_DRAIN_MS 10
+
+typedef struct {
+    // NULL starts a sample, whose line is then its number of frames
+    ObjFunction* function;
+    int line;
+} ProfileFrame;
+
+typedef struct {
+    ProfileFrame* frames;
+    int depth;
+    uint32_t hash;
+    long count;
+} ProfileStack;
+
+typedef struct {
+    _Atomic(VM*) vm;
+    timer_t timer;
+    pthread_t collector;
+    atomic_bool stopping;
+
+    ProfileFrame ring[PROFILE_RING_SIZE];
+    // only the handler moves head, only the collector and the gc tail
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_long dropped;
+
+    // taken by the collector and the gc, never by the handler
+    pthread_mutex_t lock;
+    // open addressing by hash, NULL frames for an empty entry
+    ProfileStack* stacks;
+    int stackCount;
+    int stackCapacity;
+} Profiler;
+
+static Profiler profiler;
+
+static int lineAt(ObjFunction* function, uint8_t* ip) {
+    Chunk* chunk = &function->chunk;
+    // ip is past the instruction it is at, or at the start when fresh
+    ptrdiff_t offset = ip - chunk->code - 1;
+    if (offset < 0) offset = 0;
+    // a tail call can leave the old function's ip for a moment
+    if (offset >= chunk->count) return 0;
+    return chunk->lines[offset];
+}
+
+// the SIGPROF handler, which may only read the vm
+static void sample(int signal) {
+    VM* vm = atomic_load_explicit(&profiler.vm, memory_order_relaxed);
+    if (vm == NULL) return;
+    int count = vm->frameCount;
+    CallFrame* frames = vm->frames;
+    int first = count > PROFILE_MAX_DEPTH ? count - PROFILE_MAX_DEPTH : 0;
+    int depth = count - first;
+    // no lox code running, say between event callbacks
+    if (depth == 0) return;
+
+    size_t head = atomic_load_explicit(&profiler.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&profiler.tail, memory_order_acquire);
+    if (PROFILE_RING_SIZE - (head - tail) < (size_t)depth + 1) {
+        atomic_fetch_add_explicit(&profiler.dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    profiler.ring[head & PROFILE_RING_MASK] = (ProfileFrame){NULL, depth};
+    for (int i = 0; i < depth; i++) {
+        CallFrame* frame = &frames[first + i];
+        ObjFunction* function = frame->closure->function;
+        profiler.ring[(head + 1 + i) & PROFILE_RING_MASK] =
+            (ProfileFrame){function, lineAt(function, frame->ip)};
+    }
+    atomic_store_explicit(&profiler.head, head + depth + 1,
+                          memory_order_release);
+}
+
+// FNV-1a over the frames, like hashString() over characters
+static uint32_t hashFrames(ProfileFrame* frames, int depth) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < depth; i++) {
+        uintptr_t function = (uintptr_t)frames[i].function;
+        hash ^= (uint32_t)(function >> 4);
+        hash *= 16777619;
+        hash ^= (uint32_t)frames[i].line;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// field by field, the padding of a ProfileFrame is anything
+static bool sameFrames(ProfileFrame* a, ProfileFrame* b, int depth) {
+    for (int i = 0; i < depth; i++) {
+        if (a[i].function != b[i].function || a[i].line != b[i].line) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static ProfileStack* findStack(ProfileStack* stacks, int capacity,
+                               ProfileFrame* frames, int depth,
+                               uint32_t hash) {
+    uint32_t index = hash & (capacity - 1);
+    for (;;) {
+        ProfileStack* stack = &stacks[index];
+        if (stack->frames == NULL ||
+            (stack->hash == hash && stack->depth == depth &&
+             sameFrames(stack->frames, frames, depth))) {
+            return stack;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growStacks(void) {
+    int capacity = profiler.stackCapacity < 64 ? 64
+                                               : profiler.stackCapacity * 2;
+    ProfileStack* stacks = calloc(capacity, sizeof(ProfileStack));
+    if (stacks == NULL) {
+        fprintf(stderr, "Out of memory for the profile.\n");
+        exit(70);
+    }
+    for (int i = 0; i < profiler.stackCapacity; i++) {
+        ProfileStack* old = &profiler.stacks[i];
+        if (old->frames == NULL) continue;
+        *findStack(stacks, capacity, old->frames, old->depth, old->hash) =
+            *old;
+    }
+    free(profiler.stacks);
+    profiler.stacks = stacks;
+    profiler.stackCapacity = capacity;
+}
+
+static void countStack(ProfileFrame* frames, int depth) {
+    if (profiler.stackCount + 1 > profiler.stackCapacity * 3 / 4) {
+        growStacks();
+    }
+    uint32_t hash = hashFrames(frames, depth);
+    ProfileStack* stack = findStack(profiler.stacks, profiler.stackCapacity,
+                                    frames, depth, hash);
+    if (stack->frames == NULL) {
+        stack->frames = malloc(sizeof(ProfileFrame) * depth);
+        if (stack->frames == NULL) {
+            fprintf(stderr, "Out of memory for the profile.\n");
+            exit(70);
+        }
+        memcpy(stack->frames, frames, sizeof(ProfileFrame) * depth);
+        stack->depth = depth;
+        stack->hash = hash;
+        stack->count = 0;
+        profiler.stackCount++;
+    }
+    stack->count++;
+}
+
+// moves the samples in the ring to the table, with the lock held
+static void drain(void) {
+    size_t tail = atomic_load_explicit(&profiler.tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&profiler.head, memory_order_acquire);
+    ProfileFrame frames[PROFILE_MAX_DEPTH];
+    while (tail != head) {
+        int depth = profiler.ring[tail & PROFILE_RING_MASK].line;
+        for (int i = 0; i < depth; i++) {
+            frames[i] = profiler.ring[(tail + 1 + i) & PROFILE_RING_MASK];
+        }
+        countStack(frames, depth);
+        tail += depth + 1;
+    }
+    atomic_store_explicit(&profiler.tail, tail, memory_order_release);
+}
+
+static void* collect(void* unused) {
+    struct timespec interval = {0, PROFILE_DRAIN_MS * 1000000L};
+    while (!atomic_load(&profiler.stopping)) {
+        nanosleep(&interval, NULL);
+        pthread_mutex_lock(&profiler.lock);
+        drain();
+        pthread_mutex_unlock(&profiler.lock);
+    }
+    return NULL;
+}
+
+bool startProfiler(VM* vm) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) == -1) return false;
+
+    pthread_mutex_init(&profiler.lock, NULL);
+    atomic_store(&profiler.stopping, false);
+    atomic_store(&profiler.vm, vm);
+    vm->profiling = true;
+    if (pthread_create(&profiler.collector, NULL, collect, NULL) != 0) {
+        vm->profiling = false;
+        atomic_store(&profiler.vm, NULL);
+        return false;
+    }
+
+    // only this thread gets the signal
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    struct itimerspec interval = {{0, 1000000000L / PROFILE_HZ},
+                                  {0, 1000000000L / PROFILE_HZ}};
+    if (timer_create(CLOCK_MONOTONIC, &event, &profiler.timer) == -1) {
+        atomic_store(&profiler.stopping, true);
+        pthread_join(profiler.collector, NULL);
+        vm->profiling = false;
+        atomic_store(&profiler.vm, NULL);
+        return false;
+    }
+    timer_settime(profiler.timer, 0, &interval, NULL);
+    return true;
+}
+
+static void writeFrame(FILE* file, ProfileFrame* frame) {
+    ObjString* name = frame->function->name;
+    fprintf(file, "%s:%d", name == NULL ? "script" : name->chars,
+            frame->line);
+}
+
+void stopProfiler(VM* vm, const char* path) {
+    timer_delete(profiler.timer);
+    // one may still be on its way
+    signal(SIGPROF, SIG_IGN);
+    atomic_store(&profiler.stopping, true);
+    pthread_join(profiler.collector, NULL);
+    drain();
+    vm->profiling = false;
+    atomic_store(&profiler.vm, NULL);
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+    }
+    for (int i = 0; i < profiler.stackCapacity; i++) {
+        ProfileStack* stack = &profiler.stacks[i];
+        if (stack->frames == NULL) continue;
+        if (file != NULL) {
+            for (int j = 0; j < stack->depth; j++) {
+                if (j > 0) fputc(';', file);
+                writeFrame(file, &stack->frames[j]);
+            }
+            fprintf(file, " %ld\n", stack->count);
+        }
+        free(stack->frames);
+    }
+    if (file != NULL) fclose(file);
+
+    long dropped = atomic_load(&profiler.dropped);
+    if (dropped > 0) {
+        fprintf(stderr, "Profiler dropped %ld samples.\n", dropped);
+    }
+    free(profiler.stacks);
+    profiler.stacks = NULL;
+    profiler.stackCount = 0;
+    profiler.stackCapacity = 0;
+    pthread_mutex_destroy(&profiler.lock);
+}
+
+void markProfileRoots(VM* vm) {
+    if (atomic_load_explicit(&profiler.vm, memory_order_relaxed) != vm) {
+        return;
+    }
+    // the ring's samples go to the table first, which is then all there is
+    pthread_mutex_lock(&profiler.lock);
+    drain();
+    for (int i = 0; i < profiler.stackCapacity; i++) {
+        ProfileStack* stack = &profiler.stacks[i];
+        if (stack->frames == NULL) continue;
+        for (int j = 0; j < stack->depth; j++) {
+            markObject(vm, (Obj*)stack->frames[j].function);
+        }
+    }
+    pthread_mutex_unlock(&profiler.lock);
+}
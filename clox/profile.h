@@ -0,0 +1,21 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "common.h"
+
+// samples per second
+#define PROFILE_HZ 1000
+
+// samples the frames of vm, which runs on the calling thread, PROFILE_HZ
+// times a second until stopProfiler(); false if it could not start
+bool startProfiler(VM* vm);
+
+// stops sampling and writes the samples to path as folded stacks, a
+// "script;outer:line;inner:line count" line per distinct stack, the
+// format flamegraph.pl and friends read
+void stopProfiler(VM* vm, const char* path);
+
+// the functions of every sample stay alive until they are written
+void markProfileRoots(VM* vm);
+
+#endif
@@ -0,0 +1,465 @@
+#include <stdlib.h>
+
+#include "trace.h"
+
+/*
+The recorder follows one iteration of a hot loop as the interpreter runs
+it. It keeps an abstract copy of the stack: for every slot, relative to
+the slots of the frame the loop is in, the IR instruction that produced
+what the slot holds now. Slots the trace has not touched yet are read
+with an SLOAD the first time they are needed.
+
+Guards check the assumptions this iteration made, so they always see
+the state from just before the guarded instruction; that state is what
+the snapshot of the guard records.
+*/
+
+typedef struct Recorder {
+    VM* vm;
+    Trace* trace;           // NULL when not recording
+    int baseFrame;          // index of the trace frame in vm->frames
+    IRRef slots[TRACE_MAX_SLOTS];
+    IRRef loads[TRACE_MAX_SLOTS];  // SLOAD of each slot, IR_NONE if none yet
+    int top;
+    SnapshotFrame frames[TRACE_MAX_FRAMES];
+    int frameCount;
+    uint8_t* ip;            // instruction being recorded
+    int snapshot;           // of the state before ip, -1 until a guard needs it
+    bool failed;            // ran out of room for the trace
+} Recorder;
+
+Trace* recordingTrace(VM* vm) {
+    return vm->recorder == NULL ? NULL : vm->recorder->trace;
+}
+
+void freeRecorder(VM* vm) {
+    free(vm->recorder);
+    vm->recorder = NULL;
+}
+
+static IRRef emit(Recorder* recorder, uint8_t op, uint8_t type, IRRef a, IRRef b, IRRef c) {
+    Trace* trace = recorder->trace;
+    if (trace->irCount == TRACE_MAX_IR) {
+        recorder->failed = true;
+        return 0;
+    }
+    IRIns* ins = &trace->ir[trace->irCount];
+    ins->op = op;
+    ins->type = type;
+    ins->snapshot = 0;
+    ins->a = a;
+    ins->b = b;
+    ins->c = c;
+    ins->value = NIL_VAL;
+    return (IRRef)trace->irCount++;
+}
+
+static IRRef constant(Recorder* recorder, Value value) {
+    uint8_t type = IS_NUMBER(value) ? IRT_NUM
+                 : IS_BOOL(value) ? IRT_BOOL : IRT_ANY;
+    IRRef ref = emit(recorder, IR_CONST, type, 0, 0, 0);
+    if (!recorder->failed) recorder->trace->ir[ref].value = value;
+    return ref;
+}
+
+static IRRef getSlot(Recorder* recorder, int slot) {
+    if (slot >= TRACE_MAX_SLOTS) {
+        recorder->failed = true;
+        return 0;
+    }
+    if (recorder->slots[slot] == IR_NONE) {
+        IRRef load = emit(recorder, IR_SLOAD, IRT_ANY, (IRRef)slot, 0, 0);
+        recorder->slots[slot] = load;
+        recorder->loads[slot] = load;
+    }
+    return recorder->slots[slot];
+}
+
+static void setSlot(Recorder* recorder, int slot, IRRef ref) {
+    if (slot >= TRACE_MAX_SLOTS) {
+        recorder->failed = true;
+        return;
+    }
+    recorder->slots[slot] = ref;
+    if (slot > recorder->trace->maxSlot) recorder->trace->maxSlot = slot;
+}
+
+static void pushRef(Recorder* recorder, IRRef ref) {
+    setSlot(recorder, recorder->top++, ref);
+}
+
+static IRRef popRef(Recorder* recorder) {
+    return getSlot(recorder, --recorder->top);
+}
+
+static IRRef peekRef(Recorder* recorder, int distance) {
+    return getSlot(recorder, recorder->top - 1 - distance);
+}
+
+// the state before the instruction being recorded
+static int takeSnapshot(Recorder* recorder) {
+    if (recorder->snapshot != -1) return recorder->snapshot;
+
+    Trace* trace = recorder->trace;
+    if (trace->snapshotCount == TRACE_MAX_SNAPSHOTS ||
+        trace->entryCount + recorder->top > TRACE_MAX_SNAPSHOT_ENTRIES ||
+        trace->frameCount + recorder->frameCount > TRACE_MAX_SNAPSHOT_FRAMES) {
+        recorder->failed = true;
+        return 0;
+    }
+
+    Snapshot* snapshot = &trace->snapshots[trace->snapshotCount];
+    snapshot->ip = recorder->ip;
+    snapshot->top = recorder->top;
+    snapshot->entryStart = trace->entryCount;
+    for (int slot = 0; slot < recorder->top; slot++) {
+        IRRef ref = recorder->slots[slot];
+        if (ref == IR_NONE || ref == recorder->loads[slot]) continue;
+        SnapshotEntry* entry = &trace->entries[trace->entryCount++];
+        entry->slot = (uint16_t)slot;
+        entry->ref = ref;
+    }
+    snapshot->entryCount = trace->entryCount - snapshot->entryStart;
+    snapshot->frameStart = trace->frameCount;
+    snapshot->frameCount = recorder->frameCount;
+    for (int i = 0; i < recorder->frameCount; i++) {
+        trace->frames[trace->frameCount++] = recorder->frames[i];
+    }
+
+    recorder->snapshot = trace->snapshotCount++;
+    return recorder->snapshot;
+}
+
+static void guard(Recorder* recorder, uint8_t op, IRRef ref, Value value) {
+    int snapshot = takeSnapshot(recorder);
+    IRRef guard = emit(recorder, op, IRT_ANY, ref, 0, 0);
+    if (recorder->failed) return;
+    recorder->trace->ir[guard].snapshot = (uint16_t)snapshot;
+    recorder->trace->ir[guard].value = value;
+}
+
+// guards an instance's shape and hands back its live object, NULL if the
+// value is not an instance the trace can reason about
+static ObjInstance* guardInstance(Recorder* recorder, IRRef ref, Value live) {
+    if (!IS_INSTANCE(live)) return NULL;
+    ObjInstance* instance = AS_INSTANCE(live);
+    if (instance->shape == NULL) return NULL;
+    guard(recorder, IR_GUARD_SHAPE, ref, OBJ_VAL(instance->shape));
+    return instance;
+}
+
+static bool recordArithmetic(Recorder* recorder, uint8_t op, uint8_t type) {
+    VM* vm = recorder->vm;
+    if (!IS_NUMBER(vm->stackTop[-1]) || !IS_NUMBER(vm->stackTop[-2])) {
+        return false;
+    }
+    guard(recorder, IR_GUARD_NUM, peekRef(recorder, 1), NIL_VAL);
+    guard(recorder, IR_GUARD_NUM, peekRef(recorder, 0), NIL_VAL);
+    IRRef b = popRef(recorder);
+    IRRef a = popRef(recorder);
+    pushRef(recorder, emit(recorder, op, type, a, b, 0));
+    return true;
+}
+
+static void recordBranch(Recorder* recorder, IRRef condition, bool taken) {
+    guard(recorder, taken ? IR_GUARD_FALSEY : IR_GUARD_TRUTHY, condition, NIL_VAL);
+}
+
+// inlines a call to closure whose callee slot is argCount below the top
+static bool recordCall(Recorder* recorder, ObjClosure* closure, int argCount, uint8_t* returnIp) {
+    if (closure->function->arity != argCount ||
+        recorder->frameCount == TRACE_MAX_FRAMES) {
+        return false;
+    }
+    SnapshotFrame* frame = &recorder->frames[recorder->frameCount++];
+    frame->closure = closure;
+    frame->base = recorder->top - argCount - 1;
+    frame->returnIp = returnIp;
+    // an exit can leave the interpreter running in the inlined function,
+    // which needs the slots a real call would have reserved
+    int top = frame->base + closure->function->maxSlots;
+    if (top > recorder->trace->maxSlot) recorder->trace->maxSlot = top;
+    if (recorder->frameCount > recorder->trace->maxDepth) {
+        recorder->trace->maxDepth = recorder->frameCount;
+    }
+    return true;
+}
+
+// the trace calls the native itself when it can: its values are not gc
+// roots, and when the call fails the exit goes back to before it, so the
+// interpreter makes the call again and reports the error
+static bool recordNative(Recorder* recorder, ObjNative* native, int argCount) {
+    uint8_t needs = NATIVE_PURE | NATIVE_NO_GC;
+    if ((native->flags & needs) != needs || argCount != native->arity ||
+        argCount > TRACE_MAX_NATIVE_ARGS) {
+        return false;
+    }
+    guard(recorder, IR_GUARD_VALUE, peekRef(recorder, argCount), OBJ_VAL(native));
+    int snapshot = takeSnapshot(recorder);
+    IRRef a = argCount > 0 ? peekRef(recorder, argCount - 1) : IR_NONE;
+    IRRef b = argCount > 1 ? peekRef(recorder, argCount - 2) : IR_NONE;
+    IRRef call = emit(recorder, IR_CALLN, IRT_ANY, a, b, (IRRef)argCount);
+    if (recorder->failed) return true;
+    recorder->trace->ir[call].snapshot = (uint16_t)snapshot;
+    recorder->trace->ir[call].value = OBJ_VAL(native);
+    recorder->top -= argCount + 1;
+    pushRef(recorder, call);
+    return true;
+}
+
+static uint16_t readShort(uint8_t* ip) {
+    return (uint16_t)((ip[0] << 8) | ip[1]);
+}
+
+// false for anything the trace can not follow
+static bool recordOp(Recorder* recorder, CallFrame* frame, uint8_t* ip) {
+    VM* vm = recorder->vm;
+    Trace* trace = recorder->trace;
+    Value* constants = frame->closure->function->chunk.constants.values;
+    int base = recorder->frameCount == 0
+        ? 0 : recorder->frames[recorder->frameCount - 1].base;
+
+    // quickened instructions behave like the ones they specialize
+    uint8_t instruction = genericOpcode(ip[0]);
+
+    switch (instruction) {
+        case OP_CONSTANT: pushRef(recorder, constant(recorder, constants[ip[1]])); return true;
+        case OP_NIL:      pushRef(recorder, constant(recorder, NIL_VAL)); return true;
+        case OP_TRUE:     pushRef(recorder, constant(recorder, BOOL_VAL(true))); return true;
+        case OP_FALSE:    pushRef(recorder, constant(recorder, BOOL_VAL(false))); return true;
+        case OP_POP:      recorder->top--; return true;
+        case OP_GET_LOCAL:
+            pushRef(recorder, getSlot(recorder, base + ip[1]));
+            return true;
+        case OP_SET_LOCAL:
+            setSlot(recorder, base + ip[1], peekRef(recorder, 0));
+            return true;
+        case OP_GET_GLOBAL: {
+            uint16_t slot = readShort(ip + 1);
+            // undefined globals are errors, leave them to the interpreter
+            if (IS_UNDEFINED(vm->globalValues.values[slot])) return false;
+            pushRef(recorder, emit(recorder, IR_GLOAD, IRT_ANY, slot, 0, 0));
+            return true;
+        }
+        case OP_SET_GLOBAL: {
+            uint16_t slot = readShort(ip + 1);
+            if (IS_UNDEFINED(vm->globalValues.values[slot])) return false;
+            emit(recorder, IR_GSTORE, IRT_ANY, slot, peekRef(recorder, 0), 0);
+            return true;
+        }
+        case OP_GET_THIS_PROPERTY:
+        case OP_GET_PROPERTY: {
+            bool isThis = instruction == OP_GET_THIS_PROPERTY;
+            IRRef receiver = isThis ? getSlot(recorder, base) : peekRef(recorder, 0);
+            Value live = isThis ? frame->slots[0] : vm->stackTop[-1];
+            ObjString* name = AS_STRING(constants[ip[1]]);
+            // methods would allocate a bound method
+            if (!IS_INSTANCE(live) || AS_INSTANCE(live)->shape == NULL ||
+                shapeSlot(AS_INSTANCE(live)->shape, name) == -1) {
+                return false;
+            }
+            ObjInstance* instance = guardInstance(recorder, receiver, live);
+            IRRef field = emit(recorder, IR_FLOAD, IRT_ANY, receiver,
+                               (IRRef)shapeSlot(instance->shape, name), 0);
+            if (!isThis) recorder->top--;
+            pushRef(recorder, field);
+            return true;
+        }
+        case OP_SET_PROPERTY: {
+            Value live = vm->stackTop[-2];
+            ObjString* name = AS_STRING(constants[ip[1]]);
+            // adding a field changes the shape, leave that to the interpreter
+            if (!IS_INSTANCE(live) || AS_INSTANCE(live)->shape == NULL ||
+                shapeSlot(AS_INSTANCE(live)->shape, name) == -1) {
+                return false;
+            }
+            ObjInstance* instance = guardInstance(recorder, peekRef(recorder, 1), live);
+            IRRef value = peekRef(recorder, 0);
+            emit(recorder, IR_FSTORE, IRT_ANY, peekRef(recorder, 1),
+                 (IRRef)shapeSlot(instance->shape, name), value);
+            recorder->top -= 2;
+            pushRef(recorder, value);
+            return true;
+        }
+        case OP_EQUAL:
+        case OP_NOT_EQUAL: {
+            IRRef b = popRef(recorder);
+            IRRef a = popRef(recorder);
+            uint8_t op = instruction == OP_EQUAL ? IR_EQ : IR_NE;
+            pushRef(recorder, emit(recorder, op, IRT_BOOL, a, b, 0));
+            return true;
+        }
+        case OP_GREATER:  return recordArithmetic(recorder, IR_GT, IRT_BOOL);
+        case OP_LESS:     return recordArithmetic(recorder, IR_LT, IRT_BOOL);
+        case OP_ADD:      return recordArithmetic(recorder, IR_ADD, IRT_NUM);
+        case OP_SUBTRACT: return recordArithmetic(recorder, IR_SUB, IRT_NUM);
+        case OP_MULTIPLY: return recordArithmetic(recorder, IR_MUL, IRT_NUM);
+        case OP_DIVIDE:   return recordArithmetic(recorder, IR_DIV, IRT_NUM);
+        case OP_ADD_LOCALS: {
+            if (!IS_NUMBER(frame->slots[ip[1]]) ||
+                !IS_NUMBER(frame->slots[ip[2]])) {
+                return false;
+            }
+            IRRef a = getSlot(recorder, base + ip[1]);
+            IRRef b = getSlot(recorder, base + ip[2]);
+            guard(recorder, IR_GUARD_NUM, a, NIL_VAL);
+            guard(recorder, IR_GUARD_NUM, b, NIL_VAL);
+            pushRef(recorder, emit(recorder, IR_ADD, IRT_NUM, a, b, 0));
+            return true;
+        }
+        case OP_NOT:
+            pushRef(recorder, emit(recorder, IR_NOT, IRT_BOOL, popRef(recorder), 0, 0));
+            return true;
+        case OP_NEGATE:
+            if (!IS_NUMBER(vm->stackTop[-1])) return false;
+            guard(recorder, IR_GUARD_NUM, peekRef(recorder, 0), NIL_VAL);
+            pushRef(recorder, emit(recorder, IR_NEG, IRT_NUM, popRef(recorder), 0, 0));
+            return true;
+        case OP_JUMP:
+            return true;
+        case OP_JUMP_IF_FALSE:
+            recordBranch(recorder, peekRef(recorder, 0), isFalsey(vm->stackTop[-1]));
+            return true;
+        case OP_LESS_CONSTANT_JUMP: {
+            Value k = constants[ip[1]];
+            if (!IS_NUMBER(vm->stackTop[-1]) || !IS_NUMBER(k)) return false;
+            IRRef a = peekRef(recorder, 0);
+            guard(recorder, IR_GUARD_NUM, a, NIL_VAL);
+            IRRef less = emit(recorder, IR_LT, IRT_BOOL, a, constant(recorder, k), 0);
+            recordBranch(recorder, less, AS_NUMBER(vm->stackTop[-1]) >= AS_NUMBER(k));
+            recorder->top--;
+            pushRef(recorder, less);
+            return true;
+        }
+        case OP_LOOP: {
+            // other back-edges, like the one to a for loop's increment, are
+            // just jumps; inner loops get unrolled until the trace is full
+            if (recorder->frameCount > 0 ||
+                ip + 3 - readShort(ip + 1) != trace->header) {
+                return true;
+            }
+            recorder->ip = trace->header;
+            int snapshot = takeSnapshot(recorder);
+            IRRef loop = emit(recorder, IR_LOOP, IRT_ANY, 0, 0, 0);
+            if (!recorder->failed) trace->ir[loop].snapshot = (uint16_t)snapshot;
+            return true;
+        }
+        case OP_CALL: {
+            int argCount = ip[1];
+            Value callee = vm->stackTop[-1 - argCount];
+            if (IS_NATIVE(callee)) return recordNative(recorder, AS_NATIVE(callee), argCount);
+            if (!IS_CLOSURE(callee)) return false;
+            guard(recorder, IR_GUARD_VALUE, peekRef(recorder, argCount), callee);
+            return recordCall(recorder, AS_CLOSURE(callee), argCount, ip + 2);
+        }
+        case OP_INVOKE: {
+            ObjString* name = AS_STRING(constants[ip[1]]);
+            int argCount = ip[2];
+            Value live = vm->stackTop[-1 - argCount];
+            if (!IS_INSTANCE(live) || AS_INSTANCE(live)->shape == NULL) {
+                return false;
+            }
+            ObjInstance* instance = AS_INSTANCE(live);
+            Value method;
+            // calling a field would need the callee slot rewritten
+            if (shapeSlot(instance->shape, name) != -1 ||
+                !tableGet(&instance->klass->methods, name, &method)) {
+                return false;
+            }
+            IRRef receiver = peekRef(recorder, argCount);
+            guardInstance(recorder, receiver, live);
+            guard(recorder, IR_GUARD_CLASS, receiver,
+                  NUMBER_VAL((double)instance->klass->version));
+            return recordCall(recorder, AS_CLOSURE(method), argCount, ip + 5);
+        }
+        case OP_RETURN_CONSTANT:
+        case OP_RETURN: {
+            // returning from the trace frame itself ends the loop
+            if (recorder->frameCount == 0) return false;
+            IRRef result = instruction == OP_RETURN
+                ? popRef(recorder) : constant(recorder, constants[ip[1]]);
+            recorder->top = recorder->frames[--recorder->frameCount].base;
+            pushRef(recorder, result);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+bool startRecording(VM* vm, CallFrame* frame) {
+    int top = (int)(vm->stackTop - frame->slots);
+    if (top >= TRACE_MAX_SLOTS) return false;
+
+    // only vms that get to record anything pay for a recorder
+    if (vm->recorder == NULL) {
+        vm->recorder = (Recorder*)malloc(sizeof(Recorder));
+        if (vm->recorder == NULL) return false;
+        vm->recorder->vm = vm;
+        vm->recorder->trace = NULL;
+    }
+    Recorder* recorder = vm->recorder;
+
+    Trace* trace = (Trace*)malloc(sizeof(Trace));
+    if (trace == NULL) return false;
+    trace->closure = frame->closure;
+    trace->header = frame->ip;
+    trace->irCount = 0;
+    trace->snapshotCount = 0;
+    trace->entryCount = 0;
+    trace->frameCount = 0;
+    trace->maxSlot = top;
+    trace->maxDepth = 0;
+    trace->code = NULL;
+    trace->codeSize = 0;
+    trace->next = NULL;
+
+    recorder->trace = trace;
+    recorder->baseFrame = vm->frameCount - 1;
+    for (int i = 0; i < TRACE_MAX_SLOTS; i++) {
+        recorder->slots[i] = IR_NONE;
+        recorder->loads[i] = IR_NONE;
+    }
+    recorder->top = top;
+    recorder->frameCount = 0;
+    recorder->failed = false;
+    vm->recording = true;
+    return true;
+}
+
+static void stopRecording(Recorder* recorder) {
+    recorder->trace = NULL;
+    recorder->vm->recording = false;
+}
+
+bool recordInstruction(VM* vm, CallFrame* frame, uint8_t* ip) {
+    Recorder* recorder = vm->recorder;
+    if (recorder == NULL || recorder->trace == NULL) return false;
+    Trace* trace = recorder->trace;
+
+    // a runtime error or a call the recorder did not see took the
+    // interpreter somewhere else
+    if (vm->frameCount - 1 != recorder->baseFrame + recorder->frameCount ||
+        frame->slots != vm->frames[recorder->baseFrame].slots +
+            (recorder->frameCount == 0
+                ? 0 : recorder->frames[recorder->frameCount - 1].base)) {
+        stopRecording(recorder);
+        abortTrace(vm, trace);
+        return false;
+    }
+
+    recorder->ip = ip;
+    recorder->snapshot = -1;
+    if (!recordOp(recorder, frame, ip) || recorder->failed) {
+        stopRecording(recorder);
+        abortTrace(vm, trace);
+        return false;
+    }
+
+    if (trace->irCount > 0 && trace->ir[trace->irCount - 1].op == IR_LOOP) {
+        stopRecording(recorder);
+        finishTrace(vm, trace);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,87 @@
+#include "register.h"
+#include "rewrite.h"
+
+/*
+Register code generator
+
+The compiler always emits stack code, this pass then rewrites the parts of a
+finished chunk that only move values between locals and constants into three
+address instructions that name their operands directly. Locals already live
+at fixed slots in the frame so they are used as the registers. e.g.
+
+    a = b + c;
+
+    OP_GET_LOCAL b                  OP_R_ADD a b c
+    OP_GET_LOCAL c        ->
+    OP_ADD
+    OP_SET_LOCAL a
+    OP_POP
+
+When the result is not stored straight into a local the destination is
+REG_PUSH and the result is pushed, so the rest of the stack code carries on
+as before. Anything that touches calls, globals or objects is copied as is.
+*/
+
+// maps a stack binary opcode to its register/register form, the
+// register/constant form always directly follows it in the OpCode enum
+static int registerForm(uint8_t instruction) {
+    switch (instruction) {
+        case OP_ADD:      return OP_R_ADD;
+        case OP_SUBTRACT: return OP_R_SUBTRACT;
+        case OP_MULTIPLY: return OP_R_MULTIPLY;
+        case OP_DIVIDE:   return OP_R_DIVIDE;
+        case OP_EQUAL:    return OP_R_EQUAL;
+        case OP_GREATER:  return OP_R_GREATER;
+        case OP_LESS:     return OP_R_LESS;
+        default:          return -1;
+    }
+}
+
+// tries to rewrite the instructions starting at index
+// returns how many stack instructions were consumed, 0 if nothing matched
+static int lowerAt(Rewriter* rewriter, int index, Chunk* out) {
+    VM* vm = rewriter->vm;
+    uint8_t first = rewriterOp(rewriter, index);
+    uint8_t second = rewriterOp(rewriter, index + 1);
+
+    // GET_LOCAL b, GET_LOCAL c | CONSTANT k, binary op [, SET_LOCAL a, POP]
+    int form = registerForm(rewriterOp(rewriter, index + 2));
+    if (first == OP_GET_LOCAL && form != -1 &&
+        (second == OP_GET_LOCAL || second == OP_CONSTANT) &&
+        isStraightLine(rewriter, index, 3)) {
+        if (second == OP_CONSTANT) form++;
+
+        uint8_t dest = REG_PUSH;
+        int consumed = 3;
+        if (rewriterOp(rewriter, index + 3) == OP_SET_LOCAL &&
+            rewriterOp(rewriter, index + 4) == OP_POP &&
+            isStraightLine(rewriter, index, 5)) {
+            dest = rewriterOperand(rewriter, index + 3);
+            consumed = 5;
+        }
+
+        int line = rewriterLine(rewriter, index + 2);
+        writeChunk(vm, out, (uint8_t)form, line);
+        writeChunk(vm, out, dest, line);
+        writeChunk(vm, out, rewriterOperand(rewriter, index), line);
+        writeChunk(vm, out, rewriterOperand(rewriter, index + 1), line);
+        return consumed;
+    }
+
+    // GET_LOCAL b | CONSTANT k, SET_LOCAL a, POP
+    if ((first == OP_GET_LOCAL || first == OP_CONSTANT) &&
+        second == OP_SET_LOCAL && rewriterOp(rewriter, index + 2) == OP_POP &&
+        isStraightLine(rewriter, index, 3)) {
+        int line = rewriterLine(rewriter, index + 1);
+        writeChunk(vm, out, first == OP_GET_LOCAL ? OP_R_MOVE : OP_R_LOADK, line);
+        writeChunk(vm, out, rewriterOperand(rewriter, index + 1), line);
+        writeChunk(vm, out, rewriterOperand(rewriter, index), line);
+        return 3;
+    }
+
+    return 0;
+}
+
+void lowerToRegisters(VM* vm, Chunk* chunk) {
+    rewriteChunk(vm, chunk, lowerAt);
+}
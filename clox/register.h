@@ -0,0 +1,12 @@
+#ifndef clox_register_h
+#define clox_register_h
+
+#include "chunk.h"
+
+// destination operand meaning the result is pushed as a new temporary
+// instead of being stored into a local slot
+#define REG_PUSH UINT8_MAX
+
+void lowerToRegisters(VM* vm, Chunk* chunk);
+
+#endif
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "rewrite.h"
+
+/*
+Shared driver for the passes that replace instruction sequences in a
+finished chunk. It decodes the instructions, marks every jump target, lets
+the pass rewrite whatever it likes and then re-targets all the jumps since
+the code moved around underneath them.
+*/
+
+uint8_t rewriterOp(Rewriter* rewriter, int index) {
+    // past the end reads as a no match, OP_RETURN can never start a pattern
+    if (index >= rewriter->count) return OP_RETURN;
+    return rewriter->chunk->code[rewriter->starts[index]];
+}
+
+uint8_t rewriterOperand(Rewriter* rewriter, int index) {
+    return rewriter->chunk->code[rewriter->starts[index] + 1];
+}
+
+int rewriterLine(Rewriter* rewriter, int index) {
+    return rewriter->chunk->lines[rewriter->starts[index]];
+}
+
+// instructions can only be fused if no jump lands in the middle of them
+bool isStraightLine(Rewriter* rewriter, int index, int length) {
+    for (int i = index + 1; i < index + length; i++) {
+        if (i >= rewriter->count) return false;
+        if (rewriter->isTarget[rewriter->starts[i]]) return false;
+    }
+    return true;
+}
+
+// where the jump offset sits inside a jumping instruction, 0 if the
+// instruction does not jump. it is always the last operand
+static int jumpOperand(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+            return 1;
+        case OP_LESS_CONSTANT_JUMP:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+// bytes taken by the offset, the long forms have 32 bits
+static int jumpWidth(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+            return 4;
+        default:
+            return 2;
+    }
+}
+
+static int jumpTarget(Chunk* chunk, int offset) {
+    uint8_t instruction = chunk->code[offset];
+    int operand = offset + jumpOperand(instruction);
+    int width = jumpWidth(instruction);
+    uint32_t jump = 0;
+    for (int i = 0; i < width; i++) {
+        jump = (jump << 8) | chunk->code[operand + i];
+    }
+    if (instruction == OP_LOOP || instruction == OP_LOOP_LONG) {
+        return operand + width - (int)jump;
+    }
+    return operand + width + (int)jump;
+}
+
+// writes a placeholder for the offset of the jump at index, it has to be
+// the last operand of the new instruction since jumps are relative to it
+void rewriterJumpOperand(Rewriter* rewriter, int index, Chunk* out) {
+    int line = rewriterLine(rewriter, index);
+    int width = jumpWidth(rewriterOp(rewriter, index));
+    rewriter->jumpOperands[rewriter->jumpCount] = out->count;
+    rewriter->jumpWidths[rewriter->jumpCount] = width;
+    rewriter->jumpTargets[rewriter->jumpCount] =
+        jumpTarget(rewriter->chunk, rewriter->starts[index]);
+    rewriter->jumpCount++;
+    for (int i = 0; i < width; i++) writeChunk(rewriter->vm, out, 0xff, line);
+}
+
+void rewriteChunk(VM* vm, Chunk* chunk, RewriteFn rewrite) {
+    if (chunk->count == 0) return;
+
+    Rewriter rewriter;
+    rewriter.vm = vm;
+    rewriter.chunk = chunk;
+    rewriter.starts = ALLOCATE(vm, int, chunk->count);
+    rewriter.isTarget = ALLOCATE(vm, bool, chunk->count + 1);
+    rewriter.count = 0;
+    for (int i = 0; i <= chunk->count; i++) rewriter.isTarget[i] = false;
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        rewriter.starts[rewriter.count++] = offset;
+        if (jumpOperand(chunk->code[offset]) != 0) {
+            rewriter.isTarget[jumpTarget(chunk, offset)] = true;
+        }
+    }
+
+    // newOffsets maps every old instruction offset to where it ended up
+    int* newOffsets = ALLOCATE(vm, int, chunk->count + 1);
+    rewriter.jumpOperands = ALLOCATE(vm, int, rewriter.count);
+    rewriter.jumpTargets = ALLOCATE(vm, int, rewriter.count);
+    rewriter.jumpWidths = ALLOCATE(vm, int, rewriter.count);
+    rewriter.jumpCount = 0;
+    Chunk out;
+    initChunk(&out);
+
+    for (int i = 0; i < rewriter.count;) {
+        int start = out.count;
+        int consumed = rewrite(&rewriter, i, &out);
+        if (consumed == 0) {
+            int offset = rewriter.starts[i];
+            int operand = jumpOperand(chunk->code[offset]);
+            int length = operand != 0 ? operand : instructionLength(chunk, offset);
+            for (int j = 0; j < length; j++) {
+                writeChunk(vm, &out, chunk->code[offset + j],
+                           chunk->lines[offset + j]);
+            }
+            if (operand != 0) rewriterJumpOperand(&rewriter, i, &out);
+            consumed = 1;
+        }
+
+        for (int j = i; j < i + consumed; j++) {
+            newOffsets[rewriter.starts[j]] = start;
+        }
+        i += consumed;
+    }
+    newOffsets[chunk->count] = out.count;
+
+    // code only ever shrinks so the patched jumps always still fit
+    for (int i = 0; i < rewriter.jumpCount; i++) {
+        int operand = rewriter.jumpOperands[i];
+        int width = rewriter.jumpWidths[i];
+        int from = operand + width;
+        int to = newOffsets[rewriter.jumpTargets[i]];
+        // loops store the distance backwards, everything else forwards
+        int jump = to < from ? from - to : to - from;
+        for (int j = width - 1; j >= 0; j--) {
+            out.code[operand + j] = jump & 0xff;
+            jump >>= 8;
+        }
+    }
+
+    FREE_ARRAY(vm, int, rewriter.jumpWidths, rewriter.count);
+    FREE_ARRAY(vm, int, rewriter.jumpTargets, rewriter.count);
+    FREE_ARRAY(vm, int, rewriter.jumpOperands, rewriter.count);
+    FREE_ARRAY(vm, int, newOffsets, chunk->count + 1);
+    FREE_ARRAY(vm, bool, rewriter.isTarget, chunk->count + 1);
+    FREE_ARRAY(vm, int, rewriter.starts, chunk->count);
+
+    // keep the constants and swap in the rewritten code
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+    chunk->code = out.code;
+    chunk->lines = out.lines;
+    chunk->count = out.count;
+    chunk->capacity = out.capacity;
+}
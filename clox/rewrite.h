@@ -0,0 +1,33 @@
+#ifndef clox_rewrite_h
+#define clox_rewrite_h
+
+#include "chunk.h"
+
+// a decoded view of a chunk for passes that replace instruction sequences
+typedef struct {
+    VM* vm;          // whose heap the new code is allocated on
+    Chunk* chunk;
+    int* starts;     // offset of every instruction in the original code
+    int count;       // number of instructions
+    bool* isTarget;  // indexed by offset, true if some jump lands there
+
+    // jumps in the new code, patched once every instruction has moved
+    int* jumpOperands; // offset of the jump operand in the new code
+    int* jumpTargets;  // old offset the jump has to land on
+    int* jumpWidths;   // 2 or 4 bytes, as in the original jump
+    int jumpCount;
+} Rewriter;
+
+// writes the replacement for the instructions starting at index into out
+// and returns how many were consumed, or returns 0 to keep the instruction
+typedef int (*RewriteFn)(Rewriter* rewriter, int index, Chunk* out);
+
+void rewriteChunk(VM* vm, Chunk* chunk, RewriteFn rewrite);
+
+uint8_t rewriterOp(Rewriter* rewriter, int index);
+uint8_t rewriterOperand(Rewriter* rewriter, int index);
+int rewriterLine(Rewriter* rewriter, int index);
+bool isStraightLine(Rewriter* rewriter, int index, int length);
+void rewriterJumpOperand(Rewriter* rewriter, int index, Chunk* out);
+
+#endif
@@ -0,0 +1,188 @@
+#include "stats.h"
+
+#ifdef DEBUG_STATS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "debug.h"
+#include "vm.h"
+
+/*
+Execution statistics
+
+Counts how often run() executes every opcode and, about every
+STATS_CYCLE_INTERVAL instructions, how many cycles one handler takes from
+its dispatch to the next one, which rdtsc tells cheaply. The interval is
+random, or a loop whose length divides it would only ever have the same
+few handlers timed. The cycles include those of the counting, which is
+about the same for every opcode, so they are for comparing opcodes. Calls are counted
+per ObjFunction in ObjFunction.calls, and findEntry() counts the entries
+it probes per lookup. writeStats() reports it all at exit. Only compiled
+in when DEBUG_STATS is defined.
+
+The counters are per thread, so isolates running on workers do not race
+with the script; only the thread that writes the report is in it. The
+jit's and traces' machine code runs no handlers and goes uncounted.
+*/
+
+#define STATS_REPORT_FUNCTIONS 20
+
+static _Thread_local uint64_t executions[UINT8_COUNT];
+static _Thread_local uint64_t cycles[UINT8_COUNT];
+static _Thread_local uint64_t cycleSamples[UINT8_COUNT];
+static _Thread_local int untilSample = STATS_CYCLE_INTERVAL;
+static _Thread_local uint32_t seed = 2463534242u;
+static _Thread_local uint64_t tableLookups;
+static _Thread_local uint64_t tableProbes;
+
+static uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    // nanoseconds stand in for cycles elsewhere
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void countInstruction(CycleSample* sample, uint8_t instruction) {
+    executions[instruction]++;
+    // the timed handler ends where this one starts
+    if (sample->start != 0) {
+        cycles[sample->instruction] += readCycles() - sample->start;
+        cycleSamples[sample->instruction]++;
+        sample->start = 0;
+    }
+    if (--untilSample == 0) {
+        // xorshift, for an interval from 1 to twice the mean
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        untilSample = 1 + (int)(seed % (2 * STATS_CYCLE_INTERVAL));
+        sample->instruction = instruction;
+        sample->start = readCycles();
+    }
+}
+
+void countTableProbes(int probes) {
+    tableLookups++;
+    tableProbes += probes;
+}
+
+typedef struct {
+    uint8_t instruction;
+    uint64_t count;
+    // mean per execution, 0 if it was never timed
+    double cycles;
+} OpcodeStats;
+
+static int compareOpcodes(const void* a, const void* b) {
+    uint64_t countA = ((const OpcodeStats*)a)->count;
+    uint64_t countB = ((const OpcodeStats*)b)->count;
+    if (countA == countB) return 0;
+    return countA < countB ? 1 : -1;
+}
+
+static int compareFunctions(const void* a, const void* b) {
+    uint64_t callsA = (*(ObjFunction* const*)a)->calls;
+    uint64_t callsB = (*(ObjFunction* const*)b)->calls;
+    if (callsA == callsB) return 0;
+    return callsA < callsB ? 1 : -1;
+}
+
+static const char* functionName(ObjFunction* function) {
+    return function->name == NULL ? "script" : function->name->chars;
+}
+
+void writeStats(VM* vm, const char* path) {
+    OpcodeStats opcodes[UINT8_COUNT];
+    int opcodeCount = 0;
+    uint64_t total = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        if (executions[i] == 0) continue;
+        OpcodeStats* stats = &opcodes[opcodeCount++];
+        stats->instruction = (uint8_t)i;
+        stats->count = executions[i];
+        stats->cycles = cycleSamples[i] == 0
+                            ? 0 : (double)cycles[i] / cycleSamples[i];
+        total += executions[i];
+    }
+    qsort(opcodes, opcodeCount, sizeof(OpcodeStats), compareOpcodes);
+
+    // every function is still on the heap until the vm is freed
+    int functionCount = 0;
+    int functionCapacity = 0;
+    ObjFunction** functions = NULL;
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        if (object->type != OBJ_FUNCTION) continue;
+        ObjFunction* function = (ObjFunction*)object;
+        if (function->calls == 0) continue;
+        if (functionCount == functionCapacity) {
+            functionCapacity = functionCapacity < 8 ? 8 : functionCapacity * 2;
+            functions = realloc(functions,
+                                sizeof(ObjFunction*) * functionCapacity);
+            if (functions == NULL) exit(1);
+        }
+        functions[functionCount++] = function;
+    }
+    if (functionCount > 0) {
+        qsort(functions, functionCount, sizeof(ObjFunction*),
+              compareFunctions);
+    }
+
+    if (path == NULL) {
+        fprintf(stderr, "== opcodes ==\n");
+        for (int i = 0; i < opcodeCount; i++) {
+            fprintf(stderr, "%12llu %5.1f%% %8.1f cycles  %s\n",
+                    (unsigned long long)opcodes[i].count,
+                    100.0 * opcodes[i].count / total, opcodes[i].cycles,
+                    opcodeName(opcodes[i].instruction));
+        }
+        fprintf(stderr, "== calls ==\n");
+        for (int i = 0; i < functionCount && i < STATS_REPORT_FUNCTIONS;
+             i++) {
+            fprintf(stderr, "%12llu  %s\n",
+                    (unsigned long long)functions[i]->calls,
+                    functionName(functions[i]));
+        }
+        fprintf(stderr, "== tables ==\n%12llu lookups, %.2f probes each\n",
+                (unsigned long long)tableLookups,
+                tableLookups == 0 ? 0 : (double)tableProbes / tableLookups);
+        free(functions);
+        return;
+    }
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        free(functions);
+        return;
+    }
+    fprintf(file, "{\n  \"opcodes\": [");
+    for (int i = 0; i < opcodeCount; i++) {
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"count\": %llu, "
+                      "\"cycles\": %.1f}",
+                i > 0 ? "," : "", opcodeName(opcodes[i].instruction),
+                (unsigned long long)opcodes[i].count, opcodes[i].cycles);
+    }
+    fprintf(file, "\n  ],\n  \"calls\": [");
+    for (int i = 0; i < functionCount; i++) {
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"calls\": %llu}",
+                i > 0 ? "," : "", functionName(functions[i]),
+                (unsigned long long)functions[i]->calls);
+    }
+    fprintf(file, "\n  ],\n  \"tables\": {\"lookups\": %llu, "
+                  "\"probes\": %llu}\n}\n",
+            (unsigned long long)tableLookups,
+            (unsigned long long)tableProbes);
+    fclose(file);
+    free(functions);
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef clox_stats_h
+#define clox_stats_h
+
+#include "common.h"
+#include "object.h"
+
+// mean number of instructions between two handlers whose cycles are
+// measured
+#define STATS_CYCLE_INTERVAL 64
+
+// the handler being timed, one per run() so a sample never spans two
+typedef struct {
+    uint64_t start;
+    uint8_t instruction;
+} CycleSample;
+
+void countInstruction(CycleSample* sample, uint8_t instruction);
+void countTableProbes(int probes);
+
+// a sorted report on stderr, or json into path if it is not NULL
+void writeStats(VM* vm, const char* path);
+
+#endif
@@ -3,9 +3,16 @@
 
 #include "memory.h"
 #include "object.h"
+#include "stats.h"
 #include "table.h"
 #include "value.h"
 
+#ifdef DEBUG_STATS
+#define COUNT_PROBES(probes) countTableProbes(probes)
+#else
+#define COUNT_PROBES(probes) ((void)0)
+#endif
+
 #define TABLE_MAX_LOAD 0.75
 
 void initTable(Table* table) {
@@ -14,8 +21,8 @@ void initTable(Table* table) {
     table->entries = NULL;
 }
 
-void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     initTable(table);
 }
 
@@ -26,6 +33,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
     uint32_t index = key->hash & (capacity - 1);
 
     Entry* tombstone = NULL;
+    int probes = 1;
 
     for (;;) {
         // decides where pointer to entry should be from index
@@ -35,6 +43,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
         if (entry->key == NULL) {
             if (IS_NIL(entry->value)) {
                 // Empty truly entry.
+                COUNT_PROBES(probes);
                 return tombstone != NULL ? tombstone : entry;
             } else {
                 // We found a tombstone.
@@ -42,6 +51,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
             }
             } else if (entry->key == key) {
             // We found the key.
+            COUNT_PROBES(probes);
             return entry;
         }
 
@@ -49,6 +59,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
         // run loop again with new index
         //faster version of index = (index + 1) % capacity;
         index = (index + 1) & (capacity - 1);
+        probes++;
 
     }
 }
@@ -63,9 +74,19 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
+// position of key in the entries array or -1 if it is not in the table
+// stays valid until the table next grows
+int tableIndexOf(Table* table, ObjString* key) {
+    if (table->count == 0) return -1;
+
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return -1;
+    return (int)(entry - table->entries);
+}
+
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
     // allocate empty array into hash table 
-    Entry* entries = ALLOCATE(Entry, capacity); 
+    Entry* entries = ALLOCATE(vm, Entry, capacity); 
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL; 
         entries[i].value = NIL_VAL;
@@ -86,7 +107,7 @@ static void adjustCapacity(Table* table, int capacity) {
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     table->entries = entries; 
     table->capacity = capacity;
 }
@@ -94,13 +115,13 @@ static void adjustCapacity(Table* table, int capacity) {
 // adds given key/value pair to the given hash table 
 // if entry for that key is already present, the new value overwrites the old value
 // returns ture if new entry added
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
     // if we dont have enough capacity to insert an item 
         // we reallocate and grow the array
     // adjust before its full. TABLE_MAX_LOAD is a hyperparameter
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        adjustCapacity(vm, table, capacity);
     }
     Entry* entry = findEntry(table->entries, table->capacity, key);
     bool isNewKey = entry->key == NULL;
@@ -127,11 +148,11 @@ bool tableDelete(Table* table, ObjString* key) {
 }
 
 // copies table essentially
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
         if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -172,10 +193,10 @@ void tableRemoveWhite(Table* table) {
     }
 }
 
-void markTable(Table* table) {
+void markTable(VM* vm, Table* table) {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+        markObject(vm, (Obj*)entry->key);
+        markValue(vm, entry->value);
     }
 }
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "trace.h"
+#include "x64.h"
+
+// back-edge counters, by a hash of the loop header
+#define HOT_COUNTERS 1024
+// buckets of the trace cache, by the same hash
+#define TRACE_BUCKETS 256
+
+typedef void (*TraceEntry)(VM* vm, Value* slots);
+
+struct TraceCache {
+    int16_t hotCounts[HOT_COUNTERS];
+    Trace* traces[TRACE_BUCKETS];
+};
+
+static uint32_t hashHeader(uint8_t* header) {
+    uintptr_t address = (uintptr_t)header;
+    return (uint32_t)(address ^ (address >> 12));
+}
+
+void initTraces(VM* vm) {
+    vm->traceCache = (TraceCache*)calloc(1, sizeof(TraceCache));
+    if (vm->traceCache == NULL) exit(1);
+    vm->recorder = NULL;
+}
+
+Trace* findTrace(VM* vm, uint8_t* header) {
+    Trace* trace = vm->traceCache->traces[hashHeader(header) % TRACE_BUCKETS];
+    while (trace != NULL && trace->header != header) trace = trace->next;
+    return trace;
+}
+
+bool hotLoop(VM* vm, uint8_t* header) {
+    if (vm->recording) return false;
+    int16_t* count =
+        &vm->traceCache->hotCounts[hashHeader(header) % HOT_COUNTERS];
+    if (++*count < TRACE_HOT_LOOPS) return false;
+    *count = 0;
+    return true;
+}
+
+static void freeTrace(Trace* trace) {
+    if (trace->code != NULL) freeExecutable(trace->code, trace->codeSize);
+    free(trace);
+}
+
+void abortTrace(VM* vm, Trace* trace) {
+    // give the loop a long while before recording it again
+    vm->traceCache->hotCounts[hashHeader(trace->header) % HOT_COUNTERS] =
+        -TRACE_BACKOFF;
+    freeTrace(trace);
+}
+
+void finishTrace(VM* vm, Trace* trace) {
+    if (vm->dumpTraces) printTrace(vm, trace, "recorded");
+    optimizeTrace(vm, trace);
+    if (vm->dumpTraces) printTrace(vm, trace, "optimized");
+
+    if (!assembleTrace(trace)) {
+        abortTrace(vm, trace);
+        return;
+    }
+    Trace** bucket =
+        &vm->traceCache->traces[hashHeader(trace->header) % TRACE_BUCKETS];
+    trace->next = *bucket;
+    *bucket = trace;
+}
+
+void enterTrace(VM* vm, Trace* trace, CallFrame* frame) {
+    // the slots of the inlined calls, and so their frames, have to fit
+    int index = (int)(frame - vm->frames);
+    if (!reserveStack(vm, frame->slots, trace->maxSlot + 1)) return;
+    ((TraceEntry)(void*)trace->code)(vm, vm->frames[index].slots);
+}
+
+static Value irValue(Trace* trace, IRRef ref, uint64_t* values) {
+    if (trace->ir[ref].op == IR_CONST) return trace->ir[ref].value;
+    Value value;
+    memcpy(&value, &values[ref], sizeof(Value));
+    return value;
+}
+
+void traceExit(VM* vm, Trace* trace, int index, uint64_t* values) {
+    Snapshot* snapshot = &trace->snapshots[index];
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    Value* slots = frame->slots;
+
+    for (int i = 0; i < snapshot->entryCount; i++) {
+        SnapshotEntry* entry = &trace->entries[snapshot->entryStart + i];
+        slots[entry->slot] = irValue(trace, entry->ref, values);
+    }
+    vm->stackTop = slots + snapshot->top;
+
+    // the calls inlined so far become real frames again, innermost last
+    for (int i = 0; i < snapshot->frameCount; i++) {
+        SnapshotFrame* inlined = &trace->frames[snapshot->frameStart + i];
+        frame->ip = inlined->returnIp;
+        frame = &vm->frames[vm->frameCount++];
+        frame->closure = inlined->closure;
+        frame->slots = slots + inlined->base;
+    }
+    frame->ip = snapshot->ip;
+}
+
+static void markTrace(VM* vm, Trace* trace) {
+    markObject(vm, (Obj*)trace->closure);
+    for (int i = 0; i < trace->irCount; i++) {
+        markValue(vm, trace->ir[i].value);
+    }
+    for (int i = 0; i < trace->frameCount; i++) {
+        markObject(vm, (Obj*)trace->frames[i].closure);
+    }
+}
+
+void markTraces(VM* vm) {
+    for (int i = 0; i < TRACE_BUCKETS; i++) {
+        for (Trace* trace = vm->traceCache->traces[i]; trace != NULL;
+             trace = trace->next) {
+            markTrace(vm, trace);
+        }
+    }
+    Trace* recording = recordingTrace(vm);
+    if (recording != NULL) markTrace(vm, recording);
+}
+
+void freeTraces(VM* vm) {
+    for (int i = 0; i < TRACE_BUCKETS; i++) {
+        Trace* trace = vm->traceCache->traces[i];
+        while (trace != NULL) {
+            Trace* next = trace->next;
+            freeTrace(trace);
+            trace = next;
+        }
+    }
+    free(vm->traceCache);
+    vm->traceCache = NULL;
+    freeRecorder(vm);
+}
+
+static const char* irNames[] = {
+    [IR_NOP] = "NOP",
+    [IR_CONST] = "CONST",
+    [IR_SLOAD] = "SLOAD",
+    [IR_GLOAD] = "GLOAD",
+    [IR_GSTORE] = "GSTORE",
+    [IR_FLOAD] = "FLOAD",
+    [IR_FSTORE] = "FSTORE",
+    [IR_GUARD_NUM] = "GUARD_NUM",
+    [IR_GUARD_TRUTHY] = "GUARD_TRUTHY",
+    [IR_GUARD_FALSEY] = "GUARD_FALSEY",
+    [IR_GUARD_VALUE] = "GUARD_VALUE",
+    [IR_GUARD_SHAPE] = "GUARD_SHAPE",
+    [IR_GUARD_CLASS] = "GUARD_CLASS",
+    [IR_ADD] = "ADD",
+    [IR_SUB] = "SUB",
+    [IR_MUL] = "MUL",
+    [IR_DIV] = "DIV",
+    [IR_NEG] = "NEG",
+    [IR_LT] = "LT",
+    [IR_GT] = "GT",
+    [IR_EQ] = "EQ",
+    [IR_NE] = "NE",
+    [IR_NOT] = "NOT",
+    [IR_CALLN] = "CALLN",
+    [IR_LOOP] = "LOOP",
+};
+
+static const char* irTypes[] = {
+    [IRT_ANY] = "any",
+    [IRT_NUM] = "num",
+    [IRT_BOOL] = "bool",
+};
+
+void printTrace(VM* vm, Trace* trace, const char* title) {
+    ObjFunction* function = trace->closure->function;
+    printf("== trace %s (%s @ %d) ==\n", title,
+           function->name == NULL ? "script" : function->name->chars,
+           (int)(trace->header - function->chunk.code));
+
+    for (int i = 0; i < trace->irCount; i++) {
+        IRIns* ins = &trace->ir[i];
+        if (ins->op == IR_NOP) continue;
+        printf("%04d %-4s %-13s ", i, irTypes[ins->type], irNames[ins->op]);
+        switch (ins->op) {
+            case IR_CONST:
+                printValue(ins->value);
+                break;
+            case IR_SLOAD:
+                printf("#%d", ins->a);
+                break;
+            case IR_GLOAD:
+                printf("%s", AS_CSTRING(vm->globalNames.values[ins->a]));
+                break;
+            case IR_GSTORE:
+                printf("%s %04d", AS_CSTRING(vm->globalNames.values[ins->a]),
+                       ins->b);
+                break;
+            case IR_FLOAD:
+                printf("%04d .%d", ins->a, ins->b);
+                break;
+            case IR_FSTORE:
+                printf("%04d .%d %04d", ins->a, ins->b, ins->c);
+                break;
+            case IR_GUARD_VALUE:
+            case IR_GUARD_SHAPE:
+            case IR_GUARD_CLASS:
+                printf("%04d ", ins->a);
+                printValue(ins->value);
+                break;
+            case IR_GUARD_NUM:
+            case IR_GUARD_TRUTHY:
+            case IR_GUARD_FALSEY:
+            case IR_NEG:
+            case IR_NOT:
+                printf("%04d", ins->a);
+                break;
+            case IR_CALLN:
+                printValue(ins->value);
+                if (ins->c > 0) printf(" %04d", ins->a);
+                if (ins->c > 1) printf(" %04d", ins->b);
+                break;
+            case IR_LOOP:
+                break;
+            default:
+                printf("%04d %04d", ins->a, ins->b);
+                break;
+        }
+        if ((ins->op >= IR_GUARD_NUM && ins->op <= IR_GUARD_CLASS) ||
+            ins->op == IR_CALLN) {
+            printf("  -> %d", ins->snapshot);
+        }
+        printf("\n");
+    }
+}
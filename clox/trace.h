@@ -0,0 +1,160 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "object.h"
+#include "vm.h"
+
+/*
+Tracing jit
+
+Loops whose OP_LOOP back-edge runs TRACE_HOT_LOOPS times get recorded:
+run() hands every instruction of one iteration to the recorder before
+executing it, and the recorder turns it into a linear trace of IR with a
+guard wherever the iteration relied on a type, a branch direction or an
+object shape. Calls are inlined into the trace, natives that are pure
+and never allocate are called from it directly.
+
+The optimizer folds constants, drops guards already proven and forwards
+loads. The backend turns the IR into x86-64 that runs the loop until a
+guard fails; the side exit writes the stack slots the trace kept in
+registers back and rebuilds the CallFrames of any inlined calls, so
+the interpreter carries on exactly where the guard was.
+
+Each of the three parts only talks to the others through a Trace.
+*/
+
+// back-edges before a loop is recorded
+#define TRACE_HOT_LOOPS 50
+// back-edges before a loop whose recording was aborted is tried again
+#define TRACE_BACKOFF 1000
+#define TRACE_MAX_IR 1024
+#define TRACE_MAX_SNAPSHOTS 256
+#define TRACE_MAX_SNAPSHOT_ENTRIES 4096
+#define TRACE_MAX_SNAPSHOT_FRAMES 1024
+// slots above the trace frame's slots the trace may touch
+#define TRACE_MAX_SLOTS 256
+// depth of inlined calls
+#define TRACE_MAX_FRAMES 8
+// arguments of a native call the trace makes itself
+#define TRACE_MAX_NATIVE_ARGS 2
+
+typedef uint16_t IRRef;
+#define IR_NONE UINT16_MAX
+
+typedef enum {
+    IR_NOP,          // removed by the optimizer
+    IR_CONST,        // value
+    IR_SLOAD,        // a = stack slot
+    IR_GLOAD,        // a = global slot
+    IR_GSTORE,       // a = global slot, b = value
+    IR_FLOAD,        // a = instance, b = field index
+    IR_FSTORE,       // a = instance, b = field index, c = value
+    IR_GUARD_NUM,    // a is a number
+    IR_GUARD_TRUTHY, // a is neither nil nor false
+    IR_GUARD_FALSEY, // a is nil or false
+    IR_GUARD_VALUE,  // a is exactly value
+    IR_GUARD_SHAPE,  // a is an instance with the shape in value
+    IR_GUARD_CLASS,  // the class of instance a still has version b
+    IR_ADD,          // arithmetic on numbers a and b
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_NEG,
+    IR_LT,           // comparisons of numbers a and b
+    IR_GT,
+    IR_EQ,           // valuesEqual(a, b)
+    IR_NE,
+    IR_NOT,          // isFalsey(a)
+    IR_CALLN,        // native in value, its c arguments in a and b
+    IR_LOOP,         // back to the first instruction
+} IROp;
+
+typedef enum {
+    IRT_ANY,     // any boxed value
+    IRT_NUM,
+    IRT_BOOL,
+} IRType;
+
+typedef struct {
+    uint8_t op;
+    uint8_t type;
+    uint16_t snapshot;  // where guards exit to
+    IRRef a;
+    IRRef b;
+    IRRef c;
+    Value value;
+} IRIns;
+
+// what the interpreter needs to resume when a guard fails
+typedef struct {
+    uint8_t* ip;      // instruction to resume at in the innermost frame
+    int top;          // stack top, relative to the trace frame's slots
+    int frameCount;   // inlined frames active at the guard
+    int frameStart;   // into trace->frames
+    int entryStart;   // into trace->entries
+    int entryCount;
+} Snapshot;
+
+// a stack slot that holds something else than when the trace started
+typedef struct {
+    uint16_t slot;
+    IRRef ref;
+} SnapshotEntry;
+
+// a call inlined into the trace
+typedef struct {
+    ObjClosure* closure;
+    int base;           // its slots, relative to the trace frame's slots
+    uint8_t* returnIp;  // where its caller continues after it returns
+} SnapshotFrame;
+
+typedef struct Trace {
+    ObjClosure* closure;    // whose loop this is
+    uint8_t* header;        // first instruction of the loop
+    IRIns ir[TRACE_MAX_IR];
+    int irCount;
+    Snapshot snapshots[TRACE_MAX_SNAPSHOTS];
+    int snapshotCount;
+    SnapshotEntry entries[TRACE_MAX_SNAPSHOT_ENTRIES];
+    int entryCount;
+    SnapshotFrame frames[TRACE_MAX_SNAPSHOT_FRAMES];
+    int frameCount;
+    int maxSlot;            // highest slot the trace or its exits touch
+    int maxDepth;           // deepest inlining
+
+    uint8_t* code;          // from the backend, NULL if it gave up
+    size_t codeSize;
+    struct Trace* next;     // in the trace cache
+} Trace;
+
+// trace.c: hot loops, the trace cache, entering traces and side exits
+typedef struct TraceCache TraceCache;
+void initTraces(VM* vm);
+Trace* findTrace(VM* vm, uint8_t* header);
+// counts a back-edge, true once the loop should be recorded
+bool hotLoop(VM* vm, uint8_t* header);
+void enterTrace(VM* vm, Trace* trace, CallFrame* frame);
+// called by the machine code of a trace when a guard fails
+void traceExit(VM* vm, Trace* trace, int snapshot, uint64_t* values);
+// optimizes, assembles and installs a trace the recorder completed
+void finishTrace(VM* vm, Trace* trace);
+void abortTrace(VM* vm, Trace* trace);
+void markTraces(VM* vm);
+void freeTraces(VM* vm);
+void printTrace(VM* vm, Trace* trace, const char* title);
+
+// recorder.c
+bool startRecording(VM* vm, CallFrame* frame);
+// called with the state just before ip executes, false once recording stopped
+bool recordInstruction(VM* vm, CallFrame* frame, uint8_t* ip);
+// the trace being recorded, if any, so the gc can see what it refers to
+Trace* recordingTrace(VM* vm);
+void freeRecorder(VM* vm);
+
+// optimizer.c
+void optimizeTrace(VM* vm, Trace* trace);
+
+// tracegen.c
+bool assembleTrace(Trace* trace);
+
+#endif
@@ -0,0 +1,336 @@
+#include <stddef.h>
+
+#include "jit.h"
+#include "trace.h"
+#include "x64.h"
+
+#ifdef JIT_SUPPORTED
+
+/*
+Trace backend
+
+Every IR instruction gets a spill slot at [rsp + 8 * ref] in the frame of
+the trace's machine code; operands are loaded from there (constants as
+immediates) and each result is stored back. That keeps the code simple
+while still removing all dispatch, stack traffic and redundant checks.
+The spill area doubles as the values traceExit reads snapshot refs from.
+Above it sits room for a native call's arguments, laid out like on the
+stack: the result slot first, then the arguments.
+
+    rbx  the trace frame's slots
+    r13  the VM
+    r15  QNAN
+*/
+
+#define SLOTS   RBX
+#define VM_BASE R13
+
+static int32_t spillOffset(IRRef ref) {
+    return (int32_t)ref * (int32_t)sizeof(Value);
+}
+
+// of the first native argument, the result goes just below it
+static int32_t nativeArgsOffset(Trace* trace) {
+    return spillOffset((IRRef)trace->irCount) + (int32_t)sizeof(Value);
+}
+
+static void loadRef(Assembler* as, Trace* trace, Register reg, IRRef ref) {
+    IRIns* ins = &trace->ir[ref];
+    if (ins->op == IR_CONST) {
+        asmImmediate(as, reg, ins->value);
+    } else {
+        asmLoad(as, reg, RSP, spillOffset(ref));
+    }
+}
+
+static void storeRef(Assembler* as, IRRef ref, Register reg) {
+    asmStore(as, RSP, spillOffset(ref), reg);
+}
+
+// the snapshot index is the fixup target, resolved to its exit stub
+static void exitIf(Assembler* as, uint8_t condition, IRIns* guard) {
+    asmFixup(as, condition, guard->snapshot);
+}
+
+// rax = the object pointer inside rax
+static void emitUntag(Assembler* as) {
+    asmImmediate(as, RCX, ~(SIGN_BIT | QNAN));
+    asmRegisters(as, 0x21, RAX, RCX);
+}
+
+static void emitGlobals(Assembler* as, Register reg) {
+    asmLoad(as, reg, VM_BASE,
+            offsetof(VM, globalValues) + offsetof(ValueArray, values));
+}
+
+static void emitFields(Assembler* as, Trace* trace, IRRef instance) {
+    loadRef(as, trace, RAX, instance);
+    emitUntag(as);
+    asmLoad(as, RAX, RAX, offsetof(ObjInstance, fields));
+}
+
+static void emitArithmetic(Assembler* as, Trace* trace, IRIns* ins,
+                           uint8_t sse) {
+    loadRef(as, trace, RAX, ins->a);
+    loadRef(as, trace, RCX, ins->b);
+    asmToDoubles(as);
+    EMIT(as, 0xf2, 0x0f, sse, 0xc1);         // addsd/subsd/mulsd/divsd xmm0, xmm1
+    EMIT(as, 0x66, 0x48, 0x0f, 0x7e, 0xc0);  // movq rax, xmm0
+}
+
+static void emitComparison(Assembler* as, Trace* trace, IRIns* ins) {
+    loadRef(as, trace, RAX, ins->a);
+    loadRef(as, trace, RCX, ins->b);
+    asmToDoubles(as);
+    if (ins->op == IR_GT) {
+        EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);  // ucomisd xmm0, xmm1
+    } else {
+        EMIT(as, 0x66, 0x0f, 0x2e, 0xc8);  // ucomisd xmm1, xmm0
+    }
+    EMIT(as, 0x0f, 0x97, 0xc0);            // seta al, false for NaN
+    asmBoolFromAl(as);
+}
+
+// same as valuesEqual, without the number check when both are known numbers
+static void emitEquality(Assembler* as, Trace* trace, IRIns* ins) {
+    loadRef(as, trace, RAX, ins->a);
+    loadRef(as, trace, RCX, ins->b);
+    bool numbers = trace->ir[ins->a].type == IRT_NUM &&
+                   trace->ir[ins->b].type == IRT_NUM;
+    int notA = 0;
+    int notB = 0;
+    if (!numbers) {
+        notA = asmJumpIfNotNumber(as, RAX);
+        notB = asmJumpIfNotNumber(as, RCX);
+    }
+    asmToDoubles(as);
+    EMIT(as, 0x66, 0x0f, 0x2e, 0xc1);  // ucomisd xmm0, xmm1
+    EMIT(as, 0x0f, 0x94, 0xc0);        // sete al
+    EMIT(as, 0x0f, 0x9b, 0xc2);        // setnp dl, NaN is unordered
+    EMIT(as, 0x20, 0xd0);              // and al, dl
+    if (!numbers) {
+        int done = asmJump(as, JMP);
+        asmPatchHere(as, notA);
+        asmPatchHere(as, notB);
+        asmRegisters(as, 0x39, RAX, RCX);
+        EMIT(as, 0x0f, 0x94, 0xc0);    // sete al
+        asmPatchHere(as, done);
+    }
+    if (ins->op == IR_NE) EMIT(as, 0x34, 0x01);  // xor al, 1
+    asmBoolFromAl(as);
+}
+
+static void emitIns(Assembler* as, Trace* trace, IRRef ref, int loopStart) {
+    IRIns* ins = &trace->ir[ref];
+    switch (ins->op) {
+        case IR_NOP:
+        case IR_CONST:
+            return;
+        case IR_SLOAD:
+            asmLoad(as, RAX, SLOTS, ins->a * (int)sizeof(Value));
+            break;
+        case IR_GLOAD:
+            emitGlobals(as, RCX);
+            asmLoad(as, RAX, RCX, ins->a * (int)sizeof(Value));
+            break;
+        case IR_GSTORE:
+            loadRef(as, trace, RAX, ins->b);
+            emitGlobals(as, RCX);
+            asmStore(as, RCX, ins->a * (int)sizeof(Value), RAX);
+            return;
+        case IR_FLOAD:
+            emitFields(as, trace, ins->a);
+            asmLoad(as, RAX, RAX, ins->b * (int)sizeof(Value));
+            break;
+        case IR_FSTORE:
+            emitFields(as, trace, ins->a);
+            loadRef(as, trace, RCX, ins->c);
+            asmStore(as, RAX, ins->b * (int)sizeof(Value), RCX);
+            return;
+
+        case IR_GUARD_NUM:
+            loadRef(as, trace, RAX, ins->a);
+            asmFixupAt(as, asmJumpIfNotNumber(as, RAX), ins->snapshot);
+            return;
+        case IR_GUARD_TRUTHY:
+            loadRef(as, trace, RAX, ins->a);
+            asmImmediate(as, RCX, NIL_VAL);
+            asmRegisters(as, 0x39, RAX, RCX);
+            exitIf(as, JE, ins);
+            asmImmediate(as, RCX, FALSE_VAL);
+            asmRegisters(as, 0x39, RAX, RCX);
+            exitIf(as, JE, ins);
+            return;
+        case IR_GUARD_FALSEY: {
+            loadRef(as, trace, RAX, ins->a);
+            asmImmediate(as, RCX, NIL_VAL);
+            asmRegisters(as, 0x39, RAX, RCX);
+            int isNil = asmJump(as, JE);
+            asmImmediate(as, RCX, FALSE_VAL);
+            asmRegisters(as, 0x39, RAX, RCX);
+            exitIf(as, JNE, ins);
+            asmPatchHere(as, isNil);
+            return;
+        }
+        case IR_GUARD_VALUE:
+            loadRef(as, trace, RAX, ins->a);
+            asmImmediate(as, RCX, ins->value);
+            asmRegisters(as, 0x39, RAX, RCX);
+            exitIf(as, JNE, ins);
+            return;
+        case IR_GUARD_SHAPE:
+            loadRef(as, trace, RAX, ins->a);
+            asmRegisters(as, 0x89, RDX, RAX);
+            asmImmediate(as, RCX, SIGN_BIT | QNAN);
+            asmRegisters(as, 0x21, RDX, RCX);
+            asmRegisters(as, 0x39, RDX, RCX);
+            exitIf(as, JNE, ins);
+            emitUntag(as);
+            // cmp byte [rax + type], OBJ_INSTANCE
+            EMIT(as, 0x80, 0x78, (uint8_t)offsetof(Obj, type), OBJ_INSTANCE);
+            exitIf(as, JNE, ins);
+            asmLoad(as, RCX, RAX, offsetof(ObjInstance, shape));
+            asmImmediate(as, RDX, (uint64_t)(uintptr_t)AS_OBJ(ins->value));
+            asmRegisters(as, 0x39, RCX, RDX);
+            exitIf(as, JNE, ins);
+            return;
+        case IR_GUARD_CLASS:
+            // always after the shape guard, so a is an instance
+            loadRef(as, trace, RAX, ins->a);
+            emitUntag(as);
+            asmLoad(as, RAX, RAX, offsetof(ObjInstance, klass));
+            EMIT(as, 0x81, 0xb8);  // cmp dword [rax + version], imm32
+            asm32(as, offsetof(ObjClass, version));
+            asm32(as, (uint32_t)AS_NUMBER(ins->value));
+            exitIf(as, JNE, ins);
+            return;
+
+        case IR_ADD: emitArithmetic(as, trace, ins, 0x58); break;
+        case IR_SUB: emitArithmetic(as, trace, ins, 0x5c); break;
+        case IR_MUL: emitArithmetic(as, trace, ins, 0x59); break;
+        case IR_DIV: emitArithmetic(as, trace, ins, 0x5e); break;
+        case IR_NEG:
+            loadRef(as, trace, RAX, ins->a);
+            EMIT(as, 0x48, 0x0f, 0xba, 0xf8, 0x3f);  // btc rax, 63
+            break;
+        case IR_LT:
+        case IR_GT:
+            emitComparison(as, trace, ins);
+            break;
+        case IR_EQ:
+        case IR_NE:
+            emitEquality(as, trace, ins);
+            break;
+        case IR_NOT:
+            loadRef(as, trace, RAX, ins->a);
+            asmImmediate(as, RCX, NIL_VAL);
+            asmRegisters(as, 0x39, RAX, RCX);
+            EMIT(as, 0x0f, 0x94, 0xc2);  // sete dl
+            asmImmediate(as, RCX, FALSE_VAL);
+            asmRegisters(as, 0x39, RAX, RCX);
+            EMIT(as, 0x0f, 0x94, 0xc0);  // sete al
+            EMIT(as, 0x08, 0xd0);        // or al, dl
+            asmBoolFromAl(as);
+            break;
+
+        case IR_CALLN: {
+            int32_t args = nativeArgsOffset(trace);
+            if (ins->c > 0) {
+                loadRef(as, trace, RAX, ins->a);
+                asmStore(as, RSP, args, RAX);
+            }
+            if (ins->c > 1) {
+                loadRef(as, trace, RAX, ins->b);
+                asmStore(as, RSP, args + (int32_t)sizeof(Value), RAX);
+            }
+            asmRegisters(as, 0x89, RDI, VM_BASE);
+            asmByte(as, 0xbe);                // mov esi, argCount
+            asm32(as, ins->c);
+            EMIT(as, 0x48, 0x8d, 0x94, 0x24); // lea rdx, [rsp + args]
+            asm32(as, (uint32_t)args);
+            asmImmediate(as, RAX, HELPER(AS_NATIVE(ins->value)->function));
+            EMIT(as, 0xff, 0xd0);             // call rax
+            EMIT(as, 0x84, 0xc0);             // test al, al
+            exitIf(as, JE, ins);
+            asmLoad(as, RAX, RSP, args - (int32_t)sizeof(Value));
+            break;
+        }
+
+        case IR_LOOP: {
+            // the slots the iteration changed are all the next one needs
+            Snapshot* snapshot = &trace->snapshots[ins->snapshot];
+            for (int i = 0; i < snapshot->entryCount; i++) {
+                SnapshotEntry* entry =
+                    &trace->entries[snapshot->entryStart + i];
+                loadRef(as, trace, RAX, entry->ref);
+                asmStore(as, SLOTS, entry->slot * (int)sizeof(Value), RAX);
+            }
+            asmPatch(as, asmJump(as, JMP), loopStart);
+            return;
+        }
+    }
+    storeRef(as, ref, RAX);
+}
+
+bool assembleTrace(Trace* trace) {
+    Assembler as = {0};
+    // keeps rsp 16 byte aligned for the calls to natives and traceExit
+    int32_t frameSize = (((trace->irCount + TRACE_MAX_NATIVE_ARGS + 1) *
+                          (int)sizeof(Value) + 15) & ~15) + 8;
+
+    EMIT(&as, 0x55, 0x53);                 // push rbp; push rbx
+    EMIT(&as, 0x41, 0x54, 0x41, 0x55);     // push r12; push r13
+    EMIT(&as, 0x41, 0x56, 0x41, 0x57);     // push r14; push r15
+    EMIT(&as, 0x48, 0x81, 0xec);           // sub rsp, frameSize
+    asm32(&as, (uint32_t)frameSize);
+    asmRegisters(&as, 0x89, VM_BASE, RDI);
+    asmRegisters(&as, 0x89, SLOTS, RSI);
+    asmImmediate(&as, QNAN_REG, QNAN);
+
+    int loopStart = as.count;
+    for (int i = 0; i < trace->irCount; i++) {
+        emitIns(&as, trace, (IRRef)i, loopStart);
+    }
+
+    // one stub per snapshot passes its index to the shared exit
+    int stubs[TRACE_MAX_SNAPSHOTS];
+    int jumps[TRACE_MAX_SNAPSHOTS];
+    for (int i = 0; i < trace->snapshotCount; i++) {
+        stubs[i] = as.count;
+        asmByte(&as, 0xba);                // mov edx, snapshot
+        asm32(&as, (uint32_t)i);
+        jumps[i] = asmJump(&as, JMP);
+    }
+    as.exit = as.count;
+    for (int i = 0; i < trace->snapshotCount; i++) {
+        asmPatch(&as, jumps[i], as.exit);
+    }
+    asmRegisters(&as, 0x89, RDI, VM_BASE);
+    asmImmediate(&as, RSI, (uint64_t)(uintptr_t)trace);
+    asmRegisters(&as, 0x89, RCX, RSP);
+    asmImmediate(&as, RAX, HELPER(traceExit));
+    EMIT(&as, 0xff, 0xd0);                 // call rax
+    EMIT(&as, 0x48, 0x81, 0xc4);           // add rsp, frameSize
+    asm32(&as, (uint32_t)frameSize);
+    EMIT(&as, 0x41, 0x5f, 0x41, 0x5e);     // pop r15; pop r14
+    EMIT(&as, 0x41, 0x5d, 0x41, 0x5c);     // pop r13; pop r12
+    EMIT(&as, 0x5b, 0x5d, 0xc3);           // pop rbx; pop rbp; ret
+
+    for (int i = 0; i < as.fixupCount; i++) {
+        asmPatch(&as, as.fixups[i].at, stubs[as.fixups[i].target]);
+    }
+
+    trace->code = asmFinish(&as);
+    trace->codeSize = (size_t)as.count;
+    asmFree(&as);
+    return trace->code != NULL;
+}
+
+#else
+
+bool assembleTrace(Trace* trace) {
+    (void)trace;
+    return false;
+}
+
+#endif
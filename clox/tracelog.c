@@ -0,0 +1,206 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "tracelog.h"
+
+/*
+Execution trace
+
+--trace out.trace writes a TraceRecord for every instruction run()
+interprets: its function, offset, opcode and the stack depth, 16 bytes
+each. The file is a header and a ring of TRACE_LOG_RECORDS records mapped
+shared, so the records land in the page cache as they are written and the
+last million or so instructions are there to look at afterwards even if
+the process dies. The header counts every record ever written, which
+tells where the ring starts.
+
+run() has a second dispatch table with every opcode going to a label that
+logs the instruction and then jumps to its handler, and only uses it while
+vm->traceLog is set, the way it goes past the trace recorder. With no
+--trace the interpreter runs exactly as it would without any of this.
+
+The records name functions by ObjFunction.id, the order the vm made them
+in. Compiling the same script again makes the same functions in the same
+order, so --decode-trace compiles it and has debug.c disassemble each
+record's instruction from the function with its id. Machine code from the
+jits runs no handlers and leaves no records.
+*/
+
+#define TRACE_LOG_MAGIC "LOXTRACE"
+#define TRACE_LOG_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t capacity;
+    // every record ever written, the ring starts at written % capacity
+    // once it has wrapped
+    uint64_t written;
+    // the mode the script was compiled in, for the decoder
+    uint8_t registerMode;
+    uint8_t padding[39];
+} TraceLogHeader;
+
+struct TraceLog {
+    TraceLogHeader* header;
+    TraceRecord* records;
+    size_t size;
+};
+
+static size_t traceLogSize(uint32_t capacity) {
+    return sizeof(TraceLogHeader) + sizeof(TraceRecord) * (size_t)capacity;
+}
+
+bool openTraceLog(VM* vm, const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return false;
+    size_t size = traceLogSize(TRACE_LOG_RECORDS);
+    if (ftruncate(fd, (off_t)size) == -1) {
+        close(fd);
+        return false;
+    }
+    void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // the mapping keeps the file
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+
+    TraceLog* log = malloc(sizeof(TraceLog));
+    if (log == NULL) {
+        munmap(mapped, size);
+        return false;
+    }
+    log->header = mapped;
+    log->records = (TraceRecord*)(log->header + 1);
+    log->size = size;
+    memcpy(log->header->magic, TRACE_LOG_MAGIC, 8);
+    log->header->version = TRACE_LOG_VERSION;
+    log->header->capacity = TRACE_LOG_RECORDS;
+    log->header->written = 0;
+    log->header->registerMode = vm->registerMode;
+    vm->traceLog = log;
+    return true;
+}
+
+void logInstruction(VM* vm, CallFrame* frame, uint8_t* ip, Value* sp) {
+    TraceLog* log = vm->traceLog;
+    uint64_t written = log->header->written;
+    TraceRecord* record = &log->records[written & (TRACE_LOG_RECORDS - 1)];
+    ObjFunction* function = frame->closure->function;
+    record->function = function->id;
+    record->offset = (uint32_t)(ip - function->chunk.code);
+    record->stackDepth = (uint32_t)(sp - vm->stack);
+    record->opcode = *ip;
+    log->header->written = written + 1;
+}
+
+void closeTraceLog(VM* vm) {
+    TraceLog* log = vm->traceLog;
+    if (log == NULL) return;
+    vm->traceLog = NULL;
+    munmap(log->header, log->size);
+    free(log);
+}
+
+// decoding
+
+typedef struct {
+    ObjFunction** functions;
+    uint32_t count;
+} FunctionIndex;
+
+static bool indexFunctions(VM* vm, FunctionIndex* index) {
+    uint32_t count = vm->nextFunctionId;
+    index->functions = calloc(count == 0 ? 1 : count, sizeof(ObjFunction*));
+    if (index->functions == NULL) return false;
+    index->count = count;
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        if (object->type != OBJ_FUNCTION) continue;
+        ObjFunction* function = (ObjFunction*)object;
+        if (function->id < count) index->functions[function->id] = function;
+    }
+    return true;
+}
+
+static void printRecord(VM* vm, FunctionIndex* index, TraceRecord* record) {
+    ObjFunction* function = record->function < index->count
+                                ? index->functions[record->function]
+                                : NULL;
+    if (function == NULL || record->offset >= (uint32_t)function->chunk.count) {
+        // from some other script, or sent over by an isolate
+        char name[24];
+        snprintf(name, sizeof(name), "<fn #%u>", record->function);
+        printf("%6u %-12s %-22s %04u\n", record->stackDepth, name,
+               opcodeName(record->opcode), record->offset);
+        return;
+    }
+
+    printf("%6u %-12s ", record->stackDepth,
+           function->name == NULL ? "script" : function->name->chars);
+    // the quickened form it ran as, if any
+    uint8_t compiled = function->chunk.code[record->offset];
+    printf("%-22s ", compiled == record->opcode ? ""
+                                                : opcodeName(record->opcode));
+    disassembleInstruction(vm, &function->chunk, (int)record->offset);
+}
+
+bool decodeTraceLog(VM* vm, const char* path, const char* source) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+    off_t fileSize = lseek(fd, 0, SEEK_END);
+    if (fileSize < (off_t)sizeof(TraceLogHeader)) {
+        fprintf(stderr, "\"%s\" is no trace.\n", path);
+        close(fd);
+        return false;
+    }
+    TraceLogHeader* header = mmap(NULL, (size_t)fileSize, PROT_READ,
+                                  MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) return false;
+    if (memcmp(header->magic, TRACE_LOG_MAGIC, 8) != 0 ||
+        header->version != TRACE_LOG_VERSION ||
+        (size_t)fileSize < traceLogSize(header->capacity)) {
+        fprintf(stderr, "\"%s\" is no trace.\n", path);
+        munmap(header, (size_t)fileSize);
+        return false;
+    }
+
+    vm->registerMode = header->registerMode;
+    ObjFunction* script = compile(vm, source);
+    if (script == NULL) {
+        munmap(header, (size_t)fileSize);
+        return false;
+    }
+    push(vm, OBJ_VAL(script));
+    FunctionIndex index;
+    if (!indexFunctions(vm, &index)) {
+        munmap(header, (size_t)fileSize);
+        return false;
+    }
+
+    TraceRecord* records = (TraceRecord*)(header + 1);
+    uint64_t written = header->written;
+    uint64_t first = written > header->capacity ? written - header->capacity
+                                                : 0;
+    printf("%llu instructions, the last %llu of them:\n",
+           (unsigned long long)written, (unsigned long long)(written - first));
+    printf(" stack function     ran as                 offset line instruction\n");
+    for (uint64_t i = first; i < written; i++) {
+        printRecord(vm, &index, &records[i % header->capacity]);
+    }
+
+    pop(vm);
+    free(index.functions);
+    munmap(header, (size_t)fileSize);
+    return true;
+}
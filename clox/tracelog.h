@@ -0,0 +1,34 @@
+#ifndef clox_tracelog_h
+#define clox_tracelog_h
+
+#include "common.h"
+#include "vm.h"
+
+// records the ring of a --trace file holds, the newest ones win
+#define TRACE_LOG_RECORDS (1 << 20)
+
+// one instruction run() executed
+typedef struct {
+    // ObjFunction.id of the function it is in
+    uint32_t function;
+    uint32_t offset;
+    // values on the stack before it ran
+    uint32_t stackDepth;
+    // as executed, which quickening may have changed from the compiled one
+    uint8_t opcode;
+    uint8_t padding[3];
+} TraceRecord;
+
+typedef struct TraceLog TraceLog;
+
+// maps path as the ring every instruction run() interprets from now on
+// is written to; false if it could not be created
+bool openTraceLog(VM* vm, const char* path);
+void logInstruction(VM* vm, CallFrame* frame, uint8_t* ip, Value* sp);
+void closeTraceLog(VM* vm);
+
+// compiles source, the script the trace at path was written by, and
+// prints the trace's records oldest first with the instruction each ran
+bool decodeTraceLog(VM* vm, const char* path, const char* source);
+
+#endif
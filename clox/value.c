@@ -11,11 +11,11 @@ void initValueArray(ValueArray* array) {
     array->count = 0;
 }
 
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
   if (array->capacity < array->count + 1) {
     int oldCapacity = array->capacity;
     array->capacity = GROW_CAPACITY(oldCapacity);
-    array->values = GROW_ARRAY(Value, array->values,
+    array->values = GROW_ARRAY(vm, Value, array->values,
                                oldCapacity, array->capacity);
   }
 
@@ -23,8 +23,8 @@ void writeValueArray(ValueArray* array, Value value) {
   array->count++;
 }
 
-void freeValueArray(ValueArray* array) {
-  FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+  FREE_ARRAY(vm, Value, array->values, array->capacity);
   initValueArray(array);
 }
 
@@ -49,6 +49,7 @@ void printValue(Value value) {
     case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
     case VAL_INT: printf("%g", AS_NUMBER(value)); break;
     case VAL_OBJ: printObject(value); break;
+    case VAL_UNDEFINED: break;
   }
 #endif
 }
@@ -1,4 +1,6 @@
+#include <math.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -6,33 +8,53 @@
 #include "common.h"
 #include "memory.h"
 #include "object.h"
+#include "bytecode.h"
 #include "compiler.h"
 #include "debug.h"
+#include "event.h"
+#include "fiber.h"
+#include "isolate.h"
+#include "jit.h"
+#include "ngram.h"
+#include "register.h"
+#include "stats.h"
+#include "trace.h"
+#include "tracelog.h"
 #include "vm.h"
 #include "value.h"
 
-VM vm; 
+// calls a runtime error prints at either end of a deep stack trace
+#define TRACE_EDGE_FRAMES 32
 
-static Value clockNative(int argCount, Value* args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(VM* vm, int argCount, Value* args) {
+    args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
 }
 
-static void resetStack() {
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+static bool sqrtNative(VM* vm, int argCount, Value* args) {
+    if (!IS_NUMBER(args[0])) {
+        vm->nativeError = "Argument to sqrt must be a number.";
+        return false;
+    }
+    args[-1] = NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+    return true;
 }
 
-static void runtimeError(const char* format, ...) {
-    // args represents the ... in the function input
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fputs("\n", stderr);
+static void resetStack(VM* vm) {
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
+}
 
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
+static void printFrames(VM* vm) {
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        // deep recursion only shows its innermost and outermost calls
+        if (i == vm->frameCount - 1 - TRACE_EDGE_FRAMES &&
+            i >= 2 * TRACE_EDGE_FRAMES) {
+            fprintf(stderr, "[... %d more calls]\n", i + 1 - TRACE_EDGE_FRAMES);
+            i = TRACE_EDGE_FRAMES - 1;
+        }
+        CallFrame* frame = &vm->frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
         fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
@@ -42,163 +64,577 @@ static void runtimeError(const char* format, ...) {
             fprintf(stderr, "%s()\n", function->name->chars);
         }
     }
-    resetStack();
 }
 
-static void defineNative(const char* name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+void runtimeError(VM* vm, const char* format, ...) {
+    // args represents the ... in the function input
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
+
+    // the fibers that resumed the failing one end along with it, their
+    // frames carry on the trace
+    do {
+        printFrames(vm);
+    } while (unwindFiber(vm));
+    resetStack(vm);
 }
 
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+void defineNative(VM* vm, const char* name, NativeFn function, int arity,
+                  uint8_t flags) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function, arity, flags)));
+    int slot = globalSlot(vm, AS_STRING(vm->stack[0]));
+    vm->globalValues.values[slot] = vm->stack[1];
+    pop(vm);
+    pop(vm);
+}
 
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
+// slot of the global called name, adding an undefined one the first
+// time the name is seen so code can refer to globals defined later
+int globalSlot(VM* vm, ObjString* name) {
+    Value slot;
+    if (tableGet(&vm->globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
 
+    // keep the name reachable while the arrays and table grow
+    push(vm, OBJ_VAL(name));
+    int index = vm->globalValues.count;
+    writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+    writeValueArray(vm, &vm->globalNames, OBJ_VAL(name));
+    tableSet(vm, &vm->globalSlots, name, NUMBER_VAL((double)index));
+    pop(vm);
+    return index;
+}
 
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+// moves the stack into an array of capacity values, taking every pointer
+// into it along: the frames' slots, the stack top and the open upvalues.
+// every frame has a callee slot of its own, so there are never more frames
+// than values and the frames are sized along with the stack
+static void resizeStack(VM* vm, int capacity) {
+    int oldCapacity = (int)(vm->stackEnd - vm->stack);
+    int count = (int)(vm->stackTop - vm->stack);
+    // the gc may run here and still sees the old arrays
+    Value* stack = ALLOCATE(vm, Value, capacity);
+    CallFrame* frames = ALLOCATE(vm, CallFrame, capacity);
+    // the first stack has no old one to copy from
+    if (count > 0) memcpy(stack, vm->stack, sizeof(Value) * count);
+    for (int i = 0; i < vm->frameCount; i++) {
+        frames[i] = vm->frames[i];
+        frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL;
+         upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+    Value* oldStack = vm->stack;
+    CallFrame* oldFrames = vm->frames;
 
-    // to avoid GC being triggered and runnning and reading vm.initString before it has been initialized
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+    vm->stack = stack;
+    vm->frames = frames;
+    vm->stackTop = stack + count;
+    vm->stackEnd = stack + capacity;
+    // only a grown stack is worth shrinking, once it is mostly unused
+    vm->stackLow = capacity > STACK_INITIAL ? stack + capacity / 8 : stack;
+    // the profiler's signal handler never sees the old frames freed
+    atomic_signal_fence(memory_order_release);
+    FREE_ARRAY(vm, Value, oldStack, oldCapacity);
+    FREE_ARRAY(vm, CallFrame, oldFrames, oldCapacity);
+}
 
-    defineNative("clock", clockNative);
+bool reserveStack(VM* vm, Value* base, int count) {
+    int needed = (int)(base - vm->stack) + count + STACK_HEADROOM;
+    int capacity = (int)(vm->stackEnd - vm->stack);
+    if (needed <= capacity) return true;
+    if (needed > vm->stackLimit) return false;
+
+    while (capacity < needed) capacity *= 2;
+    if (capacity > vm->stackLimit) capacity = vm->stackLimit;
+    resizeStack(vm, capacity);
+    return true;
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    vm.initString = NULL;
-    freeObjects();
+void initStack(VM* vm, int capacity) {
+    vm->stack = NULL;
+    vm->stackEnd = NULL;
+    vm->frames = NULL;
+    resetStack(vm);
+    resizeStack(vm, capacity);
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+// a return left most of a grown stack unused; hands back what no live
+// frame reserved when it was called
+static void shrinkStack(VM* vm) {
+    int needed = (int)(vm->stackTop - vm->stack);
+    for (int i = 0; i < vm->frameCount; i++) {
+        CallFrame* frame = &vm->frames[i];
+        int top = (int)(frame->slots - vm->stack) +
+                  frame->closure->function->maxSlots + STACK_HEADROOM;
+        if (top > needed) needed = top;
+    }
+
+    int capacity = (int)(vm->stackEnd - vm->stack);
+    int shrunk = capacity;
+    while (shrunk / 2 >= STACK_INITIAL && shrunk / 4 >= needed) shrunk /= 2;
+    if (shrunk == capacity) {
+        // the frames still need the room, no use trying on every return
+        // until the stack has grown again
+        vm->stackLow = vm->stack;
+        return;
+    }
+    resizeStack(vm, shrunk);
 }
 
-void push(Value value) {
-  *vm.stackTop = value;
-  vm.stackTop++;
+void initVM(VM* vm) {
+    // the gc can run from the first allocation on, so every root has to
+    // be in a sane state before anything is allocated
+    vm->stack = NULL;
+    vm->stackEnd = NULL;
+    vm->frames = NULL;
+    resetStack(vm);
+    vm->initString = NULL;
+    vm->nativeError = NULL;
+    vm->fiber = NULL;
+    vm->fibers = NULL;
+    vm->switched = false;
+    vm->suspended = false;
+    vm->receiving = NULL;
+    vm->decoder = NULL;
+    vm->loop = NULL;
+    vm->noEvents = false;
+    initValueArray(&vm->hostValues);
+    vm->objects = NULL;
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->gcCount = 0;
+    vm->nextClassVersion = 0;
+    vm->nextFunctionId = 0;
+    vm->traceLog = NULL;
+    vm->bytecodeReader = NULL;
+    vm->bytecodeFiles = NULL;
+
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->registerMode = false;
+    vm->jitMode = false;
+    vm->traceMode = false;
+    vm->dumpTraces = false;
+    vm->recording = false;
+    vm->profiling = false;
+    vm->quicken = true;
+    vm->parser = NULL;
+    initTraces(vm);
+
+    initTable(&vm->globalSlots);
+    initValueArray(&vm->globalValues);
+    initValueArray(&vm->globalNames);
+    initTable(&vm->strings);
+
+    vm->stackLimit = STACK_LIMIT;
+    resizeStack(vm, STACK_INITIAL);
+    vm->fiber = newFiber(vm, NULL);
+
+    vm->initString = copyString(vm, "init", 4);
+
+    defineNative(vm, "clock", clockNative, 0, NATIVE_NO_GC);
+    defineNative(vm, "sqrt", sqrtNative, 1, NATIVE_PURE | NATIVE_NO_GC);
+    defineIsolateNatives(vm);
+    defineFiberNatives(vm);
+    defineEventNatives(vm);
 }
 
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+void freeVM(VM* vm) {
+    freeTable(vm, &vm->globalSlots);
+    freeValueArray(vm, &vm->globalValues);
+    freeValueArray(vm, &vm->globalNames);
+    freeValueArray(vm, &vm->hostValues);
+    freeTable(vm, &vm->strings);
+    vm->initString = NULL;
+    FREE_ARRAY(vm, Value, vm->stack, vm->stackEnd - vm->stack);
+    FREE_ARRAY(vm, CallFrame, vm->frames, vm->stackEnd - vm->stack);
+    freeTraces(vm);
+    freeEventLoop(vm);
+    closeTraceLog(vm);
+    freeObjects(vm);
+    freeBytecodeFiles(vm);
+
+#ifdef DEBUG_PROFILE_NGRAMS
+    printNgramProfile();
+#endif
+}
+
+Value pop(VM* vm) {
+    vm->stackTop--;
+    return *vm->stackTop;
+}
+
+void push(VM* vm, Value value) {
+  *vm->stackTop = value;
+  vm->stackTop++;
+}
+
+static Value peek(VM* vm, int distance) {
+    return vm->stackTop[-1 - distance];
+}
+
+static void countCall(VM* vm, ObjFunction* function) {
+#ifdef DEBUG_STATS
+    function->calls++;
+#endif
+    if (vm->jitMode && ++function->callCount == JIT_HOT_CALLS) {
+        // functions the jit can not handle simply stay interpreted
+        jitCompile(function);
+    }
 }
 
 // runs the code inside the function
-static bool call(ObjClosure* closure, int argCount) {
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
     // check if user is inputting too many arguments into function 
     if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
 
-    // need to ensure theat the CallFrames array doesent overflow
-    if (vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
+    countCall(vm, closure->function);
+
+    // the only bounds check: pushes inside the function, and whatever the
+    // runtime and natives push on top of them, can then not go past the
+    // slots it reserved, and the frames grow with the stack
+    Value* slots = vm->stackTop - argCount - 1;
+    if (vm->stackEnd - slots <
+            closure->function->maxSlots + STACK_HEADROOM &&
+        !reserveStack(vm, slots, closure->function->maxSlots)) {
+        runtimeError(vm, "Stack overflow.");
         return false;
     }
 
     // create new frame
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    CallFrame* frame = &vm->frames[vm->frameCount];
     frame->closure = closure; 
     frame->ip = closure->function->chunk.code;
     // -1 is to account for stack slot 0 which the compiler set aside for when we add methods later
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm->stackTop - argCount - 1;
+    // counted once whole, for the profiler's signal handler
+    atomic_signal_fence(memory_order_release);
+    vm->frameCount++;
+    return true;
+}
+
+// natives run on the caller's stack without a frame of their own, the
+// result lands in the callee slot just below args
+static inline bool callNative(VM* vm, ObjNative* native, int argCount,
+                              Value* args) {
+    if (native->arity != -1 && argCount != native->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", native->arity,
+                     argCount);
+        return false;
+    }
+    if (!native->function(vm, argCount, args)) {
+        if (!vm->suspended && !vm->switched) {
+            runtimeError(vm, "%s", vm->nativeError);
+        }
+        return false;
+    }
     return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM* vm, Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
                ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-                vm.stackTop[-argCount - 1] = bound->receiver;
-                return call(bound->method, argCount);
+                vm->stackTop[-argCount - 1] = bound->receiver;
+                return call(vm, bound->method, argCount);
             } 
             case OBJ_CLASS: {
                 ObjClass* klass = AS_CLASS(callee);
-                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
                 Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                if (tableGet(&klass->methods, vm->initString, &initializer)) {
+                    return call(vm, AS_CLOSURE(initializer), argCount);
                 } else if (argCount != 0) {
-                runtimeError("Expect 0 arguments but got %d.", argCount);
+                runtimeError(vm, "Expect 0 arguments but got %d.", argCount);
                     return false;
                 }
                 return true;
             }
             case OBJ_CLOSURE: 
-                return call(AS_CLOSURE(callee), argCount);
+                return call(vm, AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
+                // a lox caller reserved the headroom with its own slots,
+                // a host calling in may be right at the end of the stack
+                if (vm->stackEnd - vm->stackTop < STACK_HEADROOM &&
+                    !reserveStack(vm, vm->stackTop, 0)) {
+                    runtimeError(vm, "Stack overflow.");
+                    return false;
+                }
+                Value* args = vm->stackTop - argCount;
+                if (!callNative(vm, AS_NATIVE(callee), argCount, args)) {
+                    // another fiber runs now, its frame gets loaded like
+                    // the one of a call
+                    if (vm->switched) {
+                        vm->switched = false;
+                        return true;
+                    }
+                    // a suspended call only keeps the slot for its result
+                    if (vm->suspended) vm->stackTop = args;
+                    return false;
+                }
+                vm->stackTop = args;
                 return true;
             }
             default: 
                 break;
         }
     }
-    runtimeError("Can only call functions and classes");
+    runtimeError(vm, "Can only call functions and classes");
     return false;
 }
 
-static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
+// a call in return position: a lox callee takes over the caller's frame and
+// stack window, so tail recursion runs in constant space
+static bool tailCall(VM* vm, Value callee, int argCount) {
+    ObjClosure* closure;
+    if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+    } else if (IS_BOUND_METHOD(callee)) {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        closure = bound->method;
+    } else {
+        // natives and classes are called as usual, the OP_RETURN after the
+        // call then returns their result
+        return callValue(vm, callee, argCount);
+    }
+
+    if (argCount != closure->function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", closure->function->arity, argCount);
+        return false;
+    }
+    countCall(vm, closure->function);
+
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    if (vm->stackEnd - frame->slots <
+            closure->function->maxSlots + STACK_HEADROOM &&
+        !reserveStack(vm, frame->slots, closure->function->maxSlots)) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    // the caller's locals are about to be overwritten by the arguments
+    closeUpvalues(vm, frame->slots);
+    Value* args = vm->stackTop - argCount - 1;
+    memmove(frame->slots, args, sizeof(Value) * (argCount + 1));
+    vm->stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
+}
+
+static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name, int argCount) {
     Value method;
     if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    return call(vm, AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
-    Value receiver = peek(argCount);
+// replaces the receiver on top of the stack with method bound to it
+static void bindClosure(VM* vm, Value method) {
+    ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+    pop(vm);
+    push(vm, OBJ_VAL(bound));
+}
 
-    if (!IS_INSTANCE(receiver)) {
-        runtimeError("Only instances have methods.");
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
+    Value method;
+    // report runtime error if name not found in method table
+    if (!tableGet(&klass->methods, name, &method)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
 
-    ObjInstance* instance = AS_INSTANCE(receiver);
-    Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+    bindClosure(vm, method);
+    return true;
+}
+
+/*
+Inline caches
+
+Every property and invoke instruction has an InlineCache remembering how
+its name resolved for the last few instance shapes it saw. A shape fixes
+which slot every field lives in, so a cached field is just an index into
+the instance's fields, and a cached method is known not to be shadowed by
+a field since the shape has none with that name. Entries also remember
+the version of the class, which changes whenever OP_METHOD or OP_INHERIT
+touch the methods, so entries for old methods simply never match again.
+
+Instances in dictionary mode have no shape and always take the slow path.
+*/
+
+static InlineCacheEntry* findCacheEntry(InlineCache* cache, ObjClass* klass,
+                                        ObjShape* shape) {
+    for (int i = 0; i < cache->count && i < IC_POLYMORPHIC_MAX; i++) {
+        InlineCacheEntry* entry = &cache->entries[i];
+        if (entry->shape == shape && entry->classVersion == klass->version) {
+            return entry;
+        }
     }
+    return NULL;
+}
 
-    return invokeFromClass(instance->klass, name, argCount);
+static void updateCache(InlineCache* cache, ObjClass* klass, ObjShape* shape,
+                        int fieldIndex, Value method, ObjShape* transition) {
+    if (cache->count == IC_MEGAMORPHIC || shape == NULL) return;
+
+    InlineCacheEntry* entry = findCacheEntry(cache, klass, shape);
+    if (entry == NULL) {
+        if (cache->count == IC_POLYMORPHIC_MAX) {
+            // too many shapes through here, stop caching for good
+            cache->count = IC_MEGAMORPHIC;
+            return;
+        }
+        entry = &cache->entries[cache->count++];
+        entry->classVersion = klass->version;
+        entry->shape = shape;
+    }
+    entry->fieldIndex = fieldIndex;
+    entry->method = method;
+    entry->transition = transition;
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {
+// slot of name in the instance, -1 if it has no such field or is a dictionary
+static int fieldSlot(ObjInstance* instance, ObjString* name) {
+    if (instance->shape == NULL) return -1;
+    return shapeSlot(instance->shape, name);
+}
+
+// replaces the instance on top of the stack with its property name
+bool getProperty(VM* vm, InlineCache* cache, ObjString* name) {
+    if (!IS_INSTANCE(peek(vm, 0))) {
+        runtimeError(vm, "Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+    InlineCacheEntry* entry =
+        findCacheEntry(cache, instance->klass, instance->shape);
+    if (entry != NULL) {
+        if (entry->fieldIndex == -1) {
+            bindClosure(vm, entry->method);
+        } else {
+            vm->stackTop[-1] = instance->fields[entry->fieldIndex];
+        }
+        return true;
+    }
+
+    int slot = fieldSlot(instance, name);
+    if (slot != -1) {
+        updateCache(cache, instance->klass, instance->shape, slot, NIL_VAL, NULL);
+        vm->stackTop[-1] = instance->fields[slot];
+        return true;
+    }
+
+    Value value;
+    if (instance->shape == NULL &&
+        tableGet(&instance->dictionary, name, &value)) {
+        vm->stackTop[-1] = value;
+        return true;
+    }
+
     Value method;
-    // report runtime error if name not found in method table
-    if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+    if (!tableGet(&instance->klass->methods, name, &method)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
+    updateCache(cache, instance->klass, instance->shape, -1, method, NULL);
+    bindClosure(vm, method);
+    return true;
+}
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-    pop();
-    push(OBJ_VAL(bound));
+// stores the value on top of the stack into the instance below it
+bool setProperty(VM* vm, InlineCache* cache, ObjString* name) {
+    if (!IS_INSTANCE(peek(vm, 1))) {
+        runtimeError(vm, "Only instances have fields.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+    InlineCacheEntry* entry =
+        findCacheEntry(cache, instance->klass, instance->shape);
+    if (entry != NULL && entry->transition == NULL) {
+        instance->fields[entry->fieldIndex] = peek(vm, 0);
+    } else if (entry != NULL &&
+               instance->fieldCapacity >= entry->transition->fieldCount) {
+        // adding the field, the array only needs to grow on the slow path
+        instance->fields[entry->fieldIndex] = peek(vm, 0);
+        instance->shape = entry->transition;
+    } else {
+        ObjShape* before = instance->shape;
+        instanceSetField(vm, instance, name, peek(vm, 0));
+
+        ObjShape* after = instance->shape;
+        if (after != NULL) {
+            updateCache(cache, instance->klass, before,
+                        shapeSlot(after, name), NIL_VAL,
+                        after == before ? NULL : after);
+        }
+    }
+
+    Value value = pop(vm);
+    pop(vm);
+    push(vm, value);
     return true;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
+static bool invoke(VM* vm, InlineCache* cache, ObjString* name, int argCount) {
+    Value receiver = peek(vm, argCount);
+
+    if (!IS_INSTANCE(receiver)) {
+        runtimeError(vm, "Only instances have methods.");
+        return false;
+    }
+
+    ObjInstance* instance = AS_INSTANCE(receiver);
+    InlineCacheEntry* entry =
+        findCacheEntry(cache, instance->klass, instance->shape);
+    if (entry != NULL) {
+        if (entry->fieldIndex == -1) {
+            return call(vm, AS_CLOSURE(entry->method), argCount);
+        }
+        Value value = instance->fields[entry->fieldIndex];
+        vm->stackTop[-argCount - 1] = value;
+        return callValue(vm, value, argCount);
+    }
+
+    Value value;
+    int slot = fieldSlot(instance, name);
+    if (slot != -1) {
+        updateCache(cache, instance->klass, instance->shape, slot, NIL_VAL, NULL);
+        value = instance->fields[slot];
+        vm->stackTop[-argCount - 1] = value;
+        return callValue(vm, value, argCount);
+    }
+    if (instance->shape == NULL &&
+        tableGet(&instance->dictionary, name, &value)) {
+        vm->stackTop[-argCount - 1] = value;
+        return callValue(vm, value, argCount);
+    }
+
+    Value method;
+    if (!tableGet(&instance->klass->methods, name, &method)) {
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
+        return false;
+    }
+    updateCache(cache, instance->klass, instance->shape, -1, method, NULL);
+    return call(vm, AS_CLOSURE(method), argCount);
+}
+
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
     ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
+    ObjUpvalue* upvalue = vm->openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
         upvalue = upvalue->next;
@@ -207,13 +643,13 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     if (upvalue != NULL && upvalue->location == local) {
         return upvalue;
     }
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
+    ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
     createdUpvalue->next = upvalue;
 
     // if new linked list create it as the head 
     // if not set head of linked list pointer to newUpvalued w
     if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     } else {
         prevUpvalue->next = createdUpvalue;
     }
@@ -221,355 +657,962 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
+void closeUpvalues(VM* vm, Value* last) {
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->openUpvalues;
         // closing an upvalue
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        vm->openUpvalues = upvalue->next;
     }
 }
 
-static void defineMethod(ObjString* name) {
-  Value method = peek(0);
-  ObjClass* klass = AS_CLASS(peek(1));
-  tableSet(&klass->methods, name, method);
-  pop();
+static void defineMethod(VM* vm, ObjString* name) {
+  Value method = peek(vm, 0);
+  ObjClass* klass = AS_CLASS(peek(vm, 1));
+  tableSet(vm, &klass->methods, name, method);
+  // drop every inline cache entry filled for the old methods
+  klass->version = vm->nextClassVersion++;
+  pop(vm);
 }
 
-static bool isFalsey(Value value) {
+bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
-
+// a and b must stay reachable by the gc until this returns
+static ObjString* concatenateStrings(VM* vm, ObjString* a, ObjString* b) {
     int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
+    char* chars = ALLOCATE(vm, char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
 
-    ObjString* result = takeString(chars, length);
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+    return takeString(vm, chars, length);
+}
+
+void concatenate(VM* vm) {
+    ObjString* b = AS_STRING(peek(vm, 0));
+    ObjString* a = AS_STRING(peek(vm, 1));
+
+    ObjString* result = concatenateStrings(vm, a, b);
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
 }
 
 
-static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(VM* vm, CallFrame* frame) {
+    printf("          ");
+    for (Value* slot = vm->stack + 1; slot < vm->stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+
+    // get ip to point to relative offset from beginning of bytecode
+    disassembleInstruction(vm, &frame->closure->function->chunk, 
+        (int)(frame->ip - frame->closure->function->chunk.code));
+}
+#endif
+
+static InterpretResult run(VM* vm) {
+    // the state of the running frame lives in locals the compiler can keep in
+    // registers; frame->ip and vm->stackTop are only brought up to date when
+    // something outside run() looks at them: calls, returns, allocation,
+    // errors and the jits
+    CallFrame* frame;
+    uint8_t* ip;
+    Value* sp;
+    Value* slots;
+    Value* constants;
+    // operands of the calls, read by the long forms before they join them
+    int argCount;
+    ObjString* method;
+
+#define STORE_FRAME() (frame->ip = ip, vm->stackTop = sp)
+// picks up whichever frame is on top now, after a call, return or trace exit
+#define LOAD_FRAME() \
+    (frame = &vm->frames[vm->frameCount - 1], \
+     ip = frame->ip, \
+     sp = vm->stackTop, \
+     slots = frame->slots, \
+     constants = frame->closure->function->chunk.constants.values)
 
-#define READ_BYTE() (*frame->ip++) // reads byte pointed at by ip then advances it
+    LOAD_FRAME();
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define DROP() (--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define READ_BYTE() (*ip++) // reads byte pointed at by ip then advances it
 
 // reads next byte from teh bytecode, treats the resulting number as an index
     // and looks up the corresponding Value in the chunk's constant table.
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
 // yanks next two bytes from chunk and builds a 16-bit unsigned integer out of them
 #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
+// 32-bit offset of the long jumps
+#define READ_INT() \
+    (ip += 4, \
+    ((uint32_t)ip[-4] << 24) | (ip[-3] << 16) | (ip[-2] << 8) | ip[-1])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op) \
+#define READ_CACHE() \
+    (&frame->closure->function->chunk.caches[READ_SHORT()])
+// runtimeError reads the line and the stack trace from the frames
+#define RUNTIME_ERROR(...) \
     do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+      STORE_FRAME(); \
+      runtimeError(vm, __VA_ARGS__); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+// a call either reported an error or suspended in a native
+#define CALL_FAILED() \
+    return vm->suspended ? INTERPRET_SUSPENDED : INTERPRET_RUNTIME_ERROR
+#define BINARY_OP(valueType, op, quickened) \
+    do { \
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
       } \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+      double b = AS_NUMBER(POP()); \
+      double a = AS_NUMBER(POP()); \
+      PUSH(valueType(a op b)); \
+      QUICKEN(1, quickened); \
     } while (false)
 // b has to be popped first due to the way stack is set with left operand deeper
 
-    for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION 
-        printf("          ");
-        for (Value* slot = vm.stack + 1; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
+// quickening: a generic instruction that ran rewrites itself, length bytes
+    // back, into the version specialized for the operand types it just saw
+#define QUICKEN(length, op) \
+    do { if (vm->quicken) ip[-(length)] = (op); } while (false)
+// a specialized instruction whose operands no longer fit turns back into the
+    // generic one and runs it; its operands must not have been read yet
+#define DEOPTIMIZE(generic) \
+    do { ip[-1] = (generic); goto op_##generic; } while (false)
+// inline cache of the instruction being run, without reading its operands
+#define PEEK_CACHE() \
+    (&frame->closure->function->chunk.caches[(ip[1] << 8) | ip[2]])
+#define NUMBER_OP(valueType, op, generic) \
+    do { \
+      Value b = sp[-1]; \
+      Value a = sp[-2]; \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) DEOPTIMIZE(generic); \
+      sp[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+      sp--; \
+    } while (false)
 
-        disassembleInstruction(&frame->closure->function->chunk, 
-        (int)(frame->ip - frame->closure->function->chunk.code));
-        // get ip to point to relative offset from beginning of bytecode
-        // disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+// register instructions name a destination slot, or REG_PUSH for a new
+    // temporary, followed by a local slot and then a slot or constant index
+#define READ_REGISTER() (slots[READ_BYTE()])
+#define REGISTER_DEST(dest) \
+    ((dest) == REG_PUSH ? sp++ : &slots[dest])
+#define REGISTER_OP(valueType, op, readRight) \
+    do { \
+      uint8_t dest = READ_BYTE(); \
+      Value a = READ_REGISTER(); \
+      Value b = readRight(); \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      *REGISTER_DEST(dest) = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+#define REGISTER_ADD(readRight) \
+    do { \
+      uint8_t dest = READ_BYTE(); \
+      Value a = READ_REGISTER(); \
+      Value b = readRight(); \
+      if (IS_STRING(a) && IS_STRING(b)) { \
+        STORE_FRAME(); \
+        ObjString* result = concatenateStrings(vm, AS_STRING(a), AS_STRING(b)); \
+        *REGISTER_DEST(dest) = OBJ_VAL(result); \
+      } else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+        *REGISTER_DEST(dest) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+      } else { \
+        RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+      } \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() (STORE_FRAME(), traceExecution(vm, frame))
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif
 
-        uint8_t instruction; 
-        switch(instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break; 
-            }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]); 
-                break;
+// after calls and returns the frame may belong to a compiled function,
+    // which then runs in machine code until its next call or return
+#define JIT_ENTER() \
+    do { \
+      if (frame->closure->function->jit != NULL && !vm->recording) { \
+        if (!jitExecute(vm, frame)) return INTERPRET_RUNTIME_ERROR; \
+        LOAD_FRAME(); \
+      } \
+    } while (false)
+
+// a hot loop runs as its trace once there is one, and is recorded before
+#define TRACE_LOOP() \
+    do { \
+      STORE_FRAME(); \
+      Trace* trace = findTrace(vm, ip); \
+      if (trace != NULL) { \
+        enterTrace(vm, trace, frame); \
+        LOAD_FRAME(); \
+      } else if (hotLoop(vm, ip) && startRecording(vm, frame)) { \
+        START_RECORDING(); \
+      } \
+    } while (false)
+
+#ifdef DEBUG_PROFILE_NGRAMS
+#define PROFILE_INSTRUCTION() profileInstruction(*ip)
+#else
+#define PROFILE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef DEBUG_STATS
+    CycleSample cycleSample = {0, 0};
+#define COUNT_INSTRUCTION() countInstruction(&cycleSample, *ip)
+#else
+#define COUNT_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // direct threaded dispatch: one label per handler, indexed by OpCode
+    // every handler ends with its own indirect jump so the branch predictor
+    // can learn which instruction tends to follow which
+    static void* dispatchTable[] = {
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_NIL] = &&op_OP_NIL,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_POP] = &&op_OP_POP,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+        [OP_GET_SUPER] = &&op_OP_GET_SUPER,
+        [OP_EQUAL] = &&op_OP_EQUAL,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_PRINT] = &&op_OP_PRINT,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&op_OP_LOOP,
+        [OP_CALL] = &&op_OP_CALL,
+        [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+        [OP_INVOKE] = &&op_OP_INVOKE,
+        [OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+        [OP_CLOSURE] = &&op_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&op_OP_RETURN,
+        [OP_CLASS] = &&op_OP_CLASS,
+        [OP_INHERIT] = &&op_OP_INHERIT,
+        [OP_METHOD] = &&op_OP_METHOD,
+        [OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+        [OP_GET_LOCAL_LONG] = &&op_OP_GET_LOCAL_LONG,
+        [OP_SET_LOCAL_LONG] = &&op_OP_SET_LOCAL_LONG,
+        [OP_GET_UPVALUE_LONG] = &&op_OP_GET_UPVALUE_LONG,
+        [OP_SET_UPVALUE_LONG] = &&op_OP_SET_UPVALUE_LONG,
+        [OP_JUMP_LONG] = &&op_OP_JUMP_LONG,
+        [OP_JUMP_IF_FALSE_LONG] = &&op_OP_JUMP_IF_FALSE_LONG,
+        [OP_LOOP_LONG] = &&op_OP_LOOP_LONG,
+        [OP_CALL_LONG] = &&op_OP_CALL_LONG,
+        [OP_INVOKE_LONG] = &&op_OP_INVOKE_LONG,
+        [OP_SUPER_INVOKE_LONG] = &&op_OP_SUPER_INVOKE_LONG,
+        [OP_CLOSURE_LONG] = &&op_OP_CLOSURE_LONG,
+        [OP_WIDE] = &&op_OP_WIDE,
+        [OP_NARROW] = &&op_OP_NARROW,
+        [OP_R_MOVE] = &&op_OP_R_MOVE,
+        [OP_R_LOADK] = &&op_OP_R_LOADK,
+        [OP_R_ADD] = &&op_OP_R_ADD,
+        [OP_R_ADDK] = &&op_OP_R_ADDK,
+        [OP_R_SUBTRACT] = &&op_OP_R_SUBTRACT,
+        [OP_R_SUBTRACTK] = &&op_OP_R_SUBTRACTK,
+        [OP_R_MULTIPLY] = &&op_OP_R_MULTIPLY,
+        [OP_R_MULTIPLYK] = &&op_OP_R_MULTIPLYK,
+        [OP_R_DIVIDE] = &&op_OP_R_DIVIDE,
+        [OP_R_DIVIDEK] = &&op_OP_R_DIVIDEK,
+        [OP_R_EQUAL] = &&op_OP_R_EQUAL,
+        [OP_R_EQUALK] = &&op_OP_R_EQUALK,
+        [OP_R_GREATER] = &&op_OP_R_GREATER,
+        [OP_R_GREATERK] = &&op_OP_R_GREATERK,
+        [OP_R_LESS] = &&op_OP_R_LESS,
+        [OP_R_LESSK] = &&op_OP_R_LESSK,
+        [OP_ADD_LOCALS] = &&op_OP_ADD_LOCALS,
+        [OP_GET_THIS_PROPERTY] = &&op_OP_GET_THIS_PROPERTY,
+        [OP_LESS_CONSTANT_JUMP] = &&op_OP_LESS_CONSTANT_JUMP,
+        [OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+        [OP_RETURN_CONSTANT] = &&op_OP_RETURN_CONSTANT,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+        [OP_ADD_STR] = &&op_OP_ADD_STR,
+        [OP_SUBTRACT_NUM] = &&op_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM] = &&op_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM] = &&op_OP_DIVIDE_NUM,
+        [OP_GREATER_NUM] = &&op_OP_GREATER_NUM,
+        [OP_LESS_NUM] = &&op_OP_LESS_NUM,
+        [OP_GET_PROPERTY_FIELD] = &&op_OP_GET_PROPERTY_FIELD,
+        [OP_GET_THIS_FIELD] = &&op_OP_GET_THIS_FIELD,
+    };
+    // while a trace is recorded every instruction goes past the recorder
+    static void* recordTable[UINT8_COUNT] = {
+        [0 ... UINT8_COUNT - 1] = &&record_instruction,
+    };
+    // and with --trace past the trace log first
+    static void* logTable[UINT8_COUNT] = {
+        [0 ... UINT8_COUNT - 1] = &&log_instruction,
+    };
+    // and with --profile through storing ip before either, so the sampled
+    // innermost frame is at the instruction it runs
+    static void* profileTable[UINT8_COUNT] = {
+        [0 ... UINT8_COUNT - 1] = &&profile_instruction,
+    };
+    void** runDispatch = vm->traceLog != NULL ? logTable : dispatchTable;
+    void** baseDispatch = vm->profiling ? profileTable : runDispatch;
+    void** dispatch = baseDispatch;
+
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        PROFILE_INSTRUCTION(); \
+        COUNT_INSTRUCTION(); \
+        goto *dispatch[instruction = READ_BYTE()]; \
+    } while (false)
+#define CASE(op) op_##op
+#define INTERPRET_LOOP DISPATCH();
+#define START_RECORDING() (dispatch = recordTable)
+#else
+// portable fallback, every instruction goes back through the one switch
+#define DISPATCH() continue
+// the label lets DEOPTIMIZE reach a generic handler here as well, most
+// are never jumped to
+#define CASE(op) op_##op: __attribute__((unused)); case op
+#define INTERPRET_LOOP \
+    for (;;) \
+        switch (TRACE_INSTRUCTION(), PROFILE_INSTRUCTION(), \
+                COUNT_INSTRUCTION(), SAMPLE_INSTRUCTION(), \
+                LOG_INSTRUCTION(), RECORD_INSTRUCTION(), \
+                instruction = READ_BYTE())
+// past the opcode, where the handlers store it
+#define SAMPLE_INSTRUCTION() \
+    (vm->profiling ? (void)(frame->ip = ip + 1) : (void)0)
+#define LOG_INSTRUCTION() \
+    (vm->traceLog != NULL ? logInstruction(vm, frame, ip, sp) : (void)0)
+#define RECORD_INSTRUCTION() \
+    (vm->recording ? (STORE_FRAME(), (void)recordInstruction(vm, frame, ip)) \
+                  : (void)0)
+#define START_RECORDING() ((void)0)
+#endif
+
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH(); 
+        }
+        CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP): DROP(); DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]); 
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        
+        CASE(OP_GET_GLOBAL): {
+            // the compiler already turned the name into a slot
+            uint16_t slot = READ_SHORT();
+            Value value = vm->globalValues.values[slot];
+            // slots exist as soon as a name is compiled, the definition may not have run
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.",
+                              AS_CSTRING(vm->globalNames.values[slot]));
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm->globalValues.values[slot] = PEEK(0);
+            DROP(); 
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            // it is a runtime error to assign a global that was never defined
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.",
+                              AS_CSTRING(vm->globalNames.values[slot]));
             }
-            
-            case OP_GET_GLOBAL: {
-                // get name of string from READ_STRING
-                ObjString* name = READ_STRING();
-                Value value;
-                // then use hash to search vm.globals
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+            vm->globalValues.values[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            *frame->closure->upvalues[slot]->location = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_THIS_PROPERTY):
+            PUSH(slots[0]);
+            // falls through to the property lookup on the pushed receiver
+        CASE(OP_GET_PROPERTY): {
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            STORE_FRAME();
+            if (!getProperty(vm, cache, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING(); 
-                tableSet(&vm.globals, name, peek(0)); 
-                pop(); 
-                break;
+            sp = vm->stackTop;
+            // a site that has only ever read one shape's field skips the lookup
+            if (cache->count == 1 && cache->entries[0].fieldIndex != -1) {
+                QUICKEN(4, ip[-4] == OP_GET_PROPERTY
+                               ? OP_GET_PROPERTY_FIELD : OP_GET_THIS_FIELD);
             }
-            case OP_SET_GLOBAL: {
-                // if key doesnt exist in global has table it runtime error to assign it 
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    // delete zombie value
-                    tableDelete(&vm.globals, name); 
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY_FIELD): {
+            InlineCacheEntry* entry = &PEEK_CACHE()->entries[0];
+            Value receiver = PEEK(0);
+            if (!IS_INSTANCE(receiver) ||
+                AS_INSTANCE(receiver)->shape != entry->shape) {
+                DEOPTIMIZE(OP_GET_PROPERTY);
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            ip += 3;
+            sp[-1] = AS_INSTANCE(receiver)->fields[entry->fieldIndex];
+            DISPATCH();
+        }
+        CASE(OP_GET_THIS_FIELD): {
+            InlineCacheEntry* entry = &PEEK_CACHE()->entries[0];
+            Value receiver = slots[0];
+            if (!IS_INSTANCE(receiver) ||
+                AS_INSTANCE(receiver)->shape != entry->shape) {
+                DEOPTIMIZE(OP_GET_THIS_PROPERTY);
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            ip += 3;
+            PUSH(AS_INSTANCE(receiver)->fields[entry->fieldIndex]);
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): {
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            STORE_FRAME();
+            if (!setProperty(vm, cache, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
-
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
+            sp = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER): {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(POP());
 
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            STORE_FRAME();
+            if (!bindMethod(vm, superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+            sp = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_NOT_EQUAL): {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(!valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); DISPATCH();
+        CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); DISPATCH();
+        CASE(OP_GREATER_NUM): NUMBER_OP(BOOL_VAL, >, OP_GREATER); DISPATCH();
+        CASE(OP_LESS_NUM):    NUMBER_OP(BOOL_VAL, <, OP_LESS); DISPATCH();
+        // logic for adding strings needed
+        CASE(OP_ADD): {
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+                QUICKEN(1, OP_ADD_NUM);
+            } else if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+                STORE_FRAME();
+                concatenate(vm);
+                sp = vm->stackTop;
+                QUICKEN(1, OP_ADD_STR);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
-
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCALS): {
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else if (IS_STRING(a) && IS_STRING(b)) {
+                // both operands are locals so the gc can already see them
+                STORE_FRAME();
+                PUSH(OBJ_VAL(concatenateStrings(vm, AS_STRING(a), AS_STRING(b))));
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM): NUMBER_OP(NUMBER_VAL, +, OP_ADD); DISPATCH();
+        CASE(OP_ADD_STR):
+            if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+                DEOPTIMIZE(OP_ADD);
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            // logic for adding strings needed
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                }  else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError(
-                        "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            STORE_FRAME();
+            concatenate(vm);
+            sp = vm->stackTop;
+            DISPATCH();
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); DISPATCH();
+        CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); DISPATCH();
+        CASE(OP_SUBTRACT_NUM): NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+        CASE(OP_MULTIPLY_NUM): NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+        CASE(OP_DIVIDE_NUM):   NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); DISPATCH();
+        CASE(OP_NOT): 
+            sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+            DISPATCH();
+        CASE(OP_NEGATE): 
+            if(!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number");
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: 
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE: 
-                if(!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number");
-                    return INTERPRET_RUNTIME_ERROR;
+            sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));
+            DISPATCH();
+        CASE(OP_PRINT): {
+            // isolates print from other threads, keep each line whole
+            flockfile(stdout);
+            printValue(POP()); 
+            printf("\n");
+            funlockfile(stdout);
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT(); 
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT(); 
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LESS_CONSTANT_JUMP): {
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(b)) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            // the condition stays on the stack like OP_JUMP_IF_FALSE leaves it
+            bool isLess = AS_NUMBER(PEEK(0)) < AS_NUMBER(b);
+            sp[-1] = BOOL_VAL(isLess);
+            if (!isLess) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT(); 
+            // make pointer go to beginning of loop 
+            ip -= offset;
+            if (vm->traceMode && !vm->recording) TRACE_LOOP();
+            DISPATCH();
+        }
+        CASE(OP_CALL_LONG):
+            argCount = READ_SHORT();
+            goto call;
+        CASE(OP_CALL):
+            argCount = READ_BYTE(); 
+        call: {
+            Value callee = PEEK(argCount);
+            // natives are called right here: no frame to push or load, and
+            // one that can not allocate does not need the stack published
+            if (IS_NATIVE(callee)) {
+                ObjNative* native = AS_NATIVE(callee);
+                frame->ip = ip;
+                if (!(native->flags & NATIVE_NO_GC)) vm->stackTop = sp;
+                if (!callNative(vm, native, argCount, sp - argCount)) {
+                    if (vm->switched) {
+                        vm->switched = false;
+                        LOAD_FRAME();
+                        DISPATCH();
+                    }
+                    if (vm->suspended) vm->stackTop = sp - argCount;
+                    CALL_FAILED();
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT: {
-                printValue(pop()); 
-                printf("\n");
-                break;
+                sp -= argCount;
+                DISPATCH();
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT(); 
-                frame->ip += offset;
-                break;
+            STORE_FRAME();
+            if (!callValue(vm, callee, argCount)) {
+                CALL_FAILED();
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT(); 
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+            // update frame pointer
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
+            argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!tailCall(vm, PEEK(argCount), argCount)) {
+                CALL_FAILED();
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT(); 
-                // make pointer go to beginning of loop 
-                frame->ip -= offset;
-                break;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE_LONG):
+            method = READ_STRING();
+            argCount = READ_SHORT();
+            goto invoke;
+        CASE(OP_INVOKE):
+            method = READ_STRING();
+            argCount = READ_BYTE();
+        invoke: {
+            InlineCache* cache = READ_CACHE();
+            STORE_FRAME();
+            if (!invoke(vm, cache, method, argCount)) {
+                CALL_FAILED();
             }
-            case OP_CALL: {
-                int argCount = READ_BYTE(); 
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                // update frame pointer
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE_LONG):
+            method = READ_STRING();
+            argCount = READ_SHORT();
+            goto superInvoke;
+        CASE(OP_SUPER_INVOKE):
+            method = READ_STRING();
+            argCount = READ_BYTE();
+        superInvoke: {
+            ObjClass* superclass = AS_CLASS(POP());
+
+            STORE_FRAME();
+            if (!invokeFromClass(vm, superclass, method, argCount)) {
+                CALL_FAILED();
             }
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE_LONG):
+        CASE(OP_CLOSURE): {
+            ObjFunction* function = AS_FUNCTION(ip[-1] == OP_CLOSURE
+                ? READ_CONSTANT() : constants[READ_SHORT()]);
+            STORE_FRAME();
+            ObjClosure* closure = newClosure(vm, function);
+            PUSH(OBJ_VAL(closure));
+            // capturing allocates, the closure has to be seen by the gc
+            vm->stackTop = sp;
+            // insert upvalues into upvalues pointer array 
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t flags = READ_BYTE();
+                int index = flags & UPVALUE_WIDE ? READ_SHORT() : READ_BYTE();
+                if (flags & UPVALUE_LOCAL) {
+                    closure->upvalues[i] = captureUpvalue(vm, slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
             }
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
+            DISPATCH();
 
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+        }
+        CASE(OP_CLOSE_UPVALUE): 
+            closeUpvalues(vm, sp - 1);
+            DROP();
+            DISPATCH();
+        CASE(OP_RETURN_CONSTANT):
+            PUSH(READ_CONSTANT());
+            // falls through to the normal return of the pushed constant
+        CASE(OP_RETURN): {
+            Value result = POP(); 
+            closeUpvalues(vm, slots);
+            vm->frameCount--; 
+            // if last frame, it means that we have executed the top level code function and 
+                // we can exit the interpreter and pop the main script function from the stack
+            if (vm->frameCount == 0) {
+                sp = slots;
+                if (vm->fiber->caller != NULL) {
+                    // a fiber's function returned, its resumer goes on
+                    vm->stackTop = sp;
+                    finishFiber(vm, result);
+                    LOAD_FRAME();
+                    DISPATCH();
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                // the result takes the place of the function, for
+                // interpretCall()
+                PUSH(result);
+                vm->stackTop = sp;
+                return INTERPRET_OK;
             }
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                // insert upvalues into upvalues pointer array 
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
 
+            // top of stack points to where function was called
+            sp = slots;
+            // push result onto top of stack
+            PUSH(result);
+            vm->stackTop = sp;
+            if (sp < vm->stackLow) shrinkStack(vm);
+            // reduce frame by 1
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_CLASS): {
+            ObjString* name = READ_STRING();
+            STORE_FRAME();
+            PUSH(OBJ_VAL(newClass(vm, name)));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            Value superclass = PEEK(1);
+            
+            // validate is an existing class
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
             }
-            case OP_CLOSE_UPVALUE: 
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
-            case OP_RETURN: {
-                Value result = pop(); 
-                closeUpvalues(frame->slots);
-                vm.frameCount--; 
-                // if last frame, it means that we have executed the top level code function and 
-                    // we can exit the interpreter and pop the main script function from the stack
-                if (vm.frameCount == 0) {
-                    pop(); 
-                    return INTERPRET_OK;
-                }
 
-                // top of stack points to where function was called
-                vm.stackTop = frame->slots;
-                // push result onto top of stack
-                push(result);
-                // reduce frame by 1
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            }
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                
-                // validate is an existing class
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                ObjClass* subclass = AS_CLASS(peek(0));
-                // add all superclass methods into subclass methods
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
-            }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
+            ObjClass* subclass = AS_CLASS(PEEK(0));
+            // add all superclass methods into subclass methods
+            STORE_FRAME();
+            tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+            subclass->version = vm->nextClassVersion++;
+            DROP(); // Subclass.
+            DISPATCH();
+        }
+        CASE(OP_METHOD): {
+            ObjString* name = READ_STRING();
+            STORE_FRAME();
+            defineMethod(vm, name);
+            sp = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG): {
+            int index = READ_BYTE() << 16;
+            index |= READ_SHORT();
+            PUSH(constants[index]);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_LONG): {
+            uint16_t slot = READ_SHORT();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_LONG): {
+            uint16_t slot = READ_SHORT();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE_LONG): {
+            uint16_t slot = READ_SHORT();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE_LONG): {
+            uint16_t slot = READ_SHORT();
+            *frame->closure->upvalues[slot]->location = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_JUMP_LONG): {
+            uint32_t offset = READ_INT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_LONG): {
+            uint32_t offset = READ_INT();
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP_LONG): {
+            // bodies this large are not worth recording, they are not traced
+            uint32_t offset = READ_INT();
+            ip -= offset;
+            DISPATCH();
+        }
+        // the window only moves the constants local; a call made by the
+            // instruction in between reloads it for the callee and again on
+            // return, which OP_NARROW also does
+        CASE(OP_WIDE):
+            constants += READ_BYTE() * UINT8_COUNT;
+            DISPATCH();
+        CASE(OP_NARROW):
+            constants = frame->closure->function->chunk.constants.values;
+            DISPATCH();
+        CASE(OP_R_MOVE): {
+            uint8_t dest = READ_BYTE();
+            slots[dest] = READ_REGISTER();
+            DISPATCH();
+        }
+        CASE(OP_R_LOADK): {
+            uint8_t dest = READ_BYTE();
+            slots[dest] = READ_CONSTANT();
+            DISPATCH();
+        }
+        CASE(OP_R_ADD):       REGISTER_ADD(READ_REGISTER); DISPATCH();
+        CASE(OP_R_ADDK):      REGISTER_ADD(READ_CONSTANT); DISPATCH();
+        CASE(OP_R_SUBTRACT):  REGISTER_OP(NUMBER_VAL, -, READ_REGISTER); DISPATCH();
+        CASE(OP_R_SUBTRACTK): REGISTER_OP(NUMBER_VAL, -, READ_CONSTANT); DISPATCH();
+        CASE(OP_R_MULTIPLY):  REGISTER_OP(NUMBER_VAL, *, READ_REGISTER); DISPATCH();
+        CASE(OP_R_MULTIPLYK): REGISTER_OP(NUMBER_VAL, *, READ_CONSTANT); DISPATCH();
+        CASE(OP_R_DIVIDE):    REGISTER_OP(NUMBER_VAL, /, READ_REGISTER); DISPATCH();
+        CASE(OP_R_DIVIDEK):   REGISTER_OP(NUMBER_VAL, /, READ_CONSTANT); DISPATCH();
+        CASE(OP_R_EQUAL): {
+            uint8_t dest = READ_BYTE();
+            Value a = READ_REGISTER();
+            Value b = READ_REGISTER();
+            *REGISTER_DEST(dest) = BOOL_VAL(valuesEqual(a, b));
+            DISPATCH();
+        }
+        CASE(OP_R_EQUALK): {
+            uint8_t dest = READ_BYTE();
+            Value a = READ_REGISTER();
+            Value b = READ_CONSTANT();
+            *REGISTER_DEST(dest) = BOOL_VAL(valuesEqual(a, b));
+            DISPATCH();
         }
+        CASE(OP_R_GREATER):   REGISTER_OP(BOOL_VAL, >, READ_REGISTER); DISPATCH();
+        CASE(OP_R_GREATERK):  REGISTER_OP(BOOL_VAL, >, READ_CONSTANT); DISPATCH();
+        CASE(OP_R_LESS):      REGISTER_OP(BOOL_VAL, <, READ_REGISTER); DISPATCH();
+        CASE(OP_R_LESSK):     REGISTER_OP(BOOL_VAL, <, READ_CONSTANT); DISPATCH();
     }
+#ifdef COMPUTED_GOTO
+record_instruction:
+    // the opcode has already been read, the recorder wants to see it unrun
+    STORE_FRAME();
+    if (!recordInstruction(vm, frame, ip - 1)) dispatch = baseDispatch;
+    goto *baseDispatch[instruction];
+log_instruction:
+    logInstruction(vm, frame, ip - 1, sp);
+    goto *dispatchTable[instruction];
+profile_instruction:
+    frame->ip = ip;
+    goto *runDispatch[instruction];
+#endif
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef CALL_FAILED
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
+#undef READ_CACHE
 #undef BINARY_OP
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef PEEK_CACHE
+#undef NUMBER_OP
+#undef READ_REGISTER
+#undef REGISTER_DEST
+#undef REGISTER_OP
+#undef REGISTER_ADD
+#undef DISPATCH
+#undef CASE
+#undef INTERPRET_LOOP
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef LOG_INSTRUCTION
+#undef COUNT_INSTRUCTION
+#undef TRACE_LOOP
+#undef START_RECORDING
 }
 
-InterpretResult interpret(const char* source) {
-    ObjFunction* function = compile(source);
+// the script has no scheduler to hand its thread to, so a receive just
+// blocks it until there is a message
+static InterpretResult runBlocking(VM* vm, InterpretResult result) {
+    while (result == INTERPRET_SUSPENDED) {
+        Value message;
+        if (!waitForMessage(vm, &message)) return INTERPRET_RUNTIME_ERROR;
+        result = resumeInterpret(vm, message);
+    }
+    return result;
+}
+
+// the callbacks of the timers and i/o started so far, one at a time
+static InterpretResult runEvents(VM* vm, InterpretResult result) {
+    int argCount;
+    while (result == INTERPRET_OK && (argCount = nextEvent(vm)) != -1) {
+        result = runBlocking(vm, interpretCall(vm, argCount));
+        if (result == INTERPRET_OK) pop(vm);
+    }
+    return result;
+}
+
+InterpretResult interpret(VM* vm, const char* source) {
+    ObjFunction* function = compile(vm, source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(vm, function);
+}
+
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
+    push(vm, OBJ_VAL(function));
+    ObjClosure* closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
+    call(vm, closure, 0);
+
+    InterpretResult result = runBlocking(vm, run(vm));
+    if (result == INTERPRET_OK) pop(vm);
+    return runEvents(vm, result);
+}
+
+InterpretResult callFunction(VM* vm, int argCount, Value* value) {
+    InterpretResult result = runBlocking(vm, interpretCall(vm, argCount));
+    // the result stays on the stack while the callbacks run
+    result = runEvents(vm, result);
+    if (result == INTERPRET_OK) *value = pop(vm);
+    return result;
+}
+
+bool callClosure(VM* vm, ObjClosure* closure, int argCount) {
+    return call(vm, closure, argCount);
+}
+
+InterpretResult interpretCall(VM* vm, int argCount) {
+    Value callee = vm->stackTop[-argCount - 1];
+    if (!call(vm, AS_CLOSURE(callee), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    return run(vm);
+}
 
-    push(OBJ_VAL(function));
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
-    call(closure, 0);
-    
-    return run();
+InterpretResult resumeInterpret(VM* vm, Value result) {
+    vm->suspended = false;
+    vm->stackTop[-1] = result;
+    return run(vm);
 }
 
@@ -6,55 +6,162 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// values the stack starts out with, it grows as calls need more and shrinks
+// again once returns leave most of it unused
+#define STACK_INITIAL 256
+// default for vm->stackLimit, in values
+#define STACK_LIMIT (1024 * 1024)
+// values every reservation keeps free past a function's maxSlots, for what
+// the runtime pushes for a moment to keep objects from the gc: defineNative()
+// holds two while copyString() holds a third, and natives push on top of
+// their caller's slots
+#define STACK_HEADROOM 8
 
 // represents a single ongoig function call
-typedef struct {
+typedef struct CallFrame {
     ObjClosure* closure; 
     uint8_t* ip; 
     Value* slots; 
 } CallFrame;
 
-typedef struct
-{
-    CallFrame frames[FRAMES_MAX];
+struct VM {
+    // as many as the stack has values
+    CallFrame* frames;
     int frameCount;
 
-    Value stack[STACK_MAX];
+    Value* stack;
+    // a call reserves every slot its function can use before it starts, so
+    // pushes never check against the end
+    Value* stackEnd;
+    // returns that leave the stack top below this try to shrink the stack
+    Value* stackLow;
+    // most values the stack may grow to before "Stack overflow."
+    int stackLimit;
     
     // stackTop points to the value just above the 'freshest' value
     Value* stackTop;
-    Table globals;
+    // global name -> index of its slot, filled in by the compiler
+    Table globalSlots;
+    // value of every global by slot, UNDEFINED_VAL until it is defined
+    ValueArray globalValues;
+    // name of every global by slot, for error messages
+    ValueArray globalNames;
     Table strings;
     ObjString* initString;
     ObjUpvalue* openUpvalues;
+    // the fiber whose stack the fields above are, see fiber.c
+    ObjFiber* fiber;
+    // every fiber that was started, for the gc
+    ObjFiber* fibers;
+    // set by a native that returned false after switching to another
+    // fiber, which run() then goes on with
+    bool switched;
+    // what the last native that returned false went wrong with
+    const char* nativeError;
+    // set by a native that returned false to have run() return
+    // INTERPRET_SUSPENDED instead of reporting an error
+    bool suspended;
+    // channel a receive() or await() suspended on, see isolate.c
+    struct Channel* receiving;
+    // message being decoded into this vm, its objects are roots
+    struct Decoder* decoder;
+    // timers and i/o the natives started, see event.c
+    struct EventLoop* loop;
+    // set on the vm of an isolate, which never runs callbacks
+    bool noEvents;
+    // values an embedding host holds on to, roots until its next call into
+    // the vm, see embed.c
+    ValueArray hostValues;
+    // the compile() running on this vm, if any, its functions are roots
+    struct Parser* parser;
+    // hot loop counters and installed traces, from trace.c
+    struct TraceCache* traceCache;
+    // state of the trace being recorded, from recorder.c
+    struct Recorder* recorder;
+    // next ObjClass.version to hand out, never reused
+    uint32_t nextClassVersion;
+    // next ObjFunction.id to hand out
+    uint32_t nextFunctionId;
+    // where run() logs every instruction while --trace is on, see tracelog.c
+    struct TraceLog* traceLog;
+    // .loxc file being loaded into this vm, its objects are roots
+    struct BytecodeReader* bytecodeReader;
+    // mapped .loxc files the functions' code lies in, see bytecode.c
+    struct BytecodeFile* bytecodeFiles;
 
     size_t bytesAllocated;
     size_t nextGC;
+    // collections so far, --gc-stats prints it on exit
+    size_t gcCount;
 
     Obj* objects;
 
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
-} VM;
+
+    // lower every compiled chunk to three address register code
+    bool registerMode;
+    // compile hot functions to machine code
+    bool jitMode;
+    // record hot loops as traces and compile those to machine code
+    bool traceMode;
+    // print the ir of every trace as it is compiled
+    bool dumpTraces;
+    // run() feeds every instruction to the trace recorder
+    bool recording;
+    // run() stores ip in the frame at every instruction, for --profile
+    bool profiling;
+    // let instructions rewrite themselves for the operand types they see
+    bool quicken;
+};
 
 // runtime report errors
 typedef enum {
     INTERPRET_OK, 
     INTERPRET_COMPILE_ERROR, 
     INTERPRET_RUNTIME_ERROR, 
+    // a native call is waiting on something, the call is complete once
+    // resumeInterpret() hands it its result
+    INTERPRET_SUSPENDED,
 } InterpretResult;
 
-extern VM vm;
+void initVM(VM* vm);
+void freeVM(VM* vm);
 
-void initVM();
-void freeVM();
+InterpretResult interpret(VM* vm, const char* source);
+// runs the script a compile() or a .loxc file made
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+// calls the closure below the argCount arguments on top of the stack and
+// runs it, leaving its result on the stack in place of the closure
+InterpretResult interpretCall(VM* vm, int argCount);
+InterpretResult resumeInterpret(VM* vm, Value result);
+// interpretCall() to the end: waits out natives that suspend, then runs
+// the callbacks of the timers and i/o the call started, and pops the
+// call's result into *value
+InterpretResult callFunction(VM* vm, int argCount, Value* value);
+void defineNative(VM* vm, const char* name, NativeFn function, int arity,
+                  uint8_t flags);
+int globalSlot(VM* vm, ObjString* name);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+// makes room for count values from base and STACK_HEADROOM more, false
+// if that would take the stack past vm->stackLimit
+bool reserveStack(VM* vm, Value* base, int count);
+// gives the vm an empty stack of capacity values, for a new fiber
+void initStack(VM* vm, int capacity);
+// pushes a frame for closure, which has its argCount arguments on top of
+// the stack; false once it reported an error
+bool callClosure(VM* vm, ObjClosure* closure, int argCount);
 
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+// interpreter helpers the jit calls for the instructions it does not inline
+void runtimeError(VM* vm, const char* format, ...);
+void concatenate(VM* vm);
+bool getProperty(VM* vm, InlineCache* cache, ObjString* name);
+bool setProperty(VM* vm, InlineCache* cache, ObjString* name);
+void closeUpvalues(VM* vm, Value* last);
+// lox truthiness, shared with the trace recorder
+bool isFalsey(Value value);
 
 
 
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "value.h"
+#include "x64.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+void asmByte(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        as->capacity = GROW_CAPACITY(as->capacity);
+        as->code = (uint8_t*)realloc(as->code, as->capacity);
+        if (as->code == NULL) exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+void asmCode(Assembler* as, const uint8_t* bytes, int length) {
+    for (int i = 0; i < length; i++) asmByte(as, bytes[i]);
+}
+
+void asm32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) asmByte(as, (value >> (i * 8)) & 0xff);
+}
+
+void asm64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) asmByte(as, (value >> (i * 8)) & 0xff);
+}
+
+// opcode 0x8b loads reg from [base + disp], 0x89 stores reg there
+static void memoryOperand(Assembler* as, uint8_t opcode, Register reg,
+                          Register base, int32_t disp) {
+    asmByte(as, 0x48 | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0));
+    asmByte(as, opcode);
+    asmByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    // rsp and r12 can only be a base through a SIB byte
+    if ((base & 7) == RSP) asmByte(as, 0x24);
+    asm32(as, (uint32_t)disp);
+}
+
+void asmLoad(Assembler* as, Register reg, Register base, int32_t disp) {
+    memoryOperand(as, 0x8b, reg, base, disp);
+}
+
+void asmStore(Assembler* as, Register base, int32_t disp, Register reg) {
+    memoryOperand(as, 0x89, reg, base, disp);
+}
+
+void asmRegisters(Assembler* as, uint8_t opcode, Register rm, Register reg) {
+    asmByte(as, 0x48 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+    asmByte(as, opcode);
+    asmByte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void asmImmediate(Assembler* as, Register reg, uint64_t value) {
+    asmByte(as, 0x48 | ((reg & 8) ? 1 : 0));
+    asmByte(as, 0xb8 | (reg & 7));
+    asm64(as, value);
+}
+
+int asmJump(Assembler* as, uint8_t condition) {
+    if (condition == JMP) {
+        asmByte(as, 0xe9);
+    } else {
+        EMIT(as, 0x0f, condition);
+    }
+    asm32(as, 0);
+    return as->count - 4;
+}
+
+void asmPatch(Assembler* as, int at, int position) {
+    int32_t rel = position - (at + 4);
+    memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+void asmPatchHere(Assembler* as, int at) {
+    asmPatch(as, at, as->count);
+}
+
+void asmFixupAt(Assembler* as, int at, int target) {
+    if (as->fixupCapacity < as->fixupCount + 1) {
+        as->fixupCapacity = GROW_CAPACITY(as->fixupCapacity);
+        as->fixups = (Fixup*)realloc(as->fixups,
+                                     sizeof(Fixup) * as->fixupCapacity);
+        if (as->fixups == NULL) exit(1);
+    }
+    Fixup* fixup = &as->fixups[as->fixupCount++];
+    fixup->at = at;
+    fixup->target = target;
+}
+
+void asmFixup(Assembler* as, uint8_t condition, int target) {
+    asmFixupAt(as, asmJump(as, condition), target);
+}
+
+int asmJumpIfNotNumber(Assembler* as, Register reg) {
+    asmRegisters(as, 0x89, RDX, reg);
+    asmRegisters(as, 0x21, RDX, QNAN_REG);
+    asmRegisters(as, 0x39, RDX, QNAN_REG);
+    return asmJump(as, JE);
+}
+
+void asmToDoubles(Assembler* as) {
+    EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc0);  // movq xmm0, rax
+    EMIT(as, 0x66, 0x48, 0x0f, 0x6e, 0xc9);  // movq xmm1, rcx
+}
+
+void asmBoolFromAl(Assembler* as) {
+#ifdef NAN_BOXING
+    EMIT(as, 0x0f, 0xb6, 0xc0);  // movzx eax, al
+    asmImmediate(as, RCX, FALSE_VAL);
+    asmRegisters(as, 0x01, RAX, RCX);
+#endif
+}
+
+uint8_t* asmFinish(Assembler* as) {
+#if defined(__x86_64__) && defined(__linux__)
+    uint8_t* code = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) return NULL;
+    memcpy(code, as->code, as->count);
+    // never writable and executable at the same time
+    if (mprotect(code, as->count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, as->count);
+        return NULL;
+    }
+    return code;
+#else
+    return NULL;
+#endif
+}
+
+void asmFree(Assembler* as) {
+    free(as->code);
+    free(as->fixups);
+    as->code = NULL;
+    as->fixups = NULL;
+}
+
+void freeExecutable(uint8_t* code, size_t size) {
+#if defined(__x86_64__) && defined(__linux__)
+    munmap(code, size);
+#endif
+}
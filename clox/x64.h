@@ -0,0 +1,75 @@
+#ifndef clox_x64_h
+#define clox_x64_h
+
+#include "common.h"
+
+// a tiny x86-64 assembler shared by the method jit and the trace backend
+
+typedef enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+} Register;
+
+// both backends keep QNAN pinned here to tell numbers from other values
+#define QNAN_REG R15
+
+#define HELPER(function) ((uint64_t)(uintptr_t)(function))
+
+// condition byte of a two byte jcc, or JMP for an unconditional jump
+#define JMP 0x00
+#define JE  0x84
+#define JNE 0x85
+
+// a rel32 whose target the user of the assembler resolves at the end
+typedef struct {
+    int at;      // position of the rel32
+    int target;  // whatever the user jumps to, a bytecode offset or snapshot
+} Fixup;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+    Fixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+    int exit;       // common exit sequence, once emitted
+    int errorExit;
+} Assembler;
+
+void asmByte(Assembler* as, uint8_t byte);
+void asmCode(Assembler* as, const uint8_t* bytes, int length);
+#define EMIT(as, ...) \
+    asmCode(as, (const uint8_t[]){__VA_ARGS__}, \
+            sizeof((const uint8_t[]){__VA_ARGS__}))
+void asm32(Assembler* as, uint32_t value);
+void asm64(Assembler* as, uint64_t value);
+
+// 64 bit moves between a register and [base + disp]
+void asmLoad(Assembler* as, Register reg, Register base, int32_t disp);
+void asmStore(Assembler* as, Register base, int32_t disp, Register reg);
+// 64 bit "op rm, reg": 0x89 mov, 0x01 add, 0x21 and, 0x39 cmp
+void asmRegisters(Assembler* as, uint8_t opcode, Register rm, Register reg);
+void asmImmediate(Assembler* as, Register reg, uint64_t value);
+
+// returns the position of the rel32 so it can be patched
+int asmJump(Assembler* as, uint8_t condition);
+void asmPatch(Assembler* as, int at, int position);
+void asmPatchHere(Assembler* as, int at);
+void asmFixup(Assembler* as, uint8_t condition, int target);
+// resolves a jump emitted earlier the same way
+void asmFixupAt(Assembler* as, int at, int target);
+
+// jumps away when reg does not hold a number, clobbers rdx
+int asmJumpIfNotNumber(Assembler* as, Register reg);
+// xmm0 = rax and xmm1 = rcx as doubles
+void asmToDoubles(Assembler* as);
+// rax = BOOL_VAL(al), clobbers rcx
+void asmBoolFromAl(Assembler* as);
+
+// copies the code into executable memory, NULL if that is not possible
+uint8_t* asmFinish(Assembler* as);
+void asmFree(Assembler* as);
+void freeExecutable(uint8_t* code, size_t size);
+
+#endif
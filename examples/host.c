@@ -0,0 +1,122 @@
+// a host program that runs lox code through lox.h: it loads a script once
+// and then calls its functions from c, and lox calls back into c
+//
+//     make host && ./host tests/embed.lox
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lox.h"
+
+static char* readFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+    fseek(file, 0L, SEEK_END);
+    size_t size = (size_t)ftell(file);
+    rewind(file);
+    char* buffer = malloc(size + 1);
+    if (buffer == NULL || fread(buffer, 1, size, file) < size) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+    buffer[size] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+// upper(string): reads the vm's characters in place and hands the vm a
+// buffer of its own to keep
+static bool upper(LoxVM* vm, int argCount, const LoxValue* args,
+                  LoxValue* result, void* userData) {
+    size_t length;
+    const char* chars = loxAsString(args[0], &length);
+    if (chars == NULL) {
+        loxError(vm, "upper() takes a string.");
+        return false;
+    }
+    char* copy = malloc(length + 1);
+    for (size_t i = 0; i < length; i++) copy[i] = (char)toupper(chars[i]);
+    *result = loxTakeString(vm, copy, length);
+    return true;
+}
+
+typedef struct {
+    double factor;
+    int calls;
+} Scale;
+
+// scale(number): multiplies by the factor of the Scale it was defined with
+static bool scale(LoxVM* vm, int argCount, const LoxValue* args,
+                  LoxValue* result, void* userData) {
+    Scale* state = userData;
+    if (!loxIsNumber(args[0])) {
+        loxError(vm, "scale() takes a number.");
+        return false;
+    }
+    state->calls++;
+    *result = loxNumber(loxAsNumber(args[0]) * state->factor);
+    return true;
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: host [path]\n");
+        return 64;
+    }
+
+    LoxVM* vm = loxNewVM();
+    Scale state = {3, 0};
+    loxDefine(vm, "upper", upper, 1, NULL);
+    loxDefine(vm, "scale", scale, 1, &state);
+
+    char* source = readFile(argv[1]);
+    LoxResult loaded = loxLoad(vm, source);
+    free(source);
+    if (loaded != LOX_OK) return loaded == LOX_COMPILE_ERROR ? 65 : 70;
+
+    // looked up once, called many times
+    int fib = loxGlobal(vm, "fib");
+    double sum = 0;
+    for (int n = 0; n < 25; n++) {
+        LoxValue arg = loxNumber(n), value;
+        if (loxCall(vm, fib, 1, &arg, &value) != LOX_OK) return 70;
+        sum += loxAsNumber(value);
+    }
+    printf("sum of fib(0..24) = %g\n", sum);
+
+    int greet = loxGlobal(vm, "greet");
+    char* name = malloc(6);
+    memcpy(name, "world", 5);
+    LoxValue arg = loxTakeString(vm, name, 5), greeting;
+    if (loxCall(vm, greet, 1, &arg, &greeting) != LOX_OK) return 70;
+    size_t length;
+    const char* chars = loxAsString(greeting, &length);
+    printf("%s (%zu chars)\n", chars, length);
+
+    int scaled = loxGlobal(vm, "scaled");
+    for (int i = 0; i < 1000; i++) {
+        LoxValue x = loxNumber(i), value;
+        if (loxCall(vm, scaled, 1, &x, &value) != LOX_OK) return 70;
+        if (i == 10) printf("scaled(10) = %g\n", loxAsNumber(value));
+    }
+    printf("scale() ran %d times\n", state.calls);
+
+    loxSetGlobal(vm, "answer", loxNumber(42));
+    printf("answer = %g\n", loxAsNumber(loxGetGlobal(vm, loxGlobal(vm, "answer"))));
+    printf("missing = %d\n", loxGlobal(vm, "missing"));
+
+    // errors are reported on stderr, and the vm stays usable
+    LoxResult failed = loxCall(vm, loxGlobal(vm, "fail"), 0, NULL, NULL);
+    printf("fail() -> %s\n", failed == LOX_RUNTIME_ERROR ? "runtime error" : "ok");
+    LoxValue again = loxNumber(10), value;
+    loxCall(vm, fib, 1, &again, &value);
+    printf("fib(10) = %g\n", loxAsNumber(value));
+
+    loxFreeVM(vm);
+    return 0;
+}
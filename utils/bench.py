@@ -0,0 +1,211 @@
+import argparse
+import json
+import os
+import shlex
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+'''
+Runs the scripts in bench/ a few times each after some warm-up runs and
+reports the median wall time, the spread of the times around it, the peak
+resident set size and the number of collections the gc did
+
+    python3 utils/bench.py                       # every benchmark, ./lox
+    python3 utils/bench.py fib binaryTrees       # just these
+    python3 utils/bench.py --save base.json      # keep the results
+    python3 utils/bench.py --baseline base.json  # and compare against them
+    python3 utils/bench.py --compare old/lox ./lox
+
+--compare runs both binaries, alternating between them so that both see
+the same machine, and prints new against old. A benchmark whose median
+got slower by more than --threshold and by more than the spread of either
+side is flagged as a regression, and the exit status is then 1. Both
+binaries must print the same thing for a benchmark, or it is an error.
+'''
+
+SCRIPT_DIRECTORY = os.path.dirname(os.path.realpath(__file__)) + '/../'
+EXECUTABLE = os.path.join(SCRIPT_DIRECTORY, 'lox')
+BENCH_DIRECTORY = os.path.join(SCRIPT_DIRECTORY, 'bench')
+
+
+def benchmark_names():
+    return sorted(name[:-len('.lox')] for name in os.listdir(BENCH_DIRECTORY)
+                  if name.endswith('.lox'))
+
+
+def run_once(lox, flags, name):
+    '''
+    Runs one benchmark and returns its wall time in seconds, peak rss in
+    kilobytes, gc count and output
+    '''
+    path = os.path.join(BENCH_DIRECTORY, name + '.lox')
+    # files rather than pipes so that the child can be reaped with wait4,
+    # which hands back the rusage of exactly that child
+    with tempfile.TemporaryFile('w+') as output, \
+            tempfile.TemporaryFile('w+') as errors:
+        start = time.perf_counter()
+        process = subprocess.Popen([lox, '--gc-stats'] + flags + [path],
+                                   stdout=output, stderr=errors)
+        _, status, usage = os.wait4(process.pid, 0)
+        elapsed = time.perf_counter() - start
+        # so that Popen does not try to reap it again
+        process.returncode = os.waitstatus_to_exitcode(status)
+        output.seek(0)
+        errors.seek(0)
+        output, errors = output.read(), errors.read()
+    if process.returncode != 0:
+        raise RuntimeError(f'{lox} {name} exited with {process.returncode}:\n'
+                           f'{errors}')
+
+    gc = None
+    for line in errors.splitlines():
+        if line.startswith('gc: '):
+            gc = int(line.split()[1])
+    return elapsed, usage.ru_maxrss, gc, output
+
+
+def summarize(times, output, gc, rss):
+    median = statistics.median(times)
+    return {
+        'median': median,
+        'min': min(times),
+        'max': max(times),
+        # half the range around the median, as a fraction of it
+        'spread': (max(times) - min(times)) / 2 / median if median else 0.0,
+        'peak_rss_kb': rss,
+        'gc': gc,
+        'output': output,
+        'times': times,
+    }
+
+
+def measure(binaries, flags, names, runs, warmup):
+    '''
+    Benchmarks every binary on every name, interleaving the binaries run by
+    run, and returns {binary: {name: summary}}
+    '''
+    results = {lox: {} for lox in binaries}
+    for name in names:
+        times = {lox: [] for lox in binaries}
+        rss = {lox: 0 for lox in binaries}
+        outputs = {}
+        gcs = {}
+        for run in range(warmup + runs):
+            for lox in binaries:
+                elapsed, peak, gc, output = run_once(lox, flags, name)
+                if outputs.setdefault(lox, output) != output:
+                    raise RuntimeError(f'{lox} {name} printed something '
+                                       f'else on run {run}')
+                rss[lox] = max(rss[lox], peak)
+                gcs[lox] = gc
+                if run >= warmup:
+                    times[lox].append(elapsed)
+        for lox in binaries:
+            results[lox][name] = summarize(times[lox], outputs[lox],
+                                           gcs[lox], rss[lox])
+        if len(set(outputs.values())) > 1:
+            raise RuntimeError(f'{name} prints something different with '
+                               f'{" and ".join(binaries)}')
+        print(f'  {name}', file=sys.stderr)
+    return results
+
+
+def format_seconds(seconds):
+    return f'{seconds * 1000:9.1f}ms'
+
+
+def print_results(results):
+    print(f'{"benchmark":<14} {"median":>11} {"spread":>8} '
+          f'{"peak rss":>10} {"gcs":>7}')
+    for name, result in results.items():
+        gc = '-' if result['gc'] is None else str(result['gc'])
+        print(f'{name:<14} {format_seconds(result["median"])} '
+              f'{result["spread"] * 100:7.1f}% '
+              f'{result["peak_rss_kb"]:>8}kB {gc:>7}')
+
+
+def compare(old, new, threshold):
+    '''
+    Prints new against old and returns the names that regressed
+    '''
+    regressions = []
+    print(f'{"benchmark":<14} {"old":>11} {"new":>11} {"change":>8} '
+          f'{"rss":>8} {"gcs":>12}')
+    for name, after in new.items():
+        before = old.get(name)
+        if before is None:
+            print(f'{name:<14} {"-":>11} {format_seconds(after["median"])}')
+            continue
+        change = after['median'] / before['median'] - 1
+        noise = max(threshold, before['spread'], after['spread'])
+        verdict = ''
+        if change > noise:
+            verdict = 'REGRESSION'
+            regressions.append(name)
+        elif change < -noise:
+            verdict = 'faster'
+        rss = after['peak_rss_kb'] / before['peak_rss_kb'] - 1
+        gcs = f'{before["gc"]}->{after["gc"]}'
+        print(f'{name:<14} {format_seconds(before["median"])} '
+              f'{format_seconds(after["median"])} {change * 100:+7.1f}% '
+              f'{rss * 100:+7.1f}% {gcs:>12} {verdict}')
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Benchmark lox against the scripts in bench/')
+    parser.add_argument('names', nargs='*', default=None,
+                        help='benchmarks to run, all of bench/ by default')
+    parser.add_argument('--lox', default=EXECUTABLE,
+                        help='binary to benchmark')
+    parser.add_argument('--flags', default='',
+                        help='options passed to lox, e.g. "--jit"')
+    parser.add_argument('--runs', type=int, default=5)
+    parser.add_argument('--warmup', type=int, default=1)
+    parser.add_argument('--threshold', type=float, default=0.05,
+                        help='slowdown that counts as a regression')
+    parser.add_argument('--save', help='write the results as json')
+    parser.add_argument('--baseline', help='compare against saved results')
+    parser.add_argument('--compare', nargs=2, metavar=('OLD', 'NEW'),
+                        help='benchmark two binaries against each other')
+    args = parser.parse_args()
+
+    names = args.names or benchmark_names()
+    flags = shlex.split(args.flags)
+    binaries = ([os.path.abspath(lox) for lox in args.compare]
+                if args.compare else [os.path.abspath(args.lox)])
+    if len(set(binaries)) != len(binaries):
+        parser.error('--compare needs two different binaries')
+    results = measure(binaries, flags, names, args.runs, args.warmup)
+    new = results[binaries[-1]]
+
+    if args.save:
+        with open(args.save, 'w') as file:
+            json.dump({'lox': binaries[-1], 'flags': flags, 'runs': args.runs,
+                       'warmup': args.warmup, 'results': new},
+                      file, indent=2)
+
+    old = None
+    if args.compare:
+        old = results[binaries[0]]
+    elif args.baseline:
+        with open(args.baseline) as file:
+            old = json.load(file)['results']
+
+    if old is None:
+        print_results(new)
+        return 0
+    for name in new:
+        if name in old and old[name]['output'] != new[name]['output']:
+            print(f'{name} prints something different from the baseline',
+                  file=sys.stderr)
+            return 1
+    return 1 if compare(old, new, args.threshold) else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,47 @@
+import os
+import subprocess
+import sys
+import time
+
+'''
+Times tests/speedIsolates.lox on worker pools of growing size and prints
+the speedup over a single worker, which should stay close to the number of
+workers up to the number of cores
+
+    python3 utils/bench_isolates.py [max workers]
+'''
+
+SCRIPT_DIRECTORY = os.path.dirname(os.path.realpath(__file__)) + '/../'
+EXECUTABLE = os.path.join(SCRIPT_DIRECTORY, 'lox')
+BENCHMARK = os.path.join(SCRIPT_DIRECTORY, 'tests/speedIsolates.lox')
+
+
+def wall_time(workers, runs=3):
+    best = None
+    for _ in range(runs):
+        start = time.perf_counter()
+        subprocess.run([EXECUTABLE, '--workers', str(workers), BENCHMARK],
+                       stdout=subprocess.DEVNULL, check=True)
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def main():
+    cores = os.cpu_count() or 1
+    most = int(sys.argv[1]) if len(sys.argv) > 1 else max(cores, 4)
+    counts = [1]
+    while counts[-1] * 2 <= most:
+        counts.append(counts[-1] * 2)
+
+    print(f'{cores} cores')
+    print(f'{"workers":>8} {"seconds":>8} {"speedup":>8}')
+    single = None
+    for workers in counts:
+        seconds = wall_time(workers)
+        single = single or seconds
+        print(f'{workers:>8} {seconds:>8.3f} {single / seconds:>8.2f}x')
+
+
+if __name__ == '__main__':
+    main()
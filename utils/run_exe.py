@@ -2,23 +2,32 @@ import subprocess
 import os
 
 
-def run_lox_test_exe(test_file):
+def run_lox_test_exe(test_file, flags=()):
     '''
     NOTE: lox executable has to have been make for this function to work
     Takes a file from the test directory and runs it with the executable 'lox' 
     from the top directory 
 
+    flags are extra command line options passed before the script path
+
     Example usage: 
         run_lox_test_exe('tests/speedFib.lox')
+        run_lox_test_exe('tests/speedFib.lox', ['--register'])
     '''
     script_directory = os.path.dirname(os.path.realpath(__file__)) + '/../'
     EXECUTABLE = os.path.join(script_directory, 'lox')
     test_file = os.path.join(script_directory, f'{test_file}')
 
+    # scripts are compiled every time rather than run from bytecode some
+    # earlier run left in ~/.cache/lox, unless a test picked a cache itself
+    env = dict(os.environ)
+    env.setdefault('LOX_CACHE_DIR', '')
+
     try:
-        command = [EXECUTABLE] + [test_file]
+        command = [EXECUTABLE] + list(flags) + [test_file]
         result = subprocess.run(
-            command, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True, check=True)
+            command, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True, check=True,
+            env=env)
         return str(result.stdout)
     except subprocess.CalledProcessError as e:
         return f"Error running 'lox':\n{e.stderr}"
@@ -0,0 +1,165 @@
+import os
+import shutil
+import struct
+import subprocess
+import tempfile
+import unittest
+from run_exe import run_lox_test_exe
+
+SCRIPT_DIRECTORY = os.path.dirname(os.path.realpath(__file__)) + '/../'
+EXPECTED = "2\nrex makes a sound, woof\nhello world\ntrue\n"
+
+# layout of a .loxc file, see clox/bytecode.c
+HEADER_SIZE = 48
+CHECKSUM_OFFSET = 40
+FUNCTION_RECORD_SIZE = 36
+GLOBAL_RECORD_SIZE = 12
+# a tag and an index, then a Value: NaN boxed or a tagged struct
+NAN_BOXING_FLAG = 2
+CONSTANT_RECORD_SIZE = {True: 16, False: 24}
+
+
+def checksum(data):
+    '''
+    FNV-1a of everything after the header, like hashBytes()
+    '''
+    value = 14695981039346656037
+    for byte in data[HEADER_SIZE:]:
+        value = ((value ^ byte) * 1099511628211) & 0xffffffffffffffff
+    return value
+
+
+def global_operands(data):
+    '''
+    Offsets in the file of the slot operand of every global instruction
+    '''
+    flags = struct.unpack_from('<I', data, 8)[0]
+    constant_size = CONSTANT_RECORD_SIZE[bool(flags & NAN_BOXING_FLAG)]
+    string_count, function_count = struct.unpack_from('<II', data, 24)
+    position = HEADER_SIZE
+    for _ in range(string_count):
+        position += 4 + struct.unpack_from('<I', data, position)[0]
+    position += -position % 4
+    operands = []
+    for _ in range(function_count):
+        record = struct.unpack_from('<9I', data, position)
+        code_count, constant_count, global_count = record[5], record[7], \
+            record[8]
+        position += FUNCTION_RECORD_SIZE + constant_size * constant_count
+        code = position + GLOBAL_RECORD_SIZE * global_count + 4 * code_count
+        for i in range(global_count):
+            offset = struct.unpack_from('<I', data,
+                                        position + GLOBAL_RECORD_SIZE * i)[0]
+            operands.append(code + offset)
+        position = code + code_count
+        position += -position % 4
+    return operands
+
+
+class BytecodeTests(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.mkdtemp()
+        os.environ['LOX_CACHE_DIR'] = os.path.join(self.directory, 'cache')
+
+    def tearDown(self):
+        del os.environ['LOX_CACHE_DIR']
+        shutil.rmtree(self.directory)
+
+    def compile(self, script, flags=()):
+        path = os.path.join(self.directory, os.path.basename(script))
+        shutil.copy(os.path.join(SCRIPT_DIRECTORY, script), path)
+        subprocess.run([os.path.join(SCRIPT_DIRECTORY, 'lox')] + list(flags) +
+                       ['-c', path], check=True)
+        return path + 'c'
+
+    def test_compiled_file(self):
+        for flags in [(), ['--register'], ['--jit']]:
+            with self.subTest(flags=flags):
+                compiled = self.compile('tests/bytecode.lox',
+                                        [f for f in flags if f != '--jit'])
+                self.assertEqual(EXPECTED, run_lox_test_exe(compiled, flags))
+
+    def test_cache(self):
+        cache = os.environ['LOX_CACHE_DIR']
+        for flags in [(), ['--register']]:
+            with self.subTest(flags=flags):
+                for _ in range(2):
+                    result = run_lox_test_exe('tests/bytecode.lox', flags)
+                    self.assertEqual(EXPECTED, result)
+        # one file per mode
+        files = os.listdir(cache)
+        self.assertEqual(2, len(files))
+
+        # a damaged file is compiled again and replaced
+        for name in files:
+            with open(os.path.join(cache, name), 'r+b') as file:
+                file.truncate(60)
+        self.assertEqual(EXPECTED, run_lox_test_exe('tests/bytecode.lox'))
+
+        shutil.rmtree(cache)
+        result = run_lox_test_exe('tests/bytecode.lox', ['--no-cache'])
+        self.assertEqual(EXPECTED, result)
+        self.assertFalse(os.path.exists(cache))
+
+    def test_runtime_error_lines(self):
+        compiled = self.compile('tests/bytecodeError.lox')
+        for script in ['tests/bytecodeError.lox', compiled]:
+            with self.subTest(script=script):
+                result = run_lox_test_exe(script)
+                self.assertIn("Operands must be two numbers or two strings."
+                              "\n[line 4] in fails()\n[line 7] in script",
+                              result)
+
+    def test_refused_files(self):
+        compiled = self.compile('tests/bytecode.lox')
+        result = run_lox_test_exe(compiled, ['--register'])
+        self.assertIn("it was compiled without --register", result)
+
+        with open(compiled, 'r+b') as file:
+            file.truncate(100)
+        self.assertIn("it is damaged", run_lox_test_exe(compiled))
+
+    def test_corrupted_files(self):
+        compiled = self.compile('tests/bytecode.lox')
+        with open(compiled, 'rb') as file:
+            original = bytearray(file.read())
+
+        # any byte changed after the header fails the checksum
+        for position in [HEADER_SIZE, len(original) // 2, len(original) - 1]:
+            with self.subTest(position=position):
+                data = bytearray(original)
+                data[position] ^= 0x5a
+                with open(compiled, 'wb') as file:
+                    file.write(data)
+                self.assertIn("it is damaged", run_lox_test_exe(compiled))
+
+        # and a global slot past the ones there are is refused even with
+        # the checksum made to match
+        operands = global_operands(original)
+        self.assertTrue(operands)
+        for operand in operands:
+            with self.subTest(operand=operand):
+                data = bytearray(original)
+                data[operand:operand + 2] = b'\xff\xff'
+                struct.pack_into('<Q', data, CHECKSUM_OFFSET, checksum(data))
+                with open(compiled, 'wb') as file:
+                    file.write(data)
+                self.assertIn("it has an instruction that is damaged",
+                              run_lox_test_exe(compiled))
+
+    def test_corrupted_cache(self):
+        cache = os.environ['LOX_CACHE_DIR']
+        self.assertEqual(EXPECTED, run_lox_test_exe('tests/bytecode.lox'))
+        [name] = os.listdir(cache)
+        with open(os.path.join(cache, name), 'r+b') as file:
+            data = bytearray(file.read())
+            data[len(data) // 2] ^= 0xff
+            file.seek(0)
+            file.write(data)
+        # compiled again, and the damaged file replaced
+        for _ in range(2):
+            self.assertEqual(EXPECTED, run_lox_test_exe('tests/bytecode.lox'))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,31 @@
+import os
+import subprocess
+import unittest
+
+
+def run_host(test_file):
+    '''
+    NOTE: the example host has to have been made (make host) for this to work
+    Runs the executable 'host' from the top directory on a test script
+    '''
+    script_directory = os.path.dirname(os.path.realpath(__file__)) + '/../'
+    result = subprocess.run(
+        [os.path.join(script_directory, 'host'),
+         os.path.join(script_directory, test_file)],
+        stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+    return result.stdout, result.stderr
+
+
+class EmbedTests(unittest.TestCase):
+    def test_host(self):
+        out, err = run_host('tests/embed.lox')
+        self.assertEqual("loaded\nsum of fib(0..24) = 121392\n"
+                         "hello WORLD! (12 chars)\nscaled(10) = 31\n"
+                         "scale() ran 1000 times\nanswer = 42\n"
+                         "missing = -1\nfail() -> runtime error\n"
+                         "fib(10) = 55\n", out)
+        self.assertIn("upper() takes a string.\n[line 17] in fail()", err)
+
+
+if __name__ == '__main__':
+    unittest.main()
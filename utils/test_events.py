@@ -0,0 +1,27 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class EventTests(unittest.TestCase):
+    def test_events(self):
+        for flags in [(), ['--jit'], ['--trace-jit'], ['--register']]:
+            with self.subTest(flags=flags):
+                result = run_lox_test_exe('tests/events.lox', flags)
+                self.assertEqual("script done\nthrough a pipe\nnil\ntrue\n"
+                                 "from a file\nnil\nping\nearly\nlate\n",
+                                 result)
+
+    def test_error_in_callback(self):
+        result = run_lox_test_exe('tests/eventError.lox')
+        self.assertIn("Operands must be two numbers or two strings.\n"
+                      "[line 2] in fails()", result)
+
+    def test_events_in_isolate(self):
+        result = run_lox_test_exe('tests/eventIsolate.lox')
+        self.assertIn("Isolates cannot wait for events.\n"
+                      "[line 6] in wait()\nSpawned function failed.\n"
+                      "[line 10] in script", result)
+
+
+if __name__ == '__main__':
+    unittest.main()
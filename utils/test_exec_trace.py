@@ -0,0 +1,36 @@
+import os
+import tempfile
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class ExecTraceTests(unittest.TestCase):
+    def trace(self, script, flags=()):
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, 'out.trace')
+            output = run_lox_test_exe(script, list(flags) + ['--trace', path])
+            decoded = run_lox_test_exe(script, ['--decode-trace', path])
+        return output, decoded
+
+    def test_trace(self):
+        for flags in [(), ['--register']]:
+            with self.subTest(flags=flags):
+                output, decoded = self.trace('tests/execTrace.lox', flags)
+                self.assertEqual("3\n", output)
+                lines = decoded.splitlines()
+                self.assertEqual("11 instructions, the last 11 of them:",
+                                 lines[0])
+                self.assertRegex(lines[7], r'^\s+4 script\s+0012\s+\| OP_CALL')
+                self.assertRegex(lines[9], r'^\s+5 add\s+0\d+\s+\| OP_RETURN')
+                self.assertRegex(lines[-1], r'^\s+2 script\s+0016\s+\| OP_RETURN')
+
+    def test_trace_up_to_error(self):
+        output, decoded = self.trace('tests/execTraceError.lox')
+        self.assertIn("Operands must be two numbers or two strings.", output)
+        lines = decoded.splitlines()
+        self.assertEqual("8 instructions, the last 8 of them:", lines[0])
+        self.assertRegex(lines[-1], r'^\s+5 fails\s+0003\s+\| OP_ADD$')
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,24 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class FiberTests(unittest.TestCase):
+    def test_fibers(self):
+        for flags in [(), ['--jit'], ['--trace-jit'], ['--register'],
+                      ['--no-quicken']]:
+            with self.subTest(flags=flags):
+                result = run_lox_test_exe('tests/fibers.lox', flags)
+                self.assertEqual("0\n1\n2\nfalse\ndone\ntrue\n10\n15\n22\n"
+                                 "captured\nchanged\nchanged\ninner 1\n"
+                                 "outer\ninner 2\n247500\n3.32834e+08\n",
+                                 result)
+
+    def test_error_inside_fiber(self):
+        result = run_lox_test_exe('tests/fiberError.lox')
+        self.assertIn("Operands must be two numbers or two strings.\n"
+                      "[line 3] in fails()\n[line 9] in outer()\n"
+                      "[line 12] in script", result)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,17 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class GlobalTests(unittest.TestCase):
+    def test_late_binding_and_redefinition(self):
+        result = run_lox_test_exe('tests/globals.lox').splitlines()
+        self.assertEqual(result, ['late', '20', '610', 'Counter instance', 'true'])
+
+    def test_undefined_variable_error(self):
+        result = run_lox_test_exe('tests/undefinedGlobal.lox')
+        self.assertIn("Undefined variable 'missing'.\n[line 1] in read()\n"
+                      "[line 3] in script", result)
+
+
+if __name__ == '__main__':
+    unittest.main()
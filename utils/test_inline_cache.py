@@ -0,0 +1,22 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class InlineCacheTests(unittest.TestCase):
+    def test_call_sites(self):
+        # monomorphic, polymorphic and megamorphic sites plus fields
+        # shadowing methods and differently laid out instances
+        result = run_lox_test_exe('tests/inlineCache.lox').split()
+        self.assertEqual(result, [
+            'A', 'A', 'B', 'C', 'D', 'E', 'A', 'B', 'E',
+            'A', 'field', 'field',
+            '1', '2', '3', '4',
+            'base'])
+
+    def test_initializer_returns_instance(self):
+        result = run_lox_test_exe('tests/classProperties.lox').split()
+        self.assertEqual(result, ['hello'])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,27 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class IsolateTests(unittest.TestCase):
+    def test_isolates(self):
+        for flags in [(), ['--jit'], ['--trace-jit'], ['--register'],
+                      ['--workers', '1'], ['--workers', '3']]:
+            with self.subTest(flags=flags):
+                result = run_lox_test_exe('tests/isolates.lox', flags)
+                self.assertEqual("3\n70\n100\n3\ntrue\n100\n100\n32\n",
+                                 result)
+
+    def test_repeated_await(self):
+        for flags in [(), ['--workers', '1']]:
+            with self.subTest(flags=flags):
+                result = run_lox_test_exe('tests/isolateAwait.lox', flags)
+                self.assertEqual("49\n49\n98\nmademade\n", result)
+
+    def test_failed_isolate(self):
+        result = run_lox_test_exe('tests/isolateError.lox')
+        self.assertIn("[line 2] in fail()\nSpawned function failed.\n"
+                      "[line 5] in script", result)
+
+
+if __name__ == '__main__':
+    unittest.main()
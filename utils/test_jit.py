@@ -0,0 +1,35 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+# compiled functions have to behave exactly like interpreted ones
+TEST_FILES = [
+    'tests/jit.lox',
+    'tests/jitError.lox',
+    'tests/globals.lox',
+    'tests/inlineCache.lox',
+    'tests/shapes.lox',
+    'tests/closure.lox',
+]
+
+
+class JitTests(unittest.TestCase):
+    def test_matches_interpreter(self):
+        for test_file in TEST_FILES:
+            with self.subTest(test_file=test_file):
+                self.assertEqual(
+                    run_lox_test_exe(test_file, ['--jit']),
+                    run_lox_test_exe(test_file))
+
+    def test_hot_functions(self):
+        result = run_lox_test_exe('tests/jit.lox', ['--jit']).split()
+        self.assertEqual(result, ['1.44837e+07', 'abab!', '44850', '301', '-1.375'])
+
+    def test_runtime_error_in_compiled_code(self):
+        result = run_lox_test_exe('tests/jitError.lox', ['--jit'])
+        self.assertIn("Operands must be numbers.\n[line 2] in half()\n"
+                      "[line 5] in script", result)
+
+
+if __name__ == '__main__':
+    unittest.main()
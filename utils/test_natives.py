@@ -0,0 +1,29 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class NativeTests(unittest.TestCase):
+    def test_natives(self):
+        for flags in [(), ['--jit'], ['--trace-jit'], ['--no-quicken'],
+                      ['--register']]:
+            with self.subTest(flags=flags):
+                result = run_lox_test_exe('tests/natives.lox', flags)
+                self.assertEqual("4\ntrue\n<native fn>\n9\n12\n3\n79800\n"
+                                 "800\n300\n", result)
+
+    def test_error_inside_trace(self):
+        for flags in [(), ['--trace-jit']]:
+            with self.subTest(flags=flags):
+                result = run_lox_test_exe('tests/nativeError.lox', flags)
+                self.assertIn("Argument to sqrt must be a number.\n"
+                              "[line 7] in roots()\n[line 11] in script",
+                              result)
+
+    def test_arity_error(self):
+        result = run_lox_test_exe('tests/nativeArity.lox')
+        self.assertIn("Expected 1 arguments but got 2.\n[line 2] in script",
+                      result)
+
+
+if __name__ == '__main__':
+    unittest.main()
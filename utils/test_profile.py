@@ -0,0 +1,36 @@
+import os
+import re
+import tempfile
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class ProfileTests(unittest.TestCase):
+    def test_folded_stacks(self):
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, 'profile.folded')
+            result = run_lox_test_exe('tests/profile.lox', ['--profile', path])
+            self.assertEqual("6.66666e+18\n", result)
+            with open(path) as file:
+                lines = file.read().splitlines()
+
+        counts = {}
+        for line in lines:
+            self.assertRegex(line, r'^script:\d+(;\w+:\d+)* \d+$')
+            stack, count = line.rsplit(' ', 1)
+            counts[stack] = counts.get(stack, 0) + int(count)
+        total = sum(counts.values())
+        hot = sum(count for stack, count in counts.items()
+                  if re.search(r';hot:\d+$', stack))
+        self.assertGreater(total, 0)
+        self.assertGreater(hot, total * 0.8)
+
+        # and inside hot(), the loop on lines 4 to 6 rather than the line
+        # the call left the frame at
+        loop = sum(count for stack, count in counts.items()
+                   if re.search(r';hot:[4-6]$', stack))
+        self.assertGreater(loop, hot * 0.8)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,29 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+# quickened instructions must behave exactly like the generic ones
+TEST_FILES = [
+    'tests/quicken.lox',
+    'tests/shapes.lox',
+    'tests/inlineCache.lox',
+    'tests/globals.lox',
+]
+
+
+class QuickenTests(unittest.TestCase):
+    def test_matches_generic_instructions(self):
+        for test_file in TEST_FILES:
+            with self.subTest(test_file=test_file):
+                self.assertEqual(
+                    run_lox_test_exe(test_file),
+                    run_lox_test_exe(test_file, ['--no-quicken']))
+
+    def test_deoptimized_error(self):
+        result = run_lox_test_exe('tests/quicken.lox')
+        self.assertIn("Operands must be numbers.\n[line 32] in sub()\n"
+                      "[line 34] in script", result)
+
+
+if __name__ == '__main__':
+    unittest.main()
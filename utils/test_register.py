@@ -0,0 +1,34 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+# the register backend has to print exactly what the stack machine prints
+TEST_FILES = [
+    'tests/localArithmetic.lox',
+    'tests/closure.lox',
+    'tests/superinstructions.lox',
+    'tests/testArithmatic/test_addition.lox',
+    'tests/testArithmatic/test_divide.lox',
+    'tests/testArithmatic/test_minus.lox',
+    'tests/testArithmatic/test_multiply.lox',
+    'tests/testArithmatic/test_negate.lox',
+    'tests/testArithmatic/test_string_addition.lox',
+]
+
+
+class RegisterTests(unittest.TestCase):
+    def test_matches_stack_machine(self):
+        for test_file in TEST_FILES:
+            with self.subTest(test_file=test_file):
+                self.assertEqual(
+                    run_lox_test_exe(test_file, ['--register']),
+                    run_lox_test_exe(test_file))
+
+    def test_local_arithmetic(self):
+        result = run_lox_test_exe(
+            'tests/localArithmetic.lox', ['--register']).split()
+        self.assertEqual(result[:5], ['4950', '16', '17', 'false', 'true'])
+
+
+if __name__ == '__main__':
+    unittest.main()
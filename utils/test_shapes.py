@@ -0,0 +1,17 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class ShapeTests(unittest.TestCase):
+    def test_shapes_and_dictionary_mode(self):
+        # shared shapes, other field orders, instances with too many
+        # fields and a shape with too many transitions
+        result = run_lox_test_exe('tests/shapes.lox').splitlines()
+        self.assertEqual(result, [
+            '4950', 'a value', 'a next', 'a changed',
+            '39', '4', 'still works',
+            '3', 'method', 'field'])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,29 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class StackTests(unittest.TestCase):
+    def test_deep_recursion(self):
+        for flags in [(), ['--jit'], ['--trace-jit']]:
+            with self.subTest(flags=flags):
+                self.assertEqual(
+                    run_lox_test_exe('tests/deepRecursion.lox', flags),
+                    "50000\n2.0001e+08\nafter\n")
+
+    def test_runtime_pushes_past_max_slots(self):
+        for flags in [(), ['--jit'], ['--trace-jit'], ['--register']]:
+            with self.subTest(flags=flags):
+                self.assertEqual(
+                    run_lox_test_exe('tests/stackHeadroom.lox', flags),
+                    "abcd\n")
+
+    def test_stack_limit(self):
+        result = run_lox_test_exe('tests/stackOverflow.lox',
+                                  ['--stack-limit', '1000'])
+        self.assertIn("Stack overflow.\n[line 3] in forever()\n", result)
+        self.assertIn("more calls]\n", result)
+        self.assertTrue(result.endswith("[line 5] in script\n"))
+
+
+if __name__ == '__main__':
+    unittest.main()
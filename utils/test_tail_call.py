@@ -0,0 +1,20 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+class TailCallTests(unittest.TestCase):
+    def test_deep_tail_recursion(self):
+        for flags in [(), ['--jit'], ['--trace-jit']]:
+            with self.subTest(flags=flags):
+                result = run_lox_test_exe('tests/tailCall.lox', flags)
+                self.assertEqual("5.00005e+09\nfalse\ncaptured\ndone\n7\n"
+                                 "true\nfalse\n55\n", result)
+
+    def test_arity_error(self):
+        result = run_lox_test_exe('tests/tailCallError.lox')
+        self.assertIn("Expected 1 arguments but got 0.\n[line 3] in wrong()\n"
+                      "[line 4] in script", result)
+
+
+if __name__ == '__main__':
+    unittest.main()
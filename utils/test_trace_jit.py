@@ -0,0 +1,39 @@
+import unittest
+from run_exe import run_lox_test_exe
+
+
+# side exits have to leave the interpreter exactly where it would have been
+TEST_FILES = [
+    'tests/traceJit.lox',
+    'tests/jit.lox',
+    'tests/globals.lox',
+    'tests/inlineCache.lox',
+    'tests/shapes.lox',
+]
+
+
+class TraceJitTests(unittest.TestCase):
+    def test_matches_interpreter(self):
+        for test_file in TEST_FILES:
+            with self.subTest(test_file=test_file):
+                self.assertEqual(
+                    run_lox_test_exe(test_file, ['--trace-jit']),
+                    run_lox_test_exe(test_file))
+
+    def test_hot_loops(self):
+        result = run_lox_test_exe('tests/traceJit.lox', ['--trace-jit']).split()
+        self.assertEqual(result, ['11025', '124750', '9855', '500',
+                                  '3.1329e+06', 'done', '120'])
+
+    def test_dump_traces(self):
+        result = run_lox_test_exe('tests/traceJit.lox', ['--dump-traces'])
+        self.assertIn("== trace recorded (script @ 17) ==", result)
+        self.assertIn("== trace optimized (script @ 17) ==", result)
+        # the method call is inlined behind a shape and class guard
+        self.assertIn("GUARD_SHAPE", result)
+        self.assertIn("GUARD_CLASS", result)
+        self.assertIn("LOOP", result)
+
+
+if __name__ == '__main__':
+    unittest.main()
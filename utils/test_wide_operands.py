@@ -0,0 +1,124 @@
+import os
+import tempfile
+import unittest
+from run_exe import run_lox_test_exe
+
+# enough to push every operand past a byte, and jumps past 16 bits
+COUNT = 300
+JUMP_STATEMENTS = 35000
+
+
+def names(prefix):
+    return [f'{prefix}{i}' for i in range(COUNT)]
+
+
+# the limits are about script size, so the scripts are generated here
+def wide_script():
+    lines = []
+    # constants
+    lines.append('print ' + ' + '.join(str(i) for i in range(COUNT)) + ';')
+    lines.append(f'print "s{COUNT}";')
+
+    # locals, and a closure capturing all of them
+    lines.append('fun locals() {')
+    lines += [f'  var {name} = {i};' for i, name in enumerate(names('l'))]
+    lines.append(f'  l{COUNT - 1} = l{COUNT - 1} + 1;')
+    lines.append(f'  print l0 + l255 + l{COUNT - 1};')
+    lines.append('  fun inner() {')
+    lines.append('    return ' + ' + '.join(names('l')) + ';')
+    lines.append('  }')
+    lines.append('  fun outer() {')
+    lines.append('    fun innermost() {')
+    lines.append(f'      l{COUNT - 1} = 0;')
+    lines.append(f'      return l{COUNT - 1};')
+    lines.append('    }')
+    lines.append('    return ' + ' + '.join(names('l')) + ' + innermost();')
+    lines.append('  }')
+    lines.append('  print inner();')
+    lines.append('  print outer();')
+    lines.append('  print inner();')
+    lines.append('}')
+    lines.append('locals();')
+
+    # arguments of calls, invokes and super invokes
+    params = ', '.join(names('a'))
+    args = ', '.join(str(i) for i in range(COUNT))
+    lines.append(f'fun many({params}) {{ return a0 + a{COUNT - 1}; }}')
+    lines.append(f'print many({args});')
+    lines.append('class Base {')
+    lines.append(f'  many({params}) {{ return a1 + a{COUNT - 2}; }}')
+    lines.append('  base() { return "base"; }')
+    lines.append('}')
+
+    # names, the fields take up the first 256 constants of the method
+    lines.append('class Wide < Base {')
+    lines.append('  fill() {')
+    lines += [f'    this.{name} = {i};' for i, name in enumerate(names('f'))]
+    lines.append(f'    print this.f0 + this.f{COUNT - 1};')
+    lines.append(f'    print this.many({args});')
+    lines.append(f'    print super.many({args});')
+    lines.append('    print super.base();')
+    lines.append('    var bound = super.base;')
+    lines.append('    print bound();')
+    lines.append('    return this;')
+    lines.append('  }')
+    lines.append('}')
+    lines.append(f'print Wide().fill().f{COUNT - 1};')
+    return '\n'.join(lines) + '\n'
+
+
+def wide_output():
+    last = COUNT - 1
+    total = sum(range(COUNT))
+    return '\n'.join([
+        str(total), f's{COUNT}',
+        # locals
+        str(255 + last + 1), str(total + 1), str(total + 1), str(total - last),
+        # arguments, then the method on the wide names
+        str(last), str(last), str(last), str(last), 'base', 'base', str(last),
+    ]) + '\n'
+
+
+def jump_script():
+    body = 'g;' * JUMP_STATEMENTS
+    return '\n'.join([
+        'var g = 1;',
+        f'if (g == 2) {{ {body} }} else {{ print "else"; }}',
+        'var i = 0;',
+        f'while (i < 3) {{ i = i + 1; {body} }}',
+        'print i;',
+        'fun far(n) {',
+        f'  if (n) {{ {body} return "then"; }}',
+        '  return "skipped";',
+        '}',
+        'print far(false);',
+        'print far(true);',
+        'fun near() { for (var i = 0; i < 3; i = i + 1) {} return "near"; }',
+        'print near();',
+    ]) + '\n'
+
+
+class WideOperandTests(unittest.TestCase):
+    def run_generated(self, source, expected):
+        with tempfile.NamedTemporaryFile('w', suffix='.lox',
+                                         delete=False) as script:
+            script.write(source)
+        try:
+            for flags in [(), ['--jit'], ['--trace-jit'], ['--no-quicken'],
+                          ['--register']]:
+                with self.subTest(flags=flags):
+                    self.assertEqual(
+                        run_lox_test_exe(script.name, flags), expected)
+        finally:
+            os.remove(script.name)
+
+    def test_wide_operands(self):
+        self.run_generated(wide_script(), wide_output())
+
+    def test_long_jumps(self):
+        self.run_generated(jump_script(),
+                           'else\n3\nskipped\nthen\nnear\n')
+
+
+if __name__ == '__main__':
+    unittest.main()